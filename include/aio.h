@@ -0,0 +1,57 @@
+/*
+ * aio.h
+ *
+ *  Asynchronous calls into the fs. Requests go onto a context's submission
+ *  queue and are run by its worker threads on the context's session. Each
+ *  finished request leaves a completion, and the context's eventfd stays
+ *  readable while completions wait to be reaped, so a poll loop can keep
+ *  many requests in flight without blocking on any of them.
+ */
+
+#ifndef INCLUDE_AIO_H_
+#define INCLUDE_AIO_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+#define AIO_QUEUE_DEPTH		256		// requests a context holds from submit until reaped
+#define AIO_MAX_WORKERS		64
+
+#define AIO_OPEN			1
+#define AIO_CLOSE			2
+#define AIO_READ			3
+#define AIO_WRITE			4
+#define AIO_MKDIR			5
+#define AIO_RMDIR			6
+#define AIO_UNLINK			7
+#define AIO_TRUNCATE		8
+
+// Requests in flight run in any order and at once, so one that needs
+// another's result is submitted after that one is reaped. Buffers and
+// paths must stay valid until the request's completion is reaped.
+typedef struct {
+	uint8_t op;
+	uint8_t mode;			// AIO_OPEN: FD_READ / FD_WRITE
+	int32_t fd;				// AIO_CLOSE, AIO_READ, AIO_WRITE
+	uint32_t offset;		// AIO_READ, AIO_WRITE: where in the file, the cursor is left alone; AIO_TRUNCATE: the new size
+	uint32_t len;			// AIO_READ, AIO_WRITE
+	void* buf;				// AIO_READ, AIO_WRITE
+	const char* path;		// AIO_OPEN and the path operations, relative to the session's cwd when the request runs
+	uint64_t user_data;		// handed back in the completion
+} aio_req;
+
+typedef struct {
+	uint64_t user_data;
+	int64_t res;			// AIO_OPEN: the fd; AIO_READ, AIO_WRITE: bytes moved; otherwise 0. -1 on failure
+} aio_cqe;
+
+typedef struct aio_ctx aio_ctx;
+
+aio_ctx* aio_create(session* sess, uint32_t workers);
+int aio_eventfd(const aio_ctx* ctx);
+uint32_t aio_submit(aio_ctx* ctx, const aio_req* reqs, uint32_t count);
+uint32_t aio_reap(aio_ctx* ctx, aio_cqe* cqes, uint32_t max);
+uint32_t aio_wait(aio_ctx* ctx, aio_cqe* cqes, uint32_t max);
+void aio_destroy(aio_ctx* ctx);
+
+#endif /* INCLUDE_AIO_H_ */
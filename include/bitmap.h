@@ -7,6 +7,7 @@
 #include "block.h"
 
 uint32_t find_free_bit(block* blk);
+uint32_t find_free_run(block* blk, uint32_t goal, uint32_t limit, uint32_t want, uint32_t* len);
 bool read_bitmap(block* blk, uint32_t index);
 void set_bitmap(block* blk, uint32_t index);
 void clear_bitmap(block* blk, uint32_t index);
@@ -19,5 +19,9 @@ int8_t blockdev_detach(void);
 int8_t blockdev_destroy(void);
 int8_t blk_read(const uint32_t, block*);
 int8_t blk_write(const uint32_t, const block*);
+int8_t blk_prefetch(const uint32_t, uint32_t);
+const block* blk_map(const uint32_t);
+int64_t blk_copy_in(int, uint64_t, const uint32_t, uint32_t);
+int64_t blk_copy_out(const uint32_t, uint32_t, int, uint64_t);
 
 #endif /* INCLUDE_BLOCKDEV_H_ */
@@ -28,8 +28,8 @@
 
 //server.c
 sh_err start_listening(void);
-char* recv_cmd(void);
-sh_err send_results(char*);
+int recv_cmd(char*);
+sh_err send_results(outbuf*);
 sh_err run(void);					// loop to check sockets sets (fd_set)
 void clean_svr(void);
 
@@ -37,33 +37,41 @@ void clean_svr(void);
 sh_err rconnect(char*,char*);
 sh_err send_cmd(char*);
 sh_err rclose(void);
-char* recv_results(void);
+sh_err recv_all(char*, size_t);
+sh_err recv_results(outbuf*);
 
 // shell.c
 char* prompt(void);
-char* run_cmd(char*);
+int sh_tokenize(char*, char*[], int);
+int sh_lookup(const char*);
+sh_err run_cmd(session*, char*, outbuf*);
 
-char* sh_exit(int, char*[]);
-char* sh_open(int, char*[]);
-char* sh_read(int, char*[]);
-char* sh_write(int, char*[]);
-char* sh_seek(int, char*[]);
-char* sh_close(int, char*[]);
-char* sh_mkdir(int, char*[]);
-char* sh_mkfs(int, char*[]);
-char* sh_pwd(int, char*[]);
-char* sh_rmdir(int, char*[]);
-char* sh_cd(int, char*[]);
-char* sh_ls(int, char*[]);
-char* sh_cat(int, char*[]);
-char* sh_tree(int, char*[]);
-char* sh_import(int, char*[]);
-char* sh_export(int, char*[]);
-char* sh_help(int, char*[]);
-char* sh_connect(int, char*[]);
-char* sh_rm(int, char*[]);
-sh_err chk_vfs(char**);
-char* mesg(char*,int,int,int);
+sh_err sh_exit(session*, int, char*[], outbuf*);
+sh_err sh_open(session*, int, char*[], outbuf*);
+sh_err sh_read(session*, int, char*[], outbuf*);
+sh_err sh_write(session*, int, char*[], outbuf*);
+sh_err sh_seek(session*, int, char*[], outbuf*);
+sh_err sh_fallocate(session*, int, char*[], outbuf*);
+sh_err sh_fsck(session*, int, char*[], outbuf*);
+sh_err sh_close(session*, int, char*[], outbuf*);
+sh_err sh_mkdir(session*, int, char*[], outbuf*);
+sh_err sh_mkfs(session*, int, char*[], outbuf*);
+sh_err sh_pwd(session*, int, char*[], outbuf*);
+sh_err sh_rmdir(session*, int, char*[], outbuf*);
+sh_err sh_cd(session*, int, char*[], outbuf*);
+sh_err sh_ls(session*, int, char*[], outbuf*);
+sh_err sh_cat(session*, int, char*[], outbuf*);
+sh_err sh_tree(session*, int, char*[], outbuf*);
+sh_err sh_truncate(session*, int, char*[], outbuf*);
+sh_err sh_import(session*, int, char*[], outbuf*);
+sh_err sh_export(session*, int, char*[], outbuf*);
+sh_err sh_import_tar(session*, int, char*[], outbuf*);
+sh_err sh_export_tar(session*, int, char*[], outbuf*);
+sh_err sh_help(session*, int, char*[], outbuf*);
+sh_err sh_connect(session*, int, char*[], outbuf*);
+sh_err sh_rm(session*, int, char*[], outbuf*);
+sh_err chk_vfs(outbuf*);
+sh_err mesg(outbuf*,int,int);
 
 
 
@@ -0,0 +1,30 @@
+/*
+ * dcache.h
+ *
+ *  Path lookup (dentry) cache: (parent inode, name) -> child inode, and
+ *  for entries found in the directory file, the block that holds them
+ */
+
+#ifndef INCLUDE_DCACHE_H_
+#define INCLUDE_DCACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "inode.h"
+
+#define DCACHE_SETS			1024
+#define DCACHE_WAYS			4
+#define DCACHE_NAME_MAX		59			// longer names are never cached
+
+#define DCACHE_NEGATIVE		0xFFFFFFFF	// child value of a cached "name does not exist"
+#define DCACHE_NO_BLOCK		0xFFFFFFFF	// block of an entry whose place in its directory is unknown
+
+void dcache_init(void);
+bool dcache_lookup(iptr parent, const char* name, iptr* child);
+bool dcache_block(iptr parent, const char* name, uint32_t* lblk);
+void dcache_insert(iptr parent, const char* name, iptr child);
+void dcache_insert_at(iptr parent, const char* name, iptr child, uint32_t lblk);
+void dcache_invalidate(iptr parent, const char* name);
+void dcache_purge_dir(iptr dir);
+
+#endif /* INCLUDE_DCACHE_H_ */
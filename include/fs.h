@@ -14,72 +14,218 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "fsparams.h"
 #include "inode.h"
 #include "block.h"
 #include "blockdev.h"
+#include "fsck.h"
+#include "outbuf.h"
 
 #define ITYPE_FILE 		0
 #define ITYPE_DIR		1
 
-#define MAX_FD			1024
+#define FD_CHUNK		1024	// descriptors a session's table grows by
+#define FD_CHUNKS		1024	// chunks a table can grow to
+#define FD_NONE			0xFFFFFFFF
+
+#define RA_MIN_BLOCKS	4		// first readahead window of a sequential reader
+#define RA_MAX_BLOCKS	64		// the window doubles up to this
 
 #define FD_FREE 	0
 #define FD_READ		1
 #define FD_WRITE	2
 
+#define DIRECT_BLOCKS		8
+#define PTRS_PER_BLOCK		(BLOCK_SIZE / sizeof(iptr))	// block pointers in an indirect block
+
+#define SUPERBLOCK_PADDING (BLOCK_SIZE-1056)
+
+typedef struct {
+	uint8_t boot_record[1024]; //0
+	uint32_t inode_count;      //1023
+	uint32_t block_count;      //1027
+
+	uint32_t free_inode_count; //1031
+	uint32_t free_block_count; //1035
+
+	uint32_t first_data_block; //1039, must also be the start of the directory listing for the filesystem root
+	uint16_t magic; 		   //1043
+	uint16_t state;			   //1045
+	uint32_t journal_start;	   //1047, 0 = no journal
+	uint32_t journal_blocks;   //1051
+	uint8_t padding[SUPERBLOCK_PADDING];
+} superblock;
+
+typedef struct {
+	uint32_t lblk;
+	block data;
+} dirty_block;
+
+// An open file, shared by every descriptor on it in any session. inode is
+// the file as its descriptors see it, size grown by buffered writes
+// included. Everything but refs is guarded by the file's inode lock.
 typedef struct {
-	block* data;
-	uint8_t state;
 	iptr inode_id;
 	inode inode;
+	uint32_t refs;			// descriptors on it, guarded by vnode_lock
+	bool removed;			// unlinked while open: reads find it empty, writes fail
+	dirty_block* dirty;		// written holes waiting for delalloc_flush to pick their LBAs
+	uint32_t dirty_count;
+	uint32_t dirty_cap;
+	uint32_t meta_reserved;	// free blocks held for indirect blocks the dirty ones may need
+	uint32_t meta_region;	// indirect block region of the newest dirty block, 0 = none
+} vnode;
+
+typedef struct {
+	uint8_t state;
+	iptr inode_id;
+	vnode* vn;
 	uint32_t cursor;
+	uint32_t ra_next;		// block a sequential read would start at
+	uint32_t ra_window;		// blocks to prefetch ahead, 0 after a random read
+	uint32_t ra_end;		// first block not yet prefetched
+	uint32_t next_free;		// while free: the next free descriptor, FD_NONE at the end
 } fd_entry;
 
+// A session's descriptors, in chunks that never move once added. The free
+// ones form a stack threaded through next_free, popped and pushed with
+// compare-and-swap; the head's high half counts pops so a head that went
+// and came back between a load and its swap is told apart.
+typedef struct {
+	fd_entry* chunk[FD_CHUNKS];
+	uint32_t chunks;		// chunks added so far
+	uint64_t free_head;		// pops << 32 | first free descriptor
+} fd_table;
+
 typedef struct {
-	iptr inode;			// iptr to entry's file/folder; 0 = unused/end-of-list
-	uint16_t entry_len;	// length in bytes to the next dir_entry within the block or next block if equals block size
-	uint8_t name_len;	// length in bytes of the entry's file/folder name
+	iptr inode;			// iptr to entry's file/folder
+	uint16_t entry_len;	// length in bytes to the next dir_entry within the block; the last entry runs to the end of the block
+	uint8_t name_len;	// length in bytes of the entry's file/folder name; 0 = unused slot
 	uint8_t file_type;   // ITYPE_FILE / ITYPE_DIR
 	char name[1];	// first character of the entry name
 } dir_entry;
 
+// block pointers to preallocated blocks that were never written carry this
+// flag; the block is allocated on disk but reads as zeros
+#define BLK_UNWRITTEN	0x80000000
+#define BLK_LBA(ptr)	((ptr) & ~BLK_UNWRITTEN)
+
+// bytes a dir_entry with a name of length n needs, padded out to 32 bits
+#define DIR_REC_LEN(n)	((8 + (n) + 3) & ~3)
+
+#define DIR_NO_WINDOW	0xFFFFFFFF
+
+// readdir streams the directory a block at a time through window, unless
+// whole is set: then data holds the whole directory file as inflatedir read
+// it. Otherwise data is room for the blocks a change reads and edits, grown
+// as the directory does; only the blocks the change touched are current.
 typedef struct {
 	inode inode_st;
 	iptr inode_id;
-	uint32_t index;
+	uint32_t index;		// also the resume cookie of cntelldir
 	block* data;
+	uint32_t data_blocks;	// blocks data has room for
+	bool whole;
+	block* window;
+	uint32_t window_lblk;
 } dir_ptr;
 
 typedef struct {
 	iptr inode_id;
 } stat_st;
 
+// A directory entry together with its inode, filled by cnreaddirplus
+typedef struct {
+	iptr inode_id;
+	uint8_t file_type;
+	uint8_t name_len;
+	char name[256];		// NUL terminated
+	inode attr;
+} dir_entry_plus;
+
+typedef struct {
+	const uint8_t* base;
+	uint32_t len;
+} view_seg;
+
+// A read-only window onto part of a file, filled by cnread_view
+typedef struct {
+	iptr inode_id;
+	bool locked;		// holds the file's read lock until cnread_release
+	uint32_t bytes;		// total over all segments, short at end of file
+	uint32_t count;
+	view_seg* segs;		// in file order; a hole is a segment of zeros
+} read_view;
+
+// A client's view of the mounted fs: its working directory and open files.
+// Several threads may open, read, write and close through one session and
+// look up paths relative to its cwd at once; a path resolves against the
+// cwd as it was when the lookup began. The cwd dir_ptr itself is only for
+// the thread that changes the cwd.
+typedef struct session {
+	char cwd_str[1024];
+	dir_ptr* cwd;
+	pthread_mutex_t cwd_lock;	// cwd and cwd_str, swapped by cncd, mount and fsck repair
+	fd_table fds;
+	struct session* next;
+} session;
+
+typedef struct {
+	uint32_t block_count;
+	uint32_t free_blocks;
+	uint32_t inode_count;
+	uint32_t free_inodes;
+	uint32_t reclaim_pending;	// blocks of removed files not yet freed by the background reclaimer
+} statfs_st;
+
 
 int8_t cnmkfs(void);
 int8_t cnmount(void);
 int8_t cnumount(void);
+session* cnsession_open(void);
+void cnsession_close(session*);
 int8_t cncreat(dir_ptr*, const char*);
 int8_t cnstat(dir_ptr* dir, const char* name, stat_st *buf);
-int16_t cnopen(dir_ptr*, const char *, uint8_t);
-size_t cnread(uint8_t*, size_t, int16_t);
-size_t cnwrite(uint8_t*, size_t, int16_t);
-int8_t cnseek(int16_t, uint32_t);
-int8_t cnclose(int16_t);
-dir_ptr* cnopendir(const char* name);
+int32_t cnopen(session*, dir_ptr*, const char *, uint8_t);
+fd_entry* fd_get(session*, int32_t);
+size_t cnread(session*, uint8_t*, size_t, int32_t);
+size_t cnpread(session*, uint8_t*, size_t, int32_t, uint32_t);
+size_t cnreadv(session*, const struct iovec*, int, int32_t, uint32_t);
+int8_t cnread_view(session*, int32_t, uint32_t, uint32_t, read_view*);
+void cnread_release(read_view*);
+size_t cnwrite(session*, uint8_t*, size_t, int32_t);
+size_t cnpwrite(session*, const uint8_t*, size_t, int32_t, uint32_t);
+size_t cnwritev(session*, const struct iovec*, int, int32_t, uint32_t);
+int8_t cnseek(session*, int32_t, uint32_t);
+int8_t cnfallocate(session*, int32_t, uint32_t, uint32_t);
+int8_t cnclose(session*, int32_t);
+dir_ptr* cnopendir(session*, const char* name);
 void cnclosedir(dir_ptr* dir);
 dir_entry* cnreaddir(dir_ptr* dir);
-int8_t cnmkdir(const char*);
-int8_t cnrmdir(const char*);
-int8_t cncd(const char*);
-int8_t cnpwd(char*);
-int8_t cnls(const char *, char*);
+int32_t cnreaddirplus(dir_ptr* dir, dir_entry_plus* ents, uint32_t max);
+uint32_t cntelldir(dir_ptr* dir);
+void cnseekdir(dir_ptr* dir, uint32_t cookie);
+int8_t cnmkdir(session*, const char*);
+int8_t cnrmdir(session*, const char*);
+int8_t cnunlink(session*, const char*);
+int8_t cntruncate(session*, const char*, uint32_t);
+int8_t cnstatfs(statfs_st*);
+int8_t cnfsck(bool, fsck_report*);
+int8_t cncd(session*, const char*);
+int8_t cnpwd(session*, char*);
+int8_t cnls(session*, const char *, outbuf*);
+int32_t cnls_page(session*, const char*, uint32_t*, char*, uint32_t);
 int8_t cnstat(dir_ptr*, const char*, stat_st*);
-int8_t cncat(const char*, char*);
-int8_t cntree(char*);
-int8_t cnimport(const char*, const char*);
-int8_t cnexport(const char*, const char*);
-
-extern dir_ptr* cwd;
+int8_t cncat(session*, const char*, outbuf*);
+int8_t cntree(session*, outbuf*);
+int8_t cnimport(session*, const char*, const char*);
+int32_t cnimport_tree(session*, const char*, const char*);
+int8_t cnexport(session*, const char*, const char*);
+void cnset_compaction(bool);
+iptr bmap(inode*, uint32_t);
+void split_path(const char*, char*, const char**);
+uint32_t cnbackground(void);
 
 #endif /* INCLUDE_FS_H_ */
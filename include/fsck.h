@@ -0,0 +1,37 @@
+/*
+ * fsck.h
+ *
+ *  Image checker: block and inode bitmaps against what the directory tree
+ *  and the inode block maps actually use, and the superblock free counts
+ */
+
+#ifndef INCLUDE_FSCK_H_
+#define INCLUDE_FSCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FSCK_MAX_THREADS	64
+
+typedef struct {
+	uint32_t threads;
+	uint32_t inodes_checked;	// inodes reachable from the root
+	uint32_t blocks_checked;	// blocks those inodes map, indirect blocks included
+	uint32_t bad_entries;		// broken directory records, bad inode numbers, wrong file types, second links
+	uint32_t bad_pointers;		// block pointers into the reserved area or past the device
+	uint32_t duplicate_blocks;	// blocks mapped more than once
+	uint32_t bad_block_counts;	// inode blocks fields that do not match the map
+	uint32_t orphan_inodes;		// marked used, not reachable
+	uint32_t unmarked_inodes;	// reachable, marked free
+	uint32_t leaked_blocks;		// marked used, not mapped
+	uint32_t unmarked_blocks;	// mapped, marked free
+	uint32_t bad_counts;		// superblock free counts that do not match the bitmaps
+	uint32_t repaired;
+} fsck_report;
+
+int8_t fsck_image(bool repair, fsck_report* rep);
+uint32_t fsck_errors(const fsck_report* rep);
+int fsck_summary(const fsck_report* rep, char* buf, size_t len);
+
+#endif /* INCLUDE_FSCK_H_ */
@@ -14,7 +14,7 @@
 
 #define BLOCKS_PER_INODE	4
 #define INODE_SIZE			64
-#define INODE_PADDING		3
+#define INODE_PADDING		7
 #define INODE_COUNT			(BD_SIZE_BLOCKS / BLOCKS_PER_INODE)
 #define INODE_TABLE_BLOCKS  ((INODE_COUNT) * (INODE_SIZE) / (BLOCK_SIZE))
 #define INODES_IN_BLOCK		((BLOCK_SIZE) / (INODE_SIZE))
@@ -24,5 +24,8 @@
 #define BLOCKID_INODE_BITMAP	2
 #define BLOCKID_INODE_TABLE		3
 #define BLOCKID_ROOT_DIR		BLOCKID_INODE_TABLE + INODE_TABLE_BLOCKS
+#define BLOCKID_JOURNAL			(BLOCKID_ROOT_DIR + 1)
+
+#define JOURNAL_BLOCKS			1024
 
 #endif /* INCLUDE_FSPARAMS_H_ */
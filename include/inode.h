@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "fsparams.h"
 
 #define INODE_ROOTDIR 0
@@ -19,7 +20,6 @@ typedef uint32_t iptr; // inode pointer
 
 
 typedef struct {
-	uint8_t type;
 	uint32_t size;
 	uint32_t blocks;
 
@@ -29,12 +29,16 @@ typedef struct {
 	iptr data1;			// single indirect data block pointers
 	iptr data2;			// double indirect data block pointers
 
+	uint8_t type;		// kept after the 8 byte aligned fields so the struct packs to 64 bytes
 	uint8_t padding[INODE_PADDING];
 } inode;  //64 bytes, 64 inodes/block
 
+_Static_assert(sizeof(inode) == INODE_SIZE, "inode must fill exactly one inode table slot");
+
 
 
 uint8_t inode_write(iptr, inode*);
 uint8_t inode_read(iptr, inode*);
+uint8_t inode_read_many(const iptr*, inode*, uint32_t);
 
 #endif /* INCLUDE_INODE_H_ */
@@ -0,0 +1,34 @@
+/*
+ * journal.h
+ *
+ *  Write-ahead log for metadata blocks. Changes from every operation
+ *  collect in one running transaction; a commit logs their images to a
+ *  circular region on disk, then writes them to their home blocks.
+ */
+
+#ifndef INCLUDE_JOURNAL_H_
+#define INCLUDE_JOURNAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+#define JOURNAL_MAGIC			0x434A4E4C
+#define JOURNAL_TXN_MAX			1020		// block images in one transaction, all listed in one descriptor
+#define JOURNAL_COMMIT_BLOCKS	256			// commit as soon as an operation ends with this many waiting
+#define JOURNAL_OP_BLOCKS		64			// credits for one ordinary operation: a file's whole block map, its inode, dir block and the bitmaps
+
+void journal_format(uint32_t start, uint32_t nblocks);
+int8_t journal_load(uint32_t start, uint32_t nblocks);
+void journal_begin(uint32_t credits);
+void journal_end(void);
+int8_t journal_commit(void);
+uint32_t journal_pending(void);
+uint32_t journal_tid(void);
+bool journal_committed(uint32_t tid);
+void journal_read(uint32_t lba, block* buf);
+void journal_write(uint32_t lba, const block* buf);
+void journal_update(uint32_t lba, uint32_t offset, const void* data, uint32_t len);
+void journal_forget(uint32_t lba);
+
+#endif /* INCLUDE_JOURNAL_H_ */
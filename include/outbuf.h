@@ -0,0 +1,31 @@
+/*
+ * outbuf.h
+ *
+ *  Growable output buffer that carries its length. The text is kept NUL
+ *  terminated so the finished buffer can be handed on as a C string.
+ */
+
+#ifndef INCLUDE_OUTBUF_H_
+#define INCLUDE_OUTBUF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OUTBUF_MIN_CAP	256
+
+typedef struct {
+	char* data;
+	size_t len;			// bytes of output, not counting the terminator
+	size_t cap;
+} outbuf;
+
+int8_t outbuf_init(outbuf* ob, size_t cap);
+int8_t outbuf_reserve(outbuf* ob, size_t extra);
+void outbuf_commit(outbuf* ob, size_t len);
+void outbuf_truncate(outbuf* ob, size_t len);
+int8_t outbuf_append(outbuf* ob, const void* data, size_t len);
+int8_t outbuf_printf(outbuf* ob, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+char* outbuf_release(outbuf* ob);
+void outbuf_free(outbuf* ob);
+
+#endif /* INCLUDE_OUTBUF_H_ */
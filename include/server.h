@@ -22,10 +22,12 @@
 #include <sys/select.h>
 #include <netdb.h>
 #include <errno.h>
+#include "fs.h"
 
 #define SVR_PORT "5560"
 #define SVR_TIMEOUT_CHKSOCK 2000
 #define SVR_MAX_PAYLOAD		4096
+#define SVR_RESULT_HDR		4			// bytes of length, network order, ahead of each result
 
 #define SVR_STATUS_CLIENT	3			//a client is currently connected
 #define SVR_STATUS_RUN		2
@@ -50,6 +52,8 @@ struct svrconf {
 	int clientfd;
 	int num_fds;
 	int8_t vfs;
+	session* local;		// commands typed at this shell
+	session* remote;	// commands from the connected client
 };
 
 struct clientconf {
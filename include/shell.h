@@ -8,25 +8,32 @@
 #ifndef INCLUDE_SHELL_H_
 #define INCLUDE_SHELL_H_
 
+#include "fs.h"
+
 #define SH_CMD_CAT			0
 #define SH_CMD_CD			1
 #define SH_CMD_CLOSE		2
 #define SH_CMD_CONNECT		3
 #define SH_CMD_EXIT			4
 #define SH_CMD_EXPORT		5
-#define SH_CMD_HELP			6
-#define SH_CMD_IMPORT		7
-#define SH_CMD_LS			8
-#define SH_CMD_MKDIR		9
-#define SH_CMD_MKFS			10
-#define SH_CMD_OPEN			11
-#define SH_CMD_PWD			12
-#define SH_CMD_READ			13
-#define SH_CMD_RM			14
-#define SH_CMD_RMDIR		15
-#define SH_CMD_SEEK			16
-#define SH_CMD_TREE			17
-#define SH_CMD_WRITE		18
+#define SH_CMD_EXPORT_TAR	6
+#define SH_CMD_FALLOCATE	7
+#define SH_CMD_FSCK			8
+#define SH_CMD_HELP			9
+#define SH_CMD_IMPORT		10
+#define SH_CMD_IMPORT_TAR	11
+#define SH_CMD_LS			12
+#define SH_CMD_MKDIR		13
+#define SH_CMD_MKFS			14
+#define SH_CMD_OPEN			15
+#define SH_CMD_PWD			16
+#define SH_CMD_READ			17
+#define SH_CMD_RM			18
+#define SH_CMD_RMDIR		19
+#define SH_CMD_SEEK			20
+#define SH_CMD_TREE			21
+#define SH_CMD_TRUNCATE		22
+#define SH_CMD_WRITE		23
 
 
 typedef int8_t sh_err;
@@ -51,10 +58,18 @@ typedef int8_t sh_err;
 #define SH_ERR_LISTEN		-17
 #define SH_ERR_CRECV		-18
 
+#define SH_NO_CMD			1			// run_cmd: blank line, nothing ran
+
 
-#define SH_CMD_NUM			19
+#define SH_CMD_NUM			24
 #define SH_MAX_ARGS			16
+#define SH_HASH_BITS		6
+#define SH_HASH_SLOTS		(1 << SH_HASH_BITS)	// comfortably more than SH_CMD_NUM
+#define SH_HASH_TRIES		(1 << 20)			// seeds to try before settling for a linear search
 #define SH_MAX_STR			256
+#define SH_READ_MAX			(1 << 20)	// most bytes one read command returns
+#define SH_LS_PAGE			4096	// bytes of names in one page of ls output
+#define SH_LS_MORE			(SH_MAX_STR + 32)	// room kept at the end of the page for the resume line
 
 #define STR_PROMPT			0
 #define STR_CMDS			1
@@ -89,10 +104,11 @@ extern const char *err_strings[];
 
 struct cmd_entry {
 	const char *name;
-	char* (*sh_cmd)(int,char*[]);
+	sh_err (*sh_cmd)(session*,int,char*[],outbuf*);
 	const char *help;
 };
 
 extern const char *str_table[];
+extern struct cmd_entry sh_cmds[];
 
 #endif /* INCLUDE_SHELL_H_ */
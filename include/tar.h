@@ -0,0 +1,19 @@
+/*
+ * tar.h
+ *
+ *  Whole subtrees in and out of the image as POSIX (ustar) tar streams
+ */
+
+#ifndef INCLUDE_TAR_H_
+#define INCLUDE_TAR_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+#define TAR_BLOCK		512
+#define TAR_BUF_BYTES	(64 * 1024)		// all the stream data either side holds at once
+
+int32_t tar_export(session* sess, const char* g_dir, int h_fd);
+int32_t tar_import(session* sess, int h_fd, const char* g_dir);
+
+#endif /* INCLUDE_TAR_H_ */
@@ -0,0 +1,252 @@
+/*
+ * aio.c
+ *
+ *  A context owns two rings of AIO_QUEUE_DEPTH slots under one lock: the
+ *  submission queue the workers take requests from and the completion
+ *  queue they leave results in. A context never holds more than
+ *  AIO_QUEUE_DEPTH requests between submit and reap, so neither ring can
+ *  overflow. Each completion adds one to the eventfd's counter; reaping
+ *  reads the counter back to zero before it empties the completion queue,
+ *  so a completion that lands in between leaves the eventfd readable.
+ *
+ *  The workers share the session, as fs.h allows: descriptors, positional
+ *  reads and writes and path lookups are safe from several threads at
+ *  once. A relative path resolves against the cwd the session has when its
+ *  request runs, so a cncd while requests are in flight may or may not
+ *  apply to them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "aio.h"
+#include "debug.h"
+
+struct aio_ctx {
+	session* sess;
+	int efd;
+	pthread_mutex_t lock;		//Both rings, inflight and stopping
+	pthread_cond_t work;		//Signalled when a request is queued or the context stops
+	aio_req sq[AIO_QUEUE_DEPTH];
+	uint32_t sq_head;
+	uint32_t sq_count;
+	aio_cqe cq[AIO_QUEUE_DEPTH];
+	uint32_t cq_head;
+	uint32_t cq_count;
+	uint32_t inflight;			//Submitted and not yet reaped
+	bool stopping;
+	uint32_t worker_count;
+	pthread_t workers[AIO_MAX_WORKERS];
+};
+
+//******** aio_open ******************
+//Opens path, creating it for a writer, as cnopen does in its directory
+static int32_t aio_open(session* sess, const char* path, uint8_t mode)
+{
+	char parent_name[256];
+	const char* base_name;
+	check(strlen(path) < sizeof(parent_name), "Path too long");
+	split_path(path, parent_name, &base_name);
+	dir_ptr* dir = cnopendir(sess, parent_name);
+	check(dir != NULL, "Parent of %s does not exist", path);
+	int32_t fd = cnopen(sess, dir, base_name, mode);
+	cnclosedir(dir);
+	return fd;
+error:
+	return -1;
+}
+
+//******** aio_fd_is *****************
+//cnpread and cnpwrite move 0 bytes on a bad fd; a completion says -1
+static bool aio_fd_is(session* sess, int32_t fd, uint8_t mode)
+{
+	fd_entry* fde = fd_get(sess, fd);
+	return fde != NULL && fde->state == mode;
+}
+
+//******** aio_run *******************
+static int64_t aio_run(session* sess, const aio_req* req)
+{
+	switch(req->op)
+	{
+	case AIO_OPEN:
+		return aio_open(sess, req->path, req->mode);
+	case AIO_CLOSE:
+		return cnclose(sess, req->fd);
+	case AIO_READ:
+		if(!aio_fd_is(sess, req->fd, FD_READ)) return -1;
+		return cnpread(sess, req->buf, req->len, req->fd, req->offset);
+	case AIO_WRITE:
+		if(!aio_fd_is(sess, req->fd, FD_WRITE)) return -1;
+		return cnpwrite(sess, req->buf, req->len, req->fd, req->offset);
+	case AIO_MKDIR:
+		return cnmkdir(sess, req->path);
+	case AIO_RMDIR:
+		return cnrmdir(sess, req->path);
+	case AIO_UNLINK:
+		return cnunlink(sess, req->path);
+	case AIO_TRUNCATE:
+		return cntruncate(sess, req->path, req->offset);
+	default:
+		log_err("Unknown aio op %u", req->op);
+		return -1;
+	}
+}
+
+//******** aio_worker ****************
+//Runs queued requests until the context stops and its queue is empty
+static void* aio_worker(void* arg)
+{
+	aio_ctx* ctx = arg;
+	pthread_mutex_lock(&ctx->lock);
+	while(true)
+	{
+		while(ctx->sq_count == 0 && !ctx->stopping)
+		{
+			pthread_cond_wait(&ctx->work, &ctx->lock);
+		}
+		if(ctx->sq_count == 0) break;
+		aio_req req = ctx->sq[ctx->sq_head];
+		ctx->sq_head = (ctx->sq_head + 1) % AIO_QUEUE_DEPTH;
+		ctx->sq_count--;
+		pthread_mutex_unlock(&ctx->lock);
+
+		aio_cqe cqe = { .user_data = req.user_data, .res = aio_run(ctx->sess, &req) };
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->cq[(ctx->cq_head + ctx->cq_count) % AIO_QUEUE_DEPTH] = cqe;
+		ctx->cq_count++;
+		uint64_t one = 1;
+		if(write(ctx->efd, &one, sizeof(one)) != sizeof(one))
+		{
+			log_err("Could not signal a completion");
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+//******** aio_create ****************
+//Starts a context running requests on sess with workers threads
+aio_ctx* aio_create(session* sess, uint32_t workers)
+{
+	aio_ctx* ctx = calloc(1, sizeof(aio_ctx));
+	check_mem(ctx);
+	ctx->efd = -1;
+	check(workers > 0 && workers <= AIO_MAX_WORKERS, "Bad worker count %u", workers);
+	ctx->sess = sess;
+	ctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	check(ctx->efd >= 0, "Could not create the eventfd");
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->work, NULL);
+	for(; ctx->worker_count < workers; ctx->worker_count++)
+	{
+		if(pthread_create(&ctx->workers[ctx->worker_count], NULL, aio_worker, ctx) != 0)
+		{
+			aio_destroy(ctx);
+			return NULL;
+		}
+	}
+	return ctx;
+error:
+	if(ctx != NULL && ctx->efd >= 0) close(ctx->efd);
+	free(ctx);
+	return NULL;
+}
+
+//******** aio_eventfd ***************
+//Readable while completions wait to be reaped
+int aio_eventfd(const aio_ctx* ctx)
+{
+	return ctx->efd;
+}
+
+//******** aio_submit ****************
+//Queues up to count requests. Returns how many were queued, fewer once the
+//context holds AIO_QUEUE_DEPTH requests that have not been reaped.
+uint32_t aio_submit(aio_ctx* ctx, const aio_req* reqs, uint32_t count)
+{
+	pthread_mutex_lock(&ctx->lock);
+	uint32_t queued = 0;
+	while(queued < count && ctx->inflight < AIO_QUEUE_DEPTH && !ctx->stopping)
+	{
+		ctx->sq[(ctx->sq_head + ctx->sq_count) % AIO_QUEUE_DEPTH] = reqs[queued];
+		ctx->sq_count++;
+		ctx->inflight++;
+		queued++;
+	}
+	if(queued > 0) pthread_cond_broadcast(&ctx->work);
+	pthread_mutex_unlock(&ctx->lock);
+	return queued;
+}
+
+//******** aio_reap ******************
+//Takes up to max completions without waiting. Returns how many.
+uint32_t aio_reap(aio_ctx* ctx, aio_cqe* cqes, uint32_t max)
+{
+	uint64_t count;
+	pthread_mutex_lock(&ctx->lock);
+	if(read(ctx->efd, &count, sizeof(count)) < 0)
+	{
+		count = 0;		//Nothing had completed since the last reap
+	}
+	uint32_t reaped = 0;
+	while(reaped < max && ctx->cq_count > 0)
+	{
+		cqes[reaped++] = ctx->cq[ctx->cq_head];
+		ctx->cq_head = (ctx->cq_head + 1) % AIO_QUEUE_DEPTH;
+		ctx->cq_count--;
+		ctx->inflight--;
+	}
+	if(ctx->cq_count > 0)		//Left for the next reap, keep the eventfd readable
+	{
+		uint64_t one = 1;
+		if(write(ctx->efd, &one, sizeof(one)) != sizeof(one))
+		{
+			log_err("Could not signal a completion");
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return reaped;
+}
+
+//******** aio_wait ******************
+//As aio_reap, but waits on the eventfd until there is at least one
+//completion. Returns 0 only if nothing is in flight.
+uint32_t aio_wait(aio_ctx* ctx, aio_cqe* cqes, uint32_t max)
+{
+	while(true)
+	{
+		uint32_t reaped = aio_reap(ctx, cqes, max);
+		if(reaped > 0 || max == 0) return reaped;
+		pthread_mutex_lock(&ctx->lock);
+		bool idle = (ctx->inflight == 0);
+		pthread_mutex_unlock(&ctx->lock);
+		if(idle) return 0;
+		struct pollfd pfd = { .fd = ctx->efd, .events = POLLIN, .revents = 0 };
+		poll(&pfd, 1, -1);
+	}
+}
+
+//******** aio_destroy ***************
+//Finishes the requests already queued, stops the workers and frees the
+//context. Completions not yet reaped are dropped.
+void aio_destroy(aio_ctx* ctx)
+{
+	if(ctx == NULL) return;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopping = true;
+	pthread_cond_broadcast(&ctx->work);
+	pthread_mutex_unlock(&ctx->lock);
+	for(uint32_t i = 0; i < ctx->worker_count; i++)
+	{
+		pthread_join(ctx->workers[i], NULL);
+	}
+	pthread_cond_destroy(&ctx->work);
+	pthread_mutex_destroy(&ctx->lock);
+	close(ctx->efd);
+	free(ctx);
+}
@@ -35,6 +35,49 @@ uint32_t find_free_bit(block* blk)
 	return ptr*8 + offset;
 }
 
+//Finds the first run of at least "want" clear bits below limit, searching
+//from goal and wrapping around to 0. If no run is that long, returns the
+//longest one. *len is set to the run length, 0 if every bit is set.
+uint32_t find_free_run(block* blk, uint32_t goal, uint32_t limit, uint32_t want, uint32_t* len)
+{
+	uint32_t best_start = 0;
+	uint32_t best_len = 0;
+	uint32_t run_start = 0;
+	uint32_t run_len = 0;
+	if(goal >= limit) goal = 0;
+
+	for(uint32_t n = 0; n < limit; n++)
+	{
+		uint32_t index = goal + n;
+		if(index >= limit) index -= limit;
+		if(index == 0) run_len = 0;		//Runs do not wrap around the end
+
+		//Skip whole bytes that are full
+		if(index % 8 == 0 && (blk->byte[index >> 3] & 0xFF) == 0xFF && n + 8 <= limit)
+		{
+			run_len = 0;
+			n += 7;
+			continue;
+		}
+
+		if(read_bitmap(blk, index))
+		{
+			run_len = 0;
+			continue;
+		}
+		if(run_len == 0) run_start = index;
+		run_len++;
+		if(run_len > best_len)
+		{
+			best_start = run_start;
+			best_len = run_len;
+			if(best_len >= want) break;
+		}
+	}
+	*len = best_len;
+	return best_start;
+}
+
 bool read_bitmap(block* blk, uint32_t index)
 {
 	//Calculate which byte contains the bit
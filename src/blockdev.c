@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -84,3 +86,95 @@ int8_t blk_write(const uint32_t lba, const block* b_ptr) {
 	msync(((block*)bd)+lba, BLOCK_SIZE, MS_SYNC);
 	return 0;
 }
+
+//Returns the block in place on the device, for readers that do not need
+//their own copy. Valid until the blockdev is detached.
+const block* blk_map(const uint32_t lba) {
+	if(lba >= BD_SIZE_BLOCKS) {
+		return NULL;
+	}
+	return ((const block*)bd)+lba;
+}
+
+//Copies len bytes from a host file at src_off into the device starting at
+//lba, in the kernel where the filesystems allow it, otherwise straight into
+//the mapping. The rest of a partly filled last block is zeroed. Returns the
+//bytes copied, short at the end of the host file, or -1.
+int64_t blk_copy_in(int src, uint64_t src_off, const uint32_t lba, uint32_t len) {
+	if(lba >= BD_SIZE_BLOCKS || len > (BD_SIZE_BLOCKS - lba) * (uint64_t)BLOCK_SIZE) {
+		return -1;
+	}
+	uint8_t* dst = bd + (size_t)lba*BLOCK_SIZE;
+	loff_t in = src_off;
+	loff_t out = (loff_t)lba*BLOCK_SIZE;
+	bool kernel = true;
+	uint32_t done = 0;
+	while(done < len) {
+		ssize_t n = -1;
+		if(kernel) {
+			n = copy_file_range(src, &in, fd, &out, len - done, 0);
+			if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				kernel = false;
+				continue;
+			}
+		}
+		else {
+			n = pread(src, dst + done, len - done, in);
+			if(n > 0) in += n;
+		}
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		if(n == 0) break;
+		done += n;
+	}
+	if(done % BLOCK_SIZE != 0) {
+		memset(dst + done, 0, BLOCK_SIZE - done % BLOCK_SIZE);
+	}
+	msync(dst, ((size_t)done + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, MS_SYNC);
+	return done;
+}
+
+//Copies len bytes of the device starting at lba out to a host file at
+//dst_off, in the kernel where the filesystems allow it, otherwise straight
+//from the mapping. Returns the bytes copied or -1.
+int64_t blk_copy_out(const uint32_t lba, uint32_t len, int dst, uint64_t dst_off) {
+	if(lba >= BD_SIZE_BLOCKS || len > (BD_SIZE_BLOCKS - lba) * (uint64_t)BLOCK_SIZE) {
+		return -1;
+	}
+	const uint8_t* src = bd + (size_t)lba*BLOCK_SIZE;
+	loff_t in = (loff_t)lba*BLOCK_SIZE;
+	loff_t out = dst_off;
+	bool kernel = true;
+	uint32_t done = 0;
+	while(done < len) {
+		ssize_t n = -1;
+		if(kernel) {
+			n = copy_file_range(fd, &in, dst, &out, len - done, 0);
+			if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				kernel = false;
+				continue;
+			}
+		}
+		else {
+			n = pwrite(dst, src + done, len - done, out);
+			if(n > 0) out += n;
+		}
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		done += n;
+	}
+	return done;
+}
+
+//Starts loading count blocks into memory in the background; a later
+//blk_read of them does not wait on the disk
+int8_t blk_prefetch(const uint32_t lba, uint32_t count) {
+	if(lba >= BD_SIZE_BLOCKS || count == 0) {
+		return -1;
+	}
+	if(count > BD_SIZE_BLOCKS - lba) {
+		count = BD_SIZE_BLOCKS - lba;
+	}
+	madvise(((block*)bd)+lba, (size_t)count*BLOCK_SIZE, MADV_WILLNEED);
+	return 0;
+}
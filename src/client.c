@@ -52,20 +52,28 @@ sh_err send_cmd(char* cmdbuffer) {
 	return send_err;
 }
 
-char* recv_results(void) {
-
-	int size=0;
-	char *results;
-	results = calloc(1,sizeof(char)*SVR_MAX_PAYLOAD);
-	results[0] = '\0';
-
-	size = recv(shell_client.cfd, results, SVR_MAX_PAYLOAD*sizeof(char), 0);
-	if(size < 0) {
-		// handle error
-		results[0] = '\0';
-		results[1] = SH_ERR_RECV;
-		results[2] = errno;
+//Reads exactly len bytes, however the stream splits them
+sh_err recv_all(char* buf, size_t len) {
+	while(len > 0) {
+		ssize_t size = recv(shell_client.cfd, buf, len, 0);
+		if(size < 1) {
+			if(size == 0) errno = ECONNRESET;
+			return SH_ERR_CRECV;
+		}
+		buf += size;
+		len -= size;
 	}
-	return results;
+	return SH_ERR_SUCCESS;
+}
+
+//Receives one command's output, as framed by send_results
+sh_err recv_results(outbuf* results) {
+	uint32_t hdr;
 
+	if(recv_all((char*)&hdr, SVR_RESULT_HDR) < 0) return SH_ERR_CRECV;
+	size_t len = ntohl(hdr);
+	if(outbuf_reserve(results, len) < 0) return SH_ERR_UNK;
+	if(recv_all(results->data + results->len, len) < 0) return SH_ERR_CRECV;
+	outbuf_commit(results, len);
+	return SH_ERR_SUCCESS;
 }
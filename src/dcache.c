@@ -0,0 +1,165 @@
+/*
+ * dcache.c
+ *
+ *  Set associative cache of directory lookups. Each set holds DCACHE_WAYS
+ *  entries and is replaced round robin. Misses are cached as negative
+ *  entries so that repeated lookups of missing names cost no block reads.
+ *  Each set has its own lock.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "dcache.h"
+
+typedef struct {
+	iptr parent;
+	iptr child;				// DCACHE_NEGATIVE if the name does not exist
+	uint32_t lblk;			// directory block holding the name, or DCACHE_NO_BLOCK
+	uint32_t hash;
+	uint8_t name_len;		// 0 = unused
+	char name[DCACHE_NAME_MAX];
+} dcache_entry;
+
+typedef struct {
+	dcache_entry way[DCACHE_WAYS];
+	uint8_t victim;
+	pthread_mutex_t lock;
+} dcache_set;
+
+static dcache_set dcache[DCACHE_SETS];
+
+//FNV-1a over the parent inode and the name
+static uint32_t dcache_hash(iptr parent, const char* name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for(uint8_t i = 0; i < sizeof(iptr); i++)
+	{
+		hash ^= (parent >> (i*8)) & 0xFF;
+		hash *= 16777619u;
+	}
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static dcache_entry* dcache_find(dcache_set* set, iptr parent, const char* name, size_t len, uint32_t hash)
+{
+	for(uint8_t i = 0; i < DCACHE_WAYS; i++)
+	{
+		dcache_entry* e = &set->way[i];
+		if(e->name_len == len && e->hash == hash && e->parent == parent
+				&& memcmp(e->name, name, len) == 0)
+		{
+			return e;
+		}
+	}
+	return NULL;
+}
+
+void dcache_init(void)
+{
+	memset(dcache, 0, sizeof(dcache));
+	for(uint32_t s = 0; s < DCACHE_SETS; s++)
+	{
+		pthread_mutex_init(&dcache[s].lock, NULL);
+	}
+}
+
+//Returns true if the lookup is cached; *child is DCACHE_NEGATIVE for a cached miss
+bool dcache_lookup(iptr parent, const char* name, iptr* child)
+{
+	size_t len = strlen(name);
+	if(len == 0 || len > DCACHE_NAME_MAX) return false;
+	uint32_t hash = dcache_hash(parent, name, len);
+	dcache_set* set = &dcache[hash % DCACHE_SETS];
+	pthread_mutex_lock(&set->lock);
+	dcache_entry* e = dcache_find(set, parent, name, len, hash);
+	if(e != NULL) *child = e->child;
+	pthread_mutex_unlock(&set->lock);
+	return e != NULL;
+}
+
+//Returns true if the block of the directory file that holds name is known.
+//Entries never move, but the caller checks the block before relying on it.
+bool dcache_block(iptr parent, const char* name, uint32_t* lblk)
+{
+	size_t len = strlen(name);
+	if(len == 0 || len > DCACHE_NAME_MAX) return false;
+	uint32_t hash = dcache_hash(parent, name, len);
+	dcache_set* set = &dcache[hash % DCACHE_SETS];
+	pthread_mutex_lock(&set->lock);
+	dcache_entry* e = dcache_find(set, parent, name, len, hash);
+	bool known = (e != NULL && e->child != DCACHE_NEGATIVE && e->lblk != DCACHE_NO_BLOCK);
+	if(known) *lblk = e->lblk;
+	pthread_mutex_unlock(&set->lock);
+	return known;
+}
+
+void dcache_insert(iptr parent, const char* name, iptr child)
+{
+	dcache_insert_at(parent, name, child, DCACHE_NO_BLOCK);
+}
+
+//As dcache_insert, also remembering the directory block that holds name
+void dcache_insert_at(iptr parent, const char* name, iptr child, uint32_t lblk)
+{
+	size_t len = strlen(name);
+	if(len == 0 || len > DCACHE_NAME_MAX) return;
+	uint32_t hash = dcache_hash(parent, name, len);
+	dcache_set* set = &dcache[hash % DCACHE_SETS];
+	pthread_mutex_lock(&set->lock);
+	dcache_entry* e = dcache_find(set, parent, name, len, hash);
+	if(e == NULL)
+	{
+		//Prefer an unused way, else replace round robin
+		for(uint8_t i = 0; i < DCACHE_WAYS && e == NULL; i++)
+		{
+			if(set->way[i].name_len == 0) e = &set->way[i];
+		}
+		if(e == NULL)
+		{
+			e = &set->way[set->victim];
+			set->victim = (set->victim + 1) % DCACHE_WAYS;
+		}
+	}
+	e->parent = parent;
+	e->child = child;
+	e->lblk = lblk;
+	e->hash = hash;
+	e->name_len = len;
+	memcpy(e->name, name, len);
+	pthread_mutex_unlock(&set->lock);
+}
+
+void dcache_invalidate(iptr parent, const char* name)
+{
+	size_t len = strlen(name);
+	if(len == 0 || len > DCACHE_NAME_MAX) return;
+	uint32_t hash = dcache_hash(parent, name, len);
+	dcache_set* set = &dcache[hash % DCACHE_SETS];
+	pthread_mutex_lock(&set->lock);
+	dcache_entry* e = dcache_find(set, parent, name, len, hash);
+	if(e != NULL) e->name_len = 0;
+	pthread_mutex_unlock(&set->lock);
+}
+
+//Forget every entry inside, or pointing at, a removed directory
+void dcache_purge_dir(iptr dir)
+{
+	for(uint32_t s = 0; s < DCACHE_SETS; s++)
+	{
+		pthread_mutex_lock(&dcache[s].lock);
+		for(uint8_t i = 0; i < DCACHE_WAYS; i++)
+		{
+			dcache_entry* e = &dcache[s].way[i];
+			if(e->name_len != 0 && (e->parent == dir || e->child == dir))
+			{
+				e->name_len = 0;
+			}
+		}
+		pthread_mutex_unlock(&dcache[s].lock);
+	}
+}
@@ -1,8 +1,14 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "fs.h"
 #include "bitmap.h"
 #include "inode.h"
-
-#define SUPERBLOCK_PADDING (BLOCK_SIZE-1048)
+#include "dcache.h"
+#include "journal.h"
+#include "fsck.h"
 
 // free block or inode bitmap values
 #define BM_FREE		0
@@ -15,21 +21,24 @@
 #define VFS_GOOD	1
 #define VFS_ERR		-1
 
+#define DIR_COMPACT_DEAD_BYTES	BLOCK_SIZE	// freed bytes that make a directory worth compacting
+#define DIR_COMPACT_QUEUE		64
 
+#define RECLAIM_SYNC_BLOCKS		32		// files with more blocks than this are freed in the background
+#define RECLAIM_BATCH			256		// blocks freed per background pass
+#define RECLAIM_QUEUE			256
 
-typedef struct {
-	uint8_t boot_record[1024]; //0
-	uint32_t inode_count;      //1023
-	uint32_t block_count;      //1027
+#define DELALLOC_MAX_BLOCKS		256		// buffered blocks per open file before they are flushed
 
-	uint32_t free_inode_count; //1031
-	uint32_t free_block_count; //1035
+#define STREAM_CHUNK_BLOCKS		256		// most blocks moved by one host copy
 
-	uint32_t first_data_block; //1039, must also be the start of the directory listing for the filesystem root
-	uint16_t magic; 		   //1043
-	uint16_t state;			   //1045
-	uint8_t padding[SUPERBLOCK_PADDING];
-} superblock;
+#define IMPORT_WORKERS			4		// threads copying file data in a tree import
+#define IMPORT_BATCH			256		// files created per directory write
+#define IMPORT_QUEUE			64		// created files waiting for their data
+
+#define TREE_STACK_MIN			16		// directory levels tree starts with room for
+#define TREE_BATCH				64		// entries tree reads from a directory at a time
+#define READDIRPLUS_MAX			256		// entries readdirplus returns at once
 
 
 // holds values related to a virtual file system file
@@ -40,6 +49,32 @@ typedef struct {
 	uint8_t *free_blocks;
 } vfs;
 
+// a created guest file and the host file its data comes from
+typedef struct {
+	char h_path[1024];
+	iptr inode_id;
+} import_job;
+
+// one directory level of a tree walk
+typedef struct {
+	dir_ptr dir;
+	dir_entry_plus* ents;
+	uint32_t count;
+	uint32_t next;
+} tree_frame;
+
+// state shared by the walker and the workers of a tree import
+typedef struct {
+	import_job jobs[IMPORT_QUEUE];
+	uint32_t head;
+	uint32_t count;
+	bool done;				// the walk is over, workers exit once the queue drains
+	uint32_t imported;
+	uint32_t failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// signalled when a job is added or taken
+} import_tree;
+
 
 
 //********FS state and cache********
@@ -48,625 +83,2400 @@ vfs fs;
 block superblk_cache;
 block block_bm_cache;
 block inode_bm_cache;
+block alloc_bm_cache;					//Blocks the allocator may not hand out: the block bitmap plus freed_pending
+uint32_t freed_pending;					//Blocks freed while freed_tid runs, reusable once it commits
+uint32_t freed_tid;
+
+session* sessions;						//Open sessions, for mount, umount and fsck to visit
+
+uint32_t dir_free_hint[INODE_COUNT];	//Per directory: first block that may still have a free slot
+uint32_t dir_dead_bytes[INODE_COUNT];	//Per directory: bytes freed by deletes since the last compaction
+
+bool dir_compaction = true;
+iptr compact_queue[DIR_COMPACT_QUEUE];	//Directories waiting for a background compaction pass
+uint8_t compact_head;
+uint8_t compact_count;
+
+iptr reclaim_queue[RECLAIM_QUEUE];		//Unlinked inodes whose blocks are still being freed
+uint16_t reclaim_head;
+uint16_t reclaim_count;
+uint32_t reclaim_pending;				//Blocks still held by queued inodes
+
+uint32_t delalloc_reserved;				//Free blocks promised to buffered writes that have no LBA yet
+static __thread uint32_t meta_credit;	//Promised blocks the calling thread's delalloc_flush may turn into indirect blocks
+
+vnode* vnodes[INODE_COUNT];				//Open files by inode, NULL when no descriptor is on one
+
+const uint8_t zero_block[BLOCK_SIZE];	//What read views show for holes
 
-fd_entry fd_tbl[MAX_FD];
-uint8_t fd_bm[MAX_FD/8];
+//Locks, taken in this order: directory locks (parent before child), inode
+//locks, vnode_lock, reclaim_lock, alloc_lock. The compaction queue, fd table, dentry
+//cache, session list and journal locks are leaves. journal_begin comes before all of them.
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;		//Superblock and bitmap caches, delalloc_reserved
+pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;	//Reclaim queue
+pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;	//Compaction queue
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;	//The sessions list
+pthread_mutex_t vnode_lock = PTHREAD_MUTEX_INITIALIZER;		//vnodes and the refs of each vnode
+pthread_mutex_t fd_grow_lock = PTHREAD_MUTEX_INITIALIZER;	//Adding chunks to any session's fd table
+pthread_rwlock_t dir_locks[INODE_COUNT];	//Per directory: its entries, free hint and dead bytes
+pthread_rwlock_t inode_locks[INODE_COUNT];	//Per file: its data, size and block map
+pthread_once_t locks_once = PTHREAD_ONCE_INIT;
 
-char cwd_str[1024];
-dir_ptr* cwd;
+
+//************locks_init****************
+void locks_init(void)
+{
+	for(uint32_t i = 0; i < INODE_COUNT; i++)
+	{
+		pthread_rwlock_init(&dir_locks[i], NULL);
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+}
 
 
 //************flush_metadata************
 void flush_metadata(void)
 {
-	blk_write(BLOCKID_SUPER, &superblk_cache);
-	blk_write(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
-	blk_write(BLOCKID_INODE_BITMAP, &inode_bm_cache);
+	pthread_mutex_lock(&alloc_lock);
+	journal_write(BLOCKID_SUPER, &superblk_cache);
+	journal_write(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
+	journal_write(BLOCKID_INODE_BITMAP, &inode_bm_cache);
+	pthread_mutex_unlock(&alloc_lock);
 }
 
-//*************reserve_inode************
-iptr reserve_inode(void)
+//*************take_inode***************
+//Marks a free inode used in the cached bitmap; the caller flushes
+iptr take_inode(void)
 {
 	superblock* super = (superblock*)&superblk_cache;
+	pthread_mutex_lock(&alloc_lock);
 	if(super->free_inode_count == 0)
 	{
+		pthread_mutex_unlock(&alloc_lock);
 		return 0;
 	}
 	iptr inode_ptr = find_free_bit(&inode_bm_cache);
 	set_bitmap(&inode_bm_cache, inode_ptr);
 	super->free_inode_count--;
-	flush_metadata();
+	pthread_mutex_unlock(&alloc_lock);
 	return inode_ptr;
 }
 
-//**************release_inode***********
-void release_inode(iptr inode_ptr)
+//*************give_inode***************
+void give_inode(iptr inode_ptr)
 {
 	superblock* super = (superblock*)&superblk_cache;
+	pthread_mutex_lock(&alloc_lock);
 	clear_bitmap(&inode_bm_cache, inode_ptr);
 	super->free_inode_count++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//*************reserve_inode************
+iptr reserve_inode(void)
+{
+	iptr inode_ptr = take_inode();
+	if(inode_ptr != 0)
+	{
+		flush_metadata();
+	}
+	return inode_ptr;
+}
+
+//**************release_inode***********
+void release_inode(iptr inode_ptr)
+{
+	give_inode(inode_ptr);
 	flush_metadata();
 }
 
+//**************inode_in_use************
+bool inode_in_use(iptr inode_ptr)
+{
+	pthread_mutex_lock(&alloc_lock);
+	bool used = read_bitmap(&inode_bm_cache, inode_ptr);
+	pthread_mutex_unlock(&alloc_lock);
+	return used;
+}
+
+//*************alloc_reload*************
+//Rebuilds the allocator's view from the block bitmap just read from disk
+void alloc_reload(void)
+{
+	pthread_mutex_lock(&alloc_lock);
+	memcpy(&alloc_bm_cache, &block_bm_cache, sizeof(block));
+	freed_pending = 0;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//*************alloc_settle*************
+//Makes the blocks freed by a transaction reusable once it has committed.
+//Until then a crash could bring back the old owner's pointers to them.
+//Call with alloc_lock held.
+static void alloc_settle(void)
+{
+	if(freed_pending > 0 && journal_committed(freed_tid))
+	{
+		memcpy(&alloc_bm_cache, &block_bm_cache, sizeof(block));
+		freed_pending = 0;
+	}
+}
+
+//*************alloc_room***************
+//Free blocks that are neither promised to buffered writes nor waiting for
+//their transaction to commit. Call with alloc_lock held.
+static uint32_t alloc_room(void)
+{
+	superblock* super = (superblock*)&superblk_cache;
+	alloc_settle();
+	uint32_t held = delalloc_reserved + freed_pending;
+	return (super->free_block_count > held) ? super->free_block_count - held : 0;
+}
+
 //*************reserve_block************
 iptr reserve_block(void)
 {
 	superblock* super = (superblock*)&superblk_cache;
-	if(super->free_block_count == 0)
+	pthread_mutex_lock(&alloc_lock);
+	if(meta_credit > 0)		//Already promised, turn the promise into the block
+	{
+		meta_credit--;
+		delalloc_reserved--;
+	}
+	if(alloc_room() == 0)
 	{
+		pthread_mutex_unlock(&alloc_lock);
 		return 0;
 	}
-	iptr blockid = find_free_bit(&block_bm_cache);
+	iptr blockid = find_free_bit(&alloc_bm_cache);
 	set_bitmap(&block_bm_cache, blockid);
+	set_bitmap(&alloc_bm_cache, blockid);
 	super->free_block_count--;
+	pthread_mutex_unlock(&alloc_lock);
 	flush_metadata();
 	return blockid;
 }
 
-//**************release_block***********
-void release_block(iptr blockid)
+//*************reserve_run**************
+//Reserves up to want adjacent blocks, starting the search at goal. Takes
+//the longest free run if none is long enough; *got is its length. With
+//promised set the blocks come out of delalloc_reserved, and the promises
+//for any it could not place stay held.
+static iptr reserve_run_from(iptr goal, uint32_t want, uint32_t* got, bool promised)
+{
+	superblock* super = (superblock*)&superblk_cache;
+	*got = 0;
+	pthread_mutex_lock(&alloc_lock);
+	if(promised) delalloc_reserved -= want;
+	uint32_t room = alloc_room();
+	if(promised) delalloc_reserved += want;
+	if(room == 0)
+	{
+		pthread_mutex_unlock(&alloc_lock);
+		return 0;
+	}
+	want = MIN(want, room);
+	uint32_t len;
+	iptr start = find_free_run(&alloc_bm_cache, goal, BD_SIZE_BLOCKS, want, &len);
+	len = MIN(len, want);
+	for(uint32_t i = 0; i < len; i++)
+	{
+		set_bitmap(&block_bm_cache, start + i);
+		set_bitmap(&alloc_bm_cache, start + i);
+	}
+	super->free_block_count -= len;
+	if(promised) delalloc_reserved -= len;
+	pthread_mutex_unlock(&alloc_lock);
+	flush_metadata();
+	*got = len;
+	return start;
+}
+
+iptr reserve_run(iptr goal, uint32_t want, uint32_t* got)
+{
+	return reserve_run_from(goal, want, got, false);
+}
+
+//*************return_block*************
+//Gives back a block reserve_run_from just handed out, keeping its promise.
+//Nothing ever pointed at it, so it is free for reuse at once.
+static void return_block(iptr blockid)
+{
+	superblock* super = (superblock*)&superblk_cache;
+	pthread_mutex_lock(&alloc_lock);
+	clear_bitmap(&block_bm_cache, blockid);
+	clear_bitmap(&alloc_bm_cache, blockid);
+	super->free_block_count++;
+	delalloc_reserved++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//**************unreserve_block*********
+//Returns a block to the free map without flushing, for callers freeing many.
+//The allocator skips it until the running transaction commits.
+void unreserve_block(iptr blockid)
 {
 	superblock* super = (superblock*)&superblk_cache;
+	pthread_mutex_lock(&alloc_lock);
+	alloc_settle();
 	clear_bitmap(&block_bm_cache, blockid);
 	super->free_block_count++;
+	freed_pending++;
+	freed_tid = journal_tid();
+	pthread_mutex_unlock(&alloc_lock);
+	journal_forget(blockid);
+}
+
+//**************release_block***********
+void release_block(iptr blockid)
+{
+	unreserve_block(blockid);
 	flush_metadata();
 }
 
-//****** realloc_cache*****************
-//Allocates at least "blocks_needed" blocks for this data cache
-int8_t realloc_cache(fd_entry* fde, uint32_t blocks_needed)
+//****** reserve_zeroed_block *********
+//Reserves a block and clears it on disk, for new indirect blocks
+iptr reserve_zeroed_block(void)
 {
-	block* new_data = calloc(blocks_needed, sizeof(block));
-	check(new_data != NULL, "Could not realloc data cache");
-	if(fde->data != NULL) {
-		memcpy(new_data, fde->data, fde->inode.size);
-		free(fde->data);
+	block zero;
+	memset(&zero, 0, sizeof(block));
+	iptr blockid = reserve_block();
+	if(blockid != 0)
+	{
+		journal_write(blockid, &zero);
 	}
-	fde->data = new_data;
-	return 0;
-error:
-	return -1;
+	return blockid;
 }
 
+//****** bmap *****************
+//Returns the LBA holding logical block lblk of a file, or 0 for a hole
+iptr bmap(inode* inode, uint32_t lblk)
+{
+	iptr ind[PTRS_PER_BLOCK];
+	if(lblk < DIRECT_BLOCKS)
+	{
+		return inode->data0[lblk];
+	}
+	lblk -= DIRECT_BLOCKS;
+	if(lblk < PTRS_PER_BLOCK)
+	{
+		if(inode->data1 == 0) return 0;
+		journal_read(inode->data1, (block*)ind);
+		return ind[lblk];
+	}
+	lblk -= PTRS_PER_BLOCK;
+	if(inode->data2 == 0 || lblk >= PTRS_PER_BLOCK * PTRS_PER_BLOCK) return 0;
+	journal_read(inode->data2, (block*)ind);
+	iptr s_ind = ind[lblk / PTRS_PER_BLOCK];
+	if(s_ind == 0) return 0;
+	journal_read(s_ind, (block*)ind);
+	return ind[lblk % PTRS_PER_BLOCK];
+}
 
-//****** realloc_fs_blocks*****************
-//Allocates at least "blocks_needed" blocks for this file
-int8_t realloc_fs_blocks(inode* inode, uint32_t blocks_needed)
+//****** bmap_place *****************
+//Like bmap, but fills a hole with lba, or with a newly reserved block if
+//lba is 0, along with any indirect blocks needed to reach it. The new
+//block's contents are undefined; the caller writes all of it. Returns 0
+//if the disk is full.
+iptr bmap_place(inode* inode, uint32_t lblk, iptr lba)
 {
-	uint32_t* s_ind = calloc(1, sizeof(block));
-	if(blocks_needed > inode->blocks)
+	iptr ind[PTRS_PER_BLOCK];
+	iptr ind_lba;
+
+	if(lblk < DIRECT_BLOCKS)
 	{
-		if(inode->blocks <= 8)
+		if(inode->data0[lblk] == 0)
 		{
-			for(; inode->blocks < MIN(8,blocks_needed); inode->blocks++)
-			{
-				inode->data0[inode->blocks] = reserve_block();
-			}
+			inode->data0[lblk] = lba ? lba : reserve_block();
+			check(inode->data0[lblk] != 0, "Disk full");
+			inode->blocks++;
 		}
-
-		if(inode->blocks < blocks_needed) //still not enough after allocating direct
+		return inode->data0[lblk];
+	}
+	lblk -= DIRECT_BLOCKS;
+	if(lblk < PTRS_PER_BLOCK)
+	{
+		if(inode->data1 == 0)
 		{
-			//Determine if a single indirect block has been allocated
-			if(inode->data1 == 0)
-			{
-				inode->data1 = reserve_block();
-			}
-			else
-			{
-				blk_read(inode->data1,(block*)s_ind);
-			}
-			//Allocate the blocks and save in the indirect block
-			for(;inode->blocks < blocks_needed; inode->blocks++)
-			{
-				s_ind[inode->blocks-8] = reserve_block();
-			}
-			blk_write(inode->data1,(block*)s_ind);
+			inode->data1 = reserve_zeroed_block();
+			check(inode->data1 != 0, "Disk full");
+		}
+		ind_lba = inode->data1;
+	}
+	else
+	{
+		lblk -= PTRS_PER_BLOCK;
+		check(lblk < PTRS_PER_BLOCK * PTRS_PER_BLOCK, "File too large");
+		if(inode->data2 == 0)
+		{
+			inode->data2 = reserve_zeroed_block();
+			check(inode->data2 != 0, "Disk full");
+		}
+		journal_read(inode->data2, (block*)ind);
+		if(ind[lblk / PTRS_PER_BLOCK] == 0)
+		{
+			ind[lblk / PTRS_PER_BLOCK] = reserve_zeroed_block();
+			check(ind[lblk / PTRS_PER_BLOCK] != 0, "Disk full");
+			journal_write(inode->data2, (block*)ind);
 		}
+		ind_lba = ind[lblk / PTRS_PER_BLOCK];
+		lblk %= PTRS_PER_BLOCK;
+	}
 
+	journal_read(ind_lba, (block*)ind);
+	if(ind[lblk] == 0)
+	{
+		ind[lblk] = lba ? lba : reserve_block();
+		check(ind[lblk] != 0, "Disk full");
+		journal_write(ind_lba, (block*)ind);
+		inode->blocks++;
 	}
-	free(s_ind);
+	return ind[lblk];
+error:
 	return 0;
 }
 
-//****** free_fs_blocks *****************
-//Frees all blocks in a inode
-/*
-int8_t free_fs_blocks(inode* inode)
+//****** bmap_alloc *****************
+iptr bmap_alloc(inode* inode, uint32_t lblk)
 {
-	(void*)inode;
-	return 0;
-error:
-	return -1;
-}*/
+	return bmap_place(inode, lblk, 0);
+}
 
-//*****************mount****************
-int8_t cnmount(void)
+//****** bmap_set *****************
+//Overwrites the pointer of a logical block that is already mapped
+void bmap_set(inode* inode, uint32_t lblk, iptr ptr)
 {
-	blk_read(BLOCKID_SUPER, &superblk_cache);
-	blk_read(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
-	blk_read(BLOCKID_INODE_BITMAP, &inode_bm_cache);
-
-	fs.superblk = (superblock*)&superblk_cache;
-	if(fs.superblk->magic == FS_MAGIC && fs.superblk->state == VALID_FS) {
-		fs.state = VFS_GOOD;
-		fs.superblk->state = ERROR_FS;
-	} else
+	iptr ind[PTRS_PER_BLOCK];
+	iptr ind_lba;
+	if(lblk < DIRECT_BLOCKS)
 	{
-		fs.state = VFS_BLANK;
+		inode->data0[lblk] = ptr;
+		return;
 	}
-	memset(fd_tbl, 0, sizeof(fd_entry)*1024);
-	memset(fd_bm, 0, sizeof(uint8_t)*MAX_FD/8);
-	strcpy(cwd_str,"/");
-	cwd = cnopendir("/");
-	return 0;
+	lblk -= DIRECT_BLOCKS;
+	if(lblk < PTRS_PER_BLOCK)
+	{
+		ind_lba = inode->data1;
+	}
+	else
+	{
+		lblk -= PTRS_PER_BLOCK;
+		journal_read(inode->data2, (block*)ind);
+		ind_lba = ind[lblk / PTRS_PER_BLOCK];
+		lblk %= PTRS_PER_BLOCK;
+	}
+	journal_read(ind_lba, (block*)ind);
+	ind[lblk] = ptr;
+	journal_write(ind_lba, (block*)ind);
 }
 
-//*****************umount****************
-int8_t cnumount(void)
+//******** vnode_dirty ***************
+//Returns the buffered copy of a file's logical block, NULL if none
+block* vnode_dirty(vnode* vn, uint32_t lblk)
 {
-	cnclosedir(cwd);
-	fs.superblk->state = VALID_FS;
-	blk_write(BLOCKID_SUPER, &superblk_cache);
-	blk_write(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
-	blk_write(BLOCKID_INODE_BITMAP, &inode_bm_cache);
-	return 0;
+	//Sequential writers hit the newest entry
+	for(uint32_t i = vn->dirty_count; i > 0; i--)
+	{
+		if(vn->dirty[i-1].lblk == lblk)
+		{
+			return &vn->dirty[i-1].data;
+		}
+	}
+	return NULL;
 }
 
-
-
-//*****************mkfs****************
-void superblock_init(void)
+//******** delalloc_block ************
+//Returns the buffered copy of a file's logical block, starting a zeroed
+//one and holding a free block for it if there is none. NULL if the disk
+//has no unpromised blocks left.
+block* delalloc_block(vnode* vn, uint32_t lblk)
 {
-	superblock *sb = calloc(1,sizeof(block));
-	memset(sb, 0, sizeof(block));
-	sb->inode_count = INODE_COUNT;
-	sb->block_count = BD_SIZE_BLOCKS;
-	sb->free_inode_count = INODE_COUNT-1;
-	sb->free_block_count = BD_SIZE_BLOCKS-4-INODE_TABLE_BLOCKS;  // 4 = super + bitmaps + rootdir
-	sb->magic = FS_MAGIC;
-	sb->state = FS_VALID;
-	blk_write(BLOCKID_SUPER, (block*)sb);
-	free(sb);
+	block* buffered = vnode_dirty(vn, lblk);
+	if(buffered != NULL)
+	{
+		return buffered;
+	}
+	//A block in a new indirect region may need that region's indirect block
+	//and, past the single indirect one, the double indirect root as well.
+	//Going back to an earlier region counts it again, erring high.
+	uint32_t region = (lblk < DIRECT_BLOCKS) ? 0 : (lblk - DIRECT_BLOCKS) / PTRS_PER_BLOCK + 1;
+	uint32_t meta = (region == 0 || region == vn->meta_region) ? 0 : (region == 1) ? 1 : 2;
+	pthread_mutex_lock(&alloc_lock);
+	bool room = alloc_room() > meta;
+	if(room) delalloc_reserved += 1 + meta;
+	pthread_mutex_unlock(&alloc_lock);
+	if(!room)
+	{
+		return NULL;
+	}
+	vn->meta_reserved += meta;
+	if(region != 0) vn->meta_region = region;
+	if(vn->dirty_count == vn->dirty_cap)
+	{
+		uint32_t cap = vn->dirty_cap ? vn->dirty_cap * 2 : 16;
+		dirty_block* grown = realloc(vn->dirty, cap * sizeof(dirty_block));
+		check_mem(grown);
+		vn->dirty = grown;
+		vn->dirty_cap = cap;
+	}
+	dirty_block* db = &vn->dirty[vn->dirty_count++];
+	db->lblk = lblk;
+	memset(&db->data, 0, sizeof(block));
+	return &db->data;
+error:
+	pthread_mutex_lock(&alloc_lock);
+	delalloc_reserved--;
+	pthread_mutex_unlock(&alloc_lock);
+	return NULL;
 }
 
-void block_bitmap_init(void)
+static int cmp_dirty_lblk(const void* a, const void* b)
 {
-	block *block_btm = calloc(1,sizeof(block));
-
-	//Mark all reserved blocks as used
-	set_bitmap(block_btm, BLOCKID_SUPER);
-	set_bitmap(block_btm, BLOCKID_BLOCK_BITMAP);
-	set_bitmap(block_btm, BLOCKID_INODE_BITMAP);
+	uint32_t la = ((const dirty_block*)a)->lblk;
+	uint32_t lb = ((const dirty_block*)b)->lblk;
+	return (la > lb) - (la < lb);
+}
 
-	//Mark all inode table blocks as used
-	for (uint16_t i = BLOCKID_INODE_TABLE; i < INODE_TABLE_BLOCKS + BLOCKID_INODE_TABLE; i++) {
-		set_bitmap(block_btm, i);
+//******** delalloc_flush ************
+//Gives a file's buffered blocks their LBAs in logical order, as one run
+//of adjacent blocks following the file's previous block where the bitmap
+//allows, then writes the inode. The blocks come out of those held for
+//them. Blocks it could not place stay buffered, still held, and -1 is
+//returned. Call with the inode lock held.
+int8_t delalloc_flush(vnode* vn)
+{
+	uint32_t count = vn->dirty_count;
+	uint32_t i = 0;
+	uint32_t got = 0;
+	uint32_t j = 0;
+	iptr start = 0;
+	iptr goal = 0;
+	qsort(vn->dirty, count, sizeof(dirty_block), cmp_dirty_lblk);
+	meta_credit = vn->meta_reserved;
+
+	if(count > 0 && vn->dirty[0].lblk > 0)
+	{
+		goal = BLK_LBA(bmap(&vn->inode, vn->dirty[0].lblk - 1));
+		if(goal != 0) goal++;
 	}
+	while(i < count)
+	{
+		start = reserve_run_from(goal, count - i, &got, true);
+		check(got > 0, "Disk full");
+		for(j = 0; j < got; j++, i++)
+		{
+			dirty_block* db = &vn->dirty[i];
+			iptr lba = bmap_place(&vn->inode, db->lblk, start + j);
+			check(lba != 0, "Could not map block %u", db->lblk);
+			if(lba != start + j)	//Another writer filled the hole first
+			{
+				return_block(start + j);
+				pthread_mutex_lock(&alloc_lock);
+				delalloc_reserved--;
+				pthread_mutex_unlock(&alloc_lock);
+				if(lba & BLK_UNWRITTEN)
+				{
+					lba = BLK_LBA(lba);
+					bmap_set(&vn->inode, db->lblk, lba);
+				}
+			}
+			blk_write(lba, &db->data);
+		}
+		goal = start + got;
+	}
+	inode_write(vn->inode_id, &vn->inode);
+	vn->dirty_count = 0;
+	vn->meta_region = 0;
+	pthread_mutex_lock(&alloc_lock);
+	delalloc_reserved -= meta_credit;		//Indirect blocks that were already there
+	pthread_mutex_unlock(&alloc_lock);
+	vn->meta_reserved = 0;
+	meta_credit = 0;
+	return 0;
 
-	//Mark root directory block as used
-	set_bitmap(block_btm, INODE_TABLE_BLOCKS + BLOCKID_INODE_TABLE);
-
-	blk_write(BLOCKID_BLOCK_BITMAP, block_btm);
-	free(block_btm);
+error:
+	for(; j < got; j++)		//The rest of the run was never mapped
+	{
+		return_block(start + j);
+	}
+	inode_write(vn->inode_id, &vn->inode);
+	memmove(vn->dirty, vn->dirty + i, (count - i) * sizeof(dirty_block));
+	vn->dirty_count = count - i;
+	vn->meta_reserved = meta_credit;
+	meta_credit = 0;
+	return -1;
 }
 
-void inode_bitmap_init(void)
+//******** vnode_flush ***************
+//A removed file's inode may already belong to a new file, so it is left alone
+int8_t vnode_flush(vnode* vn)
 {
-	block *inode_btm = calloc(1,sizeof(block));
-
-	//Mark first inode as used
-	set_bitmap(inode_btm, 0);
-
-	blk_write(BLOCKID_INODE_BITMAP, inode_btm);
-	free(inode_btm);
+	pthread_rwlock_wrlock(&inode_locks[vn->inode_id]);
+	int8_t res = vn->removed ? 0 : delalloc_flush(vn);
+	pthread_rwlock_unlock(&inode_locks[vn->inode_id]);
+	return res;
 }
 
-void write_root_dir(void)
+//******** vnode_drop ****************
+//Forgets a file's buffered blocks without placing them, giving back the
+//free blocks held for them. Call with the inode lock held.
+void vnode_drop(vnode* vn)
 {
-	//Prepare inode
-	inode root_i;
-	memset(&root_i, 0, sizeof(inode));
-	uint32_t now = time(NULL);
-	root_i.modified = now;
-	root_i.type = ITYPE_DIR;
-	root_i.size = 0;
-	root_i.blocks = 1;
-	root_i.data0[0] = BLOCKID_ROOT_DIR;
-
-	block* root_dir_block = calloc(1,sizeof(block));
+	pthread_mutex_lock(&alloc_lock);
+	delalloc_reserved -= vn->dirty_count + vn->meta_reserved;
+	pthread_mutex_unlock(&alloc_lock);
+	vn->dirty_count = 0;
+	vn->meta_reserved = 0;
+	vn->meta_region = 0;
+}
 
-	// . (self entry)
-	dir_entry* root_dir_entry = (dir_entry*)root_dir_block;
-	root_dir_entry->inode = 0;
-	root_dir_entry->file_type = ITYPE_DIR;
-	root_dir_entry->name_len = 1;
-	root_dir_entry->entry_len = 12;
-	memcpy(root_dir_entry->name, ".", 1);
-	root_i.size += 12;
-
-	// .. (parent entry, also itself)
-	root_dir_entry = (dir_entry*)(((char*)root_dir_block) + 12);
-	root_dir_entry->inode = 0;
-	root_dir_entry->file_type = ITYPE_DIR;
-	root_dir_entry->name_len = 2;
-	root_dir_entry->entry_len = 12;
-	memcpy(root_dir_entry->name, "..", 2);
-	root_i.size += 12;
+//******** vnode_get *****************
+//Returns the open file for an inode with a reference taken, opening it if
+//no descriptor is on it yet
+vnode* vnode_get(iptr inode_id)
+{
+	pthread_mutex_lock(&vnode_lock);
+	vnode* vn = vnodes[inode_id];
+	if(vn == NULL)
+	{
+		vn = calloc(1, sizeof(vnode));
+		check_mem(vn);
+		vn->inode_id = inode_id;
+		inode_read(inode_id, &vn->inode);
+		vnodes[inode_id] = vn;
+	}
+	vn->refs++;
+error:
+	pthread_mutex_unlock(&vnode_lock);
+	return vn;
+}
 
-	inode_write(0, &root_i);
-	blk_write(BLOCKID_ROOT_DIR, root_dir_block);
+//******** vnode_lookup **************
+//As vnode_get, but NULL if the inode is not open
+vnode* vnode_lookup(iptr inode_id)
+{
+	pthread_mutex_lock(&vnode_lock);
+	vnode* vn = vnodes[inode_id];
+	if(vn != NULL) vn->refs++;
+	pthread_mutex_unlock(&vnode_lock);
+	return vn;
+}
 
-	free(root_dir_block);
+//******** vnode_detach **************
+//Takes an open file out of the table once its inode is gone, so a new file
+//given the same inode starts afresh. Its descriptors keep it until they
+//close. Call with the inode lock held.
+void vnode_detach(vnode* vn)
+{
+	vnode_drop(vn);
+	vn->removed = true;
+	vn->inode.size = 0;
+	pthread_mutex_lock(&vnode_lock);
+	if(vnodes[vn->inode_id] == vn) vnodes[vn->inode_id] = NULL;
+	pthread_mutex_unlock(&vnode_lock);
 }
 
-int8_t cnmkfs(void)
+//******** vnode_put *****************
+//Drops a reference; the last one frees the vnode along with anything
+//still buffered on it
+void vnode_put(vnode* vn)
 {
-	superblock_init();
-	block_bitmap_init();
-	inode_bitmap_init();
-	write_root_dir();
-	return 0;
+	pthread_mutex_lock(&vnode_lock);
+	if(--vn->refs > 0)
+	{
+		pthread_mutex_unlock(&vnode_lock);
+		return;
+	}
+	if(vnodes[vn->inode_id] == vn) vnodes[vn->inode_id] = NULL;
+	pthread_mutex_unlock(&vnode_lock);
+	vnode_drop(vn);		//Whatever a failed flush left behind
+	free(vn->dirty);
+	free(vn);
 }
-//******** end mkfs *****************
 
-//******** llread *******************
-//Reads a complete file from its inode data
-int8_t llread(inode* inode_ptr, block* buf)
+//****** free_tree *****************
+//Frees the data blocks at or past logical block first under one block
+//pointer, at most *budget of them. level is 0 for a data block, 1 for a
+//single indirect block and 2 for a double indirect block. Indirect blocks
+//left mapping nothing are freed as well.
+void free_tree(inode* inode, iptr* ptr, uint8_t level, uint32_t base, uint32_t first, uint32_t* budget)
 {
-	uint32_t* s_ind = calloc(1, sizeof(block));
-	for(uint8_t i = 0; i < MIN(inode_ptr->blocks,8); i++)
+	if(*ptr == 0) return;
+	uint32_t span = (level == 0) ? 1 : (level == 1) ? PTRS_PER_BLOCK : PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+	if(base + span <= first) return;
+	if(level == 0)
 	{
-		blk_read(inode_ptr->data0[i], buf);
-		buf++;
+		if(*budget == 0) return;
+		unreserve_block(BLK_LBA(*ptr));
+		*ptr = 0;
+		(*budget)--;
+		inode->blocks--;
+		return;
 	}
 
-	if(inode_ptr->blocks > 8)
+	iptr ind[PTRS_PER_BLOCK];
+	uint32_t child_span = span / PTRS_PER_BLOCK;
+	uint32_t blocks_before = inode->blocks;
+	bool empty = true;
+	journal_read(*ptr, (block*)ind);
+	for(uint32_t i = 0; i < PTRS_PER_BLOCK; i++)
 	{
-		blk_read(inode_ptr->data1, (block*)s_ind);
-		for(uint32_t j = 0; j < inode_ptr->blocks - 8; j++)
+		if(*budget > 0)
 		{
-			blk_read(s_ind[j], buf);
-			buf++;
+			free_tree(inode, &ind[i], level - 1, base + i * child_span, first, budget);
 		}
+		if(ind[i] != 0) empty = false;
+	}
+	if(empty)
+	{
+		unreserve_block(*ptr);
+		*ptr = 0;
+	}
+	else if(inode->blocks != blocks_before)
+	{
+		journal_write(*ptr, (block*)ind);
 	}
-	free(s_ind);
-	return 0;
 }
 
-//******** llwrite ******************
-//Writes a file completely and updates inode data
-int8_t llwrite(inode* inode_ptr, block* buf)
+//****** free_fs_blocks *****************
+//Frees up to budget data blocks of a file at or past logical block
+//first_lblk, plus the indirect blocks that no longer map anything.
+//Metadata is flushed once. Returns the number of data blocks freed.
+uint32_t free_fs_blocks(inode* inode, uint32_t first_lblk, uint32_t budget)
 {
-	uint32_t* s_ind = calloc(1, sizeof(block));
-	for(uint8_t i = 0; i < MIN(inode_ptr->blocks,8); i++)
+	uint32_t start_budget = budget;
+	for(uint32_t lblk = first_lblk; lblk < DIRECT_BLOCKS; lblk++)
 	{
-		blk_write(inode_ptr->data0[i], buf);
-		buf++;
+		free_tree(inode, &inode->data0[lblk], 0, lblk, first_lblk, &budget);
 	}
+	free_tree(inode, &inode->data1, 1, DIRECT_BLOCKS, first_lblk, &budget);
+	free_tree(inode, &inode->data2, 2, DIRECT_BLOCKS + PTRS_PER_BLOCK, first_lblk, &budget);
+	flush_metadata();
+	return start_budget - budget;
+}
+
+//******** fd_at *********************
+static fd_entry* fd_at(fd_table* tbl, uint32_t fd)
+{
+	fd_entry* chunk = __atomic_load_n(&tbl->chunk[fd / FD_CHUNK], __ATOMIC_ACQUIRE);
+	return &chunk[fd % FD_CHUNK];
+}
+
+//******** fd_get ********************
+//Returns a session's descriptor entry, NULL if fd lies past its table
+fd_entry* fd_get(session* sess, int32_t fd)
+{
+	if(fd < 0 || (uint32_t)fd >= __atomic_load_n(&sess->fds.chunks, __ATOMIC_ACQUIRE) * FD_CHUNK)
+	{
+		return NULL;
+	}
+	return fd_at(&sess->fds, (uint32_t)fd);
+}
+
+//******** fd_push *******************
+//Puts descriptors first to last, already linked through next_free, on top
+//of the free stack
+static void fd_push(fd_table* tbl, uint32_t first, fd_entry* last)
+{
+	uint64_t head = __atomic_load_n(&tbl->free_head, __ATOMIC_RELAXED);
+	uint64_t pushed;
+	do
+	{
+		__atomic_store_n(&last->next_free, (uint32_t)head, __ATOMIC_RELAXED);
+		pushed = (head & ~(uint64_t)UINT32_MAX) | first;
+	} while(!__atomic_compare_exchange_n(&tbl->free_head, &head, pushed, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//******** fd_grow *******************
+//Adds a chunk of free descriptors to a table whose stack is empty. Of
+//several callers that find it empty at once only the first adds one.
+static int8_t fd_grow(fd_table* tbl)
+{
+	pthread_mutex_lock(&fd_grow_lock);
+	if((uint32_t)__atomic_load_n(&tbl->free_head, __ATOMIC_ACQUIRE) == FD_NONE)
+	{
+		uint32_t n = tbl->chunks;
+		check(n < FD_CHUNKS, "Out of file descriptors");
+		fd_entry* chunk = calloc(FD_CHUNK, sizeof(fd_entry));
+		check_mem(chunk);
+		for(uint32_t i = 0; i + 1 < FD_CHUNK; i++)
+		{
+			chunk[i].next_free = n * FD_CHUNK + i + 1;
+		}
+		__atomic_store_n(&tbl->chunk[n], chunk, __ATOMIC_RELEASE);
+		__atomic_store_n(&tbl->chunks, n + 1, __ATOMIC_RELEASE);
+		fd_push(tbl, n * FD_CHUNK, &chunk[FD_CHUNK - 1]);
+	}
+	pthread_mutex_unlock(&fd_grow_lock);
+	return 0;
+error:
+	pthread_mutex_unlock(&fd_grow_lock);
+	return -1;
+}
+
+//******** fd_alloc ******************
+//Pops the lowest recently freed descriptor, growing the table if none is
+//free. -1 once the table is full.
+int32_t fd_alloc(session* sess)
+{
+	fd_table* tbl = &sess->fds;
+	uint64_t head = __atomic_load_n(&tbl->free_head, __ATOMIC_ACQUIRE);
+	while(true)
+	{
+		uint32_t fd = (uint32_t)head;
+		if(fd == FD_NONE)
+		{
+			check(fd_grow(tbl) == 0, "Could not grow the fd table");
+			head = __atomic_load_n(&tbl->free_head, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		uint32_t next = __atomic_load_n(&fd_at(tbl, fd)->next_free, __ATOMIC_RELAXED);
+		uint64_t popped = (((head >> 32) + 1) << 32) | next;
+		if(__atomic_compare_exchange_n(&tbl->free_head, &head, popped, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			return (int32_t)fd;
+		}
+	}
+error:
+	return -1;
+}
+
+//******** fd_release ****************
+//Returns a closed descriptor to the free stack
+void fd_release(session* sess, int32_t fd)
+{
+	fd_push(&sess->fds, (uint32_t)fd, fd_get(sess, fd));
+}
+
+//******** fd_table_reset ************
+//Frees a table's chunks and leaves it empty
+void fd_table_reset(fd_table* tbl)
+{
+	for(uint32_t i = 0; i < tbl->chunks; i++)
+	{
+		free(tbl->chunk[i]);
+	}
+	memset(tbl, 0, sizeof(fd_table));
+	tbl->free_head = FD_NONE;
+}
+
+//******** session_cwd ****************
+//The inode of a session's cwd as it is now. False if it has none.
+static bool session_cwd(session* sess, iptr* inode_id)
+{
+	pthread_mutex_lock(&sess->cwd_lock);
+	bool has_cwd = (sess->cwd != NULL);
+	if(has_cwd) *inode_id = sess->cwd->inode_id;
+	pthread_mutex_unlock(&sess->cwd_lock);
+	return has_cwd;
+}
+
+//******** session_set_cwd ************
+//Swaps in a new cwd, closing the old one. Lookups that already read the
+//old inode carry on with it. path NULL keeps cwd_str.
+static void session_set_cwd(session* sess, dir_ptr* dir, const char* path)
+{
+	pthread_mutex_lock(&sess->cwd_lock);
+	dir_ptr* old = sess->cwd;
+	sess->cwd = dir;
+	if(path != NULL) strcpy(sess->cwd_str, path);
+	pthread_mutex_unlock(&sess->cwd_lock);
+	cnclosedir(old);
+}
+
+//******** session_flush ***************
+//Flushes what a session's writers have buffered; the descriptors stay open
+void session_flush(session* sess)
+{
+	for(uint32_t fd = 0; fd < sess->fds.chunks * FD_CHUNK; fd++)
+	{
+		fd_entry* fde = fd_at(&sess->fds, fd);
+		if(fde->state == FD_WRITE)
+		{
+			vnode_flush(fde->vn);
+		}
+	}
+}
+
+//******** session_reset ***************
+//Closes every descriptor without flushing and moves back to the root, for
+//a freshly mounted fs
+void session_reset(session* sess)
+{
+	for(uint32_t fd = 0; fd < sess->fds.chunks * FD_CHUNK; fd++)
+	{
+		fd_entry* fde = fd_at(&sess->fds, fd);
+		if(fde->state != FD_FREE)
+		{
+			vnode_put(fde->vn);
+		}
+	}
+	fd_table_reset(&sess->fds);
+	session_set_cwd(sess, cnopendir(sess, "/"), "/");
+}
+
+//******** cnsession_open **************
+//Starts a session at the root with no open files. Sessions opened before
+//the fs is mounted get their cwd at mount.
+session* cnsession_open(void)
+{
+	session* sess = calloc(1, sizeof(session));
+	check_mem(sess);
+	sess->fds.free_head = FD_NONE;
+	pthread_mutex_init(&sess->cwd_lock, NULL);
+	strcpy(sess->cwd_str, "/");
+	if(fs.state == VFS_GOOD)
+	{
+		sess->cwd = cnopendir(sess, "/");
+	}
+	pthread_mutex_lock(&session_lock);
+	sess->next = sessions;
+	sessions = sess;
+	pthread_mutex_unlock(&session_lock);
+	return sess;
+error:
+	return NULL;
+}
+
+//******** cnsession_close *************
+//Closes the session's open files and its cwd
+void cnsession_close(session* sess)
+{
+	if(sess == NULL) return;
+	pthread_mutex_lock(&session_lock);
+	for(session** link = &sessions; *link != NULL; link = &(*link)->next)
+	{
+		if(*link == sess)
+		{
+			*link = sess->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session_lock);
+	for(uint32_t fd = 0; fd < sess->fds.chunks * FD_CHUNK; fd++)
+	{
+		if(fd_at(&sess->fds, fd)->state != FD_FREE)
+		{
+			cnclose(sess, (int32_t)fd);
+		}
+	}
+	fd_table_reset(&sess->fds);
+	cnclosedir(sess->cwd);
+	pthread_mutex_destroy(&sess->cwd_lock);
+	free(sess);
+}
+
+//*****************mount****************
+int8_t cnmount(void)
+{
+	pthread_once(&locks_once, locks_init);
+	//Replay the journal before anything it covers is cached
+	bool journaled = false;
+	blk_read(BLOCKID_SUPER, &superblk_cache);
+	fs.superblk = (superblock*)&superblk_cache;
+	if(fs.superblk->magic == FS_MAGIC)
+	{
+		journaled = journal_load(fs.superblk->journal_start, fs.superblk->journal_blocks) >= 0
+				&& fs.superblk->journal_blocks > 0;
+	}
+	else
+	{
+		journal_load(0, 0);
+	}
+
+	blk_read(BLOCKID_SUPER, &superblk_cache);
+	blk_read(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
+	blk_read(BLOCKID_INODE_BITMAP, &inode_bm_cache);
+	alloc_reload();
+
+	//A crash leaves ERROR_FS; once the journal is replayed the metadata is whole
+	if(fs.superblk->magic == FS_MAGIC
+			&& (fs.superblk->state == VALID_FS || (fs.superblk->state == ERROR_FS && journaled))) {
+		fs.state = VFS_GOOD;
+		fs.superblk->state = ERROR_FS;
+	} else
+	{
+		fs.state = VFS_BLANK;
+	}
+	dcache_init();
+	memset(dir_free_hint, 0, sizeof(dir_free_hint));
+	memset(dir_dead_bytes, 0, sizeof(dir_dead_bytes));
+	compact_head = 0;
+	compact_count = 0;
+	reclaim_head = 0;
+	reclaim_count = 0;
+	reclaim_pending = 0;
+	delalloc_reserved = 0;
+	pthread_mutex_lock(&session_lock);
+	for(session* sess = sessions; sess != NULL; sess = sess->next)
+	{
+		session_reset(sess);
+	}
+	pthread_mutex_unlock(&session_lock);
+	return 0;
+}
+
+//*****************umount****************
+int8_t cnumount(void)
+{
+	pthread_mutex_lock(&session_lock);
+	for(session* sess = sessions; sess != NULL; sess = sess->next)
+	{
+		session_flush(sess);
+		session_set_cwd(sess, NULL, NULL);
+	}
+	pthread_mutex_unlock(&session_lock);
+	while(cnbackground() > 0);	//Finish deferred frees before the bitmaps are written
+	fs.superblk->state = VALID_FS;
+	flush_metadata();
+	journal_commit();
+	return 0;
+}
+
+
+
+//*****************mkfs****************
+void superblock_init(void)
+{
+	superblock *sb = calloc(1,sizeof(block));
+	memset(sb, 0, sizeof(block));
+	sb->inode_count = INODE_COUNT;
+	sb->block_count = BD_SIZE_BLOCKS;
+	sb->free_inode_count = INODE_COUNT-1;
+	sb->free_block_count = BD_SIZE_BLOCKS-4-INODE_TABLE_BLOCKS-JOURNAL_BLOCKS;  // 4 = super + bitmaps + rootdir
+	sb->magic = FS_MAGIC;
+	sb->state = FS_VALID;
+	sb->journal_start = BLOCKID_JOURNAL;
+	sb->journal_blocks = JOURNAL_BLOCKS;
+	blk_write(BLOCKID_SUPER, (block*)sb);
+	free(sb);
+}
+
+void block_bitmap_init(void)
+{
+	block *block_btm = calloc(1,sizeof(block));
+
+	//Mark all reserved blocks as used
+	set_bitmap(block_btm, BLOCKID_SUPER);
+	set_bitmap(block_btm, BLOCKID_BLOCK_BITMAP);
+	set_bitmap(block_btm, BLOCKID_INODE_BITMAP);
+
+	//Mark all inode table blocks as used
+	for (uint16_t i = BLOCKID_INODE_TABLE; i < INODE_TABLE_BLOCKS + BLOCKID_INODE_TABLE; i++) {
+		set_bitmap(block_btm, i);
+	}
+
+	//Mark root directory block as used
+	set_bitmap(block_btm, INODE_TABLE_BLOCKS + BLOCKID_INODE_TABLE);
+
+	//Mark the journal as used
+	for (uint32_t i = BLOCKID_JOURNAL; i < BLOCKID_JOURNAL + JOURNAL_BLOCKS; i++) {
+		set_bitmap(block_btm, i);
+	}
+
+	blk_write(BLOCKID_BLOCK_BITMAP, block_btm);
+	free(block_btm);
+}
+
+void inode_bitmap_init(void)
+{
+	block *inode_btm = calloc(1,sizeof(block));
+
+	//Mark first inode as used
+	set_bitmap(inode_btm, 0);
+
+	blk_write(BLOCKID_INODE_BITMAP, inode_btm);
+	free(inode_btm);
+}
+
+//Lays out a fresh directory block: . and .. with .. running to the end of the block
+void init_dir_block(block* dir_block, iptr self, iptr parent)
+{
+	// . (self entry)
+	dir_entry* entry = (dir_entry*)dir_block;
+	entry->inode = self;
+	entry->file_type = ITYPE_DIR;
+	entry->name_len = 1;
+	entry->entry_len = DIR_REC_LEN(1);
+	memcpy(entry->name, ".", 1);
+
+	// .. (parent entry)
+	entry = (dir_entry*)(((uint8_t*)dir_block) + DIR_REC_LEN(1));
+	entry->inode = parent;
+	entry->file_type = ITYPE_DIR;
+	entry->name_len = 2;
+	entry->entry_len = BLOCK_SIZE - DIR_REC_LEN(1);
+	memcpy(entry->name, "..", 2);
+}
+
+void write_root_dir(void)
+{
+	//Prepare inode
+	inode root_i;
+	memset(&root_i, 0, sizeof(inode));
+	uint32_t now = time(NULL);
+	root_i.modified = now;
+	root_i.type = ITYPE_DIR;
+	root_i.size = BLOCK_SIZE;
+	root_i.blocks = 1;
+	root_i.data0[0] = BLOCKID_ROOT_DIR;
+
+	block* root_dir_block = calloc(1,sizeof(block));
+	init_dir_block(root_dir_block, INODE_ROOTDIR, INODE_ROOTDIR);  //root is its own parent
+
+	inode_write(0, &root_i);
+	blk_write(BLOCKID_ROOT_DIR, root_dir_block);
+
+	free(root_dir_block);
+}
+
+int8_t cnmkfs(void)
+{
+	pthread_once(&locks_once, locks_init);
+	journal_format(BLOCKID_JOURNAL, JOURNAL_BLOCKS);
+	superblock_init();
+	block_bitmap_init();
+	inode_bitmap_init();
+	write_root_dir();
+	journal_commit();
+	dcache_init();
+	return 0;
+}
+//******** end mkfs *****************
+
+//******** llread *******************
+//Reads a complete file from its inode data
+int8_t llread(inode* inode_ptr, block* buf)
+{
+	for(uint32_t lblk = 0; lblk < inode_ptr->blocks; lblk++)
+	{
+		journal_read(bmap(inode_ptr, lblk), buf);
+		buf++;
+	}
+	return 0;
+}
+
+//******** llwrite ******************
+//Writes a file completely and updates inode data
+int8_t llwrite(inode* inode_ptr, block* buf)
+{
+	for(uint32_t lblk = 0; lblk < inode_ptr->blocks; lblk++)
+	{
+		journal_write(bmap(inode_ptr, lblk), buf);
+		buf++;
+	}
+	return 0;
+}
+
+//******** file_read ****************
+//Copies len bytes at offset out of a file, reading holes as zeros
+void file_read(inode* inode_ptr, uint8_t* buf, uint32_t len, uint32_t offset)
+{
+	block bounce;
+	while(len > 0)
+	{
+		uint32_t blk_off = offset % BLOCK_SIZE;
+		uint32_t chunk = MIN(len, BLOCK_SIZE - blk_off);
+		iptr lba = bmap(inode_ptr, offset / BLOCK_SIZE);
+		if(lba == 0 || (lba & BLK_UNWRITTEN))
+		{
+			memset(buf, 0, chunk);
+		}
+		else
+		{
+			blk_read(lba, &bounce);
+			memcpy(buf, bounce.byte + blk_off, chunk);
+		}
+		buf += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+}
+
+//******** vnode_read ****************
+//file_read, with blocks still buffered on the file read from the buffer
+void vnode_read(vnode* vn, uint8_t* buf, uint32_t len, uint32_t offset)
+{
+	file_read(&vn->inode, buf, len, offset);
+	for(uint32_t i = 0; i < vn->dirty_count; i++)
+	{
+		uint32_t start = vn->dirty[i].lblk * BLOCK_SIZE;
+		uint32_t from = MAX(start, offset);
+		uint32_t to = MIN(start + BLOCK_SIZE, offset + len);
+		if(from < to)
+		{
+			memcpy(buf + (from - offset), vn->dirty[i].data.byte + (from - start), to - from);
+		}
+	}
+}
+
+//******** prefetch_blocks ***********
+//Starts the device loading logical blocks [first, end) of a file, one
+//request per run of adjacent LBAs. Holes and unwritten blocks are skipped.
+void prefetch_blocks(inode* inode_ptr, uint32_t first, uint32_t end)
+{
+	iptr run = 0;
+	uint32_t run_len = 0;
+	for(uint32_t lblk = first; lblk < end; lblk++)
+	{
+		iptr lba = bmap(inode_ptr, lblk);
+		if(lba == 0 || (lba & BLK_UNWRITTEN)) continue;
+		if(run_len > 0 && lba == run + run_len)
+		{
+			run_len++;
+			continue;
+		}
+		if(run_len > 0) blk_prefetch(run, run_len);
+		run = lba;
+		run_len = 1;
+	}
+	if(run_len > 0) blk_prefetch(run, run_len);
+}
+
+//******** readahead *****************
+//Called before a read of len bytes at the cursor. A read that starts where
+//the last one ended is sequential; its window doubles, up to RA_MAX_BLOCKS,
+//each time the reader gets within half a window of what was already
+//prefetched, and the next window is requested then so the device stays
+//ahead. Any other read drops the window.
+void readahead(fd_entry* fde, uint32_t len)
+{
+	uint32_t first = fde->cursor / BLOCK_SIZE;
+	uint32_t last = (fde->cursor + len - 1) / BLOCK_SIZE;
+	uint32_t file_blocks = (fde->vn->inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	bool sequential = (first == fde->ra_next || first + 1 == fde->ra_next);
+	fde->ra_next = last + 1;
+	if(!sequential)
+	{
+		fde->ra_window = 0;
+		fde->ra_end = last + 1;
+		return;
+	}
+	if(fde->ra_end > last + 1 + fde->ra_window / 2)
+	{
+		return;
+	}
+	fde->ra_window = (fde->ra_window == 0) ? RA_MIN_BLOCKS : MIN(fde->ra_window * 2, RA_MAX_BLOCKS);
+	uint32_t start = MAX(fde->ra_end, first);
+	uint32_t end = MIN(last + 1 + fde->ra_window, file_blocks);
+	if(start < end)
+	{
+		prefetch_blocks(&fde->vn->inode, start, end);
+		fde->ra_end = end;
+	}
+}
+
+//******** file_write ***************
+//Copies len bytes into a file at offset, allocating blocks only for the
+//holes being written, and clears the unwritten flag of preallocated blocks
+//it fills. Grows the size if needed; the caller writes the inode. Returns
+//the bytes written, short if the disk fills up.
+uint32_t file_write(inode* inode_ptr, const uint8_t* buf, uint32_t len, uint32_t offset)
+{
+	block bounce;
+	uint32_t written = 0;
+	while(written < len)
+	{
+		uint32_t lblk = offset / BLOCK_SIZE;
+		uint32_t blk_off = offset % BLOCK_SIZE;
+		uint32_t chunk = MIN(len - written, BLOCK_SIZE - blk_off);
+		bool fresh = false;
+		iptr lba = bmap(inode_ptr, lblk);
+		if(lba == 0)
+		{
+			lba = bmap_alloc(inode_ptr, lblk);
+			if(lba == 0) break;
+			fresh = true;
+		}
+		else if(lba & BLK_UNWRITTEN)
+		{
+			lba = BLK_LBA(lba);
+			bmap_set(inode_ptr, lblk, lba);
+			fresh = true;
+		}
+		if(chunk < BLOCK_SIZE)	//Partial block, merge with what is there
+		{
+			if(fresh)
+			{
+				memset(&bounce, 0, sizeof(block));
+			}
+			else
+			{
+				blk_read(lba, &bounce);
+			}
+			memcpy(bounce.byte + blk_off, buf + written, chunk);
+			blk_write(lba, &bounce);
+		}
+		else
+		{
+			blk_write(lba, (const block*)(buf + written));
+		}
+		written += chunk;
+		offset += chunk;
+	}
+	if(offset > inode_ptr->size)
+	{
+		inode_ptr->size = offset;
+	}
+	return written;
+}
+
+
+//******** file_copy_in *************
+//Fills the first len bytes of a file from a host file, one host copy per
+//run of adjacent blocks, allocating holes and clearing the unwritten flag
+//of what it fills. The rest of the last block is zeroed, so len should be
+//the file's size. Grows the size if needed; the caller writes the inode.
+//Returns the bytes copied, short if the host file ends or the disk fills.
+uint32_t file_copy_in(inode* inode_ptr, int h_fd, uint32_t len)
+{
+	uint32_t copied = 0;
+	uint32_t end = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t lblk = 0;
+	while(lblk < end)
+	{
+		iptr run = bmap(inode_ptr, lblk);
+		if(run == 0 && (run = bmap_alloc(inode_ptr, lblk)) == 0) break;
+		uint32_t run_len = 1;
+		while(lblk + run_len < end && run_len < STREAM_CHUNK_BLOCKS)
+		{
+			iptr lba = bmap(inode_ptr, lblk + run_len);
+			if(lba == 0 || BLK_LBA(lba) != BLK_LBA(run) + run_len) break;
+			run_len++;
+		}
+
+		uint32_t bytes = MIN(len - copied, run_len * BLOCK_SIZE);
+		int64_t n = blk_copy_in(h_fd, copied, BLK_LBA(run), bytes);
+		if(n <= 0) break;
+		//Only what now holds data stops reading as zeros
+		uint32_t filled = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for(uint32_t i = 0; i < filled; i++)
+		{
+			iptr lba = bmap(inode_ptr, lblk + i);
+			if(lba & BLK_UNWRITTEN) bmap_set(inode_ptr, lblk + i, BLK_LBA(lba));
+		}
+		copied += n;
+		lblk += run_len;
+		if(n < bytes) break;
+	}
+	if(copied > inode_ptr->size)
+	{
+		inode_ptr->size = copied;
+	}
+	return copied;
+}
+
+//******** file_copy_out ************
+//Copies a whole file out to a host file, one host copy per run of adjacent
+//written blocks. Holes and unwritten blocks are skipped and the host file
+//is sized to match, so they read back as zeros. Returns the bytes of the
+//file, or -1.
+int64_t file_copy_out(inode* inode_ptr, int h_fd)
+{
+	uint32_t size = inode_ptr->size;
+	uint32_t end = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t lblk = 0;
+	while(lblk < end)
+	{
+		iptr run = bmap(inode_ptr, lblk);
+		if(run == 0 || (run & BLK_UNWRITTEN))
+		{
+			lblk++;
+			continue;
+		}
+		uint32_t run_len = 1;
+		while(lblk + run_len < end && run_len < STREAM_CHUNK_BLOCKS
+				&& bmap(inode_ptr, lblk + run_len) == run + run_len)
+		{
+			run_len++;
+		}
+		uint32_t offset = lblk * BLOCK_SIZE;
+		uint32_t bytes = MIN(size - offset, run_len * BLOCK_SIZE);
+		check(blk_copy_out(run, bytes, h_fd, offset) == bytes, "Could not copy blocks %u-%u out", run, run + run_len - 1);
+		lblk += run_len;
+	}
+	check(ftruncate(h_fd, size) == 0, "Could not size host file");
+	return size;
+error:
+	return -1;
+}
+
+
+//******** dir_window ****************
+//Reads one block of a streamed directory into its window. The inode is
+//re-read with it, so the walk sees entries added since opendir and stops
+//if the directory is removed under it.
+int8_t dir_window(dir_ptr* dir, uint32_t lblk)
+{
+	if(dir->window == NULL)
+	{
+		dir->window = malloc(sizeof(block));
+		check_mem(dir->window);
+	}
+	pthread_rwlock_rdlock(&dir_locks[dir->inode_id]);
+	inode_read(dir->inode_id, &dir->inode_st);
+	if(dir->inode_st.type != ITYPE_DIR)
+	{
+		dir->inode_st.size = 0;
+	}
+	else if(lblk < dir->inode_st.blocks)
+	{
+		journal_read(bmap(&dir->inode_st, lblk), dir->window);
+	}
+	pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+	dir->window_lblk = lblk;
+	return 0;
+error:
+	return -1;
+}
+
+//******** readdir ******************
+//Return the dir_entry at the index within dir_ptr, and increment by entry_len.
+//Unless the whole directory file is in memory, the entry is only good until
+//the next call.
+dir_entry* cnreaddir(dir_ptr* dir)
+{
+	dir_entry* entry;
+	do
+	{
+		uint32_t lblk = dir->index / BLOCK_SIZE;
+		uint32_t offset = dir->index % BLOCK_SIZE;
+		if(!dir->whole && lblk != dir->window_lblk && dir_window(dir, lblk) < 0)
+		{
+			return NULL;
+		}
+		if(dir->index >= dir->inode_st.size)      //Reached the end of the directory file
+		{
+			return NULL;
+		}
+		block* blk = dir->whole ? dir->data + lblk : dir->window;
+		entry = (dir_entry*)(blk->byte + offset);
+		if(entry->entry_len == 0 || offset + entry->entry_len > BLOCK_SIZE)  //Corrupt entry, skip the rest of this block
+		{
+			dir->index = (lblk + 1) * BLOCK_SIZE;
+			continue;
+		}
+		dir->index += entry->entry_len;
+	} while(entry->entry_len == 0 || entry->name_len == 0);  //Skip unused slots
+	return entry;
+}
+
+//******** rewinddir *****************
+void cnrewinddir(dir_ptr* dir)
+{
+	dir->index = 0;
+}
+
+//******** telldir ******************
+//Returns a cookie for the position that cnseekdir can resume from, on
+//this dir_ptr or another opened on the same directory later
+uint32_t cntelldir(dir_ptr* dir)
+{
+	return dir->index;
+}
+
+//******** seekdir ******************
+//Resumes at a cookie from cntelldir. Entries never move, but the slot
+//the cookie names may since have been merged into the one before it, so
+//the walk carries on from the first entry starting at or after the cookie
+//within its block, never from the middle of one.
+void cnseekdir(dir_ptr* dir, uint32_t cookie)
+{
+	uint32_t lblk = cookie / BLOCK_SIZE;
+	uint32_t want = cookie % BLOCK_SIZE;
+	uint32_t offset = 0;
+	block* blk;
+
+	dir->index = cookie;
+	if(want == 0) return;
+	if(!dir->whole)
+	{
+		if(dir_window(dir, lblk) < 0) return;
+		blk = dir->window;
+	}
+	else
+	{
+		blk = dir->data + lblk;
+	}
+	if(lblk >= dir->inode_st.blocks) return;		//Past the end, readdir finds nothing
+	while(offset < want)
+	{
+		uint16_t len = ((dir_entry*)(blk->byte + offset))->entry_len;
+		if(len == 0 || offset + len > BLOCK_SIZE)
+		{
+			offset = BLOCK_SIZE;
+			break;
+		}
+		offset += len;
+	}
+	dir->index = lblk * BLOCK_SIZE + offset;
+}
+
+//******** readdirplus ***************
+//Reads up to max entries from the directory's position along with their
+//inodes. The inodes are read as a group, each inode table block once.
+//Returns the number of entries, 0 at the end of the directory, or -1.
+int32_t cnreaddirplus(dir_ptr* dir, dir_entry_plus* ents, uint32_t max)
+{
+	dir_entry* entry;
+	iptr ids[READDIRPLUS_MAX];
+	inode attrs[READDIRPLUS_MAX];
+	uint32_t count = 0;
+	if(max > READDIRPLUS_MAX) max = READDIRPLUS_MAX;
+	while(count < max && (entry = cnreaddir(dir)))
+	{
+		dir_entry_plus* out = &ents[count];
+		out->inode_id = entry->inode;
+		out->file_type = entry->file_type;
+		out->name_len = entry->name_len;
+		memcpy(out->name, entry->name, entry->name_len);
+		out->name[entry->name_len] = '\0';
+		ids[count++] = entry->inode;
+	}
+	check(inode_read_many(ids, attrs, count) == 0, "Could not read inodes");
+	for(uint32_t i = 0; i < count; i++)
+	{
+		ents[i].attr = attrs[i];
+	}
+	return count;
+error:
+	return -1;
+}
+
+//******** inflatedir *****************
+//Populates a dir_ptr from an iptr
+void inflatedir(dir_ptr* dir, iptr inode_id)
+{
+	inode_read(inode_id,&dir->inode_st);
+	dir->inode_id = inode_id;
+	//Read the directory file for this inode
+	dir->data = calloc(dir->inode_st.blocks, sizeof(block));  	//Memory for all directory file blocks
+	llread(&dir->inode_st, dir->data);	//Read the directory file
+	dir->data_blocks = dir->inode_st.blocks;
+	dir->whole = true;
+	dir->index = 0;
+	dir->window = NULL;
+	dir->window_lblk = DIR_NO_WINDOW;
+}
+
+//******** streamdir ******************
+//Populates a dir_ptr from an iptr without reading the directory file;
+//readdir fetches its blocks one at a time as the walk reaches them
+void streamdir(dir_ptr* dir, iptr inode_id)
+{
+	inode_read(inode_id, &dir->inode_st);
+	dir->inode_id = inode_id;
+	dir->data = NULL;
+	dir->data_blocks = 0;
+	dir->whole = false;
+	dir->index = 0;
+	dir->window = NULL;
+	dir->window_lblk = DIR_NO_WINDOW;
+}
 
-	if(inode_ptr->blocks > 8)
+//******** releasedir *****************
+//Frees what a dir_ptr holds, but not the dir_ptr
+void releasedir(dir_ptr* dir)
+{
+	free(dir->data);
+	free(dir->window);
+	dir->data = NULL;
+	dir->data_blocks = 0;
+	dir->whole = false;
+	dir->window = NULL;
+}
+
+
+//******** dir_block_find ************
+//Returns the live entry for name in one directory block, or NULL. The
+//walk stops at a corrupt entry, as readdir skips the rest of the block.
+dir_entry* dir_block_find(block* blk, const char* name)
+{
+	size_t name_len = strlen(name);
+	uint16_t offset = 0;
+	while(offset < BLOCK_SIZE)
 	{
-		blk_read(inode_ptr->data1, (block*)s_ind);
-		for(uint32_t j = 0; j < inode_ptr->blocks - 8; j++)
+		dir_entry* entry = (dir_entry*)(blk->byte + offset);
+		if(entry->entry_len == 0 || offset + entry->entry_len > BLOCK_SIZE) break;
+		if(entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0)
 		{
-			blk_write(s_ind[j], buf);
-			buf++;
+			return entry;
 		}
+		offset += entry->entry_len;
+	}
+	return NULL;
+}
+
+//******** lookup *******************
+//Finds name within the directory parent, consulting the dentry cache before
+//reading the directory file. Misses are cached as negative entries. The
+//caller holds the directory's lock.
+int8_t dir_lookup_locked(iptr parent, const char* name, iptr* child)
+{
+	inode dir_i;
+	block* blk = NULL;
+
+	if(dcache_lookup(parent, name, child))
+	{
+		return (*child == DCACHE_NEGATIVE) ? -1 : 0;
+	}
+
+	//A block at a time, so the walk stops where the name is found
+	*child = DCACHE_NEGATIVE;
+	inode_read(parent, &dir_i);
+	blk = malloc(sizeof(block));
+	check_mem(blk);
+	uint32_t lblk;
+	for(lblk = 0; lblk < dir_i.blocks; lblk++)
+	{
+		journal_read(bmap(&dir_i, lblk), blk);
+		dir_entry* entry = dir_block_find(blk, name);
+		if(entry != NULL)
+		{
+			*child = entry->inode;
+			break;
+		}
+	}
+	free(blk);
+	dcache_insert_at(parent, name, *child, (*child == DCACHE_NEGATIVE) ? DCACHE_NO_BLOCK : lblk);
+	return (*child == DCACHE_NEGATIVE) ? -1 : 0;
+error:
+	return -1;
+}
+
+int8_t dir_lookup(iptr parent, const char* name, iptr* child)
+{
+	if(dcache_lookup(parent, name, child))
+	{
+		return (*child == DCACHE_NEGATIVE) ? -1 : 0;
+	}
+	pthread_rwlock_rdlock(&dir_locks[parent]);
+	int8_t res = dir_lookup_locked(parent, name, child);
+	pthread_rwlock_unlock(&dir_locks[parent]);
+	return res;
+}
+
+//******** resolve_path **************
+//Walks an absolute or cwd-relative path down to its inode
+int8_t resolve_path(session* sess, const char* name, iptr* inode_id)
+{
+	char name_copy[256];
+	char* name_tok;
+	char* save;
+	iptr current;
+
+	if(memcmp(name,"/",1) == 0)					//Is this path absolute or relative
+	{
+		current = INODE_ROOTDIR;
+	}
+	else
+	{
+		check(session_cwd(sess, &current), "No working directory");
+	}
+
+	strcpy(name_copy, name);
+	name_tok = strtok_r(name_copy, "/", &save);
+	while(name_tok != NULL)
+	{
+		check_debug(dir_lookup(current, name_tok, &current) == 0, "can not find %s in %s", name_tok, name);
+		name_tok = strtok_r(NULL, "/", &save);		//Read the next token
 	}
-	free(s_ind);
+	*inode_id = current;
 	return 0;
+
+error:
+	return -1;
 }
 
+//******** opendir ******************
+dir_ptr* cnopendir(session* sess, const char* name)
+{
+	iptr dir_id;
+	dir_ptr *dir = NULL;
 
+	check(resolve_path(sess, name, &dir_id) == 0, "can not find directory %s", name);
+	dir = calloc(1,sizeof(dir_ptr));	//Directory file in memory (e.g. DIR object from filedef.h)
+	check_mem(dir);
+	streamdir(dir, dir_id);
+	return dir;
 
-//******** readdir ******************
-//Return the dir_entry at the index within dir_ptr, and increment by entry_len.
-dir_entry* cnreaddir(dir_ptr* dir)
+error:
+	return NULL;
+}
+
+
+//******** closedir *****************
+void cnclosedir(dir_ptr* dir)
 {
-	if(dir->index >= dir->inode_st.size)      //Reached the end of the directory file
+	if(dir == NULL) return;
+	releasedir(dir);
+	free(dir);
+}
+
+//******** split_path **************
+//Splits a path into its parent directory path and its last component
+void split_path(const char* name, char* parent_name, const char** base_name)
+{
+	const char* slash = strrchr(name, '/');
+	if(slash == NULL)
 	{
-		return NULL;
+		strcpy(parent_name, "");		//Relative to cwd
+		*base_name = name;
+	}
+	else if(slash == name)
+	{
+		strcpy(parent_name, "/");
+		*base_name = slash + 1;
+	}
+	else
+	{
+		memcpy(parent_name, name, slash - name);
+		parent_name[slash - name] = 0;
+		*base_name = slash + 1;
 	}
-	uint8_t* entry_8 = (uint8_t*)dir->data;
-	entry_8 += dir->index;
-	dir_entry* entry = (dir_entry*)entry_8;
-	dir->index += entry->entry_len;
-	return entry;
 }
 
-//******** rewinddir *****************
-void cnrewinddir(dir_ptr* dir)
+//******** dir_room ******************
+//Grows dir->data to hold at least blocks blocks. Nothing is read into it.
+int8_t dir_room(dir_ptr* dir, uint32_t blocks)
 {
-	dir->index = 0;
+	if(blocks > dir->data_blocks)
+	{
+		block* data = realloc(dir->data, blocks * sizeof(block));
+		check_mem(data);
+		dir->data = data;
+		dir->data_blocks = blocks;
+	}
+	return 0;
+error:
+	return -1;
 }
 
-//******** inflatedir *****************
-//Populates a dir_ptr from an iptr
-void inflatedir(dir_ptr* dir, iptr inode_id)
+//******** refreshdir ****************
+//Re-reads the directory inode before a change and makes room for its
+//blocks. The change reads only the blocks it searches, so data no longer
+//holds the whole file and readdir goes back to streaming.
+int8_t refreshdir(dir_ptr* dir)
 {
-	inode_read(inode_id,&dir->inode_st);
-	dir->inode_id = inode_id;
-	//Read the directory file for this inode
-	dir->data = calloc(dir->inode_st.blocks, sizeof(block));  	//Memory for all directory file blocks
-	llread(&dir->inode_st, dir->data);	//Read the directory file
-	dir->index = 0;
+	inode_read(dir->inode_id, &dir->inode_st);
+	dir->whole = false;
+	return dir_room(dir, dir->inode_st.blocks);
 }
 
-
-//******** opendir ******************
-dir_ptr* cnopendir(const char* name)
+//******** dir_place_entry ***********
+//Places a new entry in the first slot with room for it, starting at the
+//directory's free-space hint, and returns the logical block it landed in,
+//or -1. Only dir->data and the dentry cache change; the caller writes the
+//block and the directory inode. Each block searched is re-read first in
+//case another dir_ptr changed it, except those set in touched, which hold
+//entries placed since the last write. The directory grows by one block
+//when no slot is large enough.
+int64_t dir_place_entry(dir_ptr* dir, const char* name, iptr inode_id, uint8_t file_type, uint8_t* touched)
 {
-	char name_copy[256];
-	strcpy(name_copy, name);
-	char* name_tok;
-	char entry_name[256];
-	iptr loaded_inode = INODE_COUNT + 1;		//Invalid sentinel
-	dir_entry* entry;
-	dir_ptr *dir = calloc(1,sizeof(dir_ptr));	//Directory file in memory (e.g. DIR object from filedef.h)
+	uint16_t name_len = strlen(name);
+	uint16_t needed = DIR_REC_LEN(name_len);
+	uint32_t lblk;
+	uint8_t* blk;
+	dir_entry* entry = NULL;
 
-	if(strlen(name) == 0)
+	check(name_len > 0 && name_len < 256, "Invalid name %s", name);
+
+	for(lblk = dir_free_hint[dir->inode_id]; lblk < dir->inode_st.blocks; lblk++)
 	{
-		strcpy(name_copy,".");
+		iptr lba = bmap(&dir->inode_st, lblk);
+		blk = (uint8_t*)(dir->data + lblk);
+		if(touched == NULL || !(touched[lblk / 8] & (1 << (lblk % 8))))
+		{
+			journal_read(lba, (block*)blk);
+		}
+		bool full = true;
+		uint16_t offset = 0;
+		while(offset < BLOCK_SIZE)
+		{
+			dir_entry* slot = (dir_entry*)(blk + offset);
+			check(slot->entry_len != 0, "Corrupt directory block %u", lba);
+			uint16_t used = (slot->name_len == 0) ? 0 : DIR_REC_LEN(slot->name_len);
+			uint16_t slack = slot->entry_len - used;
+			if(slack >= DIR_REC_LEN(1)) full = false;
+			if(slack >= needed)
+			{
+				if(used == 0)  //Unused slot, take it over whole
+				{
+					entry = slot;
+				}
+				else           //Split the slack off the end of a live entry
+				{
+					entry = (dir_entry*)(blk + offset + used);
+					entry->entry_len = slack;
+					slot->entry_len = used;
+				}
+				goto found;
+			}
+			offset += slot->entry_len;
+		}
+		if(full && lblk == dir_free_hint[dir->inode_id])
+		{
+			dir_free_hint[dir->inode_id]++;
+		}
 	}
 
-	if(memcmp(name,"/",1) == 0)					//Is this path absolute or relative
+	//No room, append a block holding a single slot
+	check(dir_room(dir, dir->inode_st.blocks + 1) == 0, "Could not grow directory");
+	lblk = dir->inode_st.blocks;
+	check(bmap_alloc(&dir->inode_st, lblk) != 0, "Could not grow directory");
+	dir->inode_st.size = dir->inode_st.blocks * BLOCK_SIZE;
+	blk = (uint8_t*)(dir->data + lblk);
+	memset(blk, 0, sizeof(block));
+	entry = (dir_entry*)blk;
+	entry->entry_len = BLOCK_SIZE;
+
+found:
+	entry->inode = inode_id;
+	entry->file_type = file_type;
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len);
+	if(touched != NULL)
 	{
-		//Start at the root dir
-		inflatedir(dir, INODE_ROOTDIR);
+		touched[lblk / 8] |= 1 << (lblk % 8);
 	}
-	else
+	dcache_insert_at(dir->inode_id, name, inode_id, lblk);
+	return lblk;
+error:
+	return -1;
+}
+
+//******** dir_add_entry *************
+//Adds one entry and writes back only the block it landed in
+int8_t dir_add_entry(dir_ptr* dir, const char* name, iptr inode_id, uint8_t file_type)
+{
+	check(refreshdir(dir) == 0, "Could not refresh directory");
+	int64_t lblk = dir_place_entry(dir, name, inode_id, file_type, NULL);
+	check(lblk >= 0, "Could not place %s", name);
+	journal_write(bmap(&dir->inode_st, lblk), dir->data + lblk);
+
+	dir->inode_st.modified = time(NULL);
+	inode_write(dir->inode_id, &dir->inode_st);
+	return 0;
+error:
+	return -1;
+}
+
+//******** dir_tidy_block ***********
+//Merges each unused slot into the slot before it in the block. Live
+//entries stay at their offsets, so resume cookies keep their place.
+//Returns 1 if the block changed, 0 if not, -1 if it is corrupt.
+int8_t dir_tidy_block(block* blk)
+{
+	dir_entry* keep = NULL;
+	int8_t changed = 0;
+	uint16_t offset = 0;
+	while(offset < BLOCK_SIZE)
 	{
-		//Start at cwd
-		inflatedir(dir, cwd->inode_id);
+		dir_entry* entry = (dir_entry*)(blk->byte + offset);
+		uint16_t len = entry->entry_len;
+		if(len == 0 || offset + len > BLOCK_SIZE) return -1;
+		if(entry->name_len == 0 && keep != NULL)
+		{
+			keep->entry_len += len;
+			changed = 1;
+		}
+		else
+		{
+			keep = entry;
+		}
+		offset += len;
 	}
+	return changed;
+}
 
-	if(strcmp(name,"/") == 0)  //Root is a special case, we are done now
+//******** dir_block_empty ***********
+//True if no slot in the block is in use. A corrupt block counts as used.
+bool dir_block_empty(const block* blk)
+{
+	uint16_t offset = 0;
+	while(offset < BLOCK_SIZE)
 	{
-		goto done;
+		const dir_entry* entry = (const dir_entry*)(blk->byte + offset);
+		if(entry->entry_len == 0 || offset + entry->entry_len > BLOCK_SIZE) return false;
+		if(entry->name_len != 0) return false;
+		offset += entry->entry_len;
 	}
+	return true;
+}
 
-	name_tok = strtok(name_copy, "/");   //Guaranteed not to return NULL
-	do
+//******** dir_unlink_slot ***********
+//Removes name from one block of the directory if it is there, merging its
+//slot into the previous entry of the block (or marking it unused if it is
+//first in the block), and writes back that block. Returns 1 if removed, 0
+//if name is not in the block, -1 if the block is corrupt.
+int8_t dir_unlink_slot(dir_ptr* dir, uint32_t lblk, const char* name)
+{
+	uint16_t name_len = strlen(name);
+	uint8_t* blk = (uint8_t*)(dir->data + lblk);
+	journal_read(bmap(&dir->inode_st, lblk), (block*)blk);		//Another dir_ptr may have changed it
+	dir_entry* prev = NULL;
+	uint16_t offset = 0;
+	while(offset < BLOCK_SIZE)
 	{
-		//Find the token in this dir
-		while((entry = cnreaddir(dir)))
+		dir_entry* entry = (dir_entry*)(blk + offset);
+		if(entry->entry_len == 0 || offset + entry->entry_len > BLOCK_SIZE) return -1;
+		if(entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0)
 		{
-			//Copy entry name to a null-term string to compare it
-			memcpy(entry_name, entry->name, entry->name_len);
-			entry_name[entry->name_len] = 0;
-			if(strcmp(entry_name, name_tok) == 0)  //If this is the directory we want
+			if(prev != NULL)
+			{
+				prev->entry_len += entry->entry_len;
+			}
+			else
 			{
-				loaded_inode = entry->inode;
-				dir_ptr* new_dir = calloc(1, sizeof(dir_ptr));
-				inflatedir(new_dir, entry->inode);
-				cnclosedir(dir);  //Forget the directory we already read
-				dir = new_dir;
-				break;
+				entry->name_len = 0;
 			}
+			journal_write(bmap(&dir->inode_st, lblk), (block*)blk);
+			return 1;
 		}
-		//Verify the dir was actually loaded
-		check(dir->inode_id == loaded_inode, "can not find directory %s", name_copy);
+		if(entry->name_len != 0) prev = entry;
+		offset += entry->entry_len;
+	}
+	return 0;
+}
 
-		name_tok = strtok(NULL, "/");		//Read the next token
+//******** dir_remove_entry **********
+//Removes name from the block the dentry cache says holds it, searching
+//the directory a block at a time only if that is not known. Directories
+//that pile up enough freed space are queued for a background compaction
+//pass.
+int8_t dir_remove_entry(dir_ptr* dir, const char* name)
+{
+	uint32_t hint;
+	uint32_t lblk = 0;
+	int8_t res = 0;
+	check(refreshdir(dir) == 0, "Could not refresh directory");
+	bool hinted = dcache_block(dir->inode_id, name, &hint) && hint < dir->inode_st.blocks;
+	if(hinted)
+	{
+		lblk = hint;
+		res = dir_unlink_slot(dir, lblk, name);
+	}
+	for(uint32_t i = 0; res == 0 && i < dir->inode_st.blocks; i++)
+	{
+		if(hinted && i == hint) continue;
+		lblk = i;
+		res = dir_unlink_slot(dir, lblk, name);
+	}
+	check(res >= 0, "Corrupt directory block %u in inode %u", lblk, dir->inode_id);
+	if(res == 0) return -1;
 
-	} while(name_tok != NULL);
+	if(lblk < dir_free_hint[dir->inode_id])
+	{
+		dir_free_hint[dir->inode_id] = lblk;
+	}
+	dir_dead_bytes[dir->inode_id] += DIR_REC_LEN(strlen(name));
+	pthread_mutex_lock(&compact_lock);
+	if(dir_compaction && dir_dead_bytes[dir->inode_id] >= DIR_COMPACT_DEAD_BYTES
+			&& compact_count < DIR_COMPACT_QUEUE)
+	{
+		compact_queue[(compact_head + compact_count) % DIR_COMPACT_QUEUE] = dir->inode_id;
+		compact_count++;
+		dir_dead_bytes[dir->inode_id] = 0;
+	}
+	pthread_mutex_unlock(&compact_lock);
 
-done:
-	return dir;
+	dir->inode_st.modified = time(NULL);
+	inode_write(dir->inode_id, &dir->inode_st);
+	dcache_invalidate(dir->inode_id, name);
+	return 0;
+error:
+	return -1;
+}
 
+//******** compact_dir ***************
+//Merges the free slots in each block of a directory and frees the empty
+//blocks at its end. Entries are never moved, so a cookie taken before
+//the pass still resumes where it left off.
+int8_t compact_dir(iptr inode_id)
+{
+	dir_ptr dir;
+	pthread_rwlock_wrlock(&dir_locks[inode_id]);
+	if(!inode_in_use(inode_id))		//Removed since it was queued
+	{
+		pthread_rwlock_unlock(&dir_locks[inode_id]);
+		return 0;
+	}
+	inflatedir(&dir, inode_id);
+	if(dir.inode_st.type == ITYPE_DIR)
+	{
+		uint32_t used_blocks = dir.inode_st.blocks;
+		while(used_blocks > 1 && dir_block_empty(dir.data + used_blocks - 1))
+		{
+			used_blocks--;
+		}
+		for(uint32_t lblk = 0; lblk < used_blocks; lblk++)
+		{
+			int8_t res = dir_tidy_block(dir.data + lblk);
+			check(res >= 0, "Corrupt directory block %u in inode %u", lblk, inode_id);
+			if(res > 0)
+			{
+				journal_write(bmap(&dir.inode_st, lblk), dir.data + lblk);
+			}
+		}
+		if(used_blocks < dir.inode_st.blocks)
+		{
+			free_fs_blocks(&dir.inode_st, used_blocks, UINT32_MAX);
+			dir.inode_st.size = dir.inode_st.blocks * BLOCK_SIZE;
+			inode_write(inode_id, &dir.inode_st);
+		}
+		dir_free_hint[inode_id] = 0;
+	}
+	free(dir.data);
+	pthread_rwlock_unlock(&dir_locks[inode_id]);
+	return 0;
 error:
-	free(dir);
-	return NULL;
+	free(dir.data);
+	pthread_rwlock_unlock(&dir_locks[inode_id]);
+	return -1;
 }
 
+//******** reclaim_step **************
+//Frees the next batch of blocks of the oldest unlinked inode, releasing
+//the inode once it holds nothing. Returns false if the queue is empty.
+bool reclaim_step(void)
+{
+	inode orphan;
+	pthread_mutex_lock(&reclaim_lock);
+	if(reclaim_count == 0)
+	{
+		pthread_mutex_unlock(&reclaim_lock);
+		return false;
+	}
+	iptr inode_id = reclaim_queue[reclaim_head];
+	inode_read(inode_id, &orphan);
+	reclaim_pending -= free_fs_blocks(&orphan, 0, RECLAIM_BATCH);
+	if(orphan.blocks > 0 || orphan.data1 != 0 || orphan.data2 != 0)
+	{
+		inode_write(inode_id, &orphan);
+	}
+	else
+	{
+		release_inode(inode_id);
+		reclaim_head = (reclaim_head + 1) % RECLAIM_QUEUE;
+		reclaim_count--;
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return true;
+}
 
-//******** closedir *****************
-void cnclosedir(dir_ptr* dir)
+//******** free_inode ****************
+//Frees an unlinked inode and its blocks, right away when it is small or
+//through the background reclaimer when it is large
+void free_inode(iptr inode_id, inode* inode_st)
 {
-	if(dir == NULL) return;
-	if(dir->data == NULL) return;
-	free(dir->data);
-	free(dir);
+	pthread_mutex_lock(&reclaim_lock);
+	if(inode_st->blocks > RECLAIM_SYNC_BLOCKS && reclaim_count < RECLAIM_QUEUE)
+	{
+		inode_st->size = 0;
+		inode_write(inode_id, inode_st);
+		reclaim_queue[(reclaim_head + reclaim_count) % RECLAIM_QUEUE] = inode_id;
+		reclaim_count++;
+		reclaim_pending += inode_st->blocks;
+		pthread_mutex_unlock(&reclaim_lock);
+		return;
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	free_fs_blocks(inode_st, 0, UINT32_MAX);
+	release_inode(inode_id);
+}
+
+//******** cnset_compaction **********
+//Turns background directory compaction on or off
+void cnset_compaction(bool enabled)
+{
+	pthread_mutex_lock(&compact_lock);
+	dir_compaction = enabled;
+	if(!enabled)
+	{
+		compact_count = 0;
+	}
+	pthread_mutex_unlock(&compact_lock);
+}
+
+//******** cnbackground **************
+//Runs one bounded unit of deferred work. Returns the number of units
+//done, so callers may loop until it returns 0. Once the queues are empty
+//it commits the journal, so the operations since the last pass share
+//one commit.
+uint32_t cnbackground(void)
+{
+	if(fs.state != VFS_GOOD) return 0;
+	journal_begin(JOURNAL_OP_BLOCKS);
+	bool reclaimed = reclaim_step();
+	journal_end();
+	if(reclaimed)
+	{
+		return 1;
+	}
+
+	iptr inode_id = 0;
+	pthread_mutex_lock(&compact_lock);
+	bool queued = compact_count > 0;
+	if(queued)
+	{
+		inode_id = compact_queue[compact_head];
+		compact_head = (compact_head + 1) % DIR_COMPACT_QUEUE;
+		compact_count--;
+	}
+	pthread_mutex_unlock(&compact_lock);
+	if(queued)
+	{
+		inode dir_i;
+		inode_read(inode_id, &dir_i);
+		journal_begin(JOURNAL_OP_BLOCKS + dir_i.blocks);	//Compaction may rewrite every block
+		compact_dir(inode_id);
+		journal_end();
+		return 1;
+	}
+	if(journal_pending() > 0)
+	{
+		journal_commit();
+		return 1;
+	}
+	return 0;
+}
+
+//******** dir_is_empty **************
+bool dir_is_empty(iptr inode_id)
+{
+	dir_ptr dir;
+	dir_entry* entry;
+	bool empty = true;
+
+	inflatedir(&dir, inode_id);
+	while((entry = cnreaddir(&dir)))
+	{
+		if(entry->name_len == 1 && entry->name[0] == '.') continue;
+		if(entry->name_len == 2 && memcmp(entry->name, "..", 2) == 0) continue;
+		empty = false;
+		break;
+	}
+	free(dir.data);
+	return empty;
+}
+
+//******** dir_live ******************
+//True if a directory looked up before its lock was taken still exists
+bool dir_live(iptr inode_id)
+{
+	inode dir_i;
+	if(!inode_in_use(inode_id)) return false;
+	inode_read(inode_id, &dir_i);
+	return dir_i.type == ITYPE_DIR;
 }
 
 //******** cd ************************
-int8_t cncd(const char* name)
+int8_t cncd(session* sess, const char* name)
 {
-	dir_ptr* new_cwd = cnopendir(name);
+	dir_ptr* new_cwd = cnopendir(sess, name);
 	check(new_cwd != NULL, "directory %s does not exist", name);
-	strcpy(cwd_str,name);
-	cnclosedir(cwd);
-	cwd = new_cwd;
+	session_set_cwd(sess, new_cwd, name);
 	return 0;
 error:
 	return -1;
 }
 
 //******** pwd **********************
-int8_t cnpwd(char* buf)
+int8_t cnpwd(session* sess, char* buf)
 {
-	strcpy(buf,cwd_str);
+	pthread_mutex_lock(&sess->cwd_lock);
+	strcpy(buf,sess->cwd_str);
+	pthread_mutex_unlock(&sess->cwd_lock);
 	return 0;
 }
 
 //******** mkdir ********************
-int8_t cnmkdir(const char* name)
+int8_t cnmkdir(session* sess, const char* name)
 {
-	char* name_copy = strdup(name);
-	char name_tok[256];
-	char entry_name[256];
-	char* next_name_tok;
-	dir_entry* entry;
-	dir_ptr *dir = calloc(1,sizeof(dir_ptr));		//Directory file in memory (e.g. DIR object from filedef.h)
-	bool last_dir = false;
+	journal_begin(JOURNAL_OP_BLOCKS);
+	char parent_name[256];
+	const char* base_name;
+	iptr existing;
+	iptr new_dir_id = 0;
+	block* new_dir_block = NULL;
+	inode new_dir_i;
+	memset(&new_dir_i, 0, sizeof(inode));
+
+	split_path(name, parent_name, &base_name);
+	dir_ptr* dir = cnopendir(sess, parent_name);
+	check(dir != NULL, "Parent of %s does not exist", name);
+	pthread_rwlock_wrlock(&dir_locks[dir->inode_id]);
+	check(dir_live(dir->inode_id), "Parent of %s was removed", name);
+	check_debug(dir_lookup_locked(dir->inode_id, base_name, &existing) != 0, "Directory %s already exists", name);
+
+	//Write new directory inode
+	new_dir_id = reserve_inode();
+	check(new_dir_id != 0, "Out of inodes");
+	uint32_t now = time(NULL);
+	new_dir_i.modified = now;
+	new_dir_i.type = ITYPE_DIR;
+	new_dir_i.size = BLOCK_SIZE;
+	new_dir_i.blocks = 1;
+	new_dir_i.data0[0] = reserve_block();
+	check(new_dir_i.data0[0] != 0, "Disk full");
+
+	//Write new directory file
+	new_dir_block = calloc(1,sizeof(block));
+	check_mem(new_dir_block);
+	init_dir_block(new_dir_block, new_dir_id, dir->inode_id);
+	inode_write(new_dir_id, &new_dir_i);
+	journal_write(new_dir_i.data0[0], new_dir_block);
+	dir_free_hint[new_dir_id] = 0;
+
+	//Link it into the parent
+	check(dir_add_entry(dir, base_name, new_dir_id, ITYPE_DIR) == 0, "Could not add %s to its parent", name);
+
+	free(new_dir_block);
+	pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+	cnclosedir(dir);
+	journal_end();
+	return 0;
+error:
+	if(new_dir_i.data0[0] != 0) release_block(new_dir_i.data0[0]);
+	if(new_dir_id != 0) release_inode(new_dir_id);
+	if(new_dir_block != NULL) free(new_dir_block);
+	if(dir != NULL)
+	{
+		pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+		cnclosedir(dir);
+	}
+	journal_end();
+	return -1;
+}
 
-	inode_read(cwd->inode_id, &dir->inode_st);		//Start at cwd
-	dir->inode_id = cwd->inode_id;
+//******** rmdir ********************
+int8_t cnrmdir(session* sess, const char* name)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	char parent_name[256];
+	const char* base_name;
+	iptr dir_id = 0;
+	bool dir_locked = false;
+	inode dir_inode;
+	memset(&dir_inode, 0, sizeof(inode));
 
-	next_name_tok = strtok(name_copy, "/");
-	do
+	split_path(name, parent_name, &base_name);
+	dir_ptr* parent = cnopendir(sess, parent_name);
+	check(parent != NULL, "Cannot open parent directory");
+	pthread_rwlock_wrlock(&dir_locks[parent->inode_id]);
+	check(strcmp(base_name, ".") != 0 && strcmp(base_name, "..") != 0, "Cannot remove %s", name);
+	check(dir_lookup_locked(parent->inode_id, base_name, &dir_id) == 0, "Directory %s not found", name);
+
+	inode_read(dir_id, &dir_inode);
+	check(dir_inode.type == ITYPE_DIR, "%s is not a directory", name);
+	pthread_rwlock_wrlock(&dir_locks[dir_id]);
+	dir_locked = true;
+	check(dir_is_empty(dir_id), "Directory is not empty");
+
+	check(dir_remove_entry(parent, base_name) == 0, "Could not remove %s from its parent", name);
+	free_inode(dir_id, &dir_inode);        //Release target blocks and inode
+	dcache_purge_dir(dir_id);
+
+	pthread_rwlock_unlock(&dir_locks[dir_id]);
+	pthread_rwlock_unlock(&dir_locks[parent->inode_id]);
+	cnclosedir(parent);
+	journal_end();
+	return 0;
+error:
+	if(dir_locked) pthread_rwlock_unlock(&dir_locks[dir_id]);
+	if(parent != NULL)
 	{
-		//name_tok is the dir we are searching for or going to create
-		strcpy(name_tok, next_name_tok);
+		pthread_rwlock_unlock(&dir_locks[parent->inode_id]);
+		cnclosedir(parent);
+	}
+	journal_end();
+	return -1;
+}
 
-		//Read the directory file for this inode
-		dir->data = calloc(dir->inode_st.blocks,sizeof(block));  	//Memory for all directory file blocks
-		llread(&dir->inode_st, dir->data);	//Read the directory file
-		dir->index = 0;
 
-		next_name_tok = strtok(NULL, "/");		//Read the next token
-		if(next_name_tok == NULL)   //This is the last directory in the path
-		{
-			last_dir = true;
-		}
+//******** unlink *******************
+int8_t cnunlink(session* sess, const char* name)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	char parent_name[256];
+	const char* base_name;
+	iptr file_id = 0;
+	bool file_locked = false;
+	inode file_inode;
+
+	split_path(name, parent_name, &base_name);
+	dir_ptr* parent = cnopendir(sess, parent_name);
+	check(parent != NULL, "Cannot open parent directory");
+	pthread_rwlock_wrlock(&dir_locks[parent->inode_id]);
+	check(dir_lookup_locked(parent->inode_id, base_name, &file_id) == 0, "File %s not found", name);
+	pthread_rwlock_wrlock(&inode_locks[file_id]);
+	file_locked = true;
+	inode_read(file_id, &file_inode);
+	check(file_inode.type == ITYPE_FILE, "%s is not a file", name);
+
+	check(dir_remove_entry(parent, base_name) == 0, "Could not remove %s from its parent", name);
+	free_inode(file_id, &file_inode);
+	vnode* vn = vnode_lookup(file_id);
+	if(vn != NULL)
+	{
+		vnode_detach(vn);
+		vnode_put(vn);
+	}
+
+	pthread_rwlock_unlock(&inode_locks[file_id]);
+	pthread_rwlock_unlock(&dir_locks[parent->inode_id]);
+	cnclosedir(parent);
+	journal_end();
+	return 0;
+error:
+	if(file_locked) pthread_rwlock_unlock(&inode_locks[file_id]);
+	if(parent != NULL)
+	{
+		pthread_rwlock_unlock(&dir_locks[parent->inode_id]);
+		cnclosedir(parent);
+	}
+	journal_end();
+	return -1;
+}
 
-		//Find the token in this dir
-		while((entry = cnreaddir(dir)))
+//******** truncate_inode ************
+//Sets a file's size. Shrinking frees the blocks past the new end; growing
+//only moves the end, leaving a hole that reads as zeros.
+int8_t truncate_inode(iptr inode_id, inode* inode_st, uint32_t size)
+{
+	if(size < inode_st->size)
+	{
+		//Zero the tail of the new last block so a later extension reads zeros
+		iptr lba = (size % BLOCK_SIZE != 0) ? bmap(inode_st, size / BLOCK_SIZE) : 0;
+		if(lba != 0 && !(lba & BLK_UNWRITTEN))
 		{
-			memcpy(entry_name, entry->name, entry->name_len);
-			entry_name[entry->name_len] = 0;
-			if(strcmp(entry_name, name_tok) == 0)  //If this directory already exists
-			{
-				if(last_dir)
-				{
-					return -1;   //Directory already exists
-				}
-				else   //Read the directory inode
-				{
-					dir->inode_id = entry->inode;
-					inode_read(entry->inode,&dir->inode_st);   //Read the next directory's inode
-					free(dir->data);  //Forget the directory we just read
-					break;
-				}
-			}
+			block tail;
+			blk_read(lba, &tail);
+			memset(tail.byte + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			blk_write(lba, &tail);
 		}
+		free_fs_blocks(inode_st, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, UINT32_MAX);
+	}
 
-		if(last_dir)  //Create the directory at the end of the list
-		{
-			//Create parent directory entry
-			entry = (dir_entry*)(((uint8_t*)dir->data)+dir->index);
-			entry->file_type = ITYPE_DIR;
-			entry->inode = reserve_inode();
-			memcpy(entry->name,name_tok,strlen(name_tok));
-			entry->name_len = strlen(name_tok);
-			entry->entry_len = entry->name_len + 8;
-			entry->entry_len += (4 - entry->entry_len % 4);  //padding out to 32 bits
-			dir->inode_st.size += entry->entry_len;
-			//TODO: handle mkdir block overflow
-
-			//Write parent dir and inode
-			dir->inode_st.modified = time(NULL);
-			inode_write(dir->inode_id, &dir->inode_st);
-			blk_write(dir->inode_st.data0[0], dir->data);
-
-			//Write new directory inode
-			inode new_dir_i;
-			memset(&new_dir_i, 0, sizeof(inode));
-			uint32_t now = time(NULL);
-			new_dir_i.modified = now;
-			new_dir_i.type = ITYPE_DIR;
-			new_dir_i.size = 0;
-			new_dir_i.blocks = 1;
-			new_dir_i.data0[0] = reserve_block();
-
-			//Write new directory file
-			block* new_dir_block = calloc(1,sizeof(block));
-
-			// . (self entry)
-			dir_entry* new_dir_self_entry = (dir_entry*)new_dir_block;
-			new_dir_self_entry->inode = entry->inode;
-			new_dir_self_entry->file_type = ITYPE_DIR;
-			new_dir_self_entry->name_len = 1;
-			new_dir_self_entry->entry_len = 12;
-			memcpy(new_dir_self_entry->name, ".", 1);
-			new_dir_i.size += 12;
-
-			// .. (parent entry)
-			dir_entry* new_dir_parent_entry = (dir_entry*)(((uint8_t*)new_dir_block) + 12);
-			new_dir_parent_entry->inode = dir->inode_id;
-			new_dir_parent_entry->file_type = ITYPE_DIR;
-			new_dir_parent_entry->name_len = 2;
-			new_dir_parent_entry->entry_len = 12;
-			memcpy(new_dir_parent_entry->name, "..", 2);
-			new_dir_i.size += 12;
-
-			//Write new dir and inode
-			inode_write(entry->inode, &new_dir_i);
-			blk_write(new_dir_i.data0[0], new_dir_block);
-
-			free(new_dir_block);
-			break;
-		}
+	inode_st->size = size;
+	inode_st->modified = time(NULL);
+	inode_write(inode_id, inode_st);
+	return 0;
+}
 
-	} while(1);
-	free(dir);
-	free(name_copy);
+//******** truncate *****************
+int8_t cntruncate(session* sess, const char* name, uint32_t size)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	char parent_name[256];
+	const char* base_name;
+	iptr file_id = 0;
+	bool file_locked = false;
+	inode file_inode;
+	vnode* vn = NULL;
+
+	split_path(name, parent_name, &base_name);
+	dir_ptr* parent = cnopendir(sess, parent_name);
+	check(parent != NULL, "Cannot open parent directory");
+	check(dir_lookup(parent->inode_id, base_name, &file_id) == 0, "File %s not found", name);
+	pthread_rwlock_wrlock(&inode_locks[file_id]);
+	file_locked = true;
+	inode_read(file_id, &file_inode);
+	check(file_inode.type == ITYPE_FILE, "%s is not a file", name);
+	//An open file is truncated through its vnode, buffered blocks placed first
+	vn = vnode_lookup(file_id);
+	if(vn != NULL)
+	{
+		check(delalloc_flush(vn) == 0, "Could not flush %s", name);
+	}
+	inode* target = (vn != NULL) ? &vn->inode : &file_inode;
+	check(truncate_inode(file_id, target, size) == 0, "Could not truncate %s", name);
+
+	if(vn != NULL) vnode_put(vn);
+	pthread_rwlock_unlock(&inode_locks[file_id]);
+	cnclosedir(parent);
+	journal_end();
 	return 0;
+error:
+	if(vn != NULL) vnode_put(vn);
+	if(file_locked) pthread_rwlock_unlock(&inode_locks[file_id]);
+	if(parent != NULL) cnclosedir(parent);
+	journal_end();
+	return -1;
 }
 
-//******** rmdir ********************
-int8_t cnrmdir(const char* name)
+//******** statfs *******************
+int8_t cnstatfs(statfs_st* buf)
 {
-	char parent_name[512];
-	char entry_name[256];
-	dir_entry* entry;
-	inode dir_inode;
-	memset(&dir_inode, 0, sizeof(inode));
+	superblock* super = (superblock*)&superblk_cache;
+	pthread_mutex_lock(&reclaim_lock);
+	buf->reclaim_pending = reclaim_pending;
+	pthread_mutex_unlock(&reclaim_lock);
+	pthread_mutex_lock(&alloc_lock);
+	buf->block_count = super->block_count;
+	buf->free_blocks = super->free_block_count - delalloc_reserved;
+	buf->inode_count = super->inode_count;
+	buf->free_inodes = super->free_inode_count;
+	pthread_mutex_unlock(&alloc_lock);
+	return 0;
+}
 
-	strcpy(parent_name, name);
-	strcat(parent_name, "/..");
 
-	dir_ptr* parent = cnopendir(parent_name);
-	check(parent != NULL, "Cannot open parent directory");
+//******** fsck *********************
+//Checks the mounted fs. Buffered writes, deferred work and the running
+//transaction are flushed first so the image is complete; after a repair
+//the cached metadata is reloaded from disk. Other threads must be idle.
+int8_t cnfsck(bool repair, fsck_report* rep)
+{
+	journal_begin(JOURNAL_TXN_MAX);
+	pthread_mutex_lock(&session_lock);
+	for(session* sess = sessions; sess != NULL; sess = sess->next)
+	{
+		session_flush(sess);
+	}
+	pthread_mutex_unlock(&session_lock);
+	journal_end();
+	while(cnbackground() > 0);
+	flush_metadata();
+	journal_commit();
 
-	//Copy the entire directory minus the entry
-	dir_ptr* new_parent = calloc(1,sizeof(dir_ptr));
-	new_parent->data = calloc(parent->inode_st.blocks, sizeof(block));
-	dir_entry* new_dir_entry = (dir_entry*)new_parent->data;
-	new_parent->inode_st = parent->inode_st;
-	new_parent->inode_id = parent->inode_id;
-	new_parent->inode_st.size = 0;
-	new_parent->index = 0;
-
-	while((entry = cnreaddir(parent)))
-	{
-		memcpy(entry_name, entry->name, entry->name_len);
-		entry_name[entry->name_len] = 0;
-		if(strcmp(entry_name, name) == 0)  //If this is the directory we want
-		{
-			inode_read(entry->inode, &dir_inode);
-			check(dir_inode.size == 24, "Directory is not empty");
-			release_block(dir_inode.data0[0]);  //Release target directory block
-			release_inode(entry->inode);        //Release target inode
-			continue;
+	check(fsck_image(repair, rep) == 0, "Could not check the filesystem");
+	if(repair && rep->repaired > 0)
+	{
+		blk_read(BLOCKID_SUPER, &superblk_cache);
+		blk_read(BLOCKID_BLOCK_BITMAP, &block_bm_cache);
+		blk_read(BLOCKID_INODE_BITMAP, &inode_bm_cache);
+		alloc_reload();
+		dcache_init();
+		memset(dir_free_hint, 0, sizeof(dir_free_hint));
+		memset(dir_dead_bytes, 0, sizeof(dir_dead_bytes));
+		pthread_mutex_lock(&vnode_lock);
+		for(iptr inode_id = 0; inode_id < INODE_COUNT; inode_id++)
+		{
+			if(vnodes[inode_id] != NULL) inode_read(inode_id, &vnodes[inode_id]->inode);
 		}
-		new_dir_entry->entry_len = entry->entry_len;
-		new_dir_entry->name_len = entry->name_len;
-		new_dir_entry->file_type = entry->file_type;
-		new_dir_entry->inode = entry->inode;
-		memcpy(new_dir_entry->name, entry->name, entry->name_len);
-		new_parent->inode_st.size += entry->entry_len;
-		new_parent->index += entry->entry_len;
-		new_dir_entry = (dir_entry*)((uint8_t*)new_parent->data+new_parent->index);
+		pthread_mutex_unlock(&vnode_lock);
+		pthread_mutex_lock(&session_lock);
+		for(session* sess = sessions; sess != NULL; sess = sess->next)
+		{
+			char path[sizeof(sess->cwd_str)];
+			cnpwd(sess, path);
+			dir_ptr* fresh = cnopendir(sess, path);
+			if(fresh != NULL)
+			{
+				session_set_cwd(sess, fresh, NULL);
+			}
+		}
+		pthread_mutex_unlock(&session_lock);
 	}
-
-	inode_write(new_parent->inode_id, &new_parent->inode_st);
-	llwrite(&new_parent->inode_st, new_parent->data);
-
-	free(new_parent->data);
-	free(new_parent);
-	cnclosedir(parent);
 	return 0;
 error:
-	if(new_parent != NULL && new_parent->data != NULL) free(new_parent->data);
-	if(new_parent != NULL) free(new_parent);
-	if(parent != NULL) cnclosedir(parent);
 	return -1;
 }
 
-
 //******** ls ***********************
-int8_t cnls(const char* name, char* buf)
+//Appends the names in a directory to out, one per line
+int8_t cnls(session* sess, const char* name, outbuf* out)
 {
 	char name_copy[256];
 	if(strlen(name) == 0)
@@ -678,67 +2488,85 @@ int8_t cnls(const char* name, char* buf)
 		strcpy(name_copy, name);
 	}
 	dir_entry* entry;
-	dir_ptr* dir = cnopendir(name_copy);
+	dir_ptr* dir = cnopendir(sess, name_copy);
 	check(dir !=NULL, "can not ls directory %s", name);
 	while((entry = cnreaddir(dir)))
 	{
-		strncat(buf, entry->name, entry->name_len);
-		strcat(buf, "\n");
+		check(outbuf_append(out, entry->name, entry->name_len) == 0
+				&& outbuf_append(out, "\n", 1) == 0, "Out of memory for ls");
 	}
+	cnclosedir(dir);
 	return 0;
 error:
+	cnclosedir(dir);
 	return -1;
 }
 
-//******** stat *********************
-int8_t cnstat(dir_ptr* dir, const char* name, stat_st *buf)
+//******** ls_page ******************
+//Lists as many names as fit in size bytes of buf, starting at the cookie.
+//The cookie is moved past them, or set to 0 once the directory is done, so
+//a client can page through a directory of any size. Returns the number of
+//names listed, or -1.
+int32_t cnls_page(session* sess, const char* name, uint32_t* cookie, char* buf, uint32_t size)
 {
-	char entry_name[256];
 	dir_entry* entry;
-
-	cnrewinddir(dir);
-	//Find the name in this dir
-	while((entry = cnreaddir(dir)))
+	int32_t count = 0;
+	uint32_t used = 0;
+	dir_ptr* dir = cnopendir(sess, (strlen(name) == 0) ? "." : name);
+	check(dir != NULL, "can not ls directory %s", name);
+	cnseekdir(dir, *cookie);
+	buf[0] = '\0';
+	while(true)
 	{
-		//Copy entry name to a null-term string to compare it
-		memcpy(entry_name, entry->name, entry->name_len);
-		entry_name[entry->name_len] = 0;
-		if(strcmp(entry_name, name) == 0)  //If this file exists
+		uint32_t here = cntelldir(dir);
+		if((entry = cnreaddir(dir)) == NULL)
+		{
+			*cookie = 0;
+			break;
+		}
+		if(used + entry->name_len + 2 > size)		//Name, newline and terminator
 		{
-			buf->inode_id = entry->inode;
-			return 0;
+			check(count > 0, "No room to list %s", name);
+			*cookie = here;
+			break;
 		}
+		memcpy(buf + used, entry->name, entry->name_len);
+		used += entry->name_len;
+		buf[used++] = '\n';
+		buf[used] = '\0';
+		count++;
 	}
+	cnclosedir(dir);
+	return count;
+error:
+	cnclosedir(dir);
 	return -1;
 }
+
+//******** stat *********************
+//Looks the name up on disk rather than in the dir_ptr, which may be older
+//than entries other threads added or removed
+int8_t cnstat(dir_ptr* dir, const char* name, stat_st *buf)
+{
+	return dir_lookup(dir->inode_id, name, &buf->inode_id);
+}
 //******** end stat *****************
 
 
 //******** creat ********************
 int8_t cncreat(dir_ptr* dir, const char* name)
 {
-	stat_st stat_buf;
-	dir_entry* entry;
-
-	check(cnstat(dir,name,&stat_buf) != 0, "File exists");  //If this file exists
+	journal_begin(JOURNAL_OP_BLOCKS);
+	iptr existing;
+	iptr new_file_id = 0;
 
-	//Create parent directory entry
-	entry = (dir_entry*)(((uint8_t*)dir->data)+dir->index);
-	entry->file_type = ITYPE_FILE;
-	entry->inode = reserve_inode();
-	memcpy(entry->name, name, strlen(name));
-	entry->name_len = strlen(name);
-	entry->entry_len = entry->name_len + 8;
-	entry->entry_len += (4 - entry->entry_len % 4);  //padding out to 32 bits
-	dir->inode_st.size += entry->entry_len;
-	//TODO: handle creat dir block overflow
-
-	//Write parent dir and inode
-	dir->inode_st.modified = time(NULL);
-	inode_write(dir->inode_id, &dir->inode_st);
-	blk_write(dir->inode_st.data0[0], dir->data);
+	pthread_rwlock_wrlock(&dir_locks[dir->inode_id]);
+	check(dir_live(dir->inode_id), "Directory was removed");
+	check(dir_lookup_locked(dir->inode_id, name, &existing) != 0, "File exists");  //If this file exists
 
 	//Write new file inode
+	new_file_id = reserve_inode();
+	check(new_file_id != 0, "Out of inodes");
 	inode new_file_i;
 	memset(&new_file_i, 0, sizeof(inode));
 	uint32_t now = time(NULL);
@@ -746,44 +2574,120 @@ int8_t cncreat(dir_ptr* dir, const char* name)
 	new_file_i.type = ITYPE_FILE;
 	new_file_i.size = 0;
 	new_file_i.blocks = 0;
-	inode_write(entry->inode, &new_file_i);
+	inode_write(new_file_id, &new_file_i);
+
+	//Create parent directory entry
+	check(dir_add_entry(dir, name, new_file_id, ITYPE_FILE) == 0, "Could not add %s to directory", name);
 
+	pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+	journal_end();
 	return 0;
 
 error:
+	if(new_file_id != 0) release_inode(new_file_id);
+	pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+	journal_end();
 	return -1;
 }
 
-//******** cnopen *********************
-//mode: FD_READ/FD_WRITE
-int16_t cnopen(dir_ptr* dir, const char* name, uint8_t mode)
+//******** cncreat_batch **************
+//Creates count empty files in one directory as a single change. Their
+//inodes are taken together, each directory block they land in is written
+//once, and the bitmaps are flushed once. Names that already exist are
+//skipped and their ids left 0. Returns the number created, or -1.
+int32_t cncreat_batch(dir_ptr* dir, const char* const names[], uint32_t count, iptr ids[])
 {
-	stat_st stat_buf;
-	if(cnstat(dir,name,&stat_buf) != 0)
+	journal_begin(JOURNAL_OP_BLOCKS + 2 * count);		//An inode block and a dir block per name
+	int32_t created = 0;
+	int32_t result = -1;
+	uint8_t* touched = NULL;
+	inode new_file_i;
+	memset(&new_file_i, 0, sizeof(inode));
+	new_file_i.modified = time(NULL);
+	new_file_i.type = ITYPE_FILE;
+	memset(ids, 0, count * sizeof(iptr));
+
+	pthread_rwlock_wrlock(&dir_locks[dir->inode_id]);
+	check(dir_live(dir->inode_id), "Directory was removed");
+	check(refreshdir(dir) == 0, "Could not refresh directory");
+	touched = calloc((dir->inode_st.blocks + count) / 8 + 1, 1);	//Grows a block per entry at most
+	check_mem(touched);
+
+	for(uint32_t i = 0; i < count; i++)
 	{
-		if(mode == FD_WRITE) {
-			check(cncreat(dir,name) == 0, "Could not create %s", name);
+		iptr existing;
+		if(dir_lookup_locked(dir->inode_id, names[i], &existing) == 0) continue;
+		iptr id = take_inode();
+		check(id != 0, "Out of inodes");
+		inode_write(id, &new_file_i);
+		if(dir_place_entry(dir, names[i], id, ITYPE_FILE, touched) < 0)
+		{
+			give_inode(id);
+			break;
 		}
-		check(cnstat(dir,name,&stat_buf) == 0, "Could not stat %s", name);
+		ids[i] = id;
+		created++;
 	}
-	//TODO: The fd bitmap is not 1 block long, hope we don't run out of fds
-	int16_t fd = (int16_t)(uint16_t)find_free_bit((block*)fd_bm);
-	set_bitmap((block*)fd_bm, fd);
-	fd_tbl[fd].cursor = 0;
-	fd_tbl[fd].state = mode;
-	fd_tbl[fd].inode_id = stat_buf.inode_id;
-	inode_read(stat_buf.inode_id, &fd_tbl[fd].inode);
 
-	if(fd_tbl[fd].inode.blocks > 0)
+error:
+	if(touched != NULL)
 	{
-		fd_tbl[fd].data = calloc(fd_tbl[fd].inode.blocks,sizeof(block));
-		llread(&fd_tbl[fd].inode, fd_tbl[fd].data);
+		for(uint32_t lblk = 0; lblk < dir->inode_st.blocks; lblk++)
+		{
+			if(touched[lblk / 8] & (1 << (lblk % 8)))
+			{
+				journal_write(bmap(&dir->inode_st, lblk), dir->data + lblk);
+			}
+		}
+		dir->inode_st.modified = time(NULL);
+		inode_write(dir->inode_id, &dir->inode_st);
+		flush_metadata();
+		free(touched);
+		result = created;
 	}
-	else
+	pthread_rwlock_unlock(&dir_locks[dir->inode_id]);
+	journal_end();
+	return result;
+}
+
+//******** open_inode *****************
+//Gives a session a descriptor on an inode it has already found
+int32_t open_inode(session* sess, iptr inode_id, uint8_t mode)
+{
+	vnode* vn = vnode_get(inode_id);
+	check(vn != NULL, "Could not open inode %u", inode_id);
+	int32_t fd = fd_alloc(sess);
+	if(fd < 0)
 	{
-		fd_tbl[fd].data = NULL;
+		vnode_put(vn);
+		return -1;
 	}
+	fd_entry* fde = fd_get(sess, fd);
+	fde->cursor = 0;
+	fde->ra_next = 0;
+	fde->ra_window = 0;
+	fde->ra_end = 0;
+	fde->inode_id = inode_id;
+	fde->vn = vn;
+	fde->state = mode;
 	return fd;
+error:
+	return -1;
+}
+
+//******** cnopen *********************
+//mode: FD_READ/FD_WRITE
+int32_t cnopen(session* sess, dir_ptr* dir, const char* name, uint8_t mode)
+{
+	stat_st stat_buf;
+	if(cnstat(dir,name,&stat_buf) != 0)
+	{
+		if(mode == FD_WRITE) {
+			cncreat(dir,name);		//Another thread may create it first, the stat below decides
+		}
+		check(cnstat(dir,name,&stat_buf) == 0, "Could not stat %s", name);
+	}
+	return open_inode(sess, stat_buf.inode_id, mode);
 
 error:
 	return -1;
@@ -792,277 +2696,825 @@ error:
 
 
 //******** cnclose *********************
-int8_t cnclose(int16_t fd)
+int8_t cnclose(session* sess, int32_t fd)
 {
-	if(fd_tbl[fd].state == FD_FREE)
+	fd_entry* fde = fd_get(sess, fd);
+	if(fde == NULL || fde->state == FD_FREE)
 	{
 		return -1;
 	}
-	if(fd_tbl[fd].data != NULL)
+	journal_begin(JOURNAL_OP_BLOCKS);
+	int8_t res = 0;
+	if(fde->state == FD_WRITE)
 	{
-		free(fd_tbl[fd].data);
+		res = vnode_flush(fde->vn);
 	}
-	clear_bitmap((block*)fd_bm, fd);
-	fd_tbl[fd].state = FD_FREE;
-	return 0;
+	vnode_put(fde->vn);
+	fde->vn = NULL;
+	fde->state = FD_FREE;
+	fd_release(sess, fd);
+	journal_end();
+	return res;
 }
 
-//******** cnread ********************
-size_t cnread(uint8_t* buf, size_t bytes, int16_t fd)
+//******** fd_readv ******************
+//Fills the buffers in turn from offset, under one hold of the read lock so
+//they all see the file at one moment. Reads at the cursor move it and drive
+//readahead; positional reads leave both alone and prefetch only their own
+//range, so threads can share a descriptor. Returns the bytes read, short at
+//end of file.
+static size_t fd_readv(session* sess, int32_t fd, const struct iovec* iov, int iovcnt, uint32_t offset, bool at_cursor)
 {
-	size_t bytes_to_read = 0;
-	fd_entry* fde = &fd_tbl[fd];
-	check(fde->state == FD_READ, "File descriptor not in read mode");
-	//TODO: Don't read unallocated space
-	if(bytes > (fde->inode.size - (fde->cursor + 1)))
+	size_t total = 0;
+	uint32_t done = 0;
+	fd_entry* fde = fd_get(sess, fd);
+	check(fde != NULL && fde->state == FD_READ, "File descriptor not in read mode");
+	check(iovcnt >= 0, "Bad buffer count %d", iovcnt);
+	for(int i = 0; i < iovcnt; i++)
 	{
-		bytes_to_read = fde->inode.size - (fde->cursor+1);
+		total += iov[i].iov_len;
 	}
-	else
+	pthread_rwlock_rdlock(&inode_locks[fde->inode_id]);
+	vnode* vn = fde->vn;
+	if(at_cursor) offset = fde->cursor;
+	uint32_t len = (offset < vn->inode.size) ? (uint32_t)MIN(total, vn->inode.size - offset) : 0;
+	if(len > 0)
 	{
-		bytes_to_read = bytes;
+		if(at_cursor)
+		{
+			readahead(fde, len);
+		}
+		else
+		{
+			prefetch_blocks(&vn->inode, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE + 1);
+		}
+		for(int i = 0; i < iovcnt && done < len; i++)
+		{
+			uint32_t chunk = (uint32_t)MIN(iov[i].iov_len, len - done);
+			vnode_read(vn, iov[i].iov_base, chunk, offset + done);
+			done += chunk;
+		}
+		if(at_cursor) fde->cursor += done;
 	}
-	uint8_t* data_ptr = ((uint8_t*)fde->data) + fde->cursor;
-	memcpy(buf, data_ptr, bytes_to_read);
-	fde->cursor += bytes_to_read;
-	return bytes_to_read;
+	pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+	return done;
 error:
 	return 0;
 }
 
+//******** cnread ********************
+//Sequential readers have the blocks ahead of them prefetched, see readahead
+size_t cnread(session* sess, uint8_t* buf, size_t bytes, int32_t fd)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	return fd_readv(sess, fd, &iov, 1, 0, true);
+}
+
+//******** cnpread *******************
+//Reads at offset without touching the cursor
+size_t cnpread(session* sess, uint8_t* buf, size_t bytes, int32_t fd, uint32_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	return fd_readv(sess, fd, &iov, 1, offset, false);
+}
 
-//****** cnseek **********************
-int8_t cnseek(int16_t fd, uint32_t offset)
+//******** cnreadv *******************
+//Scatters the file from offset over iovcnt buffers without touching the
+//cursor
+size_t cnreadv(session* sess, const struct iovec* iov, int iovcnt, int32_t fd, uint32_t offset)
+{
+	return fd_readv(sess, fd, iov, iovcnt, offset, false);
+}
+
+
+//******** cnread_view ***************
+//Maps len bytes at offset of a reader's file without copying them. Each
+//segment points straight into the device for a run of adjacent blocks,
+//into the vnode for a block still buffered, or at a shared zero block for
+//a hole. The cursor does not move. The file stays read-locked until
+//cnread_release, so writers wait and its blocks can not be freed or reused
+//while the view is held.
+int8_t cnread_view(session* sess, int32_t fd, uint32_t offset, uint32_t len, read_view* view)
+{
+	fd_entry* fde = fd_get(sess, fd);
+	view_seg* seg = NULL;
+	iptr prev = 0;
+	memset(view, 0, sizeof(read_view));
+	check(fde != NULL && fde->state == FD_READ, "File descriptor not in read mode");
+	pthread_rwlock_rdlock(&inode_locks[fde->inode_id]);
+	view->inode_id = fde->inode_id;
+	view->locked = true;
+	vnode* vn = fde->vn;
+	if(offset >= vn->inode.size || len == 0)
+	{
+		return 0;
+	}
+	len = MIN(len, vn->inode.size - offset);
+
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t end = (offset + len - 1) / BLOCK_SIZE + 1;
+	view->segs = calloc(end - first, sizeof(view_seg));
+	check_mem(view->segs);
+	prefetch_blocks(&vn->inode, first, end);
+	while(len > 0)
+	{
+		uint32_t blk_off = offset % BLOCK_SIZE;
+		uint32_t chunk = MIN(len, BLOCK_SIZE - blk_off);
+		iptr lba = bmap(&vn->inode, offset / BLOCK_SIZE);
+		if(lba == 0 || (lba & BLK_UNWRITTEN))
+		{
+			block* buffered = (lba == 0) ? vnode_dirty(vn, offset / BLOCK_SIZE) : NULL;
+			seg = &view->segs[view->count++];
+			seg->base = (buffered != NULL) ? (const uint8_t*)buffered->byte + blk_off : zero_block + blk_off;
+			seg->len = chunk;
+			lba = 0;
+		}
+		else if(prev != 0 && lba == prev + 1)	//Continues the run, blk_off is 0
+		{
+			seg->len += chunk;
+		}
+		else
+		{
+			seg = &view->segs[view->count++];
+			seg->base = (const uint8_t*)blk_map(lba)->byte + blk_off;
+			seg->len = chunk;
+		}
+		prev = lba;
+		view->bytes += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 0;
+error:
+	cnread_release(view);
+	return -1;
+}
+
+//******** cnread_release ************
+void cnread_release(read_view* view)
 {
-	fd_entry* fde = &fd_tbl[fd];
-	uint32_t required_size = fde->cursor + offset;
-	if(fde->inode.size < required_size)   //The data cache and block size may have to be expanded
+	if(view->locked)
 	{
-		//Compute new sizes
-		uint32_t required_blocks = (required_size / BLOCK_SIZE) + 1;
+		pthread_rwlock_unlock(&inode_locks[view->inode_id]);
+	}
+	free(view->segs);
+	memset(view, 0, sizeof(read_view));
+}
 
-		//Allocate new data cache
-		check(realloc_cache(fde, required_blocks) == 0, "Unable to realloc cache");
-		fde->inode.size = required_size;
 
-		//Allocate fs blocks
-		if(fde->inode.blocks < required_blocks)
+//****** cnseek **********************
+//Seeking a writer past the end grows the file with a hole; no blocks are
+//allocated until data is written there
+int8_t cnseek(session* sess, int32_t fd, uint32_t offset)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	fd_entry* fde = fd_get(sess, fd);
+	check(fde != NULL && fde->state != FD_FREE, "File descriptor not open");
+	vnode* vn = fde->vn;
+	if(fde->state == FD_WRITE)
+	{
+		pthread_rwlock_wrlock(&inode_locks[fde->inode_id]);
+		bool removed = vn->removed;
+		if(!removed && vn->inode.size < offset)
 		{
-			check(realloc_fs_blocks(&fde->inode, required_blocks) == 0, "Could not allocate fs blocks");
+			vn->inode.size = offset;
+			vn->inode.modified = time(NULL);
+			inode_write(fde->inode_id, &vn->inode);
 		}
-		fde->inode.modified = time(NULL);
-		inode_write(fde->inode_id, &fde->inode);
+		pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+		check(!removed, "File was removed");
 	}
 	fde->cursor = offset;
+	journal_end();
 	return 0;
 error:
+	journal_end();
 	return -1;
 }
 
 
+//****** vnode_write *****************
+//Writes bytes at offset without touching the size. Overwrites of allocated
+//blocks go straight to disk. Data written into holes is buffered on the
+//vnode with only a free block count held for it; delalloc_flush picks its
+//LBAs later. Returns the bytes written, short once no free block can be
+//promised. Call with the inode lock held.
+uint32_t vnode_write(vnode* vn, const uint8_t* buf, uint32_t bytes, uint32_t offset)
+{
+	uint32_t written = 0;
+	while(written < bytes)
+	{
+		uint32_t lblk = offset / BLOCK_SIZE;
+		uint32_t blk_off = offset % BLOCK_SIZE;
+		uint32_t chunk = MIN(bytes - written, BLOCK_SIZE - blk_off);
+		if(bmap(&vn->inode, lblk) != 0)
+		{
+			file_write(&vn->inode, (uint8_t*)buf + written, chunk, offset);
+		}
+		else
+		{
+			block* dirty = delalloc_block(vn, lblk);
+			if(dirty == NULL) break;
+			memcpy(dirty->byte + blk_off, buf + written, chunk);
+		}
+		written += chunk;
+		offset += chunk;
+	}
+	return written;
+}
+
+//****** fd_writev *******************
+//Writes the buffers one after another from offset, under one hold of the
+//write lock so readers see all of them or none. The inode is written once
+//nothing is left buffered. Writes at the cursor move it; positional writes
+//leave it alone. Returns the bytes written.
+static size_t fd_writev(session* sess, int32_t fd, const struct iovec* iov, int iovcnt, uint32_t offset, bool at_cursor)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	fd_entry* fde = fd_get(sess, fd);
+	bool locked = false;
+	size_t total = 0;
+	uint32_t written = 0;
+	check(fde != NULL && fde->state == FD_WRITE, "File descriptor not in write mode");
+	check(iovcnt >= 0, "Bad buffer count %d", iovcnt);
+	for(int i = 0; i < iovcnt; i++)
+	{
+		total += iov[i].iov_len;
+	}
+	vnode* vn = fde->vn;
+	pthread_rwlock_wrlock(&inode_locks[fde->inode_id]);
+	locked = true;
+	check(!vn->removed, "File was removed");
+	if(at_cursor) offset = fde->cursor;
+	check(total <= UINT32_MAX - offset, "Write past the largest file size");
+
+	for(int i = 0; i < iovcnt; i++)
+	{
+		uint32_t n = vnode_write(vn, iov[i].iov_base, (uint32_t)iov[i].iov_len, offset + written);
+		written += n;
+		if(n < iov[i].iov_len) break;
+	}
+	check(written > 0 || total == 0, "Could not write to file");
+	offset += written;
+	if(offset > vn->inode.size)
+	{
+		vn->inode.size = offset;
+	}
+	if(at_cursor) fde->cursor = offset;
+	vn->inode.modified = time(NULL);
+
+	if(vn->dirty_count >= DELALLOC_MAX_BLOCKS)
+	{
+		check(delalloc_flush(vn) == 0, "Could not flush file");
+	}
+	else if(vn->dirty_count == 0)
+	{
+		inode_write(fde->inode_id, &vn->inode);
+	}
+
+	pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+	journal_end();
+	return written;
+error:
+	if(locked) pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+	journal_end();
+	return 0;
+}
+
 //****** cnwrite *********************
-size_t cnwrite(uint8_t* buf, size_t bytes, int16_t fd)
+size_t cnwrite(session* sess, uint8_t* buf, size_t bytes, int32_t fd)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+	return fd_writev(sess, fd, &iov, 1, 0, true);
+}
+
+//****** cnpwrite ********************
+//Writes at offset without touching the cursor
+size_t cnpwrite(session* sess, const uint8_t* buf, size_t bytes, int32_t fd, uint32_t offset)
+{
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = bytes };
+	return fd_writev(sess, fd, &iov, 1, offset, false);
+}
+
+//****** cnwritev ********************
+//Gathers iovcnt buffers into the file from offset as one write, without
+//touching the cursor
+size_t cnwritev(session* sess, const struct iovec* iov, int iovcnt, int32_t fd, uint32_t offset)
 {
-	fd_entry* fde = &fd_tbl[fd];
-	check(fde->state == FD_WRITE, "File descriptor not in write mode");
+	return fd_writev(sess, fd, iov, iovcnt, offset, false);
+}
 
-	uint32_t required_size = fde->cursor + bytes;
-	if(fde->inode.size < required_size)   //The data cache and block size may have to be expanded
+//****** cnfallocate *****************
+//Reserves blocks for the holes in [offset, offset+len) as adjacent runs,
+//following the file's previous block where possible, and marks them
+//unwritten so they read as zeros. Later writes land in them without
+//allocating. The file grows to cover the range.
+int8_t cnfallocate(session* sess, int32_t fd, uint32_t offset, uint32_t len)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	fd_entry* fde = fd_get(sess, fd);
+	iptr next = 0;
+	uint32_t run_left = 0;
+	bool locked = false;
+	check(fde != NULL && fde->state == FD_WRITE, "File descriptor not in write mode");
+	vnode* vn = fde->vn;
+	check(len > 0 && offset + len > offset, "Bad range");
+	pthread_rwlock_wrlock(&inode_locks[fde->inode_id]);
+	locked = true;
+	check(!vn->removed, "File was removed");
+
+	uint32_t lblk = offset / BLOCK_SIZE;
+	uint32_t end = (offset + len - 1) / BLOCK_SIZE + 1;
+	iptr goal = (lblk > 0) ? BLK_LBA(bmap(&vn->inode, lblk - 1)) : 0;
+	if(goal != 0) goal++;
+	for(; lblk < end; lblk++)
 	{
-		//Compute new sizes
-		uint32_t required_blocks = (required_size / BLOCK_SIZE) + 1;
+		if(bmap(&vn->inode, lblk) != 0) continue;
+		if(vnode_dirty(vn, lblk) != NULL) continue;
 
-		//Allocate new data cache
-		check(realloc_cache(fde, required_blocks) == 0, "Unable to realloc cache");
-		fde->inode.size = required_size;
+		if(run_left == 0)
+		{
+			next = reserve_run(goal, end - lblk, &run_left);
+			check(run_left > 0, "Disk full");
+		}
+		check(bmap_place(&vn->inode, lblk, next | BLK_UNWRITTEN) != 0, "Could not map block %u", lblk);
+		next++;
+		run_left--;
+		goal = next;
+	}
+	//Give back what the holes did not use
+	for(; run_left > 0; run_left--, next++)
+	{
+		unreserve_block(next);
+	}
+	flush_metadata();
 
-		//Allocate fs blocks
-		if(fde->inode.blocks < required_blocks)
+	if(offset + len > vn->inode.size)
+	{
+		vn->inode.size = offset + len;
+	}
+	vn->inode.modified = time(NULL);
+	inode_write(fde->inode_id, &vn->inode);
+	pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+	journal_end();
+	return 0;
+error:
+	if(locked)
+	{
+		for(; run_left > 0; run_left--, next++)
 		{
-			check(realloc_fs_blocks(&fde->inode, required_blocks) == 0, "Could not allocate fs blocks");
+			unreserve_block(next);
 		}
-		fde->inode.modified = time(NULL);
-		inode_write(fde->inode_id, &fde->inode);
+		flush_metadata();
+		inode_write(fde->inode_id, &vn->inode);
+		pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
 	}
+	journal_end();
+	return -1;
+}
 
-	uint8_t* data_ptr = ((uint8_t*)fde->data)+fde->cursor;
-	memcpy(data_ptr, buf, bytes);
-	fde->cursor += bytes;
-	llwrite(&fde->inode, (block*)fde->data);
+//****** stream_in *****************
+//Fills a writer's file with the first len bytes of a host file, as
+//file_copy_in, and leaves the cursor after them. Returns the bytes copied.
+uint32_t stream_in(session* sess, int32_t fd, int h_fd, uint32_t len)
+{
+	journal_begin(JOURNAL_OP_BLOCKS);
+	fd_entry* fde = fd_get(sess, fd);
+	uint32_t copied = 0;
+	check(fde != NULL && fde->state == FD_WRITE, "File descriptor not in write mode");
+	vnode* vn = fde->vn;
+	pthread_rwlock_wrlock(&inode_locks[fde->inode_id]);
+	if(!vn->removed && (vn->dirty_count == 0 || delalloc_flush(vn) == 0))
+	{
+		copied = file_copy_in(&vn->inode, h_fd, len);
+		fde->cursor = copied;
+		vn->inode.modified = time(NULL);
+		inode_write(fde->inode_id, &vn->inode);
+	}
+	pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+error:
+	journal_end();
+	return copied;
+}
 
-	return bytes;
+//****** stream_out ****************
+//Copies a reader's whole file out to a host file, as file_copy_out. That
+//goes straight to the blocks, so anything other descriptors still have
+//buffered is flushed first. The cursor does not move. Returns the bytes
+//of the file, or -1.
+int64_t stream_out(session* sess, int32_t fd, int h_fd)
+{
+	fd_entry* fde = fd_get(sess, fd);
+	check(fde != NULL && fde->state == FD_READ, "File descriptor not in read mode");
+	vnode* vn = fde->vn;
+	pthread_rwlock_rdlock(&inode_locks[fde->inode_id]);
+	while(vn->dirty_count > 0)
+	{
+		pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+		journal_begin(JOURNAL_OP_BLOCKS);
+		int8_t res = vnode_flush(vn);
+		journal_end();
+		check(res == 0, "Could not flush buffered writes");
+		pthread_rwlock_rdlock(&inode_locks[fde->inode_id]);
+	}
+	int64_t size = file_copy_out(&vn->inode, h_fd);
+	pthread_rwlock_unlock(&inode_locks[fde->inode_id]);
+	return size;
 error:
-	return 0;
+	return -1;
 }
 
 //****** cncat *********************
-int8_t cncat(const char* name, char* buf)
+int8_t cncat(session* sess, const char* name, outbuf* out)
 {
 	stat_st filestat;
-	dir_ptr* dir = cnopendir(".");
+	read_view view;
+	dir_ptr* dir = cnopendir(sess, ".");
 
 	check(cnstat(dir, name, &filestat) == 0, "Can not stat file");
 	inode file_i;
 	inode_read(filestat.inode_id, &file_i);
 
-	int8_t fd = cnopen(dir,name,FD_READ);
+	int32_t fd = cnopen(sess,dir,name,FD_READ);
 	check(fd >= 0, "Can not open file");
-	cnread((uint8_t*)buf, file_i.size, fd);
+	if(cnread_view(sess, fd, 0, file_i.size, &view) == 0)
+	{
+		int8_t res = outbuf_reserve(out, view.bytes);
+		for(uint32_t i = 0; res == 0 && i < view.count; i++)
+		{
+			outbuf_append(out, view.segs[i].base, view.segs[i].len);
+		}
+		cnread_release(&view);
+		if(res != 0)
+		{
+			cnclose(sess, fd);
+			sentinel("Out of memory for cat");
+		}
+	}
+	cnclose(sess, fd);
+	cnclosedir(dir);
 	return 0;
 error:
 	cnclosedir(dir);
 	return -1;
 }
 
-//****** cnimport ****************
-int8_t cnimport(const char* h_name, const char* g_name)
+//****** import_data *************
+//Fills a new, empty guest file from an open host file. The file is
+//preallocated first so the data lands in adjacent runs.
+int8_t import_data(session* sess, int32_t g_file, int h_file, const char* h_name)
 {
-	FILE* h_file;
-	size_t h_size;
-	char* buf;
-	size_t result;
-	int16_t g_file;
+	struct stat h_stat;
+	check(fstat(h_file, &h_stat) == 0 && S_ISREG(h_stat.st_mode), "%s is not a regular file", h_name);
+	check((uint64_t)h_stat.st_size <= UINT32_MAX, "%s is too large", h_name);
+	uint32_t h_size = h_stat.st_size;
+	if(h_size > 0)
+	{
+		check(cnfallocate(sess, g_file, 0, h_size) == 0, "Not enough space for %s", h_name);
+	}
+	check(stream_in(sess, g_file, h_file, h_size) == h_size, "Error reading from %s", h_name);
+	return 0;
+error:
+	return -1;
+}
 
-	h_file = fopen(h_name, "rb");
-	check(h_file != NULL, "Can not open host file");
+//****** cnimport ****************
+//Streams a host file into a new guest file without holding it in memory
+int8_t cnimport(session* sess, const char* h_name, const char* g_name)
+{
+	int h_file;
+	int32_t g_file = -1;
+	dir_ptr* cwd = NULL;
 
-	//get file size
-	fseek(h_file, 0, SEEK_END);
-	h_size = ftell(h_file);
-	rewind(h_file);
+	h_file = open(h_name, O_RDONLY);
+	check(h_file >= 0, "Can not open host file");
 
-	dir_ptr* cwd = cnopendir(".");
+	cwd = cnopendir(sess, ".");
+	check(cwd != NULL, "Cannot open working directory");
 	check(cncreat(cwd, g_name) == 0, "Cannot creat guest file");
-	g_file = cnopen(cwd, g_name, FD_WRITE);
+	g_file = cnopen(sess, cwd, g_name, FD_WRITE);
 	check(g_file >= 0, "Cannot open guest file for writing");
-
-	//buffer for whole file
-	buf = calloc(h_size, sizeof(char));
-
-	//load file
-	result = fread(buf,1,h_size,h_file);
-	check(result == (size_t)h_size, "Error reading from host file");
-
-	//write the buffer to the guest
-	result = cnwrite((uint8_t*)buf, h_size, g_file);
-	check(result > 0, "Error writing to guest file");
+	check(import_data(sess, g_file, h_file, h_name) == 0, "Cannot import %s", h_name);
 
 	//close guest resources
-	cnclose(g_file);
+	cnclose(sess, g_file);
 	cnclosedir(cwd);
-	fclose(h_file);
-	free(buf);
+	close(h_file);
 	return 0;
 error:
 	//close guest resources
-	cnclose(g_file);
+	if(g_file >= 0) cnclose(sess, g_file);
 	cnclosedir(cwd);
-	fclose(h_file);
-	free(buf);
+	if(h_file >= 0) close(h_file);
 	return -1;
 }
 
 
 //****** cnexport ****************
-int8_t cnexport(const char* g_name, const char* h_name)
+//Streams a guest file out to a host file. Holes stay holes on the host.
+int8_t cnexport(session* sess, const char* g_name, const char* h_name)
 {
-	FILE* h_file;
-	size_t h_size;
-	char* buf;
-	size_t result;
-	int16_t g_file;
-	stat_st statbuf;
+	int h_file;
+	int32_t g_file = -1;
+	dir_ptr* cwd = NULL;
 
-	h_file = fopen(h_name, "wb");
-	check(h_file != NULL, "Can not open host file");
+	h_file = open(h_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	check(h_file >= 0, "Can not open host file");
 
-	dir_ptr* cwd = cnopendir(".");
-	g_file = cnopen(cwd, g_name, FD_READ);
+	cwd = cnopendir(sess, ".");
+	check(cwd != NULL, "Cannot open working directory");
+	g_file = cnopen(sess, cwd, g_name, FD_READ);
 	check(g_file >= 0, "Cannot open guest file for reading");
-
-	check(cnstat(cwd, g_name, &statbuf) == 0, "Cannot stat guest file");
-	inode g_inode;
-	inode_read(statbuf.inode_id, &g_inode);
-	h_size = g_inode.size;
-
-	//buffer for whole file
-	buf = calloc(h_size, sizeof(char));
-
-	//load file
-	result = cnread((uint8_t*)buf, h_size, g_file);
-	check(result == h_size, "Error reading from guest file");
-
-	//write the buffer to the host
-	result = fwrite(buf, sizeof(char), h_size, h_file);
-	check(result > 0, "Error writing to host file");
+	check(stream_out(sess, g_file, h_file) >= 0, "Error writing to host file");
 
 	//close guest resources
-	cnclose(g_file);
+	cnclose(sess, g_file);
 	cnclosedir(cwd);
-	fclose(h_file);
-	free(buf);
+	close(h_file);
 	return 0;
 error:
 	//close guest resources
-	cnclose(g_file);
+	if(g_file >= 0) cnclose(sess, g_file);
 	cnclosedir(cwd);
-	fclose(h_file);
-	free(buf);
+	if(h_file >= 0) close(h_file);
 	return -1;
 }
 
-//******* cntree ************
-void treedir(dir_ptr* dir, uint8_t indents, char** buf)
-{
-	dir_entry* entry;
-	inode entry_i;
-	memset(&entry_i, 0, sizeof(inode));
-	int chars;
 
-	//Write indent pattern
-	char indent_str[256];
-	uint8_t indents_ptr = indents;
-	while(indents_ptr > 0)
+//****** import_worker ***********
+//Takes created files off the queue and copies their data in, each worker
+//through a session of its own
+void* import_worker(void* arg)
+{
+	import_tree* tree = arg;
+	session* sess = cnsession_open();
+	import_job job;
+	pthread_mutex_lock(&tree->lock);
+	while(true)
 	{
-		strcat(indent_str,"    ");
-		indents_ptr--;
+		while(tree->count == 0 && !tree->done)
+		{
+			pthread_cond_wait(&tree->cond, &tree->lock);
+		}
+		if(tree->count == 0) break;
+		job = tree->jobs[tree->head];
+		tree->head = (tree->head + 1) % IMPORT_QUEUE;
+		tree->count--;
+		pthread_cond_broadcast(&tree->cond);
+		pthread_mutex_unlock(&tree->lock);
+
+		int8_t res = -1;
+		int h_file = open(job.h_path, O_RDONLY);
+		if(sess != NULL && h_file >= 0)
+		{
+			int32_t g_file = open_inode(sess, job.inode_id, FD_WRITE);
+			res = import_data(sess, g_file, h_file, job.h_path);
+			if(cnclose(sess, g_file) != 0) res = -1;
+		}
+		if(h_file >= 0) close(h_file);
+		else log_warn("Can not open %s", job.h_path);
+
+		pthread_mutex_lock(&tree->lock);
+		if(res == 0) tree->imported++;
+		else tree->failed++;
 	}
+	pthread_mutex_unlock(&tree->lock);
+	cnsession_close(sess);
+	return NULL;
+}
 
-	while((entry = cnreaddir(dir)))
+//****** import_batch ************
+//Creates a batch of files in a guest directory and queues their data
+void import_batch(import_tree* tree, dir_ptr* g_dir, const char* h_path, const char* const names[], uint32_t count)
+{
+	iptr ids[IMPORT_BATCH];
+	uint32_t skipped = 0;
+	if(count == 0) return;
+	if(cncreat_batch(g_dir, names, count, ids) < 0)
 	{
-		char name_copy[256];
-		memset(name_copy, 0, 256);
-		memcpy(name_copy, entry->name, entry->name_len);
-		if(strcmp(name_copy,".") == 0) continue;
-		if(strcmp(name_copy,"..") == 0) continue;
-
-		inode_read(entry->inode,&entry_i);
-
-		if(indents > 0)
+		memset(ids, 0, sizeof(ids));
+	}
+	for(uint32_t i = 0; i < count; i++)
+	{
+		if(ids[i] == 0)
+		{
+			log_warn("Could not create %s", names[i]);
+			skipped++;
+			continue;
+		}
+		pthread_mutex_lock(&tree->lock);
+		while(tree->count == IMPORT_QUEUE)
 		{
-			strcpy(*buf,indent_str);
-			*buf += strlen(indent_str);
+			pthread_cond_wait(&tree->cond, &tree->lock);
 		}
-		memcpy(*buf, entry->name, entry->name_len);
-		*buf += entry->name_len;
-		chars = sprintf(*buf, "  %s  %u  %s", (entry_i.type == ITYPE_FILE) ? "F":"D", entry_i.size, ctime((const time_t *)&entry_i.modified));
-		*buf += chars;
+		import_job* job = &tree->jobs[(tree->head + tree->count) % IMPORT_QUEUE];
+		snprintf(job->h_path, sizeof(job->h_path), "%s/%s", h_path, names[i]);
+		job->inode_id = ids[i];
+		tree->count++;
+		pthread_cond_broadcast(&tree->cond);
+		pthread_mutex_unlock(&tree->lock);
+	}
+	pthread_mutex_lock(&tree->lock);
+	tree->failed += skipped;
+	pthread_mutex_unlock(&tree->lock);
+}
 
-		if(entry->file_type == ITYPE_DIR)  //Go to next indent level if a dir
+//****** import_dir **************
+//Mirrors one host directory into the guest: regular files are created in
+//batches and handed to the workers, subdirectories are walked in turn.
+//Anything else is skipped.
+int8_t import_dir(session* sess, import_tree* tree, const char* h_path, const char* g_path)
+{
+	DIR* h_dir = NULL;
+	dir_ptr* g_dir = NULL;
+	struct dirent* ent;
+	char (*names)[256] = NULL;
+	const char* name_ptrs[IMPORT_BATCH];
+	uint32_t count = 0;
+	uint32_t failed = 0;
+	char h_child[1024];
+	char g_child[256];
+	struct stat st;
+
+	h_dir = opendir(h_path);
+	check(h_dir != NULL, "Can not open host directory %s", h_path);
+	cnmkdir(sess, g_path);			//May already exist, opening it decides
+	g_dir = cnopendir(sess, g_path);
+	check(g_dir != NULL, "Can not open guest directory %s", g_path);
+	names = calloc(IMPORT_BATCH, sizeof(*names));
+	check_mem(names);
+
+	while((ent = readdir(h_dir)) != NULL)
+	{
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+		if(snprintf(h_child, sizeof(h_child), "%s/%s", h_path, ent->d_name) >= (int)sizeof(h_child)
+				|| stat(h_child, &st) != 0)
+		{
+			log_warn("Can not stat %s/%s", h_path, ent->d_name);
+			failed++;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode))
+		{
+			bool root = (strcmp(g_path, "/") == 0);
+			if(snprintf(g_child, sizeof(g_child), "%s/%s", root ? "" : g_path, ent->d_name) >= (int)sizeof(g_child)
+					|| import_dir(sess, tree, h_child, g_child) != 0)
+			{
+				failed++;
+			}
+		}
+		else if(S_ISREG(st.st_mode))
 		{
-			cncd(name_copy);
-			dir_ptr* next_dir = cnopendir(".");
-			treedir(next_dir,indents+1,buf);
-			cnclosedir(next_dir);
-			cncd("..");
+			if(strlen(ent->d_name) >= sizeof(names[0]))
+			{
+				log_warn("Name too long: %s", h_child);
+				failed++;
+				continue;
+			}
+			strcpy(names[count], ent->d_name);
+			name_ptrs[count] = names[count];
+			if(++count == IMPORT_BATCH)
+			{
+				import_batch(tree, g_dir, h_path, name_ptrs, count);
+				count = 0;
+			}
 		}
 	}
+	import_batch(tree, g_dir, h_path, name_ptrs, count);
+
+	free(names);
+	cnclosedir(g_dir);
+	closedir(h_dir);
+	return (failed == 0) ? 0 : -1;
+error:
+	free(names);
+	cnclosedir(g_dir);
+	if(h_dir != NULL) closedir(h_dir);
+	return -1;
+}
+
+//****** cnimport_tree ***********
+//Copies a host directory tree into the guest directory g_dir, creating it
+//if needed. The calling thread walks the host tree and creates the guest
+//directories and files; IMPORT_WORKERS threads read the host files and
+//fill in the data. Returns the number of files imported, or -1 if any
+//part of the tree could not be.
+int32_t cnimport_tree(session* sess, const char* h_dir, const char* g_dir)
+{
+	pthread_t workers[IMPORT_WORKERS];
+	uint32_t started = 0;
+	import_tree* tree = calloc(1, sizeof(import_tree));
+	check_mem(tree);
+	pthread_mutex_init(&tree->lock, NULL);
+	pthread_cond_init(&tree->cond, NULL);
+	for(; started < IMPORT_WORKERS; started++)
+	{
+		if(pthread_create(&workers[started], NULL, import_worker, tree) != 0) break;
+	}
+	check(started > 0, "Could not start import workers");
+
+	int8_t walked = import_dir(sess, tree, h_dir, g_dir);
+
+	pthread_mutex_lock(&tree->lock);
+	tree->done = true;
+	pthread_cond_broadcast(&tree->cond);
+	pthread_mutex_unlock(&tree->lock);
+	for(uint32_t i = 0; i < started; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	int32_t imported = (walked == 0 && tree->failed == 0) ? (int32_t)tree->imported : -1;
+	pthread_mutex_destroy(&tree->lock);
+	pthread_cond_destroy(&tree->cond);
+	free(tree);
+	return imported;
+error:
+	if(tree != NULL)
+	{
+		pthread_mutex_destroy(&tree->lock);
+		pthread_cond_destroy(&tree->cond);
+	}
+	free(tree);
+	return -1;
 }
 
-int8_t cntree(char* buf)
+//******* cntree ************
+//Lists the tree under the working directory, depth first. Directories are
+//opened by inode and kept on an explicit stack, so the walk neither
+//recurses nor resolves paths, and the output grows as needed. Entries come
+//with their inodes a batch at a time.
+int8_t cntree(session* sess, outbuf* out)
 {
-	dir_ptr* dir = cnopendir(".");
-	uint8_t indents = 0;
-	treedir(dir,indents,&buf);
+	tree_frame* stack = NULL;
+	uint32_t depth = 0;
+	uint32_t cap = TREE_STACK_MIN;
+	char when[32];
+
+	iptr cwd_id;
+	check(session_cwd(sess, &cwd_id), "No working directory");
+	stack = calloc(cap, sizeof(tree_frame));
+	check_mem(stack);
+	stack[0].ents = malloc(TREE_BATCH * sizeof(dir_entry_plus));
+	check_mem(stack[0].ents);
+	streamdir(&stack[0].dir, cwd_id);
+	depth = 1;
+	while(depth > 0)
+	{
+		tree_frame* frame = &stack[depth - 1];
+		if(frame->next == frame->count)
+		{
+			int32_t got = cnreaddirplus(&frame->dir, frame->ents, TREE_BATCH);
+			check(got >= 0, "Could not read directory %u", frame->dir.inode_id);
+			frame->count = got;
+			frame->next = 0;
+			if(got == 0)
+			{
+				releasedir(&frame->dir);
+				free(frame->ents);
+				frame->ents = NULL;
+				depth--;
+				continue;
+			}
+		}
+		dir_entry_plus* entry = &frame->ents[frame->next++];
+		if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) continue;
+
+		time_t modified = entry->attr.modified;
+		ctime_r(&modified, when);
+		check(outbuf_printf(out, "%*s%s  %s  %u  %s", (int)(depth - 1) * 4, "", entry->name,
+				(entry->attr.type == ITYPE_FILE) ? "F" : "D", entry->attr.size, when) == 0, "Out of memory for tree");
+
+		if(entry->file_type == ITYPE_DIR)  //Go down a level
+		{
+			iptr child = entry->inode_id;
+			if(depth == cap)
+			{
+				tree_frame* grown = realloc(stack, cap * 2 * sizeof(tree_frame));
+				check_mem(grown);
+				memset(grown + cap, 0, cap * sizeof(tree_frame));
+				stack = grown;
+				cap *= 2;
+			}
+			memset(&stack[depth], 0, sizeof(tree_frame));
+			stack[depth].ents = malloc(TREE_BATCH * sizeof(dir_entry_plus));
+			check_mem(stack[depth].ents);
+			streamdir(&stack[depth].dir, child);
+			depth++;
+		}
+	}
+	free(stack);
 	return 0;
+error:
+	if(stack != NULL)
+	{
+		if(depth < cap) free(stack[depth].ents);		//The level being opened, NULL unless it got that far
+		while(depth > 0)
+		{
+			depth--;
+			releasedir(&stack[depth].dir);
+			free(stack[depth].ents);
+		}
+	}
+	free(stack);
+	return -1;
 }
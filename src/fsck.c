@@ -0,0 +1,429 @@
+/*
+ * fsck.c
+ *
+ *  Checks the image on the block device in three passes. A pool of
+ *  threads walks the directory tree from the root, sharing a queue of
+ *  directories, and builds the set of reachable inodes. The inode table is
+ *  then split across the same threads, which walk the block map of every
+ *  reachable inode and build the set of mapped blocks. Last, both sets are
+ *  compared with the bitmaps on disk and the superblock free counts.
+ *
+ *  In repair mode broken entries and pointers are cleared, block counts
+ *  are corrected, and the bitmaps and counts are rewritten from the sets,
+ *  which frees orphaned inodes along with their blocks.
+ *
+ *  The checker reads the device directly, so a mounted fs has to be
+ *  flushed first (see cnfsck).
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "fsck.h"
+#include "fs.h"
+#include "bitmap.h"
+
+typedef struct {
+	bool repair;
+	fsck_report* rep;
+	superblock super;
+	block block_bm;
+	block inode_bm;
+	inode* itable;					// the whole inode table
+	uint8_t reached[INODE_COUNT / 8];
+	uint8_t seen[BD_SIZE_BLOCKS / 8];
+	uint32_t journal_start;
+	uint32_t journal_end;
+	uint32_t nthreads;
+
+	//Directories waiting to be read; each is queued at most once
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	iptr dir_queue[INODE_COUNT];
+	uint32_t q_head;
+	uint32_t q_tail;
+	uint32_t busy;					// workers reading a directory
+} fsck_state;
+
+typedef struct {
+	fsck_state* st;
+	uint32_t index;
+} fsck_worker;
+
+typedef struct {
+	fsck_state* st;
+	bool check;						// mark, validate and repair pointers
+	iptr inode_id;
+	uint32_t data_blocks;
+	void (*visit)(fsck_state*, iptr, uint32_t);
+} walk_ctx;
+
+
+static void count(uint32_t* field)
+{
+	__atomic_fetch_add(field, 1, __ATOMIC_RELAXED);
+}
+
+static bool test_bit(const uint8_t* map, uint32_t bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+//Sets a bit shared between workers; returns whether it was already set
+static bool test_and_set(uint8_t* map, uint32_t bit)
+{
+	uint8_t mask = 1 << (bit % 8);
+	return __atomic_fetch_or(&map[bit / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static bool lba_ok(fsck_state* st, uint32_t lba)
+{
+	return lba >= BLOCKID_ROOT_DIR && lba < BD_SIZE_BLOCKS
+			&& (lba < st->journal_start || lba >= st->journal_end);
+}
+
+//Walks the blocks under one block pointer. level is 0 for a data block,
+//1 for a single and 2 for a double indirect block. Returns true if a
+//repair changed *ptr.
+static bool walk_tree(walk_ctx* w, iptr* ptr, uint8_t level)
+{
+	fsck_state* st = w->st;
+	if(*ptr == 0) return false;
+	uint32_t lba = (level == 0) ? BLK_LBA(*ptr) : *ptr;
+	if(!lba_ok(st, lba))
+	{
+		if(!w->check) return false;
+		count(&st->rep->bad_pointers);
+		if(!st->repair) return false;
+		*ptr = 0;
+		count(&st->rep->repaired);
+		return true;
+	}
+	if(w->check)
+	{
+		if(test_and_set(st->seen, lba)) count(&st->rep->duplicate_blocks);
+		count(&st->rep->blocks_checked);
+	}
+	if(level == 0)
+	{
+		w->data_blocks++;
+		if(w->visit != NULL) w->visit(st, w->inode_id, lba);
+		return false;
+	}
+
+	iptr ind[PTRS_PER_BLOCK];
+	bool dirty = false;
+	blk_read(lba, (block*)ind);
+	for(uint32_t i = 0; i < PTRS_PER_BLOCK; i++)
+	{
+		dirty |= walk_tree(w, &ind[i], level - 1);
+	}
+	if(dirty) blk_write(lba, (block*)ind);
+	return false;
+}
+
+//Returns true if a repair changed the inode
+static bool walk_inode(walk_ctx* w, inode* inode_st)
+{
+	bool changed = false;
+	for(uint8_t i = 0; i < DIRECT_BLOCKS; i++)
+	{
+		changed |= walk_tree(w, &inode_st->data0[i], 0);
+	}
+	changed |= walk_tree(w, &inode_st->data1, 1);
+	changed |= walk_tree(w, &inode_st->data2, 2);
+	return changed;
+}
+
+static void enqueue_dir(fsck_state* st, iptr dir)
+{
+	pthread_mutex_lock(&st->lock);
+	st->dir_queue[st->q_tail++] = dir;
+	pthread_cond_signal(&st->wake);
+	pthread_mutex_unlock(&st->lock);
+}
+
+//Returns true if a repair changed the entry
+static bool check_entry(fsck_state* st, dir_entry* entry)
+{
+	bool changed = false;
+	iptr child = entry->inode;
+	if(child >= INODE_COUNT)
+	{
+		count(&st->rep->bad_entries);
+		if(!st->repair) return false;
+		entry->name_len = 0;	//Free the slot
+		count(&st->rep->repaired);
+		return true;
+	}
+	inode* inode_st = &st->itable[child];
+	if(entry->file_type != inode_st->type)
+	{
+		count(&st->rep->bad_entries);
+		if(st->repair)
+		{
+			entry->file_type = inode_st->type;
+			count(&st->rep->repaired);
+			changed = true;
+		}
+	}
+	if(test_and_set(st->reached, child))
+	{
+		count(&st->rep->bad_entries);	//A second link; there are no hard links
+		return changed;
+	}
+	count(&st->rep->inodes_checked);
+	if(inode_st->type == ITYPE_DIR)
+	{
+		enqueue_dir(st, child);
+	}
+	return changed;
+}
+
+static void check_dir_block(fsck_state* st, iptr dir, uint32_t lba)
+{
+	block blk;
+	bool dirty = false;
+	uint32_t offset = 0;
+	blk_read(lba, &blk);
+	while(offset < BLOCK_SIZE)
+	{
+		dir_entry* entry = (dir_entry*)(blk.byte + offset);
+		if(entry->entry_len < DIR_REC_LEN(0) || entry->entry_len % 4 != 0
+				|| offset + entry->entry_len > BLOCK_SIZE
+				|| (entry->name_len != 0 && DIR_REC_LEN(entry->name_len) > entry->entry_len))
+		{
+			count(&st->rep->bad_entries);
+			if(st->repair)
+			{
+				//Turn the rest of the block into one free slot
+				entry->entry_len = BLOCK_SIZE - offset;
+				entry->name_len = 0;
+				count(&st->rep->repaired);
+				dirty = true;
+			}
+			break;
+		}
+		bool dot = (entry->name_len == 1 && entry->name[0] == '.');
+		bool dotdot = (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+		if(dot && entry->inode != dir)
+		{
+			count(&st->rep->bad_entries);
+		}
+		else if(entry->name_len != 0 && !dot && !dotdot)
+		{
+			dirty |= check_entry(st, entry);
+		}
+		offset += entry->entry_len;
+	}
+	if(dirty) blk_write(lba, &blk);
+}
+
+//Pass 1: read directories off the shared queue until it is empty and no
+//worker can add to it
+static void* tree_worker(void* arg)
+{
+	fsck_state* st = ((fsck_worker*)arg)->st;
+	walk_ctx w = { .st = st, .check = false, .visit = check_dir_block };
+	pthread_mutex_lock(&st->lock);
+	while(true)
+	{
+		while(st->q_head == st->q_tail && st->busy > 0)
+		{
+			pthread_cond_wait(&st->wake, &st->lock);
+		}
+		if(st->q_head == st->q_tail) break;
+		iptr dir = st->dir_queue[st->q_head++];
+		st->busy++;
+		pthread_mutex_unlock(&st->lock);
+
+		w.inode_id = dir;
+		walk_inode(&w, &st->itable[dir]);
+
+		pthread_mutex_lock(&st->lock);
+		st->busy--;
+		if(st->busy == 0) pthread_cond_broadcast(&st->wake);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+//Pass 2: map the blocks of the reachable inodes in every nthreads'th
+//inode table block
+static void* inode_worker(void* arg)
+{
+	fsck_state* st = ((fsck_worker*)arg)->st;
+	for(uint32_t b = ((fsck_worker*)arg)->index; b < INODE_TABLE_BLOCKS; b += st->nthreads)
+	{
+		bool dirty = false;
+		for(uint32_t i = 0; i < INODES_IN_BLOCK; i++)
+		{
+			iptr inode_id = b * INODES_IN_BLOCK + i;
+			if(!test_bit(st->reached, inode_id)) continue;
+			inode* inode_st = &st->itable[inode_id];
+			walk_ctx w = { .st = st, .check = true, .inode_id = inode_id };
+			dirty |= walk_inode(&w, inode_st);
+			if(w.data_blocks != inode_st->blocks)
+			{
+				count(&st->rep->bad_block_counts);
+				if(st->repair)
+				{
+					inode_st->blocks = w.data_blocks;
+					count(&st->rep->repaired);
+					dirty = true;
+				}
+			}
+		}
+		if(dirty)
+		{
+			blk_write(BLOCKID_INODE_TABLE + b, (block*)&st->itable[b * INODES_IN_BLOCK]);
+		}
+	}
+	return NULL;
+}
+
+static void run_workers(fsck_state* st, void* (*fn)(void*))
+{
+	pthread_t tid[FSCK_MAX_THREADS];
+	fsck_worker args[FSCK_MAX_THREADS];
+	for(uint32_t t = 0; t < st->nthreads; t++)
+	{
+		args[t].st = st;
+		args[t].index = t;
+		pthread_create(&tid[t], NULL, fn, &args[t]);
+	}
+	for(uint32_t t = 0; t < st->nthreads; t++)
+	{
+		pthread_join(tid[t], NULL);
+	}
+}
+
+//Pass 3: compare the sets with the bitmaps and the counts
+static void check_bitmaps(fsck_state* st)
+{
+	fsck_report* rep = st->rep;
+	uint32_t marked_blocks = 0, used_blocks = 0;
+	uint32_t marked_inodes = 0, used_inodes = 0;
+	for(uint32_t lba = 0; lba < BD_SIZE_BLOCKS; lba++)
+	{
+		bool marked = read_bitmap(&st->block_bm, lba);
+		bool used = test_bit(st->seen, lba);
+		if(marked && !used) rep->leaked_blocks++;
+		if(!marked && used) rep->unmarked_blocks++;
+		marked_blocks += marked;
+		used_blocks += used;
+	}
+	for(iptr inode_id = 0; inode_id < INODE_COUNT; inode_id++)
+	{
+		bool marked = read_bitmap(&st->inode_bm, inode_id);
+		bool used = test_bit(st->reached, inode_id);
+		if(marked && !used) rep->orphan_inodes++;
+		if(!marked && used) rep->unmarked_inodes++;
+		marked_inodes += marked;
+		used_inodes += used;
+	}
+	if(st->super.free_block_count != BD_SIZE_BLOCKS - marked_blocks) rep->bad_counts++;
+	if(st->super.free_inode_count != INODE_COUNT - marked_inodes) rep->bad_counts++;
+
+	bool stale = rep->leaked_blocks || rep->unmarked_blocks || rep->orphan_inodes
+			|| rep->unmarked_inodes || rep->bad_counts;
+	if(st->repair && stale)
+	{
+		memset(&st->block_bm, 0, sizeof(block));
+		memcpy(&st->block_bm, st->seen, sizeof(st->seen));
+		memset(&st->inode_bm, 0, sizeof(block));
+		memcpy(&st->inode_bm, st->reached, sizeof(st->reached));
+		st->super.free_block_count = BD_SIZE_BLOCKS - used_blocks;
+		st->super.free_inode_count = INODE_COUNT - used_inodes;
+		blk_write(BLOCKID_BLOCK_BITMAP, &st->block_bm);
+		blk_write(BLOCKID_INODE_BITMAP, &st->inode_bm);
+		blk_write(BLOCKID_SUPER, (block*)&st->super);
+		rep->repaired += rep->leaked_blocks + rep->unmarked_blocks + rep->orphan_inodes
+				+ rep->unmarked_inodes + rep->bad_counts;
+	}
+}
+
+//Checks, and with repair fixes, the image. Returns -1 if it is not a
+//filesystem, else 0; the findings are in rep.
+int8_t fsck_image(bool repair, fsck_report* rep)
+{
+	fsck_state* st = calloc(1, sizeof(fsck_state));
+	check_mem(st);
+	memset(rep, 0, sizeof(fsck_report));
+	st->repair = repair;
+	st->rep = rep;
+
+	blk_read(BLOCKID_SUPER, (block*)&st->super);
+	check(st->super.magic == FS_MAGIC, "No filesystem on the device");
+	blk_read(BLOCKID_BLOCK_BITMAP, &st->block_bm);
+	blk_read(BLOCKID_INODE_BITMAP, &st->inode_bm);
+	st->itable = malloc(INODE_TABLE_BLOCKS * sizeof(block));
+	check_mem(st->itable);
+	for(uint32_t b = 0; b < INODE_TABLE_BLOCKS; b++)
+	{
+		blk_read(BLOCKID_INODE_TABLE + b, (block*)&st->itable[b * INODES_IN_BLOCK]);
+	}
+
+	//Everything before the root directory, and the journal, is always in use
+	st->journal_start = st->super.journal_start;
+	st->journal_end = st->super.journal_start + st->super.journal_blocks;
+	for(uint32_t lba = 0; lba < BLOCKID_ROOT_DIR; lba++)
+	{
+		test_and_set(st->seen, lba);
+	}
+	for(uint32_t lba = st->journal_start; lba < st->journal_end && lba < BD_SIZE_BLOCKS; lba++)
+	{
+		test_and_set(st->seen, lba);
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	st->nthreads = (cpus < 1) ? 1 : MIN((uint32_t)cpus, FSCK_MAX_THREADS);
+	rep->threads = st->nthreads;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->wake, NULL);
+
+	test_and_set(st->reached, INODE_ROOTDIR);
+	rep->inodes_checked = 1;
+	st->dir_queue[st->q_tail++] = INODE_ROOTDIR;
+	run_workers(st, tree_worker);
+	run_workers(st, inode_worker);
+	check_bitmaps(st);
+
+	pthread_cond_destroy(&st->wake);
+	pthread_mutex_destroy(&st->lock);
+	free(st->itable);
+	free(st);
+	return 0;
+
+error:
+	if(st != NULL) free(st->itable);
+	free(st);
+	return -1;
+}
+
+uint32_t fsck_errors(const fsck_report* rep)
+{
+	return rep->bad_entries + rep->bad_pointers + rep->duplicate_blocks + rep->bad_block_counts
+			+ rep->orphan_inodes + rep->unmarked_inodes + rep->leaked_blocks
+			+ rep->unmarked_blocks + rep->bad_counts;
+}
+
+int fsck_summary(const fsck_report* rep, char* buf, size_t len)
+{
+	return snprintf(buf, len,
+			"Checked %u inodes, %u blocks with %u threads\n"
+			"Bad directory entries: %u\n"
+			"Bad block pointers: %u\n"
+			"Blocks mapped twice: %u\n"
+			"Wrong block counts: %u\n"
+			"Orphaned inodes: %u\n"
+			"Used inodes marked free: %u\n"
+			"Leaked blocks: %u\n"
+			"Used blocks marked free: %u\n"
+			"Wrong free counts: %u\n"
+			"%u problems, %u repaired",
+			rep->inodes_checked, rep->blocks_checked, rep->threads,
+			rep->bad_entries, rep->bad_pointers, rep->duplicate_blocks, rep->bad_block_counts,
+			rep->orphan_inodes, rep->unmarked_inodes, rep->leaked_blocks, rep->unmarked_blocks,
+			rep->bad_counts, fsck_errors(rep), rep->repaired);
+}
@@ -0,0 +1,39 @@
+/*
+ * fsck_main.c
+ *
+ *  Standalone checker for the image in /tmp/fs.bin: cnfsck [-r]
+ *  Replays the journal first so the checker sees committed state. Exits
+ *  0 if the image is clean, 1 if problems were found, 2 if it could not
+ *  be checked.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "fs.h"
+#include "fsck.h"
+#include "journal.h"
+
+#ifndef UNITY_FIXTURES
+int main(int argc, char *argv[]) {
+	fsck_report rep;
+	superblock super;
+	char out[1024];
+	bool repair = (argc > 1 && strcmp(argv[1], "-r") == 0);
+
+	blockdev_attach();
+	blk_read(BLOCKID_SUPER, (block*)&super);
+	if(super.magic == FS_MAGIC)
+	{
+		journal_load(super.journal_start, super.journal_blocks);
+	}
+	if(fsck_image(repair, &rep) < 0)
+	{
+		blockdev_detach();
+		return 2;
+	}
+	fsck_summary(&rep, out, sizeof(out));
+	printf("%s\n", out);
+	blockdev_detach();
+	return fsck_errors(&rep) > 0 ? 1 : 0;
+}
+#endif
@@ -7,6 +7,7 @@
 
 #include "inode.h"
 #include "blockdev.h"
+#include "journal.h"
 
 uint32_t find_inode_table_blockid(iptr index)
 {
@@ -16,30 +17,88 @@ uint32_t find_inode_table_blockid(iptr index)
 
 uint8_t inode_write(iptr index, inode* inode_st)
 {
+	uint32_t lba = BLOCKID_INODE_TABLE + find_inode_table_blockid(index);
+	//Other inodes in the block may be changing too, update only this slot
+	journal_update(lba, (index % INODES_IN_BLOCK) * sizeof(inode), inode_st, sizeof(inode));
+	return 0;
+}
 
+uint8_t inode_read(iptr index, inode* inode_st)
+{
 	block* inode_blk = malloc(sizeof(block));
 	uint32_t lba = BLOCKID_INODE_TABLE + find_inode_table_blockid(index);
-	blk_read(lba, inode_blk);
+	journal_read(lba, inode_blk);
 
 	inode* inode_table = (inode*)inode_blk;
-	memcpy(inode_table + (index % INODES_IN_BLOCK), inode_st, sizeof(inode));
-	//debug("writing inode %u at block %u offset %u",index,lba,(index % INODES_IN_BLOCK));
-	blk_write(lba, inode_blk);
+	memcpy(inode_st, inode_table + (index % INODES_IN_BLOCK), sizeof(inode));
+	//debug("reading inode %u at block %u offset %u",index,lba,(index % INODES_IN_BLOCK));
 
 	free(inode_blk);
 	return 0;
 }
 
-uint8_t inode_read(iptr index, inode* inode_st)
+typedef struct {
+	iptr index;
+	uint32_t slot;
+} inode_want;
+
+static int inode_want_cmp(const void* a, const void* b)
 {
+	const inode_want* x = a;
+	const inode_want* y = b;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+//Reads count inodes into out, in the order given, reading each inode table
+//block they share only once
+uint8_t inode_read_many(const iptr* indexes, inode* out, uint32_t count)
+{
+	inode_want* wants = malloc(count * sizeof(inode_want));
 	block* inode_blk = malloc(sizeof(block));
-	uint32_t lba = BLOCKID_INODE_TABLE + find_inode_table_blockid(index);
-	blk_read(lba, inode_blk);
+	uint32_t loaded = 0xFFFFFFFF;
+	if(count == 0)
+	{
+		free(wants);
+		free(inode_blk);
+		return 0;
+	}
+	if(wants == NULL || inode_blk == NULL)
+	{
+		free(wants);
+		free(inode_blk);
+		return 1;
+	}
+	for(uint32_t i = 0; i < count; i++)
+	{
+		wants[i].index = indexes[i];
+		wants[i].slot = i;
+	}
+	qsort(wants, count, sizeof(inode_want), inode_want_cmp);
 
-	inode* inode_table = (inode*)inode_blk;
-	memcpy(inode_st, inode_table + (index % INODES_IN_BLOCK), sizeof(inode));
-	//debug("reading inode %u at block %u offset %u",index,lba,(index % INODES_IN_BLOCK));
+	//Let the device load all the blocks while the first is copied from
+	uint32_t first = 0;
+	for(uint32_t i = 1; i <= count; i++)
+	{
+		if(i == count || find_inode_table_blockid(wants[i].index) > find_inode_table_blockid(wants[i - 1].index) + 1)
+		{
+			uint32_t start = find_inode_table_blockid(wants[first].index);
+			blk_prefetch(BLOCKID_INODE_TABLE + start, find_inode_table_blockid(wants[i - 1].index) - start + 1);
+			first = i;
+		}
+	}
 
+	inode* inode_table = (inode*)inode_blk;
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t lba = BLOCKID_INODE_TABLE + find_inode_table_blockid(wants[i].index);
+		if(lba != loaded)
+		{
+			journal_read(lba, inode_blk);
+			loaded = lba;
+		}
+		memcpy(&out[wants[i].slot], inode_table + (wants[i].index % INODES_IN_BLOCK), sizeof(inode));
+	}
+	free(wants);
 	free(inode_blk);
 	return 0;
 }
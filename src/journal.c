@@ -0,0 +1,462 @@
+/*
+ * journal.c
+ *
+ *  The journal region starts with a header block naming the log position
+ *  and id of the next transaction. A transaction is logged as a descriptor
+ *  listing the home LBAs, the block images in that order, and a commit
+ *  block. Once the commit block is on disk the images are written home and
+ *  the header moves past the transaction, so mount only replays the
+ *  transaction, if any, that a crash caught between the two.
+ *
+ *  Operations bracket their changes with journal_begin/journal_end. They
+ *  all join the running transaction, which commits when no operation is
+ *  open and either enough blocks are waiting or journal_commit is called,
+ *  so many operations share the cost of one commit. A commit waits for
+ *  open operations to end and holds off new ones until it is done.
+ *
+ *  journal_begin reserves room in the transaction for the most blocks the
+ *  operation can change. An operation that would not fit waits for the
+ *  open ones to end and commits them first, so a transaction never fills
+ *  while an operation is half done.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
+#include "journal.h"
+#include "blockdev.h"
+
+#define JBLK_HEADER		1
+#define JBLK_DESC		2
+#define JBLK_COMMIT		3
+
+#define JOURNAL_HASH	2048		// power of two, at least twice JOURNAL_TXN_MAX
+#define JOURNAL_DEAD	0xFFFFFFFF	// slot of a forgotten block
+
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t tid;
+	uint32_t count;		// descriptor: images that follow; header: log position of the next transaction
+	uint32_t lba[JOURNAL_TXN_MAX];
+} journal_block;
+
+_Static_assert(sizeof(journal_block) == BLOCK_SIZE, "journal_block must fill one block");
+
+static uint32_t j_start;		// first block of the region, the header
+static uint32_t j_blocks;		// 0 = no journal, writes go straight home
+static uint32_t j_tid;
+static uint32_t j_head;
+
+//Running transaction
+static uint32_t txn_lba[JOURNAL_TXN_MAX];
+static block* txn_data;
+static uint32_t txn_cap;
+static uint32_t txn_count;		// slots used, forgotten ones included
+static uint32_t txn_live;
+static uint16_t txn_hash[JOURNAL_HASH];	// slot + 1, 0 = empty
+static uint32_t txn_handles;
+static uint32_t txn_reserved;	// slots promised to open operations and not yet used
+
+static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;	//All of the above
+static pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;	//Signalled when txn_handles drops to 0 or a commit ends
+static bool j_committing;
+static __thread uint32_t j_depth;	//Handles the calling thread holds
+static __thread uint32_t j_credits;	//Slots its outermost handle may still use
+
+
+static uint32_t log_next(uint32_t pos)
+{
+	return (pos + 1 < j_blocks) ? pos + 1 : 1;
+}
+
+static void txn_reset(void)
+{
+	txn_count = 0;
+	txn_live = 0;
+	memset(txn_hash, 0, sizeof(txn_hash));
+}
+
+static uint32_t txn_hash_of(uint32_t lba)
+{
+	return (lba * 2654435761u) & (JOURNAL_HASH - 1);
+}
+
+//Returns the slot holding lba's image, or -1
+static int32_t txn_find(uint32_t lba)
+{
+	for(uint32_t h = txn_hash_of(lba); txn_hash[h] != 0; h = (h + 1) & (JOURNAL_HASH - 1))
+	{
+		if(txn_lba[txn_hash[h] - 1] == lba)
+		{
+			return txn_hash[h] - 1;
+		}
+	}
+	return -1;
+}
+
+static void write_header(void)
+{
+	journal_block hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.type = JBLK_HEADER;
+	hdr.tid = j_tid;
+	hdr.count = j_head;
+	blk_write(j_start, (block*)&hdr);
+}
+
+//Starts an empty log in the region. Transaction ids carry on from any log
+//already there, so none of its old transactions can pass for a new one.
+void journal_format(uint32_t start, uint32_t nblocks)
+{
+	block zero;
+	journal_block old;
+	j_start = start;
+	j_blocks = nblocks;
+	j_tid = 1;
+	j_head = 1;
+	if(j_blocks != 0)
+	{
+		blk_read(j_start, (block*)&old);
+		if(old.magic == JOURNAL_MAGIC && old.type == JBLK_HEADER)
+		{
+			j_tid = old.tid + 1;
+		}
+		else
+		{
+			j_tid = (uint32_t)time(NULL);	//Whatever was here, it is not from now
+		}
+	}
+	txn_handles = 0;
+	txn_reserved = 0;
+	txn_reset();
+	if(j_blocks == 0) return;
+
+	//A stale descriptor at the first position must not look like transaction 1
+	memset(&zero, 0, sizeof(block));
+	blk_write(j_start + j_head, &zero);
+	write_header();
+}
+
+//Attaches to the journal at mount and replays committed transactions that
+//were not yet written home. nblocks 0 runs without a journal. Returns the
+//number of transactions replayed, -1 if the header is bad.
+int8_t journal_load(uint32_t start, uint32_t nblocks)
+{
+	journal_block hdr;
+	journal_block desc;
+	block image;
+	int8_t replayed = 0;
+
+	j_start = start;
+	j_blocks = nblocks;
+	txn_handles = 0;
+	txn_reserved = 0;
+	txn_reset();
+	if(j_blocks == 0) return 0;
+
+	blk_read(j_start, (block*)&hdr);
+	check(hdr.magic == JOURNAL_MAGIC && hdr.type == JBLK_HEADER, "Bad journal header");
+	check(hdr.count > 0 && hdr.count < j_blocks, "Bad journal position %u", hdr.count);
+	j_tid = hdr.tid;
+	j_head = hdr.count;
+
+	while(true)
+	{
+		blk_read(j_start + j_head, (block*)&desc);
+		if(desc.magic != JOURNAL_MAGIC || desc.type != JBLK_DESC || desc.tid != j_tid
+				|| desc.count > JOURNAL_TXN_MAX)
+		{
+			break;
+		}
+		uint32_t pos = log_next(j_head);
+		for(uint32_t i = 0; i < desc.count; i++)
+		{
+			pos = log_next(pos);
+		}
+		journal_block commit;
+		blk_read(j_start + pos, (block*)&commit);
+		if(commit.magic != JOURNAL_MAGIC || commit.type != JBLK_COMMIT || commit.tid != j_tid)
+		{
+			break;		//Never committed, its changes are dropped
+		}
+
+		pos = log_next(j_head);
+		for(uint32_t i = 0; i < desc.count; i++)
+		{
+			blk_read(j_start + pos, &image);
+			blk_write(desc.lba[i], &image);
+			pos = log_next(pos);
+		}
+		j_head = log_next(pos);
+		j_tid++;
+		replayed++;
+	}
+	if(replayed > 0)
+	{
+		log_warn("Replayed %d journal transaction(s)", replayed);
+		write_header();
+	}
+	return replayed;
+
+error:
+	j_blocks = 0;
+	return -1;
+}
+
+static void commit_locked(void);
+
+//Opens an operation that changes at most credits metadata blocks, at most
+//JOURNAL_TXN_MAX. A nested handle shares the outermost one's reservation.
+void journal_begin(uint32_t credits)
+{
+	pthread_mutex_lock(&j_lock);
+	if(j_depth == 0)
+	{
+		credits = MIN(credits, JOURNAL_TXN_MAX);
+		while(true)
+		{
+			while(j_committing)
+			{
+				pthread_cond_wait(&j_cond, &j_lock);
+			}
+			if(j_blocks == 0 || txn_count + txn_reserved + credits <= JOURNAL_TXN_MAX) break;
+
+			//No room: let the open operations finish, then commit them
+			j_committing = true;
+			while(txn_handles > 0)
+			{
+				pthread_cond_wait(&j_cond, &j_lock);
+			}
+			commit_locked();
+			j_committing = false;
+			pthread_cond_broadcast(&j_cond);
+		}
+		j_credits = credits;
+		txn_reserved += credits;
+	}
+	j_depth++;
+	txn_handles++;
+	pthread_mutex_unlock(&j_lock);
+}
+
+void journal_end(void)
+{
+	pthread_mutex_lock(&j_lock);
+	j_depth--;
+	txn_handles--;
+	if(j_depth == 0)
+	{
+		txn_reserved -= j_credits;
+		j_credits = 0;
+	}
+	if(txn_handles == 0)
+	{
+		pthread_cond_broadcast(&j_cond);
+		if(txn_live >= JOURNAL_COMMIT_BLOCKS && !j_committing)
+		{
+			commit_locked();
+		}
+	}
+	pthread_mutex_unlock(&j_lock);
+}
+
+//The id of the running transaction, for journal_committed
+uint32_t journal_tid(void)
+{
+	pthread_mutex_lock(&j_lock);
+	uint32_t tid = j_tid;
+	pthread_mutex_unlock(&j_lock);
+	return tid;
+}
+
+//Whether the changes made while tid was running are on disk for good
+bool journal_committed(uint32_t tid)
+{
+	pthread_mutex_lock(&j_lock);
+	bool committed = (j_blocks == 0 || (int32_t)(j_tid - tid) > 0);
+	pthread_mutex_unlock(&j_lock);
+	return committed;
+}
+
+uint32_t journal_pending(void)
+{
+	pthread_mutex_lock(&j_lock);
+	uint32_t pending = txn_live;
+	pthread_mutex_unlock(&j_lock);
+	return pending;
+}
+
+//Waits for the open operations other than the caller's to end, then
+//commits everything they did as one transaction
+int8_t journal_commit(void)
+{
+	pthread_mutex_lock(&j_lock);
+	while(j_committing)
+	{
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	j_committing = true;
+	while(txn_handles > j_depth)
+	{
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	commit_locked();
+	j_committing = false;
+	pthread_cond_broadcast(&j_cond);
+	pthread_mutex_unlock(&j_lock);
+	return 0;
+}
+
+//Logs the running transaction, then writes its blocks home
+static void commit_locked(void)
+{
+	journal_block desc;
+	if(txn_live == 0)
+	{
+		txn_reset();
+		return;
+	}
+
+	memset(&desc, 0, sizeof(desc));
+	desc.magic = JOURNAL_MAGIC;
+	desc.type = JBLK_DESC;
+	desc.tid = j_tid;
+	for(uint32_t slot = 0; slot < txn_count; slot++)
+	{
+		if(txn_lba[slot] != JOURNAL_DEAD) desc.lba[desc.count++] = txn_lba[slot];
+	}
+	uint32_t pos = j_head;
+	blk_write(j_start + pos, (block*)&desc);
+	for(uint32_t slot = 0; slot < txn_count; slot++)
+	{
+		if(txn_lba[slot] == JOURNAL_DEAD) continue;
+		pos = log_next(pos);
+		blk_write(j_start + pos, &txn_data[slot]);
+	}
+
+	journal_block commit;
+	memset(&commit, 0, sizeof(commit));
+	commit.magic = JOURNAL_MAGIC;
+	commit.type = JBLK_COMMIT;
+	commit.tid = j_tid;
+	pos = log_next(pos);
+	blk_write(j_start + pos, (block*)&commit);
+
+	//Committed; write home and retire it
+	for(uint32_t slot = 0; slot < txn_count; slot++)
+	{
+		if(txn_lba[slot] == JOURNAL_DEAD) continue;
+		blk_write(txn_lba[slot], &txn_data[slot]);
+	}
+	j_head = log_next(pos);
+	j_tid++;
+	write_header();
+	txn_reset();
+}
+
+//Reads a metadata block, as changed by the running transaction
+void journal_read(uint32_t lba, block* buf)
+{
+	pthread_mutex_lock(&j_lock);
+	int32_t slot = (j_blocks != 0) ? txn_find(lba) : -1;
+	if(slot >= 0)
+	{
+		memcpy(buf, &txn_data[slot], sizeof(block));
+	}
+	else
+	{
+		blk_read(lba, buf);
+	}
+	pthread_mutex_unlock(&j_lock);
+}
+
+static void write_locked(uint32_t lba, const block* buf)
+{
+	if(j_blocks == 0)
+	{
+		blk_write(lba, buf);
+		return;
+	}
+	int32_t slot = txn_find(lba);
+	if(slot < 0)
+	{
+		if(txn_count == JOURNAL_TXN_MAX)
+		{
+			//Only an operation that outgrew its credits gets here. Committing
+			//is safe if no other thread has an operation open.
+			check(txn_handles == j_depth, "Journal transaction full, writing %u home", lba);
+			log_warn("Journal transaction full, committing early");
+			commit_locked();
+		}
+		if(txn_count == txn_cap)
+		{
+			uint32_t cap = txn_cap ? txn_cap * 2 : 64;
+			block* grown = realloc(txn_data, cap * sizeof(block));
+			check_mem(grown);
+			txn_data = grown;
+			txn_cap = cap;
+		}
+		slot = txn_count++;
+		txn_lba[slot] = lba;
+		txn_live++;
+		if(j_credits > 0)
+		{
+			j_credits--;
+			txn_reserved--;
+		}
+		uint32_t h = txn_hash_of(lba);
+		while(txn_hash[h] != 0) h = (h + 1) & (JOURNAL_HASH - 1);
+		txn_hash[h] = slot + 1;
+	}
+	memcpy(&txn_data[slot], buf, sizeof(block));
+	return;
+
+error:
+	blk_write(lba, buf);
+}
+
+//Adds a metadata block image to the running transaction
+void journal_write(uint32_t lba, const block* buf)
+{
+	pthread_mutex_lock(&j_lock);
+	write_locked(lba, buf);
+	pthread_mutex_unlock(&j_lock);
+}
+
+//Changes len bytes at offset within a metadata block, atomically with
+//respect to other updates of the same block
+void journal_update(uint32_t lba, uint32_t offset, const void* data, uint32_t len)
+{
+	block buf;
+	pthread_mutex_lock(&j_lock);
+	int32_t slot = (j_blocks != 0) ? txn_find(lba) : -1;
+	if(slot >= 0)
+	{
+		memcpy(txn_data[slot].byte + offset, data, len);
+	}
+	else
+	{
+		blk_read(lba, &buf);
+		memcpy(buf.byte + offset, data, len);
+		write_locked(lba, &buf);
+	}
+	pthread_mutex_unlock(&j_lock);
+}
+
+//Drops a freed block from the running transaction, so a stale image can
+//not land on it after it is reused for file data
+void journal_forget(uint32_t lba)
+{
+	pthread_mutex_lock(&j_lock);
+	int32_t slot = (j_blocks != 0) ? txn_find(lba) : -1;
+	if(slot >= 0)
+	{
+		txn_lba[slot] = JOURNAL_DEAD;
+		txn_live--;
+	}
+	pthread_mutex_unlock(&j_lock);
+}
@@ -0,0 +1,100 @@
+/*
+ * outbuf.c
+ *
+ *  The buffer doubles when it fills, so building output of n bytes costs
+ *  O(n) however many pieces it arrives in.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include "outbuf.h"
+#include "debug.h"
+
+int8_t outbuf_init(outbuf* ob, size_t cap)
+{
+	ob->len = 0;
+	ob->cap = (cap < OUTBUF_MIN_CAP) ? OUTBUF_MIN_CAP : cap;
+	ob->data = malloc(ob->cap);
+	check_mem(ob->data);
+	ob->data[0] = '\0';
+	return 0;
+error:
+	ob->cap = 0;
+	return -1;
+}
+
+//Makes room for extra more bytes and the terminator, so a producer can
+//write straight into data + len and then commit what it wrote
+int8_t outbuf_reserve(outbuf* ob, size_t extra)
+{
+	check(extra <= SIZE_MAX - ob->len - 1, "Output of %zu more bytes is too large", extra);
+	if(ob->len + extra < ob->cap) return 0;
+	size_t cap = ob->cap ? ob->cap : OUTBUF_MIN_CAP;
+	while(ob->len + extra >= cap)
+	{
+		cap = (cap <= SIZE_MAX / 2) ? cap * 2 : SIZE_MAX;
+	}
+	char* grown = realloc(ob->data, cap);
+	check_mem(grown);
+	ob->data = grown;
+	ob->cap = cap;
+	return 0;
+error:
+	return -1;
+}
+
+//Takes len bytes written past the end into the output
+void outbuf_commit(outbuf* ob, size_t len)
+{
+	ob->len += len;
+	ob->data[ob->len] = '\0';
+}
+
+//Drops the output past len, keeping the memory for reuse
+void outbuf_truncate(outbuf* ob, size_t len)
+{
+	if(len >= ob->len) return;
+	ob->len = len;
+	ob->data[len] = '\0';
+}
+
+int8_t outbuf_append(outbuf* ob, const void* data, size_t len)
+{
+	if(outbuf_reserve(ob, len) != 0) return -1;
+	memcpy(ob->data + ob->len, data, len);
+	ob->len += len;
+	ob->data[ob->len] = '\0';
+	return 0;
+}
+
+int8_t outbuf_printf(outbuf* ob, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int needed = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(needed < 0 || outbuf_reserve(ob, needed) != 0) return -1;
+	va_start(ap, fmt);
+	vsnprintf(ob->data + ob->len, ob->cap - ob->len, fmt, ap);
+	va_end(ap);
+	ob->len += needed;
+	return 0;
+}
+
+//Hands the text over to the caller, who frees it
+char* outbuf_release(outbuf* ob)
+{
+	char* data = ob->data;
+	ob->data = NULL;
+	ob->len = 0;
+	ob->cap = 0;
+	return data;
+}
+
+void outbuf_free(outbuf* ob)
+{
+	free(outbuf_release(ob));
+}
@@ -23,6 +23,9 @@ sh_err start_listening(void) {
 	shell_client.cfd = -1;
 	shell_client.status = CLIENT_STATUS_CLOSE;
 
+	shell_server.local = cnsession_open();
+	shell_server.remote = NULL;
+
 	struct addrinfo hints;
 	struct addrinfo *res;
 	int sockfd;
@@ -63,45 +66,42 @@ sh_err start_listening(void) {
 }
 
 
-char* recv_cmd(void) {
-	int size=0;
-	char *cmdbuffer;
-	cmdbuffer = calloc(1,sizeof(char)*SH_MAX_STR);
-	cmdbuffer[0] = '\0';
-
-	size = recv(shell_server.clientfd, cmdbuffer, SH_MAX_STR*sizeof(char), 0);
+//Receives a command line into cmdbuffer, which holds SH_MAX_STR bytes, and
+//terminates it. Returns its length, 0 if the client has gone, or
+//SH_ERR_RECV.
+int recv_cmd(char* cmdbuffer) {
+	ssize_t size = recv(shell_server.clientfd, cmdbuffer, SH_MAX_STR - 1, 0);
 	if(size < 0) {
-		// handle error
 		cmdbuffer[0] = '\0';
-		cmdbuffer[1] = SH_ERR_RECV;
-		cmdbuffer[2] = errno;
-
+		return SH_ERR_RECV;
 	}
-	return cmdbuffer;
+	cmdbuffer[size] = '\0';
+	return size;
 }
 
 
-sh_err send_results(char* resultstr) {
-	sh_err send_err;
-	int bytes_sent;
-
-	int result_len = strlen(resultstr)*sizeof(char);
-	int bytes_remain = result_len;
-	char* cursor = resultstr;
-
-	while(bytes_remain > 0) {
-		int send_len = result_len > (SVR_MAX_PAYLOAD-1) ? (SVR_MAX_PAYLOAD-1) : result_len;
-
-		bytes_sent = send(shell_server.clientfd,cursor,sizeof(char)*send_len,0);
-
-		if(bytes_sent > 0) {
+//Sends one command's output as its length followed by the bytes, so the
+//client knows where it ends whatever bytes it holds
+sh_err send_results(outbuf* results) {
+	sh_err send_err = SH_ERR_SUCCESS;
+	uint32_t hdr = htonl((uint32_t)results->len);
+	const char* pieces[2] = { (const char*)&hdr, results->data };
+	size_t lens[2] = { SVR_RESULT_HDR, results->len };
+
+	for(int p = 0; p < 2 && send_err == SH_ERR_SUCCESS; p++) {
+		const char* cursor = pieces[p];
+		size_t bytes_remain = lens[p];
+		while(bytes_remain > 0) {
+			size_t send_len = bytes_remain > SVR_MAX_PAYLOAD ? SVR_MAX_PAYLOAD : bytes_remain;
+			ssize_t bytes_sent = send(shell_server.clientfd,cursor,send_len,0);
+			if(bytes_sent < 1) {
+				send_err = SH_ERR_SOCKET;
+				break;
+			}
 			bytes_remain -= bytes_sent;
-			cursor += bytes_sent / sizeof(char);
-		} else {
-			bytes_remain = bytes_sent;
+			cursor += bytes_sent;
 		}
 	}
-	if(bytes_sent<1) send_err = bytes_sent;
 
 	return send_err;
 }
@@ -117,6 +117,7 @@ sh_err accept_client(void) {
 	if(clientfd>0) {
 		shell_server.client = CLIENT_STATUS_OPEN;
 		shell_server.clientfd = clientfd;
+		shell_server.remote = cnsession_open();
 	    if (client_addr.ss_family == AF_INET) {
 	        inet_ntop(client_addr.ss_family,&(((struct sockaddr_in*)&client_addr)->sin_addr),str_addr, sizeof(str_addr));
 	    } else {
@@ -135,19 +136,20 @@ sh_err accept_client(void) {
 sh_err run(void) {
 
 	char cmdbuffer[SH_MAX_STR];
-	char* result;
+	outbuf out;		// output of one command, reused for the next
 
 	sh_err run_err = SH_ERR_SUCCESS;
+	if(outbuf_init(&out, SVR_MAX_PAYLOAD) < 0) return SH_ERR_UNK;
 
 	printf("%s",str_table[STR_PROMPT]);
 	fflush(stdout);
 
 	struct pollfd pfd_in[4];
+	uint32_t background = 0;		//Units of deferred work the last pass did
 
 	while(shell_server.status == SVR_STATUS_RUN) {
 
 		memset(pfd_in, 0 , sizeof(pfd_in));
-		result = NULL;
 		pfd_in[0].fd = 0;
 		pfd_in[0].events = POLLIN;
 		pfd_in[0].revents = 0;
@@ -171,7 +173,8 @@ sh_err run(void) {
 			num_fds++;
 		}
 
-		sh_err pol_err = poll(pfd_in, num_fds, SVR_TIMEOUT_CHKSOCK);
+		//Only wait for input once the deferred work has run dry
+		sh_err pol_err = poll(pfd_in, num_fds, background > 0 ? 0 : SVR_TIMEOUT_CHKSOCK);
 		if(pol_err<0) {
 			printf("%s\n",err_str(SH_ERR_SOCKET));
 			perror("Errno");
@@ -187,14 +190,16 @@ sh_err run(void) {
 					perror("Errno");
 				}
 				if(!strncmp(cmdbuffer,"exit",4)) {
-					result = run_cmd(cmdbuffer);
-					if(result) printf("%s",result);
+					outbuf_truncate(&out, 0);
+					run_cmd(shell_server.local, cmdbuffer, &out);
+					fwrite(out.data, 1, out.len, stdout);
 				}
 
 			} else {
 			// stdin
-				result = run_cmd(cmdbuffer);
-				if(result) printf("%s",result);
+				outbuf_truncate(&out, 0);
+				run_cmd(shell_server.local, cmdbuffer, &out);
+				fwrite(out.data, 1, out.len, stdout);
 
 			}
 			if(shell_server.status == SVR_STATUS_RUN) {
@@ -222,23 +227,23 @@ sh_err run(void) {
 				}
 				// remote client sending cmd
 				if(pfd_in[i].fd == shell_server.clientfd) {
-					result = recv_cmd();
-					if(result[0]=='\0') {
-						run_err = result[1];
-						int err_errno = result[2];
+					int cmd_len = recv_cmd(cmdbuffer);
+					if(cmd_len<0) {
+						run_err = cmd_len;
 						printf("\n%s",err_str(run_err));
-						printf("\n%s\n",strerror(err_errno));
-					} else if((strlen(result)>=4) && (!strncmp(result,"exit",4))) {
+						printf("\n%s\n",strerror(errno));
+					} else if(cmd_len==0 || !strncmp(cmdbuffer,"exit",4)) {
 
 						run_err = close(shell_server.clientfd);
 						shell_server.clientfd = -1;
 						shell_server.client = CLIENT_STATUS_CLOSE;
+						cnsession_close(shell_server.remote);
+						shell_server.remote = NULL;
 
 					} else {
-						char *sendback = run_cmd(result);
-						if(sendback) {
-							run_err = send_results(sendback);
-							free(sendback);
+						outbuf_truncate(&out, 0);
+						if(run_cmd(shell_server.remote, cmdbuffer, &out) != SH_NO_CMD) {
+							run_err = send_results(&out);
 						}
 
 					}
@@ -250,23 +255,27 @@ sh_err run(void) {
 				}
 				// client receiving cmd results
 				if(pfd_in[i].fd == shell_client.cfd) {
-					result = recv_results();
-					if(result[0]=='\0') {
-						run_err = result[1];
-						int err_errno = result[2];
+					outbuf_truncate(&out, 0);
+					run_err = recv_results(&out);
+					if(run_err<0) {
 						printf("\n%s",err_str(run_err));
-						printf("\n%s\n",strerror(err_errno));
+						printf("\n%s\n",strerror(errno));
+						rclose();
 					} else {
-						printf("\n%s",result);
+						printf("\n");
+						fwrite(out.data, 1, out.len, stdout);
 						printf("\n%s",str_table[STR_REMOTE_PROMPT]);
 					}
 					fflush(stdout);
 				}
 			}
 		}
-		if(result) free(result);
+
+		// deferred filesystem work, one bounded unit per pass
+		background = (shell_server.vfs == VFS_STATUS_ON) ? cnbackground() : 0;
 
 	}
+	outbuf_free(&out);
 	clean_svr();
 	if(!run_err) run_err = shell_server.status;
 	return run_err;
@@ -278,6 +287,8 @@ void clean_svr(void) {
 		rclose();
 
 	}
+	cnsession_close(shell_server.remote);
+	cnsession_close(shell_server.local);
 	cnumount();
 	blockdev_detach();
 }
@@ -1,10 +1,15 @@
 
 #include <cdnwsh.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "tar.h"
 
 const char *str_table[] = {
 		"\ncdnw-shell> \0",
-		"Available commands: cat cd close connect exit export help import ls mkdir mkfs open read rm rmdir seek tree write\0",
+		"Available commands: cat cd close connect exit export export-tar fallocate fsck help import import-tar ls mkdir mkfs open read rm rmdir seek tree truncate write\0",
 		"Exiting...\0",
 		"5560\0",
 		"\nremote-cdnw> \0",
@@ -58,9 +63,22 @@ struct cmd_entry sh_cmds[] = {
 				"EXIT will disconnect the client connection.\nIf used at a local prompt, "
 				"EXIT will close the shell and stop the client or server\0"},
 		{"export\0",sh_export,"Usage: export <internal_filename> <external_filename>\0"},
+		{"export-tar\0",sh_export_tar,"Usage: export-tar <internal_dir> <external_filename|->\n"
+				"Writes the whole directory tree as a tar archive; - writes it to standard output,\n"
+				"which is not available at a remote server prompt\0"},
+		{"fallocate\0",sh_fallocate,"Usage: fallocate <fd> <byte_offset> <length>\n"
+				"Reserves disk blocks for the range ahead of writing it; they read as zeros until written\0"},
+		{"fsck\0",sh_fsck,"Usage: fsck [-r]\n"
+				"Checks the bitmaps, block maps and directory tree; -r repairs what it finds\0"},
 		{"help\0",sh_help,"Usage: 'help [<cmd>]' or '<cmd> --help'\0"},
-		{"import\0",sh_import,"Usage: import <external_filename> <internal_filename>\0"},
-		{"ls\0",sh_ls,"Usage: ls\0"},
+		{"import\0",sh_import,"Usage: import <external_filename> <internal_filename>\n"
+				"       import -r <external_dir> <internal_dir>\n"
+				"-r copies a whole directory tree\0"},
+		{"import-tar\0",sh_import_tar,"Usage: import-tar <external_filename|-> <internal_dir>\n"
+				"Unpacks a tar archive into the directory; - reads it from standard input,\n"
+				"which is not available at a remote server prompt\0"},
+		{"ls\0",sh_ls,"Usage: ls [<dir> [<cookie>]]\n"
+				"Lists a page of names; a large directory ends the page with the cookie to resume from\0"},
 		{"mkdir\0",sh_mkdir,"Usage: mkdir <dir_name>\0"},
 		{"mkfs\0",sh_mkfs,"Usage: mkfs\n Check and mount the virtual file system\0"},
 		{"open\0",sh_open,"Usage: open <filename> <R/W>\n"
@@ -71,140 +89,141 @@ struct cmd_entry sh_cmds[] = {
 		{"rm\0",sh_rm,"Usage: rm <filename>\0"},
 		{"rmdir\0",sh_rmdir,"Usage: rmdir <dir name>\0"},
 		{"seek\0",sh_seek,"Usage: seek <fd> <byte_offset>\n"
-				"A negative byte offset will move back instead of forward in the file\0"},
+				"Moves the cursor to byte_offset bytes from the start of the file\0"},
 		{"tree\0",sh_tree,"Usage: tree\0"},
+		{"truncate\0",sh_truncate,"Usage: truncate <filename> <size>\n"
+				"Growing a file leaves a hole that reads as zeros and uses no disk blocks\0"},
 		{"write\0",sh_write,"Usage: write <fd> <string>\0"}
 };
 
-char* cat_num(char* a, int n) {
-	int len = 5;
-	if(n>10000 && n<100000000) {
-		len = 9;
-	} else {
-		len = 16;
-	}
-	char* b = calloc(1,len);
-	sprintf(b,"%d",n);
-	strcat(a,b);
-	free(b);
-	return a;
-}
-
-// incomplete function
-// need to make case insensitive
-// need quote handling
-char* run_cmd(char *cmdstr) {
-	char *cmd_argv[SH_MAX_ARGS];
-	char *cmd_tok=NULL;
-	int cmd_argc = 0;
-	char *result=NULL;
-	int last_stop = 0;
-	int qopen = 0;
-	int dqopen = 0;
-	//int qseen = 0;
-
-	int cmdstr_len = strlen(cmdstr);
-	for(int i = 0; i<cmdstr_len; i++) {
-		char c = cmdstr[i];
-		if (c == '\"' || c == '\'') {
-			// quote handling
-			if(c=='\"') {
-				if(dqopen) dqopen=0;
-				else {
-					dqopen=1;
-					if(i==last_stop+1) {
-						last_stop += 1;
-					}
-					//qseen=1;
-				}
-			} else if (c=='\'') {
-				if(qopen) qopen=0;
-				else {
-					qopen=1;
-					if(i==last_stop+1) {
-						last_stop += 1;
-					}
-					//qseen=1;
-				}
+//Splits a command line into words in place, pointing argv into the line.
+//Quotes group words and are removed; a backslash outside single quotes
+//takes the next character as it is. The line ends at a newline. Returns
+//the number of words, or SH_ERR_BADARGS for an unterminated quote or more
+//than max words.
+int sh_tokenize(char* line, char* argv[], int max) {
+	char* src = line;
+	char* dst = line;
+	int argc = 0;
+
+	while(1) {
+		while(*src == ' ' || *src == '\t') src++;
+		if(*src == '\0' || *src == '\n' || *src == '\r') break;
+		if(argc == max) return SH_ERR_BADARGS;
+		argv[argc++] = dst;
+
+		char quote = 0;
+		for(; *src != '\0' && *src != '\n' && *src != '\r'; src++) {
+			char c = *src;
+			if(!quote && (c == ' ' || c == '\t')) break;
+			if(!quote && (c == '\"' || c == '\'')) {
+				quote = c;
+				continue;
 			}
-		} else if ((c == ' ' && !dqopen && !qopen) || c == '\n' || c == '\r'){
-			int idx = i;
-			if(i>0) {
-				char *chk = (cmdstr+(i-1));
-				if((chk[0]=='\"' || chk[0]=='\'') && !dqopen && !qopen) {
-					idx--;
-				}
+			if(c == quote) {
+				quote = 0;
+				continue;
 			}
-			if(cmd_tok) {
-				cmd_argv[cmd_argc] = calloc(1,sizeof(char)*(idx-last_stop));
-				strncpy(cmd_argv[cmd_argc],cmdstr+last_stop+1,(idx-last_stop-1));
-				(cmd_argv[cmd_argc])[idx-last_stop-1] = '\0';
-
-				cmd_argc++;
-			} else {
-				cmd_tok = calloc(1,sizeof(char)*(idx+1));
-				strncpy(cmd_tok,cmdstr,idx);
-				cmd_tok[idx] = '\0';
+			if(c == '\\' && quote != '\'' && src[1] != '\0' && src[1] != '\n' && src[1] != '\r') {
+				c = *++src;
 			}
-
-			last_stop = i;
-		}
-		if(c=='\n'||c=='\r') {
-			break;
+			*dst++ = c;
 		}
+		if(quote) return SH_ERR_BADARGS;
+		char stop = *src;
+		*dst++ = '\0';		//The word never outruns the line, so this is at or behind src
+		if(stop != ' ' && stop != '\t') break;
+		src++;
+	}
+	return argc;
+}
+
+static int sh_slot[SH_HASH_SLOTS];		// command index + 1, 0 = empty
+static uint32_t sh_seed;
+static int sh_hashed;		// 0 if no seed was found, lookups search the table
+static pthread_once_t sh_hash_once = PTHREAD_ONCE_INIT;
 
+static uint32_t sh_hash(const char* name, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for(; *name; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619u;
 	}
+	return h >> (32 - SH_HASH_BITS);		//The low bits of FNV mix poorly
+}
 
-	if(cmd_tok && cmd_tok[0] && strncmp(cmd_tok,"\n",1) && strncmp(cmd_tok,"\r",1) && strncmp(cmd_tok," ",1)) {
+//Finds a seed that gives every command its own slot, so dispatch is one
+//hash and one compare
+static void sh_hash_init(void) {
+	for(uint32_t seed = 0; seed < SH_HASH_TRIES; seed++) {
 		int i;
+		memset(sh_slot, 0, sizeof(sh_slot));
 		for(i=0; i<SH_CMD_NUM; i++) {
-			if(!strcmp(cmd_tok,sh_cmds[i].name)) {
-				result = sh_cmds[i].sh_cmd(cmd_argc, cmd_argv);
-				break;
-			}
+			uint32_t h = sh_hash(sh_cmds[i].name, seed);
+			if(sh_slot[h]) break;
+			sh_slot[h] = i + 1;
 		}
-		if(!result) {
-			result = mesg(result,SH_ERR_BADCMD,STR_TYPE_ERR,0);
+		if(i == SH_CMD_NUM) {
+			sh_seed = seed;
+			sh_hashed = 1;
+			return;
 		}
-	} else {
-		result = NULL;
 	}
-	if(cmd_tok) free(cmd_tok);
-	int j=0;
-	for(j=0;j<cmd_argc;j++) {
-		free(cmd_argv[j]);
+}
+
+//Returns the index of the named command in sh_cmds, or -1
+int sh_lookup(const char* name) {
+	pthread_once(&sh_hash_once, sh_hash_init);
+	if(!sh_hashed) {
+		for(int i=0; i<SH_CMD_NUM; i++) {
+			if(!strcmp(name, sh_cmds[i].name)) return i;
+		}
+		return -1;
 	}
+	int idx = sh_slot[sh_hash(name, sh_seed)] - 1;
+	if(idx < 0 || strcmp(name, sh_cmds[idx].name)) return -1;
+	return idx;
+}
 
-	return result;
+//Runs one command line, appending what it prints to out. The line is
+//split in place, so nothing is allocated to parse or dispatch it. Returns
+//the command's result, or SH_NO_CMD for a blank line.
+sh_err run_cmd(session* sess, char *cmdstr, outbuf* out) {
+	char *cmd_argv[SH_MAX_ARGS + 1];		//The command and its arguments
+
+	int words = sh_tokenize(cmdstr, cmd_argv, SH_MAX_ARGS + 1);
+	if(words < 0) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+	if(words == 0) return SH_NO_CMD;
+	int cmd = sh_lookup(cmd_argv[0]);
+	if(cmd < 0) return mesg(out,SH_ERR_BADCMD,STR_TYPE_ERR);
+	return sh_cmds[cmd].sh_cmd(sess, words - 1, cmd_argv + 1, out);
 }
 
-char* sh_exit(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_exit(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
+	(void)(sess);
 	(void)(cmd_argc);
 	(void)(cmd_argv);
 	if(shell_client.status == CLIENT_STATUS_OPEN) {
 		cmd_err = rclose();
 		if(cmd_err<0) {
-			char* str_errno = strerror(errno);
-			result = mesg(result,SH_ERR_RCLOSE,STR_TYPE_ERR,strlen(str_errno));
-			strcat(result, "\n");
-			strcat(result, str_errno);
+			mesg(out,SH_ERR_RCLOSE,STR_TYPE_ERR);
+			outbuf_printf(out, "\n%s", strerror(errno));
 		} else {
-			result = mesg(result,STR_SUCCESS_REXIT,STR_TYPE_STR,0);
+			mesg(out,STR_SUCCESS_REXIT,STR_TYPE_STR);
 		}
 	} else {
 		shell_server.status = SVR_STATUS_EXIT;
-		result = mesg(result,STR_EXIT,STR_TYPE_STR,0);
+		mesg(out,STR_EXIT,STR_TYPE_STR);
 	}
 
-	return result;
+	return cmd_err;
 }
 
 
-char* sh_mkfs(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_mkfs(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
+	(void)(sess);
 	(void)(cmd_argc);
 	(void)(cmd_argv);
 	cmd_err = blockdev_attach();
@@ -213,33 +232,31 @@ char* sh_mkfs(int cmd_argc, char* cmd_argv[]) {
 
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
 			cmd_err=cnmount();
 			if(cmd_err<0) {
 				// error
-				result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+				return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 			} else {
 				shell_server.vfs = VFS_STATUS_ON;
-				result = mesg(result,STR_SUCCESS_MKFS,STR_TYPE_STR,0);
+				mesg(out,STR_SUCCESS_MKFS,STR_TYPE_STR);
 			}
 		}
 	} else {
-		result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+		return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_open(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_open(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_OPEN].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_OPEN].help);
+		return mesg(out,SH_CMD_OPEN,STR_TYPE_HELP);
 	} else {
-		int16_t f_fd = -1;
+		int32_t f_fd = -1;
 		int mode = 0;
 		if(cmd_argv[1][0]=='r') mode = FD_READ;
 		else if(cmd_argv[1][0]=='w') mode = FD_WRITE;
@@ -250,414 +267,480 @@ char* sh_open(int cmd_argc, char* cmd_argv[]) {
 		}
 		else cmd_err = -1;
 		if(cmd_err>=0) {
-			f_fd = cnopen(cwd, cmd_argv[0], mode);
+			f_fd = cnopen(sess, sess->cwd, cmd_argv[0], mode);
 			cmd_err = f_fd;
 		}
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("SUCCESS, fd = ")+5));
-			strcpy(result, "SUCCESS, fd = ");
-			cat_num(result, f_fd);
+			outbuf_printf(out, "%s%d", str_table[STR_SUCCESS_OPEN], f_fd);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_close(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_close(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_CLOSE].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_CLOSE].help);
+		return mesg(out,SH_CMD_CLOSE,STR_TYPE_HELP);
 	} else {
-		int16_t f_fd = (int16_t)strtol(cmd_argv[0],(char **)NULL, 10);
-		cmd_err = cnclose(f_fd);
+		int32_t f_fd = (int32_t)strtol(cmd_argv[0],(char **)NULL, 10);
+		cmd_err = cnclose(sess, f_fd);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("File closed.")+2));
-			strcpy(result, "File closed.");
+			mesg(out,STR_SUCCESS_CLOSE,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_read(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
-	sh_err cmd_err = SH_ERR_SUCCESS;
-	if(chk_vfs(&result)<0) return result;
+//Parses a decimal byte count no larger than max. Returns -1 for an empty,
+//signed or non-numeric word, or a count past max.
+static int8_t sh_count(const char* word, uint32_t max, uint32_t* count) {
+	char* end;
+	if(*word < '0' || *word > '9') return -1;
+	errno = 0;
+	unsigned long val = strtoul(word, &end, 10);
+	if(*end != '\0' || errno == ERANGE || val > max) return -1;
+	*count = (uint32_t)val;
+	return 0;
+}
+
+//The bytes go out as they are, NULs and all
+sh_err sh_read(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_READ].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_READ].help);
+		return mesg(out,SH_CMD_READ,STR_TYPE_HELP);
 	} else {
-		size_t bytes = (size_t)strtol(cmd_argv[1],(char **)NULL, 10);
-		result = calloc(1,sizeof(char)*bytes);
-		int16_t f_fd = (int16_t)strtol(cmd_argv[0],(char **)NULL, 10);
+		uint32_t bytes;
+		if(sh_count(cmd_argv[1], SH_READ_MAX, &bytes) < 0) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+		int32_t f_fd = (int32_t)strtol(cmd_argv[0],(char **)NULL, 10);
 		size_t bytes_read = 0;
-		bytes_read = cnread((uint8_t*)result, bytes, f_fd);
-		if(bytes_read==0) {
-			cmd_err = SH_ERR_UNK;
+		if(outbuf_reserve(out, bytes) == 0) {
+			bytes_read = cnread(sess, (uint8_t*)out->data + out->len, bytes, f_fd);
 		}
-		if(cmd_err<0) {
+		if(bytes_read==0) {
 			// error
-			free(result);
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		}
+		outbuf_commit(out, bytes_read);
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_write(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
-	sh_err cmd_err = SH_ERR_SUCCESS;
-
-	if(chk_vfs(&result)<0) return result;
+sh_err sh_write(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_WRITE].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_WRITE].help);
+		return mesg(out,SH_CMD_WRITE,STR_TYPE_HELP);
 	} else {
 		size_t bytes = strlen(cmd_argv[1]);
-		int16_t f_fd = (int16_t)strtol(cmd_argv[0],(char **)NULL, 10);
+		int32_t f_fd = (int32_t)strtol(cmd_argv[0],(char **)NULL, 10);
 		size_t bytes_write = 0;
-		bytes_write = cnwrite((uint8_t*)cmd_argv[1], bytes, f_fd);
+		bytes_write = cnwrite(sess, (uint8_t*)cmd_argv[1], bytes, f_fd);
 		if(bytes_write==0) {
-			cmd_err = SH_ERR_UNK;
-		}
-		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("Write successful.")+2));
-			strcpy(result, "Write successful.");
+			mesg(out,STR_SUCCESS_WRITE,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_seek(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_seek(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_SEEK].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_SEEK].help);
+		return mesg(out,SH_CMD_SEEK,STR_TYPE_HELP);
 	} else {
-		uint32_t offset = (int16_t)strtol(cmd_argv[1],(char **)NULL, 10);
-		int16_t f_fd = (int16_t)strtol(cmd_argv[0],(char **)NULL, 10);
-		cmd_err = cnseek(f_fd, offset);
+		uint32_t offset;
+		if(sh_count(cmd_argv[1], UINT32_MAX, &offset) < 0) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+		int32_t f_fd = (int32_t)strtol(cmd_argv[0],(char **)NULL, 10);
+		cmd_err = cnseek(sess, f_fd, offset);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("Seek successful.")+2));
-			strcpy(result, "Seek successful.");
+			mesg(out,STR_SUCCESS_SEEK,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_mkdir(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_fallocate(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
-	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_MKDIR].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_MKDIR].help);
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 3) {
+		return mesg(out,SH_CMD_FALLOCATE,STR_TYPE_HELP);
 	} else {
-		cmd_err = cnmkdir(cmd_argv[0]);
+		int32_t f_fd = (int32_t)strtol(cmd_argv[0],(char **)NULL, 10);
+		uint32_t offset, len;
+		if(sh_count(cmd_argv[1], UINT32_MAX, &offset) < 0 || sh_count(cmd_argv[2], UINT32_MAX, &len) < 0) {
+			return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+		}
+		cmd_err = cnfallocate(sess, f_fd, offset, len);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("Directory created.")+2));
-			strcpy(result, "Directory created.");
+			outbuf_printf(out, "Space allocated.");
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_rmdir(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_fsck(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
+	fsck_report rep;
+	char summary[1024];
+	(void)(sess);
 
-	if(chk_vfs(&result)<0) return result;
-	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_RMDIR].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_RMDIR].help);
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc > 1 || (cmd_argc == 1 && strcmp(cmd_argv[0], "-r") != 0)) {
+		return mesg(out,SH_CMD_FSCK,STR_TYPE_HELP);
 	} else {
-		(void)cmd_argv;
-		cmd_err = cnrmdir(cmd_argv[0]);
+		cmd_err = cnfsck(cmd_argc == 1, &rep);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("Directory removed.")+2));
-			strcpy(result, "Directory removed.");
+			fsck_summary(&rep, summary, sizeof(summary));
+			outbuf_printf(out, "%s", summary);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_rm(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_mkdir(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_RM].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_RM].help);
+		return mesg(out,SH_CMD_MKDIR,STR_TYPE_HELP);
 	} else {
-		(void)cmd_argv;
-		//cmd_err = cnrm(cmd_argv[0]);
+		cmd_err = cnmkdir(sess, cmd_argv[0]);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("File removed.")+2));
-			strcpy(result, "File removed.");
+			mesg(out,STR_SUCCESS_MKDIR,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_cat(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_rmdir(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_CAT].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_CAT].help);
+		return mesg(out,SH_CMD_RMDIR,STR_TYPE_HELP);
 	} else {
-		result = calloc(1,sizeof(char)*4096);
-		cmd_err = cncat(cmd_argv[0],result);
+		cmd_err = cnrmdir(sess, cmd_argv[0]);
 		if(cmd_err<0) {
 			// error
-			free(result);
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+		} else {
+			mesg(out,STR_SUCCESS_RMDIR,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_cd(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_rm(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_CD].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_CD].help);
+		return mesg(out,SH_CMD_RM,STR_TYPE_HELP);
 	} else {
-		cmd_err = cncd(cmd_argv[0]);
+		cmd_err = cnunlink(sess, cmd_argv[0]);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("Directory changed.")+2));
-			strcpy(result, "Directory changed.");
+			outbuf_printf(out, "File removed.");
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_ls(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_truncate(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
-	if(cmd_argc>1) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_LS].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_LS].help);
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 2) {
+		return mesg(out,SH_CMD_TRUNCATE,STR_TYPE_HELP);
 	} else {
-		result = calloc(1,sizeof(char)*4096);
-		if(cmd_argc==1) {
-			cmd_err = cnls(cmd_argv[0],result);
+		uint32_t size;
+		if(sh_count(cmd_argv[1], UINT32_MAX, &size) < 0) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+		cmd_err = cntruncate(sess, cmd_argv[0], size);
+		if(cmd_err<0) {
+			// error
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			cmd_err = cnls("",result);
+			outbuf_printf(out, "File truncated.");
 		}
+	}
+	return SH_ERR_SUCCESS;
+}
+
+sh_err sh_cat(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	sh_err cmd_err = SH_ERR_SUCCESS;
+
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 1) {
+		return mesg(out,SH_CMD_CAT,STR_TYPE_HELP);
+	} else {
+		size_t start = out->len;
+		cmd_err = cncat(sess, cmd_argv[0], out);
 		if(cmd_err<0) {
 			// error
-			free(result);
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			outbuf_truncate(out, start);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_pwd(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_cd(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
+
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 1) {
+		return mesg(out,SH_CMD_CD,STR_TYPE_HELP);
+	} else {
+		cmd_err = cncd(sess, cmd_argv[0]);
+		if(cmd_err<0) {
+			// error
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+		} else {
+			mesg(out,STR_SUCCESS_CD,STR_TYPE_STR);
+		}
+	}
+	return SH_ERR_SUCCESS;
+}
+
+sh_err sh_ls(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc>2) {
+		return mesg(out,SH_CMD_LS,STR_TYPE_HELP);
+	} else {
+		const char* dir = (cmd_argc>0) ? cmd_argv[0] : "";
+		uint32_t cookie = (cmd_argc>1) ? (uint32_t)strtoul(cmd_argv[1],(char **)NULL, 10) : 0;
+		size_t start = out->len;
+		if(outbuf_reserve(out, SH_LS_PAGE) < 0
+				|| cnls_page(sess, dir, &cookie, out->data + start, SH_LS_PAGE - SH_LS_MORE) < 0) {
+			// error
+			outbuf_truncate(out, start);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+		}
+		outbuf_commit(out, strlen(out->data + start));
+		if(cookie != 0) {
+			outbuf_printf(out, "-- more: ls %s %u", (strlen(dir) > 0) ? dir : ".", cookie);
+		}
+	}
+	return SH_ERR_SUCCESS;
+}
+
+sh_err sh_pwd(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	sh_err cmd_err = SH_ERR_SUCCESS;
+	char cwd[SH_MAX_STR];
 	(void)cmd_argv;
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc>0) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_PWD].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_PWD].help);
+		return mesg(out,SH_CMD_PWD,STR_TYPE_HELP);
 	} else {
-		result = calloc(1,sizeof(char)*256);
-		cmd_err = cnpwd(result);
+		cmd_err = cnpwd(sess, cwd);
 		if(cmd_err<0) {
 			// error
-			free(result);
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		}
+		outbuf_printf(out, "%s", cwd);
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_tree(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_tree(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 	(void)(cmd_argv);
 
-	if(chk_vfs(&result)<0) return result;
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc>0) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_TREE].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_TREE].help);
+		return mesg(out,SH_CMD_TREE,STR_TYPE_HELP);
 	} else {
-		result = calloc(1,sizeof(char)*4096);
-		cmd_err = cntree(result);
+		size_t start = out->len;
+		cmd_err = cntree(sess, out);
 		if(cmd_err<0) {
 			// error
-			free(result);
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			outbuf_truncate(out, start);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_import(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_import(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
-	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_IMPORT].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_IMPORT].help);
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc == 3 && strcmp(cmd_argv[0], "-r") == 0) {
+		int32_t files = cnimport_tree(sess, cmd_argv[1], cmd_argv[2]);
+		if(files<0) {
+			// error
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+		} else {
+			outbuf_printf(out, "%d files imported.", files);
+		}
+	} else if(cmd_argc != 2) {
+		return mesg(out,SH_CMD_IMPORT,STR_TYPE_HELP);
 	} else {
-		(void)cmd_argv;
-		cmd_err = cnimport(cmd_argv[0], cmd_argv[1]);
+		cmd_err = cnimport(sess, cmd_argv[0], cmd_argv[1]);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("File imported.")+2));
-			strcpy(result, "File imported.");
+			mesg(out,STR_SUCCESS_IMPORT,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_export(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_export(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
 
-	if(chk_vfs(&result)<0) return result;
-	if(chk_vfs(&result)) return result;
-
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_EXPORT].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_EXPORT].help);
+		return mesg(out,SH_CMD_EXPORT,STR_TYPE_HELP);
 	} else {
-		(void)cmd_argv;
-		cmd_err = cnimport(cmd_argv[0], cmd_argv[1]);
+		cmd_err = cnexport(sess, cmd_argv[0], cmd_argv[1]);
 		if(cmd_err<0) {
 			// error
-			result = mesg(result,SH_ERR_UNK,STR_TYPE_ERR,0);
+			return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
 		} else {
-			result = calloc(1,sizeof(char)*(strlen("File exported.")+2));
-			strcpy(result, "File exported.");
+			mesg(out,STR_SUCCESS_EXPORT,STR_TYPE_STR);
 		}
 	}
-	return result;
+	return SH_ERR_SUCCESS;
+}
+
+//The server's standard streams are its own terminal, not a remote client's,
+//so only the local session may stream an archive through them
+static bool sh_is_remote(const session* sess) {
+	return sess != NULL && sess == shell_server.remote;
+}
+
+sh_err sh_import_tar(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	int h_fd = -1;
+	int32_t entries = -1;
+
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 2) {
+		return mesg(out,SH_CMD_IMPORT_TAR,STR_TYPE_HELP);
+	}
+	if(strcmp(cmd_argv[0], "-") == 0 && sh_is_remote(sess)) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+	h_fd = strcmp(cmd_argv[0], "-") ? open(cmd_argv[0], O_RDONLY) : STDIN_FILENO;
+	if(h_fd >= 0) {
+		entries = tar_import(sess, h_fd, cmd_argv[1]);
+		if(h_fd != STDIN_FILENO) close(h_fd);
+	}
+	if(entries<0) {
+		// error
+		return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+	}
+	outbuf_printf(out, "%d entries imported.", entries);
+	return SH_ERR_SUCCESS;
 }
 
-char* sh_connect(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_export_tar(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	int h_fd = -1;
+	int32_t entries = -1;
+
+	if(chk_vfs(out)<0) return SH_ERR_NOVFS;
+	if(cmd_argc != 2) {
+		return mesg(out,SH_CMD_EXPORT_TAR,STR_TYPE_HELP);
+	}
+	if(strcmp(cmd_argv[1], "-") == 0 && sh_is_remote(sess)) return mesg(out,SH_ERR_BADARGS,STR_TYPE_ERR);
+	h_fd = strcmp(cmd_argv[1], "-") ? open(cmd_argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644) : STDOUT_FILENO;
+	if(h_fd >= 0) {
+		entries = tar_export(sess, cmd_argv[0], h_fd);
+		if(h_fd != STDOUT_FILENO) close(h_fd);
+	}
+	if(entries<0) {
+		// error
+		return mesg(out,SH_ERR_UNK,STR_TYPE_ERR);
+	}
+	outbuf_printf(out, "%d entries exported.", entries);
+	return SH_ERR_SUCCESS;
+}
+
+sh_err sh_connect(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
 	sh_err cmd_err = SH_ERR_SUCCESS;
+	(void)(sess);
 
 	if(cmd_argc != 2) {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_CONNECT].help)+2));
-		strcpy(result, sh_cmds[SH_CMD_CONNECT].help);
+		return mesg(out,SH_CMD_CONNECT,STR_TYPE_HELP);
 	} else {
 		cmd_err = rconnect(cmd_argv[0],cmd_argv[1]);
 		if(cmd_err>=0) {
-			result = calloc(1,sizeof(char)*(strlen("Connected to server: ")+strlen(cmd_argv[0])+2));
-			strcpy(result, "Connected to server: ");
-			strcat(result, cmd_argv[0]);
+			outbuf_printf(out, "%s%s", str_table[STR_SUCCESS_CONNECT], cmd_argv[0]);
 		} else {
-			char* str_errno = strerror(errno);
-			result = calloc(1,sizeof(char)*(strlen(err_str(SH_ERR_RCONNECT))+strlen(cmd_argv[0])+strlen(str_errno)+2));
-			strcpy(result, err_str(SH_ERR_RCONNECT));
-			strcat(result, cmd_argv[0]);
-			strcat(result, "\n");
-			strcat(result, str_errno);
+			outbuf_printf(out, "%s%s\n%s", err_str(SH_ERR_RCONNECT), cmd_argv[0], strerror(errno));
 		}
 	}
 
-	return result;
+	return cmd_err;
 }
 
-char* sh_help(int cmd_argc, char* cmd_argv[]) {
-	char* result = NULL;
+sh_err sh_help(session* sess, int cmd_argc, char* cmd_argv[], outbuf* out) {
+	(void)(sess);
 
 	if(cmd_argc) {
 		int i;
 		for(i=0; i<SH_CMD_NUM; i++) {
 			if(!strcmp(cmd_argv[0],sh_cmds[i].name)) {
-				result = calloc(1,sizeof(char)*(strlen(sh_cmds[i].help)));
-				strcpy(result, sh_cmds[i].help);
-				break;
+				return mesg(out,i,STR_TYPE_HELP);
 			}
 		}
-		if(!result) {
-			result = mesg(result,SH_ERR_BADCMD,STR_TYPE_ERR,0);
-		}
+		return mesg(out,SH_ERR_BADCMD,STR_TYPE_ERR);
 	} else {
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[SH_CMD_HELP].help)+strlen(str_table[STR_CMDS])+2));
-		strcpy(result, sh_cmds[SH_CMD_HELP].help);
-		strcat(result, "\n");
-		strcat(result, str_table[STR_CMDS]);
+		outbuf_printf(out, "%s\n%s", sh_cmds[SH_CMD_HELP].help, str_table[STR_CMDS]);
 	}
 
-	return result;
+	return SH_ERR_SUCCESS;
 }
 
-sh_err chk_vfs(char** result) {
+sh_err chk_vfs(outbuf* out) {
 
 	sh_err vfs_err = SH_ERR_SUCCESS;
 	if(shell_server.vfs != VFS_STATUS_ON) {
-		*result = calloc(1,sizeof(char)*(strlen(err_str(SH_ERR_NOVFS))+2));
-		strcpy(*result,err_str(SH_ERR_NOVFS));
-		vfs_err = SH_ERR_NOVFS;
+		vfs_err = mesg(out,SH_ERR_NOVFS,STR_TYPE_ERR);
 	}
 	return vfs_err;
 }
 
-char* mesg(char* result, int idx, int type, int extra) {
-
+//Appends a string from one of the tables. Returns the error code for error
+//strings, so a command can report and fail in one step, else SH_ERR_SUCCESS.
+sh_err mesg(outbuf* out, int idx, int type) {
 
 	if(type==STR_TYPE_STR) {
 		// strings table
-		result = calloc(1,sizeof(char)*(strlen(str_table[idx])+extra+2));
-		strcpy(result, str_table[idx]);
+		outbuf_append(out, str_table[idx], strlen(str_table[idx]));
 	} else if(type==STR_TYPE_HELP){
 		// help strings
-		result = calloc(1,sizeof(char)*(strlen(sh_cmds[idx].help)+extra+2));
-		strcpy(result, sh_cmds[idx].help);
+		outbuf_append(out, sh_cmds[idx].help, strlen(sh_cmds[idx].help));
 	} else {
 		// error strings
-		result = calloc(1,sizeof(char)*(strlen(err_str(idx))+extra+2));
-		strcpy(result,err_str(idx));
+		outbuf_append(out, err_str(idx), strlen(err_str(idx)));
+		return idx;
 	}
-	return result;
+	return SH_ERR_SUCCESS;
 }
-
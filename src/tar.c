@@ -0,0 +1,538 @@
+/*
+ * tar.c
+ *
+ *  Export writes a directory's files, then its subdirectories, each file as
+ *  a header followed by its data taken from read views. Within a directory
+ *  the files go out in the order of their first blocks, so the device is
+ *  read front to back rather than in name order. Everything passes through
+ *  one TAR_BUF_BYTES buffer on its way to the host.
+ *
+ *  Import reads the stream through a buffer of the same size and writes
+ *  each file's data straight out of it. Paths are taken relative to the
+ *  target directory; absolute paths lose their leading slash and entries
+ *  with ".." components are refused. Only regular files and directories
+ *  are created, anything else is skipped over.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "tar.h"
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} tar_header;
+
+_Static_assert(sizeof(tar_header) == TAR_BLOCK, "tar_header must fill one tar block");
+
+#define TAR_FILE		'0'
+#define TAR_OLD_FILE	'\0'
+#define TAR_DIR			'5'
+
+typedef struct {
+	int fd;
+	uint8_t* buf;
+	uint32_t pos;		// next byte to hand out, input only
+	uint32_t len;		// bytes in buf
+} tar_stream;
+
+typedef struct {
+	char name[256];
+	uint8_t type;
+	iptr first;			// first block of a file, 0 if none
+} tar_entry;
+
+static const uint8_t tar_zeros[TAR_BLOCK];
+
+
+//******** output *******************
+
+static int8_t tar_flush(tar_stream* ts)
+{
+	uint32_t done = 0;
+	while(done < ts->len)
+	{
+		ssize_t n = write(ts->fd, ts->buf + done, ts->len - done);
+		if(n < 0 && errno == EINTR) continue;
+		check(n > 0, "Could not write tar stream");
+		done += n;
+	}
+	ts->len = 0;
+	return 0;
+error:
+	return -1;
+}
+
+static int8_t tar_put(tar_stream* ts, const void* data, uint32_t len)
+{
+	const uint8_t* src = data;
+	while(len > 0)
+	{
+		if(ts->len == TAR_BUF_BYTES && tar_flush(ts) != 0) return -1;
+		uint32_t chunk = MIN(len, TAR_BUF_BYTES - ts->len);
+		memcpy(ts->buf + ts->len, src, chunk);
+		ts->len += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int8_t tar_put_zeros(tar_stream* ts, uint32_t len)
+{
+	while(len > 0)
+	{
+		uint32_t chunk = MIN(len, TAR_BLOCK);
+		if(tar_put(ts, tar_zeros, chunk) != 0) return -1;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static uint32_t tar_padding(uint32_t size)
+{
+	return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static uint32_t tar_checksum(const tar_header* h)
+{
+	const uint8_t* b = (const uint8_t*)h;
+	uint32_t sum = 0;
+	for(uint32_t i = 0; i < TAR_BLOCK; i++)
+	{
+		bool in_chksum = (i >= offsetof(tar_header, chksum) && i < offsetof(tar_header, chksum) + sizeof(h->chksum));
+		sum += in_chksum ? ' ' : b[i];
+	}
+	return sum;
+}
+
+static int8_t tar_put_header(tar_stream* ts, const char* path, char type, uint32_t size, uint32_t mtime)
+{
+	tar_header h;
+	size_t len = strlen(path);
+	memset(&h, 0, sizeof(h));
+	if(len <= sizeof(h.name))
+	{
+		memcpy(h.name, path, len);
+	}
+	else
+	{
+		//Split at a slash where both halves fit
+		const char* slash = strchr(path, '/');
+		while(slash != NULL && (size_t)(path + len - slash - 1) > sizeof(h.name))
+		{
+			slash = strchr(slash + 1, '/');
+		}
+		check(slash != NULL && (size_t)(slash - path) <= sizeof(h.prefix) && slash[1] != '\0',
+				"Path too long for tar: %s", path);
+		memcpy(h.prefix, path, slash - path);
+		memcpy(h.name, slash + 1, path + len - slash - 1);
+	}
+	snprintf(h.mode, sizeof(h.mode), "%07o", (type == TAR_DIR) ? 0755 : 0644);
+	snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+	snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+	snprintf(h.size, sizeof(h.size), "%011o", size);
+	snprintf(h.mtime, sizeof(h.mtime), "%011o", mtime);
+	h.typeflag = type;
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+	snprintf(h.chksum, sizeof(h.chksum), "%06o", tar_checksum(&h));
+	h.chksum[7] = ' ';
+	return tar_put(ts, &h, sizeof(h));
+error:
+	return -1;
+}
+
+
+//******** export *******************
+
+//Files before directories; files by first block, directories by name
+static int tar_entry_cmp(const void* a, const void* b)
+{
+	const tar_entry* x = a;
+	const tar_entry* y = b;
+	if(x->type != y->type) return (x->type == ITYPE_FILE) ? -1 : 1;
+	if(x->type == ITYPE_FILE && x->first != y->first) return (x->first < y->first) ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static int8_t export_file(session* sess, tar_stream* ts, dir_ptr* dir, const char* name, const char* a_path)
+{
+	read_view view;
+	int32_t fd = cnopen(sess, dir, name, FD_READ);
+	check(fd >= 0, "Can not open %s", a_path);
+	uint32_t size = fd_get(sess, fd)->vn->inode.size;
+	check(tar_put_header(ts, a_path, TAR_FILE, size, fd_get(sess, fd)->vn->inode.modified) == 0, "Can not write header of %s", a_path);
+
+	uint32_t offset = 0;
+	while(offset < size)
+	{
+		check(cnread_view(sess, fd, offset, TAR_BUF_BYTES, &view) == 0, "Can not read %s", a_path);
+		if(view.bytes == 0) break;			//Shrank since the header went out
+		for(uint32_t i = 0; i < view.count; i++)
+		{
+			if(tar_put(ts, view.segs[i].base, view.segs[i].len) != 0)
+			{
+				cnread_release(&view);
+				goto error;
+			}
+		}
+		offset += view.bytes;
+		cnread_release(&view);
+	}
+	check(tar_put_zeros(ts, MAX(size, offset) - offset + tar_padding(size)) == 0, "Can not write %s", a_path);
+	cnclose(sess, fd);
+	return 0;
+error:
+	if(fd >= 0) cnclose(sess, fd);
+	return -1;
+}
+
+static int8_t export_dir(session* sess, tar_stream* ts, const char* g_path, const char* a_path, int32_t* count)
+{
+	tar_entry* ents = NULL;
+	uint32_t n = 0;
+	uint32_t cap = 0;
+	dir_entry* entry;
+	char g_child[256];
+	char a_child[256];
+	bool root = (g_path[strlen(g_path) - 1] == '/');
+
+	dir_ptr* dir = cnopendir(sess, g_path);
+	check(dir != NULL, "Can not open directory %s", g_path);
+	while((entry = cnreaddir(dir)))
+	{
+		if(entry->name_len == 1 && entry->name[0] == '.') continue;
+		if(entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.') continue;
+		if(n == cap)
+		{
+			cap = cap ? cap * 2 : 64;
+			tar_entry* grown = realloc(ents, cap * sizeof(tar_entry));
+			check_mem(grown);
+			ents = grown;
+		}
+		memcpy(ents[n].name, entry->name, entry->name_len);
+		ents[n].name[entry->name_len] = '\0';
+		ents[n].type = entry->file_type;
+		inode child_i;
+		inode_read(entry->inode, &child_i);
+		ents[n].first = BLK_LBA(child_i.data0[0]);
+		n++;
+	}
+	qsort(ents, n, sizeof(tar_entry), tar_entry_cmp);
+
+	for(uint32_t i = 0; i < n; i++)
+	{
+		bool is_dir = (ents[i].type == ITYPE_DIR);
+		check(snprintf(a_child, sizeof(a_child), "%s%s%s", a_path, ents[i].name, is_dir ? "/" : "") < (int)sizeof(a_child),
+				"Path too long: %s%s", a_path, ents[i].name);
+		if(!is_dir)
+		{
+			check(export_file(sess, ts, dir, ents[i].name, a_child) == 0, "Could not export %s", a_child);
+		}
+		else
+		{
+			check(snprintf(g_child, sizeof(g_child), "%s%s%s", g_path, root ? "" : "/", ents[i].name) < (int)sizeof(g_child),
+					"Path too long: %s/%s", g_path, ents[i].name);
+			inode child_i;
+			stat_st st;
+			check(cnstat(dir, ents[i].name, &st) == 0, "Can not stat %s", g_child);
+			inode_read(st.inode_id, &child_i);
+			check(tar_put_header(ts, a_child, TAR_DIR, 0, child_i.modified) == 0, "Can not write header of %s", a_child);
+			check(export_dir(sess, ts, g_child, a_child, count) == 0, "Could not export %s", a_child);
+		}
+		(*count)++;
+	}
+	free(ents);
+	cnclosedir(dir);
+	return 0;
+error:
+	free(ents);
+	cnclosedir(dir);
+	return -1;
+}
+
+//Writes the subtree under g_dir to h_fd as a tar stream, with paths
+//relative to g_dir. Returns the number of entries written, or -1.
+int32_t tar_export(session* sess, const char* g_dir, int h_fd)
+{
+	tar_stream ts;
+	int32_t count = 0;
+	memset(&ts, 0, sizeof(ts));
+	ts.fd = h_fd;
+	ts.buf = malloc(TAR_BUF_BYTES);
+	check_mem(ts.buf);
+	check(export_dir(sess, &ts, g_dir, "", &count) == 0, "Could not export %s", g_dir);
+	check(tar_put_zeros(&ts, 2 * TAR_BLOCK) == 0 && tar_flush(&ts) == 0, "Could not finish tar stream");
+	free(ts.buf);
+	return count;
+error:
+	free(ts.buf);
+	return -1;
+}
+
+
+//******** input ********************
+
+//Points data at up to max buffered bytes and consumes them, refilling the
+//buffer when it is empty. Returns 0 at the end of the stream or on error.
+static uint32_t tar_take(tar_stream* ts, uint8_t** data, uint32_t max)
+{
+	if(ts->pos == ts->len)
+	{
+		ssize_t n;
+		do
+		{
+			n = read(ts->fd, ts->buf, TAR_BUF_BYTES);
+		} while(n < 0 && errno == EINTR);
+		ts->pos = 0;
+		ts->len = (n > 0) ? n : 0;
+		if(n <= 0) return 0;
+	}
+	uint32_t chunk = MIN(max, ts->len - ts->pos);
+	*data = ts->buf + ts->pos;
+	ts->pos += chunk;
+	return chunk;
+}
+
+//Copies exactly len bytes, or returns how many there were before the end
+static uint32_t tar_get(tar_stream* ts, void* dst, uint32_t len)
+{
+	uint8_t* out = dst;
+	uint8_t* data;
+	uint32_t got = 0;
+	while(got < len)
+	{
+		uint32_t n = tar_take(ts, &data, len - got);
+		if(n == 0) break;
+		memcpy(out + got, data, n);
+		got += n;
+	}
+	return got;
+}
+
+static int8_t tar_skip(tar_stream* ts, uint64_t len)
+{
+	uint8_t* data;
+	while(len > 0)
+	{
+		uint32_t n = tar_take(ts, &data, MIN(len, TAR_BUF_BYTES));
+		if(n == 0) return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint64_t tar_octal(const char* field, size_t len)
+{
+	uint64_t value = 0;
+	size_t i = 0;
+	while(i < len && field[i] == ' ') i++;
+	for(; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+	{
+		value = value * 8 + (field[i] - '0');
+	}
+	return value;
+}
+
+//Turns an archive path into one relative to the target directory, without
+//"." components or a trailing slash. Fails on ".." components.
+static int8_t tar_clean_path(const tar_header* h, char* out, size_t out_len)
+{
+	char raw[sizeof(h->prefix) + sizeof(h->name) + 2];
+	char* save;
+	size_t used = 0;
+	if(h->prefix[0] != '\0')
+	{
+		snprintf(raw, sizeof(raw), "%.*s/%.*s", (int)sizeof(h->prefix), h->prefix, (int)sizeof(h->name), h->name);
+	}
+	else
+	{
+		snprintf(raw, sizeof(raw), "%.*s", (int)sizeof(h->name), h->name);
+	}
+	out[0] = '\0';
+	for(char* part = strtok_r(raw, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+	{
+		if(strcmp(part, ".") == 0) continue;
+		check(strcmp(part, "..") != 0, "Refusing path with ..: %s", raw);
+		size_t part_len = strlen(part);
+		check(used + part_len + 2 <= out_len, "Path too long: %s", part);
+		if(used > 0) out[used++] = '/';
+		memcpy(out + used, part, part_len + 1);
+		used += part_len;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+//Creates path and any of its parents that are missing
+static int8_t make_dirs(session* sess, const char* path)
+{
+	char prefix[256];
+	stat_st st;
+	size_t len = strlen(path);
+	size_t start = (path[0] == '/') ? 1 : 0;
+	dir_ptr* dir = cnopendir(sess, start ? "/" : ".");
+	check(dir != NULL, "Can not open the directory above %s", path);
+	for(size_t i = start; i < len; )
+	{
+		const char* slash = strchr(path + i, '/');
+		size_t end = slash ? (size_t)(slash - path) : len;
+		memcpy(prefix, path, end);
+		prefix[end] = '\0';
+		if(end > i && cnstat(dir, prefix + i, &st) != 0)
+		{
+			check(cnmkdir(sess, prefix) == 0, "Can not create directory %s", prefix);
+		}
+		if(end > i)
+		{
+			cnclosedir(dir);
+			dir = cnopendir(sess, prefix);
+			check(dir != NULL, "Can not open directory %s", prefix);
+		}
+		i = end + 1;
+	}
+	cnclosedir(dir);
+	return 0;
+error:
+	cnclosedir(dir);
+	return -1;
+}
+
+//Creates a file from the next size bytes of the stream. Those bytes are
+//consumed even if the file can not be created.
+static int8_t import_file(session* sess, tar_stream* ts, const char* g_path, uint32_t size)
+{
+	char parent[256];
+	const char* base = strrchr(g_path, '/');
+	int32_t fd = -1;
+	dir_ptr* dir = NULL;
+	uint8_t* data;
+	uint32_t left = size;
+
+	memcpy(parent, g_path, base - g_path);
+	parent[base - g_path] = '\0';
+	base++;
+	if(parent[0] == '\0') strcpy(parent, "/");
+	check(make_dirs(sess, parent) == 0, "Can not create %s", parent);
+	dir = cnopendir(sess, parent);
+	check(dir != NULL, "Can not open %s", parent);
+	check(cncreat(dir, base) == 0, "Can not create %s", g_path);
+	fd = cnopen(sess, dir, base, FD_WRITE);
+	check(fd >= 0, "Can not open %s", g_path);
+	if(size > 0)
+	{
+		check(cnfallocate(sess, fd, 0, size) == 0, "Not enough space for %s", g_path);
+	}
+	while(left > 0)
+	{
+		uint32_t n = tar_take(ts, &data, left);
+		check(n > 0, "Tar stream ends inside %s", g_path);
+		left -= n;		//Taken from the stream whether or not it is written
+		check(cnwrite(sess, data, n, fd) == n, "Can not write %s", g_path);
+	}
+	check(cnclose(sess, fd) == 0, "Can not close %s", g_path);
+	cnclosedir(dir);
+	return 0;
+error:
+	if(fd >= 0) cnclose(sess, fd);
+	cnclosedir(dir);
+	tar_skip(ts, left);
+	return -1;
+}
+
+//Recreates the entries of the tar stream on h_fd under g_dir, which is
+//created if needed. An entry that can not be created is skipped and the
+//rest are still read. Returns the number of entries created, or -1 if
+//any failed or the stream is malformed.
+int32_t tar_import(session* sess, int h_fd, const char* g_dir)
+{
+	tar_stream ts;
+	tar_header h;
+	char rel[256];
+	char g_path[256];
+	int32_t count = 0;
+	uint32_t failed = 0;
+	bool root = (g_dir[strlen(g_dir) - 1] == '/');
+	memset(&ts, 0, sizeof(ts));
+	ts.fd = h_fd;
+	ts.buf = malloc(TAR_BUF_BYTES);
+	check_mem(ts.buf);
+	check(make_dirs(sess, g_dir) == 0, "Can not create %s", g_dir);
+
+	while(true)
+	{
+		uint32_t got = tar_get(&ts, &h, sizeof(h));
+		if(got == 0) break;				//Ended without the zero blocks, accept it
+		check(got == sizeof(h), "Tar stream ends inside a header");
+		if(memcmp(&h, tar_zeros, sizeof(h)) == 0) break;
+		check(tar_octal(h.chksum, sizeof(h.chksum)) == tar_checksum(&h), "Bad tar header checksum");
+
+		uint64_t size = tar_octal(h.size, sizeof(h.size));
+		uint64_t data_left = size + tar_padding(size % TAR_BLOCK);
+		bool is_file = (h.typeflag == TAR_FILE || h.typeflag == TAR_OLD_FILE);
+		bool is_dir = (h.typeflag == TAR_DIR);
+		if(!is_file && !is_dir)			//Links, devices and the like
+		{
+			check(tar_skip(&ts, data_left) == 0, "Tar stream ends early");
+			continue;
+		}
+
+		int8_t res = -1;
+		bool cleaned = (tar_clean_path(&h, rel, sizeof(rel)) == 0);
+		if(cleaned && is_dir && rel[0] == '\0')		//The target directory itself
+		{
+			check(tar_skip(&ts, data_left) == 0, "Tar stream ends early");
+			continue;
+		}
+		if(cleaned && rel[0] != '\0' && (is_dir || size <= UINT32_MAX)
+				&& snprintf(g_path, sizeof(g_path), "%s%s%s", g_dir, root ? "" : "/", rel) < (int)sizeof(g_path))
+		{
+			if(is_dir)
+			{
+				res = make_dirs(sess, g_path);
+			}
+			else
+			{
+				res = import_file(sess, &ts, g_path, size);
+				data_left -= size;		//Consumed either way
+			}
+		}
+		if(res == 0)
+		{
+			count++;
+		}
+		else
+		{
+			log_warn("Could not import %.100s", h.name);
+			failed++;
+		}
+		if(tar_skip(&ts, data_left) != 0)
+		{
+			failed++;
+			break;
+		}
+	}
+	free(ts.buf);
+	return (failed == 0) ? count : -1;
+error:
+	free(ts.buf);
+	return -1;
+}
@@ -0,0 +1,189 @@
+#include <poll.h>
+#include <string.h>
+#include "aio.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(aio);
+
+static session* sess;
+
+TEST_SETUP(aio)
+{
+	blockdev_attach();
+	sess = cnsession_open();
+	cnmkfs();
+	cnmount();
+}
+
+TEST_TEAR_DOWN(aio)
+{
+	cnumount();
+	cnsession_close(sess);
+	blockdev_detach();
+	blockdev_destroy();
+}
+
+//Submits one request and waits for its completion on the eventfd
+static int64_t aio_one(aio_ctx* ctx, aio_req req)
+{
+	aio_cqe cqe;
+	req.user_data = 0xC0FFEE;
+	TEST_ASSERT_EQUAL_UINT32(1, aio_submit(ctx, &req, 1));
+	struct pollfd pfd = { .fd = aio_eventfd(ctx), .events = POLLIN, .revents = 0 };
+	TEST_ASSERT_EQUAL_INT(1, poll(&pfd, 1, 5000));
+	TEST_ASSERT_EQUAL_UINT32(1, aio_reap(ctx, &cqe, 1));
+	TEST_ASSERT_EQUAL_UINT64(0xC0FFEE, cqe.user_data);
+	return cqe.res;
+}
+
+TEST(aio, RequestsShouldCompleteThroughTheEventfd)
+{
+	uint8_t buf[32];
+	aio_ctx* ctx = aio_create(sess, 4);
+	TEST_ASSERT_NOT_NULL(ctx);
+
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_MKDIR, .path = "a" }));
+	int64_t fd = aio_one(ctx, (aio_req){ .op = AIO_OPEN, .path = "a/f", .mode = FD_WRITE });
+	TEST_ASSERT_TRUE(fd >= 0);
+	TEST_ASSERT_EQUAL_INT64(11, aio_one(ctx, (aio_req){ .op = AIO_WRITE, .fd = fd,
+			.buf = (void*)"hello world", .len = 11 }));
+	TEST_ASSERT_EQUAL_INT64(5, aio_one(ctx, (aio_req){ .op = AIO_WRITE, .fd = fd,
+			.buf = (void*)"WORLD", .len = 5, .offset = 6 }));
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_CLOSE, .fd = fd }));
+
+	fd = aio_one(ctx, (aio_req){ .op = AIO_OPEN, .path = "a/f", .mode = FD_READ });
+	TEST_ASSERT_TRUE(fd >= 0);
+	memset(buf, 0, sizeof(buf));
+	TEST_ASSERT_EQUAL_INT64(11, aio_one(ctx, (aio_req){ .op = AIO_READ, .fd = fd,
+			.buf = buf, .len = sizeof(buf) }));
+	TEST_ASSERT_EQUAL_STRING("hello WORLD", (char*)buf);
+	TEST_ASSERT_EQUAL_INT64(-1, aio_one(ctx, (aio_req){ .op = AIO_WRITE, .fd = fd,
+			.buf = buf, .len = 1 }));
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_CLOSE, .fd = fd }));
+
+	TEST_ASSERT_EQUAL_INT64(-1, aio_one(ctx, (aio_req){ .op = AIO_OPEN, .path = "nope/f", .mode = FD_READ }));
+	TEST_ASSERT_EQUAL_INT64(-1, aio_one(ctx, (aio_req){ .op = AIO_RMDIR, .path = "a" }));
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_TRUNCATE, .path = "a/f", .offset = 5 }));
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_UNLINK, .path = "a/f" }));
+	TEST_ASSERT_EQUAL_INT64(0, aio_one(ctx, (aio_req){ .op = AIO_RMDIR, .path = "a" }));
+
+	aio_cqe cqe;
+	TEST_ASSERT_EQUAL_UINT32(0, aio_reap(ctx, &cqe, 1));
+	aio_destroy(ctx);
+}
+
+#define AIO_FILES	64
+
+TEST(aio, ManyRequestsInFlightShouldAllComplete)
+{
+	static char names[AIO_FILES][8];
+	static aio_req reqs[AIO_QUEUE_DEPTH + 1];
+	static aio_cqe cqes[AIO_QUEUE_DEPTH];
+	uint8_t seen[AIO_FILES];
+	uint8_t buf[8];
+	aio_ctx* ctx = aio_create(sess, 8);
+	TEST_ASSERT_NOT_NULL(ctx);
+
+	//Files are opened in parallel
+	memset(reqs, 0, sizeof(reqs));
+	for(uint32_t i = 0; i < AIO_FILES; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "f%u", i);
+		reqs[i] = (aio_req){ .op = AIO_OPEN, .path = names[i], .mode = FD_WRITE, .user_data = i };
+	}
+	TEST_ASSERT_EQUAL_UINT32(AIO_FILES, aio_submit(ctx, reqs, AIO_FILES));
+	int32_t fds[AIO_FILES];
+	memset(seen, 0, sizeof(seen));
+	for(uint32_t done = 0; done < AIO_FILES; )
+	{
+		uint32_t n = aio_wait(ctx, cqes, AIO_QUEUE_DEPTH);
+		TEST_ASSERT_TRUE(n > 0);
+		for(uint32_t c = 0; c < n; c++)
+		{
+			TEST_ASSERT_TRUE(cqes[c].user_data < AIO_FILES && cqes[c].res >= 0);
+			seen[cqes[c].user_data]++;
+			fds[cqes[c].user_data] = cqes[c].res;
+		}
+		done += n;
+	}
+	for(uint32_t i = 0; i < AIO_FILES; i++) TEST_ASSERT_EQUAL_UINT8(1, seen[i]);
+
+	//The queue takes no more than its depth until something is reaped
+	for(uint32_t i = 0; i <= AIO_QUEUE_DEPTH; i++)
+	{
+		uint32_t f = i % AIO_FILES;
+		reqs[i] = (aio_req){ .op = AIO_WRITE, .fd = fds[f], .buf = names[f],
+				.len = 4, .offset = (i / AIO_FILES) * 4, .user_data = i };
+	}
+	TEST_ASSERT_EQUAL_UINT32(AIO_QUEUE_DEPTH, aio_submit(ctx, reqs, AIO_QUEUE_DEPTH + 1));
+	TEST_ASSERT_EQUAL_UINT32(0, aio_submit(ctx, &reqs[AIO_QUEUE_DEPTH], 1));
+	uint32_t done = 0;
+	while(done < AIO_QUEUE_DEPTH)
+	{
+		uint32_t n = aio_wait(ctx, cqes, AIO_QUEUE_DEPTH);
+		TEST_ASSERT_TRUE(n > 0);
+		for(uint32_t c = 0; c < n; c++) TEST_ASSERT_EQUAL_INT64(4, cqes[c].res);
+		done += n;
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, aio_wait(ctx, cqes, AIO_QUEUE_DEPTH));
+
+	for(uint32_t i = 0; i < AIO_FILES; i++)
+	{
+		reqs[i] = (aio_req){ .op = AIO_CLOSE, .fd = fds[i], .user_data = i };
+	}
+	TEST_ASSERT_EQUAL_UINT32(AIO_FILES, aio_submit(ctx, reqs, AIO_FILES));
+	for(done = 0; done < AIO_FILES; )
+	{
+		uint32_t n = aio_wait(ctx, cqes, AIO_QUEUE_DEPTH);
+		for(uint32_t c = 0; c < n; c++) TEST_ASSERT_EQUAL_INT64(0, cqes[c].res);
+		done += n;
+	}
+	aio_destroy(ctx);
+
+	//Each file got its name at every slot the writes covered
+	dir_ptr* dir = cnopendir(sess, "");
+	for(uint32_t i = 0; i < AIO_FILES; i++)
+	{
+		int32_t fd = cnopen(sess, dir, names[i], FD_READ);
+		TEST_ASSERT_TRUE(fd >= 0);
+		for(uint32_t slot = 0; slot < AIO_QUEUE_DEPTH / AIO_FILES; slot++)
+		{
+			TEST_ASSERT_EQUAL_UINT32(4, cnpread(sess, buf, 4, fd, slot * 4));
+			TEST_ASSERT_EQUAL_MEMORY(names[i], buf, 4);
+		}
+		cnclose(sess, fd);
+	}
+	cnclosedir(dir);
+}
+
+TEST(aio, PathsShouldResolveWhileTheCwdChanges)
+{
+	static char names[AIO_FILES][8];
+	static aio_req reqs[AIO_FILES];
+	static aio_cqe cqes[AIO_FILES];
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "d"));
+	aio_ctx* ctx = aio_create(sess, 8);
+	TEST_ASSERT_NOT_NULL(ctx);
+	for(uint32_t i = 0; i < AIO_FILES; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "d/x%u", i);
+		reqs[i] = (aio_req){ .op = AIO_MKDIR, .path = names[i], .user_data = i };
+	}
+	TEST_ASSERT_EQUAL_UINT32(AIO_FILES, aio_submit(ctx, reqs, AIO_FILES));
+	for(uint32_t i = 0; i < 200; i++)		//Every cwd it swaps in is the root
+	{
+		TEST_ASSERT_EQUAL_INT8(0, cncd(sess, "/"));
+	}
+	for(uint32_t done = 0; done < AIO_FILES; )
+	{
+		uint32_t n = aio_wait(ctx, cqes, AIO_FILES);
+		TEST_ASSERT_TRUE(n > 0);
+		for(uint32_t c = 0; c < n; c++) TEST_ASSERT_EQUAL_INT64(0, cqes[c].res);
+		done += n;
+	}
+	aio_destroy(ctx);
+	dir_ptr* dir = cnopendir(sess, "/d/x0");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+}
@@ -0,0 +1,62 @@
+#include "dcache.h"
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(dcache);
+
+TEST_SETUP(dcache)
+{
+	dcache_init();
+}
+
+TEST_TEAR_DOWN(dcache)
+{
+}
+
+TEST(dcache, LookupAfterInsertShouldHit)
+{
+	iptr child = 0;
+	TEST_ASSERT_FALSE(dcache_lookup(3, "alpha", &child));
+	dcache_insert(3, "alpha", 17);
+	TEST_ASSERT_TRUE(dcache_lookup(3, "alpha", &child));
+	TEST_ASSERT_EQUAL_UINT32(17, child);
+	TEST_ASSERT_FALSE(dcache_lookup(4, "alpha", &child));
+	TEST_ASSERT_FALSE(dcache_lookup(3, "alph", &child));
+}
+
+TEST(dcache, NegativeEntryShouldBeReplaced)
+{
+	iptr child = 0;
+	dcache_insert(3, "beta", DCACHE_NEGATIVE);
+	TEST_ASSERT_TRUE(dcache_lookup(3, "beta", &child));
+	TEST_ASSERT_EQUAL_UINT32(DCACHE_NEGATIVE, child);
+	dcache_insert(3, "beta", 21);
+	TEST_ASSERT_TRUE(dcache_lookup(3, "beta", &child));
+	TEST_ASSERT_EQUAL_UINT32(21, child);
+}
+
+TEST(dcache, InvalidateAndPurgeShouldForget)
+{
+	iptr child = 0;
+	dcache_insert(3, "gamma", 30);
+	dcache_insert(30, "delta", 31);
+	dcache_insert(3, "epsilon", 32);
+	dcache_invalidate(3, "epsilon");
+	TEST_ASSERT_FALSE(dcache_lookup(3, "epsilon", &child));
+	dcache_purge_dir(30);
+	TEST_ASSERT_FALSE(dcache_lookup(3, "gamma", &child));
+	TEST_ASSERT_FALSE(dcache_lookup(30, "delta", &child));
+}
+
+TEST(dcache, BlockShouldBeKnownOnlyForEntriesPlacedWithOne)
+{
+	uint32_t lblk = 0;
+	dcache_insert_at(5, "zeta", 40, 7);
+	TEST_ASSERT_TRUE(dcache_block(5, "zeta", &lblk));
+	TEST_ASSERT_EQUAL_UINT32(7, lblk);
+	dcache_insert(5, "zeta", 40);
+	TEST_ASSERT_FALSE(dcache_block(5, "zeta", &lblk));
+	dcache_insert_at(5, "eta", DCACHE_NEGATIVE, 2);
+	TEST_ASSERT_FALSE(dcache_block(5, "eta", &lblk));
+	TEST_ASSERT_FALSE(dcache_block(5, "theta", &lblk));
+}
@@ -1,16 +1,28 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "fs.h"
+#include "journal.h"
+#include "bitmap.h"
+#include "tar.h"
 #include "unity.h"
 #include "unity_fixture.h"
 
 TEST_GROUP(fs);
 
+static session* sess;
+
 TEST_SETUP(fs)
 {
 	blockdev_attach();
+	sess = cnsession_open();
 }
 
 TEST_TEAR_DOWN(fs)
 {
+	cnsession_close(sess);
 	blockdev_detach();
 	blockdev_destroy();
 }
@@ -32,39 +44,39 @@ TEST(fs, MkdirShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	int8_t result = cnmkdir("test1");
+	int8_t result = cnmkdir(sess, "test1");
 	//debug("test1");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test1/test1a");
+	result = cnmkdir(sess, "test1/test1a");
 	//debug("test1/test1a");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test2");
+	result = cnmkdir(sess, "test2");
 	//debug("test2");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test1/test1b");
+	result = cnmkdir(sess, "test1/test1b");
 	//debug("test1/test1b");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test1/test1a/alpha");
+	result = cnmkdir(sess, "test1/test1a/alpha");
 	//debug("test1/test1a/alpha");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test1/test1a/alpha/beta");
+	result = cnmkdir(sess, "test1/test1a/alpha/beta");
 	//debug("test1/test1a/alpha/beta");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test2/test2a");
+	result = cnmkdir(sess, "test2/test2a");
 	//debug("test2/test2a");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,0);
-	result = cnmkdir("test2/test2a");
+	result = cnmkdir(sess, "test2/test2a");
 	//debug("test2/test2a  SHOULD FAIL");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,-1);
-	result = cnmkdir("test2");
+	result = cnmkdir(sess, "test2");
 	//debug("test2  SHOULD FAIL");
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(result,-1);
@@ -76,22 +88,22 @@ TEST(fs, CdShouldComplete)
 	cnmkfs();
 	cnmount();
 	int8_t result;
-	result = cnmkdir("test1");
+	result = cnmkdir(sess, "test1");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cncd("test1");
+	result = cncd(sess, "test1");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cnmkdir("test2");
+	result = cnmkdir(sess, "test2");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cncd("test2");
+	result = cncd(sess, "test2");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
 	system("hd /tmp/fs.bin");
-	result = cncd("..");
+	result = cncd(sess, "..");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cncd("/");
+	result = cncd(sess, "/");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cncd("test1/test2");
+	result = cncd(sess, "test1/test2");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	result = cncd("/test1/test2");
+	result = cncd(sess, "/test1/test2");
 	TEST_ASSERT_EQUAL_INT8(result, 0);
 	cnumount();
 }
@@ -101,29 +113,32 @@ TEST(fs, LsShouldComplete)
 	cnmkfs();
 	cnmount();
 	int8_t result;
-	result = cnmkdir("test1");
-	result = cncd("test1");
-	result = cnmkdir("test2");
-	char lsbuf[4096];
-	result = cnls("",lsbuf);
-	debug("ls:\n%s\n", lsbuf);
+	result = cnmkdir(sess, "test1");
+	result = cncd(sess, "test1");
+	result = cnmkdir(sess, "test2");
+	outbuf lsbuf;
+	outbuf_init(&lsbuf, 0);
+	result = cnls(sess, "",&lsbuf);
+	debug("ls:\n%s\n", lsbuf.data);
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	char lsbuf2[4096];
-	result = cnls("/",lsbuf2);
-	debug("ls /:\n%s\n", lsbuf2);
+	TEST_ASSERT_EQUAL_STRING(".\n..\ntest2\n", lsbuf.data);
+	outbuf_truncate(&lsbuf, 0);
+	result = cnls(sess, "/",&lsbuf);
+	debug("ls /:\n%s\n", lsbuf.data);
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	char lsbuf3[4096];
-	result = cnls("/test1",lsbuf3);
-	debug("ls /test1:\n%s\n", lsbuf3);
+	outbuf_truncate(&lsbuf, 0);
+	result = cnls(sess, "/test1",&lsbuf);
+	debug("ls /test1:\n%s\n", lsbuf.data);
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	char lsbuf4[4096];
-	result = cnls("..",lsbuf4);
-	debug("ls ..:\n%s\n", lsbuf4);
+	outbuf_truncate(&lsbuf, 0);
+	result = cnls(sess, "..",&lsbuf);
+	debug("ls ..:\n%s\n", lsbuf.data);
 	TEST_ASSERT_EQUAL_INT8(result, 0);
-	char lsbuf5[4096];
-	result = cnls("test3",lsbuf5);
-	debug("ls test3 (SHOULD FAIL):\n%s\n", lsbuf5);
+	outbuf_truncate(&lsbuf, 0);
+	result = cnls(sess, "test3",&lsbuf);
+	debug("ls test3 (SHOULD FAIL):\n%s\n", lsbuf.data);
 	TEST_ASSERT_EQUAL_INT8(result, -1);
+	outbuf_free(&lsbuf);
 }
 
 TEST(fs, CreatShouldComplete)
@@ -131,14 +146,15 @@ TEST(fs, CreatShouldComplete)
 	cnmkfs();
 	cnmount();
 	int8_t result;
-	dir_ptr* dir = cnopendir("");
+	dir_ptr* dir = cnopendir(sess, "");
 	result = cncreat(dir, "file1.txt");
 	result = cncreat(dir, "file2.txt");
 	system("hd /tmp/fs.bin");
-	char lsbuf[1024];
-	memset(lsbuf, 0, 1024);
-	cnls("",lsbuf);
-	debug("ls after creat:\n%s",lsbuf);
+	outbuf lsbuf;
+	outbuf_init(&lsbuf, 0);
+	cnls(sess, "",&lsbuf);
+	debug("ls after creat:\n%s",lsbuf.data);
+	outbuf_free(&lsbuf);
 	TEST_ASSERT_EQUAL_INT8(result, 0);
 	cnumount();
 }
@@ -147,14 +163,14 @@ TEST(fs, OpenShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	dir_ptr* dir = cnopendir("");
-	int16_t fd1 = cnopen(dir, "file1.txt", FD_WRITE);
-	int16_t fd2 = cnopen(dir, "file2.txt", FD_WRITE);
+	dir_ptr* dir = cnopendir(sess, "");
+	int16_t fd1 = cnopen(sess, dir, "file1.txt", FD_WRITE);
+	int16_t fd2 = cnopen(sess, dir, "file2.txt", FD_WRITE);
 	system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT16(fd1, 0);
 	TEST_ASSERT_EQUAL_INT16(fd2, 1);
-	int16_t result4 = cnclose(fd2);
-	int16_t result3 = cnclose(fd1);
+	int16_t result4 = cnclose(sess, fd2);
+	int16_t result3 = cnclose(sess, fd1);
 	TEST_ASSERT_EQUAL_INT16(result3, 0);
 	TEST_ASSERT_EQUAL_INT16(result4, 0);
 	cnumount();
@@ -164,9 +180,9 @@ TEST(fs, SeekShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	dir_ptr* dir = cnopendir("");
-	int16_t fd1 = cnopen(dir, "file1.txt", FD_WRITE);
-	int8_t result = cnseek(fd1, 10000);
+	dir_ptr* dir = cnopendir(sess, "");
+	int16_t fd1 = cnopen(sess, dir, "file1.txt", FD_WRITE);
+	int8_t result = cnseek(sess, fd1, 10000);
 	system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT16(result, 0);
 	cnumount();
@@ -176,37 +192,37 @@ TEST(fs, ReadWriteShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	cnmkdir("test1");
-	cncd("test1");
-	dir_ptr* dir = cnopendir(".");
-	int16_t fd1 = cnopen(dir, "file1.txt", FD_WRITE);
-	cnseek(fd1, 10000);
-	size_t bytes_written = cnwrite((uint8_t*)"This is only a test.", 21, fd1);
-	cnseek(fd1, 20000);
-	bytes_written = cnwrite((uint8_t*)"This is only a test.", 21, fd1);
-	cnseek(fd1, 50000);
-	bytes_written = cnwrite((uint8_t*)"This is only a test.", 21, fd1);
-	cnseek(fd1, 40000);
-	bytes_written = cnwrite((uint8_t*)"This is only a test.", 21, fd1);
-	cnclose(fd1);
+	cnmkdir(sess, "test1");
+	cncd(sess, "test1");
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd1 = cnopen(sess, dir, "file1.txt", FD_WRITE);
+	cnseek(sess, fd1, 10000);
+	size_t bytes_written = cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd1);
+	cnseek(sess, fd1, 20000);
+	bytes_written = cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd1);
+	cnseek(sess, fd1, 50000);
+	bytes_written = cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd1);
+	cnseek(sess, fd1, 40000);
+	bytes_written = cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd1);
+	cnclose(sess, fd1);
 	system("hd /tmp/fs.bin");
 	TEST_ASSERT_TRUE(21 == bytes_written);
 	char readbuf[100];
-	fd1 = cnopen(dir, "file1.txt", FD_READ);
-	cnseek(fd1, 50000);
-	size_t bytes_read = cnread((uint8_t*)readbuf, 21, fd1);
+	fd1 = cnopen(sess, dir, "file1.txt", FD_READ);
+	cnseek(sess, fd1, 50000);
+	size_t bytes_read = cnread(sess, (uint8_t*)readbuf, 21, fd1);
 	TEST_ASSERT_EQUAL_STRING("This is only a test.", readbuf);
 	TEST_ASSERT_TRUE(21 == bytes_read);
-	cnseek(fd1, 20000);
-	bytes_read = cnread((uint8_t*)readbuf, 21, fd1);
+	cnseek(sess, fd1, 20000);
+	bytes_read = cnread(sess, (uint8_t*)readbuf, 21, fd1);
 	TEST_ASSERT_EQUAL_STRING("This is only a test.", readbuf);
 	TEST_ASSERT_TRUE(21 == bytes_read);
-	cnseek(fd1, 10000);
-	bytes_read = cnread((uint8_t*)readbuf, 21, fd1);
+	cnseek(sess, fd1, 10000);
+	bytes_read = cnread(sess, (uint8_t*)readbuf, 21, fd1);
 	TEST_ASSERT_EQUAL_STRING("This is only a test.", readbuf);
 	TEST_ASSERT_TRUE(21 == bytes_read);
-	cnseek(fd1, 40000);
-	bytes_read = cnread((uint8_t*)readbuf, 21, fd1);
+	cnseek(sess, fd1, 40000);
+	bytes_read = cnread(sess, (uint8_t*)readbuf, 21, fd1);
 	TEST_ASSERT_EQUAL_STRING("This is only a test.", readbuf);
 	TEST_ASSERT_TRUE(21 == bytes_read);
 	cnumount();
@@ -216,16 +232,18 @@ TEST(fs, RmdirShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	cnmkdir("test1");
-	cnmkdir("test2");
-	char lsbuf[512];
-	cnls("",lsbuf);
+	cnmkdir(sess, "test1");
+	cnmkdir(sess, "test2");
+	outbuf lsbuf;
+	outbuf_init(&lsbuf, 0);
+	cnls(sess, "",&lsbuf);
 	system("hd /tmp/fs.bin");
-	debug("%s",lsbuf);
-	int8_t result = cnrmdir("test1");
-	char lsbuf2[512];
-	cnls("",lsbuf2);
-	debug("%s",lsbuf2);
+	debug("%s",lsbuf.data);
+	int8_t result = cnrmdir(sess, "test1");
+	outbuf_truncate(&lsbuf, 0);
+	cnls(sess, "",&lsbuf);
+	debug("%s",lsbuf.data);
+	outbuf_free(&lsbuf);
 	system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(0, result);
 	cnumount();
@@ -235,16 +253,18 @@ TEST(fs, CatShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	dir_ptr* dir = cnopendir(".");
-	int16_t fd1 = cnopen(dir, "file1.txt", FD_WRITE);
-	size_t bytes_written = cnwrite((uint8_t*)"This is only a test.\r\n\r\n", 24, fd1);
-	cnwrite((uint8_t*)"This is also a test.\r\n\r\n\r\n",26,fd1);
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd1 = cnopen(sess, dir, "file1.txt", FD_WRITE);
+	size_t bytes_written = cnwrite(sess, (uint8_t*)"This is only a test.\r\n\r\n", 24, fd1);
+	cnwrite(sess, (uint8_t*)"This is also a test.\r\n\r\n\r\n",26,fd1);
 	TEST_ASSERT_TRUE(24 == bytes_written);
-	cnclose(fd1);
-	char catbuf[512];
-	memset(catbuf, 0, 512);
-	int8_t result = cncat("file1.txt",catbuf);
-	debug("%s",catbuf);
+	cnclose(sess, fd1);
+	outbuf catbuf;
+	outbuf_init(&catbuf, 0);
+	int8_t result = cncat(sess, "file1.txt",&catbuf);
+	debug("%s",catbuf.data);
+	TEST_ASSERT_EQUAL_UINT32(50, catbuf.len);
+	outbuf_free(&catbuf);
 	system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(0, result);
 	cnumount();
@@ -254,13 +274,15 @@ TEST(fs, ImportExportShouldComplete)
 {
 	cnmkfs();
 	cnmount();
-	int8_t result = cnimport("./test/test_fs.c","test_fs.c");
-	char catbuf[8192];
-	cncat("test_fs.c",catbuf);
+	int8_t result = cnimport(sess, "./test/test_fs.c","test_fs.c");
+	outbuf catbuf;
+	outbuf_init(&catbuf, 0);
+	cncat(sess, "test_fs.c",&catbuf);
+	outbuf_free(&catbuf);
 	//debug("%s",catbuf);
 	//system("hd /tmp/fs.bin");
 	TEST_ASSERT_EQUAL_INT8(0, result);
-	result = cnexport("test_fs.c","./test_fs_copy.c");
+	result = cnexport(sess, "test_fs.c","./test_fs_copy.c");
 	TEST_ASSERT_EQUAL_INT8(0, result);
 }
 
@@ -270,19 +292,1610 @@ TEST(fs, TreeShouldComplete)
 	//debug("sizeof time_t %u",sizeof(time_t));
 	cnmkfs();
 	cnmount();
-	cnmkdir("test1");
-	cncd("test1");
-	cnmkdir("test1a");
-	cnmkdir("test1b");
-	cncd("..");
-	cnmkdir("test2");
-	cncd("test2");
-	cnmkdir("test2a");
-	cnmkdir("test2b");
-	cncd("..");
-	char buf[4096];
-	memset(buf, 0, 4096);
-	int8_t result = cntree(buf);
-	debug("\n%s",buf);
+	cnmkdir(sess, "test1");
+	cncd(sess, "test1");
+	cnmkdir(sess, "test1a");
+	cnmkdir(sess, "test1b");
+	cncd(sess, "..");
+	cnmkdir(sess, "test2");
+	cncd(sess, "test2");
+	cnmkdir(sess, "test2a");
+	cnmkdir(sess, "test2b");
+	cncd(sess, "..");
+	outbuf buf;
+	outbuf_init(&buf, 0);
+	int8_t result = cntree(sess, &buf);
+	debug("\n%s",buf.data);
 	TEST_ASSERT_EQUAL_INT8(0, result);
+	outbuf_free(&buf);
+}
+
+TEST(fs, LookupCacheShouldFollowMkdirRmdir)
+{
+	cnmkfs();
+	cnmount();
+	TEST_ASSERT_NULL(cnopendir(sess, "test1"));     //Caches a negative entry
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "test1"));
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "test1/test1a"));
+	dir_ptr* dir = cnopendir(sess, "/test1/test1a");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+	dir = cnopendir(sess, "/test1/test1a/..");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+	TEST_ASSERT_EQUAL_INT8(0, cnrmdir(sess, "test1/test1a"));
+	TEST_ASSERT_NULL(cnopendir(sess, "/test1/test1a"));
+	cnumount();
+}
+
+TEST(fs, LargeDirectoryShouldSpanBlocks)
+{
+	char name[32];
+	stat_st statbuf;
+	cnmkfs();
+	cnmount();
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "big"));
+	dir_ptr* dir = cnopendir(sess, "big");
+	for(int i = 0; i < 600; i++)
+	{
+		sprintf(name, "file%04d.txt", i);
+		TEST_ASSERT_EQUAL_INT8(0, cncreat(dir, name));
+	}
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "big/sub"));
+	TEST_ASSERT_TRUE(dir->inode_st.blocks > 1);
+	cnclosedir(dir);
+
+	//Every entry is visible from a freshly read directory
+	dir = cnopendir(sess, "/big");
+	int entries = 0;
+	while(cnreaddir(dir)) entries++;
+	TEST_ASSERT_EQUAL_INT(603, entries);
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "file0599.txt", &statbuf));
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "sub", &statbuf));
+	cnclosedir(dir);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnrmdir(sess, "big/sub"));
+	TEST_ASSERT_NULL(cnopendir(sess, "/big/sub"));
+	TEST_ASSERT_EQUAL_INT8(-1, cnrmdir(sess, "big"));	//Not empty
+	cnumount();
+}
+
+TEST(fs, RmdirShouldReuseSlotsAndCompact)
+{
+	char name[32];
+	stat_st statbuf;
+	cnmkfs();
+	cnmount();
+	for(int i = 0; i < 400; i++)
+	{
+		sprintf(name, "dir%04d", i);
+		TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, name));
+	}
+	dir_ptr* dir = cnopendir(sess, "/");
+	uint32_t blocks = dir->inode_st.blocks;
+	cnclosedir(dir);
+	for(int i = 0; i < 400; i++)
+	{
+		if(i % 10 == 0) continue;
+		sprintf(name, "dir%04d", i);
+		TEST_ASSERT_EQUAL_INT8(0, cnrmdir(sess, name));
+	}
+
+	//Freed slots are reused before the directory grows
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "a_much_longer_directory_name"));
+	dir = cnopendir(sess, "/");
+	TEST_ASSERT_EQUAL_UINT32(blocks, dir->inode_st.blocks);
+	cnclosedir(dir);
+
+	//Background pass packs the survivors without losing any
+	TEST_ASSERT_TRUE(cnbackground() > 0);
+	while(cnbackground() > 0);
+	dir = cnopendir(sess, "/");
+	int entries = 0;
+	while(cnreaddir(dir)) entries++;
+	TEST_ASSERT_EQUAL_INT(2 + 40 + 1, entries);
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "dir0390", &statbuf));
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "a_much_longer_directory_name", &statbuf));
+	TEST_ASSERT_EQUAL_INT8(-1, cnstat(dir, "dir0391", &statbuf));
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, UnlinkShouldReclaimBlocks)
+{
+	statfs_st before, after;
+	uint8_t* data = calloc(1, 200000);
+	cnmkfs();
+	cnmount();
+	cnstatfs(&before);
+
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd = cnopen(sess, dir, "small.txt", FD_WRITE);
+	cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd);
+	cnclose(sess, fd);
+	fd = cnopen(sess, dir, "large.bin", FD_WRITE);
+	TEST_ASSERT_TRUE(cnwrite(sess, data, 200000, fd) == 200000);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+
+	//Small files are freed right away
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "small.txt"));
+	TEST_ASSERT_EQUAL_INT8(-1, cnunlink(sess, "small.txt"));
+
+	//Large files are freed by the background reclaimer
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "large.bin"));
+	cnstatfs(&after);
+	TEST_ASSERT_TRUE(after.reclaim_pending > 0);
+	while(cnbackground() > 0);
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(0, after.reclaim_pending);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks, after.free_blocks);
+	TEST_ASSERT_EQUAL_UINT32(before.free_inodes, after.free_inodes);
+	free(data);
+	cnumount();
+}
+
+TEST(fs, TruncateShouldFreeAndZeroFill)
+{
+	statfs_st before, after;
+	char readbuf[32];
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd = cnopen(sess, dir, "file1.txt", FD_WRITE);
+	cnseek(sess, fd, 40000);
+	cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd);
+	cnseek(sess, fd, 5000);
+	cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd);
+	cnclose(sess, fd);
+	cnstatfs(&before);
+
+	TEST_ASSERT_EQUAL_INT8(0, cntruncate(sess, "file1.txt", 5010));
+	cnstatfs(&after);
+	TEST_ASSERT_TRUE(after.free_blocks > before.free_blocks);
+	TEST_ASSERT_EQUAL_INT8(0, cntruncate(sess, "file1.txt", 9000));
+
+	fd = cnopen(sess, dir, "file1.txt", FD_READ);
+	cnseek(sess, fd, 5000);
+	memset(readbuf, 0xFF, sizeof(readbuf));
+	cnread(sess, (uint8_t*)readbuf, 21, fd);
+	TEST_ASSERT_EQUAL_MEMORY("This is on\0\0\0\0\0\0\0\0\0\0\0", readbuf, 21);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+	TEST_ASSERT_EQUAL_INT8(-1, cntruncate(sess, "missing.txt", 0));
+	cnumount();
+}
+
+TEST(fs, SparseFileShouldReadZeros)
+{
+	statfs_st before, after;
+	char readbuf[32];
+	char zeros[32];
+	memset(zeros, 0, sizeof(zeros));
+	cnmkfs();
+	cnmount();
+	cnstatfs(&before);
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd = cnopen(sess, dir, "sparse.bin", FD_WRITE);
+	TEST_ASSERT_EQUAL_INT8(0, cnseek(sess, fd, 1u << 30));	//1 GB hole, no blocks
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks, after.free_blocks);
+	TEST_ASSERT_TRUE(21 == cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd));
+	cnstatfs(&after);
+	TEST_ASSERT_TRUE(before.free_blocks - after.free_blocks <= 3);	//Data block plus indirect blocks
+	cnclose(sess, fd);
+
+	fd = cnopen(sess, dir, "sparse.bin", FD_READ);
+	memset(readbuf, 0xFF, sizeof(readbuf));
+	cnseek(sess, fd, 500000000);
+	TEST_ASSERT_TRUE(32 == cnread(sess, (uint8_t*)readbuf, 32, fd));
+	TEST_ASSERT_EQUAL_MEMORY(zeros, readbuf, 32);
+	cnseek(sess, fd, 1u << 30);
+	TEST_ASSERT_TRUE(21 == cnread(sess, (uint8_t*)readbuf, 32, fd));
+	TEST_ASSERT_EQUAL_STRING("This is only a test.", readbuf);
+	cnclose(sess, fd);
+
+	TEST_ASSERT_EQUAL_INT8(0, cntruncate(sess, "sparse.bin", 3000000000u));
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "sparse.bin"));
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks, after.free_blocks);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, InterleavedWritersShouldGetContiguousBlocks)
+{
+	uint8_t wbuf[BLOCK_SIZE];
+	uint8_t rbuf[BLOCK_SIZE];
+	inode inode_a, inode_b;
+	stat_st stat_a, stat_b;
+	statfs_st before, during;
+	cnmkfs();
+	cnmount();
+	cnstatfs(&before);
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd_a = cnopen(sess, dir, "a.bin", FD_WRITE);
+	int16_t fd_b = cnopen(sess, dir, "b.bin", FD_WRITE);
+	for(uint8_t i = 0; i < 20; i++)
+	{
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		TEST_ASSERT_TRUE(BLOCK_SIZE == cnwrite(sess, wbuf, BLOCK_SIZE, fd_a));
+		memset(wbuf, 'A' + i, BLOCK_SIZE);
+		TEST_ASSERT_TRUE(BLOCK_SIZE == cnwrite(sess, wbuf, BLOCK_SIZE, fd_b));
+	}
+	cnstatfs(&during);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks - 42, during.free_blocks);	//Space is held, not placed, with an indirect block each
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, fd_a));
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, fd_b));
+
+	cnstat(dir, "a.bin", &stat_a);
+	cnstat(dir, "b.bin", &stat_b);
+	inode_read(stat_a.inode_id, &inode_a);
+	inode_read(stat_b.inode_id, &inode_b);
+	TEST_ASSERT_EQUAL_UINT32(20, inode_a.blocks);
+	TEST_ASSERT_EQUAL_UINT32(20, inode_b.blocks);
+	for(uint32_t lblk = 1; lblk < 20; lblk++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(bmap(&inode_a, 0) + lblk, bmap(&inode_a, lblk));
+		TEST_ASSERT_EQUAL_UINT32(bmap(&inode_b, 0) + lblk, bmap(&inode_b, lblk));
+	}
+
+	int16_t fd = cnopen(sess, dir, "b.bin", FD_READ);
+	cnseek(sess, fd, 13 * BLOCK_SIZE);
+	TEST_ASSERT_TRUE(BLOCK_SIZE == cnread(sess, rbuf, BLOCK_SIZE, fd));
+	memset(wbuf, 'A' + 13, BLOCK_SIZE);
+	TEST_ASSERT_EQUAL_MEMORY(wbuf, rbuf, BLOCK_SIZE);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, FallocateShouldReserveContiguousUnwrittenBlocks)
+{
+	uint8_t wbuf[BLOCK_SIZE];
+	uint8_t rbuf[BLOCK_SIZE];
+	uint8_t zeros[BLOCK_SIZE];
+	inode inode_st;
+	stat_st stat_buf;
+	statfs_st before, after;
+	memset(zeros, 0, BLOCK_SIZE);
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, ".");
+	int16_t fd = cnopen(sess, dir, "log.bin", FD_WRITE);
+	cnstatfs(&before);
+	TEST_ASSERT_EQUAL_INT8(0, cnfallocate(sess, fd, 0, 12 * BLOCK_SIZE));
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(13, before.free_blocks - after.free_blocks);	//12 data blocks and an indirect block
+
+	//Writing into the reserved range allocates nothing more
+	memset(wbuf, 'x', BLOCK_SIZE);
+	cnseek(sess, fd, 5 * BLOCK_SIZE + 100);
+	TEST_ASSERT_TRUE(BLOCK_SIZE == cnwrite(sess, wbuf, BLOCK_SIZE, fd));
+	cnstatfs(&before);
+	TEST_ASSERT_EQUAL_UINT32(after.free_blocks, before.free_blocks);
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, fd));
+
+	cnstat(dir, "log.bin", &stat_buf);
+	inode_read(stat_buf.inode_id, &inode_st);
+	TEST_ASSERT_EQUAL_UINT32(12 * BLOCK_SIZE, inode_st.size);
+	TEST_ASSERT_EQUAL_UINT32(12, inode_st.blocks);
+	for(uint32_t lblk = 1; lblk < 12; lblk++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(BLK_LBA(bmap(&inode_st, 0)) + lblk, BLK_LBA(bmap(&inode_st, lblk)));
+	}
+
+	//Unwritten blocks and the untouched parts of written ones read as zeros
+	fd = cnopen(sess, dir, "log.bin", FD_READ);
+	TEST_ASSERT_TRUE(BLOCK_SIZE == cnread(sess, rbuf, BLOCK_SIZE, fd));
+	TEST_ASSERT_EQUAL_MEMORY(zeros, rbuf, BLOCK_SIZE);
+	cnseek(sess, fd, 5 * BLOCK_SIZE);
+	TEST_ASSERT_TRUE(BLOCK_SIZE == cnread(sess, rbuf, BLOCK_SIZE, fd));
+	TEST_ASSERT_EQUAL_MEMORY(zeros, rbuf, 100);
+	TEST_ASSERT_EQUAL_MEMORY(wbuf, rbuf + 100, BLOCK_SIZE - 100);
+	cnseek(sess, fd, 6 * BLOCK_SIZE + 100);
+	TEST_ASSERT_TRUE(BLOCK_SIZE == cnread(sess, rbuf, BLOCK_SIZE, fd));
+	TEST_ASSERT_EQUAL_MEMORY(zeros, rbuf, BLOCK_SIZE);
+	cnclose(sess, fd);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "log.bin"));
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, MountShouldReplayCommittedJournal)
+{
+	block hdr;
+	block zero;
+	memset(&zero, 0, sizeof(block));
+	cnmkfs();
+	cnmount();
+	blk_read(BLOCKID_JOURNAL, &hdr);
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "replayed"));
+	TEST_ASSERT_EQUAL_INT8(0, journal_commit());
+
+	//Crash after the commit block, before the home writes and header update
+	blk_write(BLOCKID_ROOT_DIR, &zero);
+	blk_write(BLOCKID_JOURNAL, &hdr);
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, "/replayed");
+	TEST_ASSERT_NOT_NULL(dir);
+
+	//The replayed fs is mounted good, so deferred work still runs
+	statfs_st before, after;
+	uint8_t* data = calloc(1, 200000);
+	cnstatfs(&before);
+	int32_t fd = cnopen(sess, dir, "large.bin", FD_WRITE);
+	TEST_ASSERT_TRUE(cnwrite(sess, data, 200000, fd) == 200000);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+	free(data);
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "/replayed/large.bin"));
+	TEST_ASSERT_TRUE(cnbackground() > 0);
+	while(cnbackground() > 0);
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(0, after.reclaim_pending);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks, after.free_blocks);
+	TEST_ASSERT_EQUAL_UINT32(0, journal_pending());
+
+	//Changes that were never committed are dropped as a whole
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "lost"));
+	TEST_ASSERT_TRUE(journal_pending() > 0);
+	cnmount();
+	TEST_ASSERT_NULL(cnopendir(sess, "/lost"));
+	dir = cnopendir(sess, "/replayed");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, FsckShouldFindAndRepairDamage)
+{
+	fsck_report rep;
+	block bm;
+	cnmkfs();
+	cnmount();
+	cnmkdir(sess, "a");
+	cnmkdir(sess, "a/b");
+	dir_ptr* dir = cnopendir(sess, "a");
+	int16_t fd = cnopen(sess, dir, "file.bin", FD_WRITE);
+	cnseek(sess, fd, 20 * BLOCK_SIZE);
+	cnwrite(sess, (uint8_t*)"This is only a test.", 21, fd);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(false, &rep));
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	TEST_ASSERT_EQUAL_UINT32(4, rep.inodes_checked);
+	cnumount();
+
+	//Leak a block, lose a used one and orphan an inode
+	blk_read(BLOCKID_BLOCK_BITMAP, &bm);
+	set_bitmap(&bm, BD_SIZE_BLOCKS - 1);
+	clear_bitmap(&bm, BLOCKID_ROOT_DIR);
+	blk_write(BLOCKID_BLOCK_BITMAP, &bm);
+	blk_read(BLOCKID_INODE_BITMAP, &bm);
+	set_bitmap(&bm, INODE_COUNT - 1);
+	blk_write(BLOCKID_INODE_BITMAP, &bm);
+
+	cnmount();
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(false, &rep));
+	TEST_ASSERT_EQUAL_UINT32(1, rep.leaked_blocks);
+	TEST_ASSERT_EQUAL_UINT32(1, rep.unmarked_blocks);
+	TEST_ASSERT_EQUAL_UINT32(1, rep.orphan_inodes);
+	TEST_ASSERT_EQUAL_UINT32(1, rep.bad_counts);
+	TEST_ASSERT_EQUAL_UINT32(4, fsck_errors(&rep));
+	TEST_ASSERT_EQUAL_UINT32(0, rep.repaired);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(true, &rep));
+	TEST_ASSERT_EQUAL_UINT32(4, rep.repaired);
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(false, &rep));
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	dir = cnopendir(sess, "/a/b");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+	cnumount();
+}
+
+#define STRESS_THREADS		8
+#define STRESS_FILES		24
+#define STRESS_BIG_BLOCKS	40		// past RECLAIM_SYNC_BLOCKS, so unlinking it goes through the reclaimer
+#define STRESS_SLICE		(4 * BLOCK_SIZE)
+
+static atomic_bool stress_done;
+static const uint8_t stress_zeros[STRESS_BIG_BLOCKS * BLOCK_SIZE];	//Unity's malloc counter is not thread-safe
+
+static void* stress_background(void* arg)
+{
+	(void)arg;
+	while(!stress_done)
+	{
+		cnbackground();
+	}
+	return NULL;
+}
+
+//Each thread works in its own directory, creates and removes directories
+//side by side in a shared one, and writes its own slice of a shared file.
+//Returns the number of mismatches it saw.
+static void* stress_worker(void* arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	uintptr_t errors = 0;
+	session* sess = cnsession_open();		//Each worker has its own
+	char path[64];
+	char name[32];
+	uint8_t data[3000];
+	uint8_t back[3000];
+
+	sprintf(path, "/t%u", (unsigned)id);
+	if(cnmkdir(sess, path) != 0)
+	{
+		cnsession_close(sess);
+		return (void*)(uintptr_t)1;
+	}
+	dir_ptr* dir = cnopendir(sess, path);
+	for(uint32_t i = 0; i < STRESS_FILES; i++)
+	{
+		sprintf(name, "f%u", i);
+		memset(data, (int)(id * 31 + i), sizeof(data));
+		int16_t fd = cnopen(sess, dir, name, FD_WRITE);
+		if(fd < 0 || cnwrite(sess, data, sizeof(data), fd) != sizeof(data)) errors++;
+		cnclose(sess, fd);
+
+		sprintf(path, "/shared/t%u_%u", (unsigned)id, i);
+		if(cnmkdir(sess, path) != 0) errors++;
+		if(i % 2 == 0 && cnrmdir(sess, path) != 0) errors++;
+	}
+
+	int16_t fd = cnopen(sess, dir, "big", FD_WRITE);
+	cnwrite(sess, (uint8_t*)stress_zeros, sizeof(stress_zeros), fd);
+	cnclose(sess, fd);
+	sprintf(path, "/t%u/big", (unsigned)id);
+	if(cnunlink(sess, path) != 0) errors++;
+
+	for(uint32_t i = 1; i < STRESS_FILES; i += 2)
+	{
+		sprintf(path, "/t%u/f%u", (unsigned)id, i);
+		if(cnunlink(sess, path) != 0) errors++;
+	}
+	for(uint32_t i = 0; i < STRESS_FILES; i += 2)
+	{
+		sprintf(name, "f%u", i);
+		memset(data, (int)(id * 31 + i), sizeof(data));
+		fd = cnopen(sess, dir, name, FD_READ);
+		if(fd < 0 || cnread(sess, back, sizeof(back), fd) != sizeof(back) || memcmp(data, back, sizeof(data)) != 0) errors++;
+		cnclose(sess, fd);
+	}
+
+	dir_ptr* shared = cnopendir(sess, "/shared");
+	memset(data, (int)id + 1, sizeof(data));
+	fd = cnopen(sess, shared, "slices", FD_WRITE);
+	if(fd < 0) errors++;
+	cnseek(sess, fd, id * STRESS_SLICE);
+	for(uint32_t done = 0; done < STRESS_SLICE; done += sizeof(data))
+	{
+		cnwrite(sess, data, MIN(sizeof(data), STRESS_SLICE - done), fd);
+	}
+	cnclose(sess, fd);
+	cnclosedir(shared);
+	cnclosedir(dir);
+	cnsession_close(sess);
+	return (void*)errors;
+}
+
+TEST(fs, ConcurrentOperationsShouldKeepFsConsistent)
+{
+	pthread_t workers[STRESS_THREADS];
+	pthread_t background;
+	fsck_report rep;
+	uint8_t slice[STRESS_SLICE];
+	uintptr_t errors = 0;
+	cnmkfs();
+	cnmount();
+	cnmkdir(sess, "/shared");
+
+	stress_done = false;
+	pthread_create(&background, NULL, stress_background, NULL);
+	for(uintptr_t t = 0; t < STRESS_THREADS; t++)
+	{
+		pthread_create(&workers[t], NULL, stress_worker, (void*)t);
+	}
+	for(uint32_t t = 0; t < STRESS_THREADS; t++)
+	{
+		void* res;
+		pthread_join(workers[t], &res);
+		errors += (uintptr_t)res;
+	}
+	stress_done = true;
+	pthread_join(background, NULL);
+	TEST_ASSERT_EQUAL_UINT32(0, errors);
+
+	//Every slice of the shared file holds its writer's bytes
+	dir_ptr* shared = cnopendir(sess, "/shared");
+	int16_t fd = cnopen(sess, shared, "slices", FD_READ);
+	for(uint32_t t = 0; t < STRESS_THREADS; t++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(STRESS_SLICE, cnread(sess, slice, STRESS_SLICE, fd));
+		for(uint32_t i = 0; i < STRESS_SLICE; i++)
+		{
+			TEST_ASSERT_EQUAL_UINT8(t + 1, slice[i]);
+		}
+	}
+	cnclose(sess, fd);
+
+	//Half the directories each thread made in /shared survive, plus the file
+	uint32_t entries = 0;
+	while(cnreaddir(shared) != NULL) entries++;
+	TEST_ASSERT_EQUAL_UINT32(2 + STRESS_THREADS * STRESS_FILES / 2 + 1, entries);
+	cnclosedir(shared);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(false, &rep));
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	TEST_ASSERT_EQUAL_UINT32(2 + STRESS_THREADS * (1 + STRESS_FILES / 2) + STRESS_THREADS * STRESS_FILES / 2 + 1, rep.inodes_checked);
+	cnumount();
+}
+
+TEST(fs, SessionsShouldKeepTheirOwnCwdAndFds)
+{
+	char buf[64];
+	cnmkfs();
+	cnmount();
+	session* other = cnsession_open();
+	cnmkdir(sess, "a");
+	cnmkdir(sess, "b");
+
+	//A cd in one session leaves the other where it was
+	TEST_ASSERT_EQUAL_INT8(0, cncd(sess, "/a"));
+	TEST_ASSERT_EQUAL_INT8(0, cncd(other, "/b"));
+	cnpwd(sess, buf);
+	TEST_ASSERT_EQUAL_STRING("/a", buf);
+	cnpwd(other, buf);
+	TEST_ASSERT_EQUAL_STRING("/b", buf);
+	cnmkdir(sess, "in_a");
+	dir_ptr* dir = cnopendir(other, "/a/in_a");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+
+	//Both sessions get fd 0, each naming its own file
+	dir_ptr* a = cnopendir(sess, ".");
+	dir_ptr* b = cnopendir(other, ".");
+	int16_t fd_a = cnopen(sess, a, "f", FD_WRITE);
+	int16_t fd_b = cnopen(other, b, "f", FD_WRITE);
+	TEST_ASSERT_EQUAL_INT16(0, fd_a);
+	TEST_ASSERT_EQUAL_INT16(0, fd_b);
+	cnwrite(sess, (uint8_t*)"in a", 5, fd_a);
+	cnwrite(other, (uint8_t*)"in b", 5, fd_b);
+	cnclose(sess, fd_a);
+	TEST_ASSERT_EQUAL_INT8(-1, cnclose(sess, fd_a));
+
+	//Closing a session closes its files
+	cnsession_close(other);
+	cnclosedir(b);
+	b = cnopendir(sess, "/b");
+	fd_b = cnopen(sess, b, "f", FD_READ);
+	TEST_ASSERT_EQUAL_UINT32(5, cnread(sess, (uint8_t*)buf, sizeof(buf), fd_b));
+	TEST_ASSERT_EQUAL_STRING("in b", buf);
+	cnclose(sess, fd_b);
+	cnclosedir(a);
+	cnclosedir(b);
+	cnumount();
+}
+
+TEST(fs, SequentialReadsShouldGrowReadahead)
+{
+	uint8_t blk[BLOCK_SIZE];
+	uint32_t blocks = 4 * RA_MAX_BLOCKS;
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, "/");
+	int16_t fd = cnopen(sess, dir, "stream.bin", FD_WRITE);
+	for(uint32_t i = 0; i < blocks; i++)
+	{
+		memset(blk, (int)(i & 0xFF), BLOCK_SIZE);
+		cnwrite(sess, blk, BLOCK_SIZE, fd);
+	}
+	cnclose(sess, fd);
+
+	fd = cnopen(sess, dir, "stream.bin", FD_READ);
+	fd_entry* fde = fd_get(sess, fd);
+	uint32_t window = 0;
+	for(uint32_t i = 0; i < blocks; i++)
+	{
+		TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnread(sess, blk, BLOCK_SIZE, fd));
+		TEST_ASSERT_EQUAL_UINT8(i & 0xFF, blk[0]);
+		TEST_ASSERT_EQUAL_UINT8(i & 0xFF, blk[BLOCK_SIZE - 1]);
+		//Never shrinks while the reader stays sequential, and stays ahead of it
+		TEST_ASSERT_TRUE(fde->ra_window >= window);
+		TEST_ASSERT_TRUE(fde->ra_end > i || fde->ra_end == blocks);
+		window = fde->ra_window;
+	}
+	TEST_ASSERT_EQUAL_UINT32(RA_MAX_BLOCKS, window);
+	TEST_ASSERT_EQUAL_UINT32(blocks, fde->ra_end);
+
+	//A jump drops the window; reading on from there starts it again
+	cnseek(sess, fd, 10 * BLOCK_SIZE);
+	cnread(sess, blk, 100, fd);
+	TEST_ASSERT_EQUAL_UINT32(0, fde->ra_window);
+	cnread(sess, blk, 100, fd);
+	TEST_ASSERT_EQUAL_UINT32(RA_MIN_BLOCKS, fde->ra_window);
+	TEST_ASSERT_EQUAL_UINT8(10, blk[0]);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, ReadViewShouldMapRunsWithoutCopying)
+{
+	uint8_t blk[BLOCK_SIZE];
+	read_view view;
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, "/");
+	int16_t fd = cnopen(sess, dir, "view.bin", FD_WRITE);
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		memset(blk, 'a' + i, BLOCK_SIZE);
+		cnwrite(sess, blk, BLOCK_SIZE, fd);
+	}
+	//Blocks 3 and 4 are a hole
+	cnseek(sess, fd, 5 * BLOCK_SIZE);
+	memset(blk, 'z', BLOCK_SIZE);
+	cnwrite(sess, blk, BLOCK_SIZE, fd);
+	cnwrite(sess, blk, 100, fd);
+	cnclose(sess, fd);
+
+	fd = cnopen(sess, dir, "view.bin", FD_READ);
+	TEST_ASSERT_EQUAL_INT8(0, cnread_view(sess, fd, 0, 10 * BLOCK_SIZE, &view));
+	//Clipped at the end of the file
+	TEST_ASSERT_EQUAL_UINT32(6 * BLOCK_SIZE + 100, view.bytes);
+	//The first three blocks were allocated together and come back as one run
+	TEST_ASSERT_EQUAL_UINT32(3 * BLOCK_SIZE, view.segs[0].len);
+	TEST_ASSERT_EQUAL_UINT8('a', view.segs[0].base[0]);
+	TEST_ASSERT_EQUAL_UINT8('c', view.segs[0].base[3 * BLOCK_SIZE - 1]);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, view.segs[1].len);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, view.segs[2].len);
+	TEST_ASSERT_EQUAL_UINT8(0, view.segs[1].base[0]);
+	TEST_ASSERT_EQUAL_UINT8(0, view.segs[2].base[BLOCK_SIZE - 1]);
+	uint32_t total = 0;
+	for(uint32_t i = 3; i < view.count; i++)
+	{
+		TEST_ASSERT_EQUAL_UINT8('z', view.segs[i].base[0]);
+		total += view.segs[i].len;
+	}
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE + 100, total);
+	cnread_release(&view);
+
+	//An unaligned view starts inside its first block and leaves the cursor alone
+	TEST_ASSERT_EQUAL_INT8(0, cnread_view(sess, fd, BLOCK_SIZE + 10, 20, &view));
+	TEST_ASSERT_EQUAL_UINT32(1, view.count);
+	TEST_ASSERT_EQUAL_UINT32(20, view.bytes);
+	TEST_ASSERT_EQUAL_UINT8('b', view.segs[0].base[0]);
+	cnread_release(&view);
+	TEST_ASSERT_EQUAL_UINT32(0, fd_get(sess, fd)->cursor);
+	TEST_ASSERT_EQUAL_UINT32(10, cnread(sess, blk, 10, fd));
+	TEST_ASSERT_EQUAL_UINT8('a', blk[0]);
+
+	//Past the end there is nothing to map
+	TEST_ASSERT_EQUAL_INT8(0, cnread_view(sess, fd, 7 * BLOCK_SIZE, 10, &view));
+	TEST_ASSERT_EQUAL_UINT32(0, view.bytes);
+	cnread_release(&view);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, ImportExportShouldStreamLargeFiles)
+{
+	const char* src = "/tmp/cn_stream_src.bin";
+	const char* dst = "/tmp/cn_stream_dst.bin";
+	uint32_t size = 300 * BLOCK_SIZE + 123;
+	uint8_t blk[BLOCK_SIZE];
+	uint8_t host[BLOCK_SIZE];
+	FILE* f = fopen(src, "wb");
+	for(uint32_t i = 0; i < size; i++)
+	{
+		fputc((int)((i * 7 + i / BLOCK_SIZE) & 0xFF), f);
+	}
+	fclose(f);
+
+	cnmkfs();
+	cnmount();
+	TEST_ASSERT_EQUAL_INT8(0, cnimport(sess, src, "big.bin"));
+	stat_st st;
+	dir_ptr* dir = cnopendir(sess, "/");
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "big.bin", &st));
+	inode ino;
+	inode_read(st.inode_id, &ino);
+	TEST_ASSERT_EQUAL_UINT32(size, ino.size);
+
+	//Every block was filled, none reads back as zeros
+	int16_t fd = cnopen(sess, dir, "big.bin", FD_READ);
+	for(uint32_t off = 0; off < size; off += BLOCK_SIZE)
+	{
+		uint32_t n = cnread(sess, blk, BLOCK_SIZE, fd);
+		TEST_ASSERT_EQUAL_UINT32(MIN(BLOCK_SIZE, size - off), n);
+		for(uint32_t i = 0; i < n; i += 511)
+		{
+			TEST_ASSERT_EQUAL_UINT8(((off + i) * 7 + (off + i) / BLOCK_SIZE) & 0xFF, blk[i]);
+		}
+	}
+	cnclose(sess, fd);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnexport(sess, "big.bin", dst));
+	FILE* a = fopen(src, "rb");
+	FILE* b = fopen(dst, "rb");
+	size_t na, nb;
+	uint32_t total = 0;
+	do
+	{
+		na = fread(blk, 1, BLOCK_SIZE, a);
+		nb = fread(host, 1, BLOCK_SIZE, b);
+		TEST_ASSERT_EQUAL_UINT32(na, nb);
+		if(na > 0) TEST_ASSERT_EQUAL_MEMORY(blk, host, na);
+		total += na;
+	} while(na > 0);
+	fclose(a);
+	fclose(b);
+	TEST_ASSERT_EQUAL_UINT32(size, total);
+
+	//A hole in the guest file comes out as zeros
+	fd = cnopen(sess, dir, "sparse.bin", FD_WRITE);
+	cnseek(sess, fd, 3 * BLOCK_SIZE);
+	memset(blk, 'x', 10);
+	cnwrite(sess, blk, 10, fd);
+	cnclose(sess, fd);
+	TEST_ASSERT_EQUAL_INT8(0, cnexport(sess, "sparse.bin", dst));
+	b = fopen(dst, "rb");
+	fseek(b, 0, SEEK_END);
+	TEST_ASSERT_EQUAL_INT(3 * BLOCK_SIZE + 10, ftell(b));
+	fseek(b, BLOCK_SIZE + 5, SEEK_SET);
+	TEST_ASSERT_EQUAL_INT(0, fgetc(b));
+	fseek(b, 3 * BLOCK_SIZE, SEEK_SET);
+	TEST_ASSERT_EQUAL_INT('x', fgetc(b));
+	fclose(b);
+
+	//Nothing leaked or double mapped along the way
+	fsck_report rep;
+	cnfsck(false, &rep);
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	cnclosedir(dir);
+	cnumount();
+	remove(src);
+	remove(dst);
+}
+
+TEST(fs, ImportTreeShouldCopyDirectoriesAndFiles)
+{
+	char path[256];
+	uint8_t blk[BLOCK_SIZE];
+	uint32_t files = 600;		//More than two creation batches
+	system("rm -rf /tmp/cn_tree_src");
+	mkdir("/tmp/cn_tree_src", 0755);
+	mkdir("/tmp/cn_tree_src/a", 0755);
+	mkdir("/tmp/cn_tree_src/a/b", 0755);
+	for(uint32_t i = 0; i < files; i++)
+	{
+		sprintf(path, "/tmp/cn_tree_src/f%u", i);
+		FILE* f = fopen(path, "wb");
+		fprintf(f, "file %u", i);
+		fclose(f);
+	}
+	FILE* f = fopen("/tmp/cn_tree_src/a/small", "wb");
+	fclose(f);
+	f = fopen("/tmp/cn_tree_src/a/b/large", "wb");
+	for(uint32_t i = 0; i < 20 * BLOCK_SIZE; i++)
+	{
+		fputc((int)(i % 251), f);
+	}
+	fclose(f);
+
+	cnmkfs();
+	cnmount();
+	TEST_ASSERT_EQUAL_INT32(files + 2, cnimport_tree(sess, "/tmp/cn_tree_src", "/data"));
+
+	dir_ptr* dir = cnopendir(sess, "/data");
+	TEST_ASSERT_NOT_NULL(dir);
+	for(uint32_t i = 0; i < files; i += 37)
+	{
+		char expect[32];
+		sprintf(path, "f%u", i);
+		sprintf(expect, "file %u", i);
+		int16_t fd = cnopen(sess, dir, path, FD_READ);
+		TEST_ASSERT_TRUE(fd >= 0);
+		memset(blk, 0, sizeof(blk));
+		TEST_ASSERT_EQUAL_UINT32(strlen(expect), cnread(sess, blk, sizeof(blk), fd));
+		TEST_ASSERT_EQUAL_STRING(expect, (char*)blk);
+		cnclose(sess, fd);
+	}
+	cnclosedir(dir);
+
+	stat_st st;
+	dir = cnopendir(sess, "/data/a");
+	TEST_ASSERT_EQUAL_INT8(0, cnstat(dir, "small", &st));
+	cnclosedir(dir);
+	dir = cnopendir(sess, "/data/a/b");
+	int16_t fd = cnopen(sess, dir, "large", FD_READ);
+	for(uint32_t off = 0; off < 20 * BLOCK_SIZE; off += BLOCK_SIZE)
+	{
+		TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnread(sess, blk, BLOCK_SIZE, fd));
+		TEST_ASSERT_EQUAL_UINT8(off % 251, blk[0]);
+		TEST_ASSERT_EQUAL_UINT8((off + BLOCK_SIZE - 1) % 251, blk[BLOCK_SIZE - 1]);
+	}
+	cnclose(sess, fd);
+	cnclosedir(dir);
+
+	//Importing over the same names fails, and leaves nothing behind
+	TEST_ASSERT_EQUAL_INT32(-1, cnimport_tree(sess, "/tmp/cn_tree_src", "/data"));
+	fsck_report rep;
+	cnfsck(false, &rep);
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	cnumount();
+	system("rm -rf /tmp/cn_tree_src");
+}
+
+TEST(fs, TarExportImportShouldRoundTripATree)
+{
+	const char* archive = "/tmp/cn_tree.tar";
+	uint8_t blk[BLOCK_SIZE];
+	char name[64];
+	cnmkfs();
+	cnmount();
+	cnmkdir(sess, "/src");
+	cnmkdir(sess, "/src/sub");
+	cnmkdir(sess, "/src/sub/empty");
+	dir_ptr* dir = cnopendir(sess, "/src");
+	for(uint32_t i = 0; i < 10; i++)
+	{
+		sprintf(name, "file%u", i);
+		int16_t fd = cnopen(sess, dir, name, FD_WRITE);
+		for(uint32_t j = 0; j < i * 3; j++)
+		{
+			memset(blk, (int)(i * 16 + j), BLOCK_SIZE);
+			cnwrite(sess, blk, (j % 2) ? BLOCK_SIZE : 700, fd);
+		}
+		cnclose(sess, fd);
+	}
+	cnclosedir(dir);
+	//A long path goes out split over the ustar prefix and name
+	char long_dir[200];
+	sprintf(long_dir, "/src/sub/%s", "a_directory_name_long_enough_to_push_the_archive_path_past_one_hundred_bytes");
+	cnmkdir(sess, long_dir);
+	dir = cnopendir(sess, long_dir);
+	int16_t fd = cnopen(sess, dir, "sparse_file_at_the_end_of_a_long_path", FD_WRITE);
+	cnseek(sess, fd, 5 * BLOCK_SIZE);
+	cnwrite(sess, (uint8_t*)"tail", 4, fd);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+
+	int h_fd = open(archive, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	TEST_ASSERT_EQUAL_INT32(14, tar_export(sess, "/src", h_fd));
+	close(h_fd);
+	struct stat h_stat;
+	stat(archive, &h_stat);
+	TEST_ASSERT_EQUAL_INT(0, h_stat.st_size % TAR_BLOCK);
+
+	h_fd = open(archive, O_RDONLY);
+	TEST_ASSERT_EQUAL_INT32(14, tar_import(sess, h_fd, "/dst"));
+	close(h_fd);
+
+	//Every file reads back the same from both trees
+	dir_ptr* a = cnopendir(sess, "/src");
+	dir_ptr* b = cnopendir(sess, "/dst");
+	uint8_t other[BLOCK_SIZE];
+	for(uint32_t i = 0; i < 10; i++)
+	{
+		sprintf(name, "file%u", i);
+		int16_t fa = cnopen(sess, a, name, FD_READ);
+		int16_t fb = cnopen(sess, b, name, FD_READ);
+		TEST_ASSERT_TRUE(fb >= 0);
+		uint32_t na, nb;
+		do
+		{
+			na = cnread(sess, blk, BLOCK_SIZE, fa);
+			nb = cnread(sess, other, BLOCK_SIZE, fb);
+			TEST_ASSERT_EQUAL_UINT32(na, nb);
+			if(na > 0) TEST_ASSERT_EQUAL_MEMORY(blk, other, na);
+		} while(na > 0);
+		cnclose(sess, fa);
+		cnclose(sess, fb);
+	}
+	cnclosedir(a);
+	cnclosedir(b);
+	dir = cnopendir(sess, "/dst/sub/empty");
+	TEST_ASSERT_NOT_NULL(dir);
+	cnclosedir(dir);
+	sprintf(long_dir, "/dst/sub/%s", "a_directory_name_long_enough_to_push_the_archive_path_past_one_hundred_bytes");
+	dir = cnopendir(sess, long_dir);
+	fd = cnopen(sess, dir, "sparse_file_at_the_end_of_a_long_path", FD_READ);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnread(sess, blk, BLOCK_SIZE, fd));
+	TEST_ASSERT_EQUAL_UINT8(0, blk[100]);
+	cnseek(sess, fd, 5 * BLOCK_SIZE);
+	TEST_ASSERT_EQUAL_UINT32(4, cnread(sess, blk, BLOCK_SIZE, fd));
+	TEST_ASSERT_EQUAL_MEMORY("tail", blk, 4);
+	cnclose(sess, fd);
+	cnclosedir(dir);
+
+	//Unpacking again fails on the files that exist, but still reads the whole stream
+	h_fd = open(archive, O_RDONLY);
+	TEST_ASSERT_EQUAL_INT32(-1, tar_import(sess, h_fd, "/dst"));
+	close(h_fd);
+	fsck_report rep;
+	cnfsck(false, &rep);
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	cnumount();
+	remove(archive);
+}
+
+TEST(fs, TreeShouldWalkDeepWideTreesWithoutMovingCwd)
+{
+	char path[256] = "/deep";
+	char name[32];
+	char cwd[1024];
+	cnmkfs();
+	cnmount();
+	//Deeper than the starting stack, and more output than the old 4 KB buffer
+	cnmkdir(sess, path);
+	for(uint32_t i = 1; i < 40; i++)
+	{
+		strcat(path, "/d");
+		cnmkdir(sess, path);
+	}
+	cnmkdir(sess, "/wide");
+	dir_ptr* dir = cnopendir(sess, "/wide");
+	for(uint32_t i = 0; i < 300; i++)
+	{
+		sprintf(name, "entry_%03u", i);
+		cncreat(dir, name);
+	}
+	cnclosedir(dir);
+	cncd(sess, "/");
+
+	outbuf out;
+	outbuf_init(&out, 0);
+	TEST_ASSERT_EQUAL_INT8(0, cntree(sess, &out));
+	TEST_ASSERT_EQUAL_UINT32(strlen(out.data), out.len);
+	TEST_ASSERT_TRUE(out.len > 4096);
+	//The deepest directory is indented once per level above it
+	char deepest[200];
+	sprintf(deepest, "\n%*sd  D", 39 * 4, "");
+	TEST_ASSERT_NOT_NULL(strstr(out.data, deepest));
+	TEST_ASSERT_NOT_NULL(strstr(out.data, "\n    entry_299  F  0  "));
+	TEST_ASSERT_TRUE(strstr(out.data, "deep  D") < strstr(out.data, "wide  D"));
+	cnpwd(sess, cwd);
+	TEST_ASSERT_EQUAL_STRING("/", cwd);
+	outbuf_free(&out);
+	cnumount();
+}
+
+TEST(fs, ReadDirPlusShouldReturnEntriesWithTheirInodes)
+{
+	char name[32];
+	uint8_t data[300];
+	cnmkfs();
+	cnmount();
+	memset(data, 'p', sizeof(data));
+	cnmkdir(sess, "/plus");
+	dir_ptr* dir = cnopendir(sess, "/plus");
+	for(uint32_t i = 0; i < 300; i++)
+	{
+		sprintf(name, "file_%03u", i);
+		int16_t fd = cnopen(sess, dir, name, FD_WRITE);
+		cnwrite(sess, data, i, fd);
+		cnclose(sess, fd);
+	}
+	cnmkdir(sess, "/plus/sub");
+	cnclosedir(dir);
+
+	dir = cnopendir(sess, "/plus");
+	dir_entry_plus* ents = malloc(64 * sizeof(dir_entry_plus));
+	uint32_t files = 0;
+	uint32_t dirs = 0;
+	int32_t got;
+	while((got = cnreaddirplus(dir, ents, 64)) > 0)
+	{
+		TEST_ASSERT_TRUE(got <= 64);
+		for(int32_t i = 0; i < got; i++)
+		{
+			inode single;
+			inode_read(ents[i].inode_id, &single);
+			TEST_ASSERT_EQUAL_MEMORY(&single, &ents[i].attr, sizeof(inode));
+			TEST_ASSERT_EQUAL_UINT8(strlen(ents[i].name), ents[i].name_len);
+			if(ents[i].file_type == ITYPE_FILE)
+			{
+				uint32_t n;
+				TEST_ASSERT_EQUAL_INT(1, sscanf(ents[i].name, "file_%u", &n));
+				TEST_ASSERT_EQUAL_UINT32(n, ents[i].attr.size);
+				files++;
+			}
+			else
+			{
+				TEST_ASSERT_EQUAL_UINT8(ITYPE_DIR, ents[i].attr.type);
+				dirs++;
+			}
+		}
+	}
+	TEST_ASSERT_EQUAL_INT32(0, got);
+	TEST_ASSERT_EQUAL_UINT32(300, files);
+	TEST_ASSERT_EQUAL_UINT32(3, dirs);		//".", ".." and sub
+	free(ents);
+	cnclosedir(dir);
+	cnumount();
+}
+
+TEST(fs, ReadDirShouldStreamAndResumeFromCookies)
+{
+	char name[32];
+	cnmkfs();
+	cnmount();
+	cnmkdir(sess, "/huge");
+	dir_ptr* dir = cnopendir(sess, "/huge");
+	for(uint32_t i = 0; i < 2000; i++)
+	{
+		sprintf(name, "entry_%04u", i);
+		cncreat(dir, name);
+	}
+	cnclosedir(dir);
+
+	//Walk it in pages, each from a freshly opened dir_ptr
+	uint8_t* seen = calloc(2000, 1);
+	uint32_t cookie = 0;
+	uint32_t entries = 0;
+	dir_entry* entry;
+	do
+	{
+		dir = cnopendir(sess, "/huge");
+		cnseekdir(dir, cookie);
+		for(uint32_t i = 0; i < 150 && (entry = cnreaddir(dir)); i++)
+		{
+			uint32_t n;
+			entries++;
+			if(entry->name_len == 10 && sscanf(entry->name, "entry_%4u", &n) == 1)
+			{
+				TEST_ASSERT_EQUAL_UINT8(0, seen[n]);
+				seen[n] = 1;
+			}
+		}
+		TEST_ASSERT_NULL(dir->data);		//Only ever one block in memory
+		cookie = cntelldir(dir);
+		entry = cnreaddir(dir);
+		cnclosedir(dir);
+	} while(entry != NULL);
+	TEST_ASSERT_EQUAL_UINT32(2002, entries);
+	for(uint32_t i = 0; i < 2000; i++)
+	{
+		TEST_ASSERT_EQUAL_UINT8(1, seen[i]);
+	}
+	free(seen);
+
+	//A cookie inside an entry resumes at the next whole entry
+	dir = cnopendir(sess, "/huge");
+	cnreaddir(dir);
+	cnreaddir(dir);
+	cookie = cntelldir(dir);
+	entry = cnreaddir(dir);
+	TEST_ASSERT_NOT_NULL(entry);
+	memcpy(name, entry->name, entry->name_len);
+	name[entry->name_len] = '\0';
+	entry = cnreaddir(dir);
+	TEST_ASSERT_NOT_NULL(entry);
+	char next[32];
+	memcpy(next, entry->name, entry->name_len);
+	next[entry->name_len] = '\0';
+	cnseekdir(dir, cookie + 1);
+	entry = cnreaddir(dir);
+	TEST_ASSERT_NOT_NULL(entry);
+	TEST_ASSERT_EQUAL_UINT8(strlen(next), entry->name_len);
+	TEST_ASSERT_EQUAL_MEMORY(next, entry->name, entry->name_len);
+	cnclosedir(dir);
+
+	//ls pages through the same directory in small buffers
+	char page[512];
+	uint32_t names = 0;
+	uint32_t pages = 0;
+	cookie = 0;
+	do
+	{
+		int32_t got = cnls_page(sess, "/huge", &cookie, page, sizeof(page));
+		TEST_ASSERT_TRUE(got > 0);
+		TEST_ASSERT_TRUE(strlen(page) < sizeof(page));
+		for(char* c = page; *c; c++)
+		{
+			if(*c == '\n') names++;
+		}
+		pages++;
+	} while(cookie != 0);
+	TEST_ASSERT_EQUAL_UINT32(2002, names);
+	TEST_ASSERT_TRUE(pages > 30);
+	cnumount();
+}
+
+TEST(fs, CookieShouldResumeAfterCompactionBetweenPages)
+{
+	char name[32];
+	cnmkfs();
+	cnmount();
+	cnmkdir(sess, "/paged");
+	dir_ptr* dir = cnopendir(sess, "/paged");
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		sprintf(name, "entry_%04u", i);
+		cncreat(dir, name);
+	}
+	cnclosedir(dir);
+
+	//First page
+	uint8_t* seen = calloc(1000, 1);
+	dir_entry* entry;
+	uint32_t n;
+	dir = cnopendir(sess, "/paged");
+	uint32_t blocks = dir->inode_st.blocks;
+	for(uint32_t i = 0; i < 300 && (entry = cnreaddir(dir)); i++)
+	{
+		if(entry->name_len == 10 && sscanf(entry->name, "entry_%4u", &n) == 1) seen[n]++;
+	}
+	uint32_t cookie = cntelldir(dir);
+	cnclosedir(dir);
+
+	//Free space before the cookie and empty the blocks at the end, then compact
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		if(i >= 250 && i < 800) continue;
+		sprintf(name, "/paged/entry_%04u", i);
+		TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, name));
+	}
+	TEST_ASSERT_TRUE(cnbackground() > 0);
+	while(cnbackground() > 0);
+
+	//Second page picks up right after the first
+	dir = cnopendir(sess, "/paged");
+	TEST_ASSERT_TRUE(dir->inode_st.blocks < blocks);
+	cnseekdir(dir, cookie);
+	while((entry = cnreaddir(dir)))
+	{
+		TEST_ASSERT_TRUE(entry->name_len == 10 && sscanf(entry->name, "entry_%4u", &n) == 1);
+		TEST_ASSERT_TRUE(n >= 250 && n < 800);
+		seen[n]++;
+	}
+	cnclosedir(dir);
+	for(uint32_t i = 250; i < 800; i++)
+	{
+		TEST_ASSERT_EQUAL_UINT8(1, seen[i]);
+	}
+	free(seen);
+	cnumount();
+}
+
+TEST(fs, CatShouldKeepBinaryContentOfAnySize)
+{
+	uint32_t size = 200 * 1024 + 7;
+	uint8_t* data = malloc(size);
+	for(uint32_t i = 0; i < size; i++)
+	{
+		data[i] = (uint8_t)(i * 7);		//A NUL every 256 bytes
+	}
+	cnmkfs();
+	cnmount();
+	int16_t fd = cnopen(sess, sess->cwd, "binary", FD_WRITE);
+	TEST_ASSERT_EQUAL_UINT32(size, cnwrite(sess, data, size, fd));
+	cnclose(sess, fd);
+
+	//Appends after what is already there, and grows as it goes
+	outbuf out;
+	outbuf_init(&out, 0);
+	outbuf_append(&out, "head", 4);
+	TEST_ASSERT_EQUAL_INT8(0, cncat(sess, "binary", &out));
+	TEST_ASSERT_EQUAL_UINT32(4 + size, out.len);
+	TEST_ASSERT_EQUAL_MEMORY("head", out.data, 4);
+	TEST_ASSERT_EQUAL_MEMORY(data, out.data + 4, size);
+	TEST_ASSERT_EQUAL_INT8(0, out.data[out.len]);
+	TEST_ASSERT_EQUAL_INT8(-1, cncat(sess, "missing", &out));
+	TEST_ASSERT_EQUAL_UINT32(4 + size, out.len);
+
+	//Past the descriptors an int8_t could name
+	int32_t held[200];
+	for(uint32_t i = 0; i < 200; i++)
+	{
+		held[i] = cnopen(sess, sess->cwd, "binary", FD_READ);
+	}
+	outbuf_truncate(&out, 0);
+	TEST_ASSERT_EQUAL_INT8(0, cncat(sess, "binary", &out));
+	TEST_ASSERT_EQUAL_UINT32(size, out.len);
+	for(uint32_t i = 0; i < 200; i++)
+	{
+		cnclose(sess, held[i]);
+	}
+	outbuf_free(&out);
+	free(data);
+	cnumount();
+}
+
+TEST(fs, DescriptorsOnOneFileShouldShareItsVnode)
+{
+	uint8_t blk[BLOCK_SIZE];
+	char buf[64];
+	cnmkfs();
+	cnmount();
+	session* other = cnsession_open();
+	dir_ptr* dir = cnopendir(sess, "/");
+	int16_t w1 = cnopen(sess, dir, "shared", FD_WRITE);
+	int16_t w2 = cnopen(sess, dir, "shared", FD_WRITE);
+	int16_t r = cnopen(other, dir, "shared", FD_READ);
+	vnode* vn = fd_get(sess, w1)->vn;
+	TEST_ASSERT_EQUAL_PTR(vn, fd_get(sess, w2)->vn);
+	TEST_ASSERT_EQUAL_PTR(vn, fd_get(other, r)->vn);
+	TEST_ASSERT_EQUAL_UINT32(3, vn->refs);
+
+	//Writers on separate fds add to the same buffered blocks
+	memset(blk, 'a', BLOCK_SIZE);
+	cnwrite(sess, blk, BLOCK_SIZE, w1);
+	cnseek(sess, w2, BLOCK_SIZE);
+	memset(blk, 'b', BLOCK_SIZE);
+	cnwrite(sess, blk, 10, w2);
+	cnwrite(sess, (uint8_t*)"tail", 5, w1);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE + 10, vn->inode.size);
+	TEST_ASSERT_EQUAL_UINT32(2, vn->dirty_count);
+
+	//A reader in another session sees them before they reach the disk
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnread(other, blk, BLOCK_SIZE, r));
+	TEST_ASSERT_EQUAL_UINT8('a', blk[0]);
+	TEST_ASSERT_EQUAL_UINT8('a', blk[BLOCK_SIZE - 1]);
+	TEST_ASSERT_EQUAL_UINT32(10, cnread(other, (uint8_t*)buf, sizeof(buf), r));
+	TEST_ASSERT_EQUAL_STRING("tail", buf);
+	read_view view;
+	TEST_ASSERT_EQUAL_INT8(0, cnread_view(other, r, BLOCK_SIZE, BLOCK_SIZE, &view));
+	TEST_ASSERT_EQUAL_UINT32(10, view.bytes);
+	TEST_ASSERT_EQUAL_MEMORY("tail\0bbbbb", view.segs[0].base, 10);
+	cnread_release(&view);
+
+	//The first writer to close places the blocks for both
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, w1));
+	TEST_ASSERT_EQUAL_UINT32(0, vn->dirty_count);
+	TEST_ASSERT_EQUAL_UINT32(2, vn->refs);
+	cnwrite(sess, (uint8_t*)"B", 1, w2);
+	cnclose(sess, w2);
+	cnseek(other, r, BLOCK_SIZE);
+	TEST_ASSERT_EQUAL_UINT32(11, cnread(other, (uint8_t*)buf, sizeof(buf), r));
+	TEST_ASSERT_EQUAL_MEMORY("tail\0bbbbbB", buf, 11);
+
+	//Truncating by path is seen through the open file
+	TEST_ASSERT_EQUAL_INT8(0, cntruncate(sess, "/shared", 3));
+	TEST_ASSERT_EQUAL_UINT32(3, fd_get(other, r)->vn->inode.size);
+	cnseek(other, r, 0);
+	TEST_ASSERT_EQUAL_UINT32(3, cnread(other, (uint8_t*)buf, sizeof(buf), r));
+
+	//Once unlinked, the open file reads empty and a new file of the same
+	//name gets a vnode of its own
+	int16_t w3 = cnopen(sess, dir, "shared", FD_WRITE);
+	TEST_ASSERT_EQUAL_INT8(0, cnunlink(sess, "/shared"));
+	TEST_ASSERT_EQUAL_UINT32(0, cnwrite(sess, (uint8_t*)"x", 1, w3));
+	cnseek(other, r, 0);
+	TEST_ASSERT_EQUAL_UINT32(0, cnread(other, (uint8_t*)buf, sizeof(buf), r));
+	int16_t w4 = cnopen(sess, dir, "shared", FD_WRITE);
+	TEST_ASSERT_TRUE(fd_get(sess, w4)->vn != fd_get(other, r)->vn);
+	TEST_ASSERT_EQUAL_UINT32(0, fd_get(sess, w4)->vn->inode.size);
+	cnclose(sess, w4);
+	cnclose(sess, w3);
+	cnsession_close(other);
+	cnclosedir(dir);
+
+	fsck_report rep;
+	TEST_ASSERT_EQUAL_INT8(0, cnfsck(false, &rep));
+	TEST_ASSERT_EQUAL_UINT32(0, fsck_errors(&rep));
+	cnumount();
+}
+
+#define FD_THREADS		8
+#define FD_PER_THREAD	(FD_CHUNK + 100)
+
+static session* fd_shared_sess;
+static dir_ptr* fd_shared_dir;
+static int32_t fd_opened[FD_THREADS][FD_PER_THREAD];
+
+//Opens and closes on the shared session, then leaves FD_PER_THREAD open
+static void* fd_worker(void* arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	for(uint32_t i = 0; i < FD_PER_THREAD; i++)
+	{
+		cnclose(fd_shared_sess, cnopen(fd_shared_sess, fd_shared_dir, "many", FD_READ));
+		fd_opened[id][i] = cnopen(fd_shared_sess, fd_shared_dir, "many", FD_READ);
+	}
+	return NULL;
+}
+
+TEST(fs, FdTableShouldGrowAndHandOutEachFdOnce)
+{
+	uint32_t total = 3 * FD_CHUNK + 5;
+	char buf[8];
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, "/");
+	int32_t w = cnopen(sess, dir, "many", FD_WRITE);
+	cnwrite(sess, (uint8_t*)"data", 5, w);
+	cnclose(sess, w);
+
+	//A fresh table hands out the lowest fds first, growing a chunk at a time
+	for(uint32_t i = 0; i < total; i++)
+	{
+		TEST_ASSERT_EQUAL_INT32((int32_t)i, cnopen(sess, dir, "many", FD_READ));
+	}
+	TEST_ASSERT_EQUAL_UINT32(4, sess->fds.chunks);
+	TEST_ASSERT_EQUAL_UINT32(total, fd_get(sess, 0)->vn->refs);
+	TEST_ASSERT_EQUAL_UINT32(5, cnread(sess, (uint8_t*)buf, sizeof(buf), total - 1));
+
+	//Closed fds come back newest first
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, 7));
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, 2 * FD_CHUNK));
+	TEST_ASSERT_EQUAL_INT8(-1, cnclose(sess, 7));
+	TEST_ASSERT_EQUAL_INT32(2 * FD_CHUNK, cnopen(sess, dir, "many", FD_READ));
+	TEST_ASSERT_EQUAL_INT32(7, cnopen(sess, dir, "many", FD_READ));
+
+	//Fds outside the table are refused rather than indexed
+	TEST_ASSERT_EQUAL_INT8(-1, cnclose(sess, -1));
+	TEST_ASSERT_EQUAL_INT8(-1, cnclose(sess, 4 * FD_CHUNK));
+	TEST_ASSERT_EQUAL_INT8(-1, cnseek(sess, FD_CHUNK * FD_CHUNKS, 0));
+	TEST_ASSERT_EQUAL_UINT32(0, cnread(sess, (uint8_t*)buf, sizeof(buf), 0x7FFFFFFF));
+	for(uint32_t i = 0; i < total; i++)
+	{
+		TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, (int32_t)i));
+	}
+
+	//Threads opening on one session at once never get the same fd
+	pthread_t workers[FD_THREADS];
+	fd_shared_sess = cnsession_open();
+	fd_shared_dir = dir;
+	for(uintptr_t t = 0; t < FD_THREADS; t++)
+	{
+		pthread_create(&workers[t], NULL, fd_worker, (void*)t);
+	}
+	for(uint32_t t = 0; t < FD_THREADS; t++)
+	{
+		pthread_join(workers[t], NULL);
+	}
+	uint32_t slots = fd_shared_sess->fds.chunks * FD_CHUNK;
+	uint8_t* seen = calloc(slots, 1);
+	for(uint32_t t = 0; t < FD_THREADS; t++)
+	{
+		for(uint32_t i = 0; i < FD_PER_THREAD; i++)
+		{
+			int32_t fd = fd_opened[t][i];
+			TEST_ASSERT_TRUE(fd >= 0 && (uint32_t)fd < slots);
+			TEST_ASSERT_EQUAL_UINT8(0, seen[fd]);
+			seen[fd] = 1;
+		}
+	}
+	free(seen);
+	TEST_ASSERT_EQUAL_UINT32(FD_THREADS * FD_PER_THREAD, fd_get(fd_shared_sess, fd_opened[0][0])->vn->refs);
+	cnsession_close(fd_shared_sess);
+	cnclosedir(dir);
+	cnumount();
+}
+
+#define PREAD_THREADS	4
+#define PREAD_BLOCKS	32
+
+static int32_t pread_fd;
+
+//Reads every block of the file at its own offsets through the shared fd.
+//Returns the number of blocks that came back wrong.
+static void* pread_worker(void* arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	uintptr_t errors = 0;
+	uint8_t blk[BLOCK_SIZE];
+	for(uint32_t round = 0; round < 20; round++)
+	{
+		for(uint32_t i = 0; i < PREAD_BLOCKS; i++)
+		{
+			uint32_t lblk = (i + id * 7) % PREAD_BLOCKS;
+			if(cnpread(sess, blk, BLOCK_SIZE, pread_fd, lblk * BLOCK_SIZE) != BLOCK_SIZE
+					|| blk[0] != lblk || blk[BLOCK_SIZE - 1] != lblk)
+			{
+				errors++;
+			}
+		}
+	}
+	return (void*)errors;
+}
+
+TEST(fs, PositionalAndVectoredIoShouldLeaveTheCursorAlone)
+{
+	char buf[32];
+	uint8_t blk[BLOCK_SIZE];
+	cnmkfs();
+	cnmount();
+	dir_ptr* dir = cnopendir(sess, "/");
+	int32_t w = cnopen(sess, dir, "records", FD_WRITE);
+	cnwrite(sess, (uint8_t*)"0123456789", 10, w);
+	TEST_ASSERT_EQUAL_UINT32(2, cnpwrite(sess, (const uint8_t*)"AB", 2, w, 2));
+	TEST_ASSERT_EQUAL_UINT32(10, fd_get(sess, w)->cursor);
+	cnwrite(sess, (uint8_t*)"X", 1, w);
+
+	//A header and its body land together, across a block boundary into a hole
+	struct iovec rec[2] = {
+		{ .iov_base = (void*)"HDR:0005", .iov_len = 8 },
+		{ .iov_base = (void*)"hello", .iov_len = 5 },
+	};
+	TEST_ASSERT_EQUAL_UINT32(13, cnwritev(sess, rec, 2, w, BLOCK_SIZE - 4));
+	TEST_ASSERT_EQUAL_UINT32(11, fd_get(sess, w)->cursor);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE + 9, fd_get(sess, w)->vn->inode.size);
+	TEST_ASSERT_EQUAL_UINT32(0, cnpread(sess, (uint8_t*)buf, 4, w, 0));
+
+	int32_t r = cnopen(sess, dir, "records", FD_READ);
+	TEST_ASSERT_EQUAL_UINT32(0, cnpwrite(sess, (const uint8_t*)"no", 2, r, 0));
+	TEST_ASSERT_EQUAL_UINT32(4, cnpread(sess, (uint8_t*)buf, 4, r, 0));
+	TEST_ASSERT_EQUAL_MEMORY("01AB", buf, 4);
+	TEST_ASSERT_EQUAL_UINT32(0, fd_get(sess, r)->cursor);
+	TEST_ASSERT_EQUAL_UINT32(11, cnread(sess, (uint8_t*)buf, 11, r));
+	TEST_ASSERT_EQUAL_MEMORY("01AB456789X", buf, 11);
+
+	//Scattered back out, short at the end of the file
+	char hdr[8];
+	char body[5];
+	char extra[16];
+	struct iovec out[3] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = body, .iov_len = sizeof(body) },
+		{ .iov_base = extra, .iov_len = sizeof(extra) },
+	};
+	TEST_ASSERT_EQUAL_UINT32(13, cnreadv(sess, out, 3, r, BLOCK_SIZE - 4));
+	TEST_ASSERT_EQUAL_MEMORY("HDR:0005", hdr, 8);
+	TEST_ASSERT_EQUAL_MEMORY("hello", body, 5);
+	TEST_ASSERT_EQUAL_UINT32(0, cnpread(sess, (uint8_t*)buf, 4, r, BLOCK_SIZE + 9));
+	TEST_ASSERT_EQUAL_UINT32(11, fd_get(sess, r)->cursor);
+	cnclose(sess, r);
+	cnclose(sess, w);
+
+	//Threads share one fd without stepping on each other
+	w = cnopen(sess, dir, "blocks", FD_WRITE);
+	for(uint32_t i = 0; i < PREAD_BLOCKS; i++)
+	{
+		memset(blk, (int)i, BLOCK_SIZE);
+		cnwrite(sess, blk, BLOCK_SIZE, w);
+	}
+	cnclose(sess, w);
+	pread_fd = cnopen(sess, dir, "blocks", FD_READ);
+	pthread_t workers[PREAD_THREADS];
+	for(uintptr_t t = 0; t < PREAD_THREADS; t++)
+	{
+		pthread_create(&workers[t], NULL, pread_worker, (void*)t);
+	}
+	for(uint32_t t = 0; t < PREAD_THREADS; t++)
+	{
+		void* errors;
+		pthread_join(workers[t], &errors);
+		TEST_ASSERT_EQUAL_UINT32(0, (uintptr_t)errors);
+	}
+	TEST_ASSERT_EQUAL_UINT32(0, fd_get(sess, pread_fd)->cursor);
+	cnclose(sess, pread_fd);
+	cnclosedir(dir);
+	cnumount();
+}
+
+static volatile int big_op_done;
+
+static void* big_op(void* arg)
+{
+	(void)arg;
+	journal_begin(JOURNAL_TXN_MAX);
+	big_op_done = 1;
+	journal_end();
+	return NULL;
+}
+
+TEST(fs, JournalShouldNotCommitHalfAnOperation)
+{
+	pthread_t big;
+	cnmkfs();
+	cnmount();
+	journal_commit();
+
+	//An operation that will not fit waits for the open one and commits it whole
+	big_op_done = 0;
+	journal_begin(JOURNAL_OP_BLOCKS);
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "half"));
+	pthread_create(&big, NULL, big_op, NULL);
+	usleep(50000);
+	TEST_ASSERT_EQUAL_INT(0, big_op_done);
+	TEST_ASSERT_TRUE(journal_pending() > 0);
+	TEST_ASSERT_EQUAL_INT8(0, cnmkdir(sess, "whole"));
+	journal_end();
+	pthread_join(big, NULL);
+	TEST_ASSERT_EQUAL_INT(1, big_op_done);
+	TEST_ASSERT_EQUAL_UINT32(0, journal_pending());
+	cnumount();
+}
+
+TEST(fs, FreedBlocksShouldWaitForTheirTransactionToCommit)
+{
+	uint8_t data[8 * BLOCK_SIZE];
+	inode old_i;
+	inode new_i;
+	memset(data, 'x', sizeof(data));
+	cnmkfs();
+	cnmount();
+	int32_t fd = cnopen(sess, sess->cwd, "old", FD_WRITE);
+	cnwrite(sess, data, sizeof(data), fd);
+	cnclose(sess, fd);
+	journal_commit();
+	dir_ptr* dir = cnopendir(sess, "");
+	stat_st st;
+	cnstat(dir, "old", &st);
+	inode_read(st.inode_id, &old_i);
+
+	//Until the truncate commits, a crash would give old its blocks back
+	TEST_ASSERT_EQUAL_INT8(0, cntruncate(sess, "old", 0));
+	fd = cnopen(sess, dir, "new", FD_WRITE);
+	cnwrite(sess, data, sizeof(data), fd);
+	cnclose(sess, fd);
+	cnstat(dir, "new", &st);
+	inode_read(st.inode_id, &new_i);
+	for(uint32_t i = 0; i < 8; i++)
+	{
+		for(uint32_t j = 0; j < 8; j++)
+		{
+			TEST_ASSERT_TRUE(BLK_LBA(new_i.data0[i]) != BLK_LBA(old_i.data0[j]));
+		}
+	}
+
+	//Once it has, they are handed out again
+	journal_commit();
+	fd = cnopen(sess, dir, "newer", FD_WRITE);
+	cnwrite(sess, data, BLOCK_SIZE, fd);
+	cnclose(sess, fd);
+	cnstat(dir, "newer", &st);
+	inode_read(st.inode_id, &new_i);
+	bool reused = false;
+	for(uint32_t j = 0; j < 8; j++)
+	{
+		reused = reused || (BLK_LBA(new_i.data0[0]) == BLK_LBA(old_i.data0[j]));
+	}
+	TEST_ASSERT_TRUE(reused);
+	cnclosedir(dir);
+	cnumount();
+}
+
+extern block alloc_bm_cache;
+int8_t vnode_flush(vnode* vn);
+
+TEST(fs, FailedFlushShouldKeepWhatItCouldNotPlace)
+{
+	block saved;
+	uint8_t wbuf[BLOCK_SIZE];
+	uint8_t rbuf[BLOCK_SIZE];
+	statfs_st before, held, after;
+	cnmkfs();
+	cnmount();
+	cnstatfs(&before);
+	int32_t fd = cnopen(sess, sess->cwd, "kept", FD_WRITE);
+	for(uint32_t i = 0; i < 20; i++)
+	{
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnwrite(sess, wbuf, BLOCK_SIZE, fd));
+	}
+	cnstatfs(&held);
+
+	//With no free run to be found, nothing is placed and nothing is lost
+	vnode* vn = fd_get(sess, fd)->vn;
+	memcpy(&saved, &alloc_bm_cache, sizeof(block));
+	memset(&alloc_bm_cache, 0xFF, sizeof(block));
+	TEST_ASSERT_EQUAL_INT8(-1, vnode_flush(vn));
+	memcpy(&alloc_bm_cache, &saved, sizeof(block));
+	TEST_ASSERT_EQUAL_UINT32(20, vn->dirty_count);
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(held.free_blocks, after.free_blocks);
+
+	TEST_ASSERT_EQUAL_INT8(0, cnclose(sess, fd));
+	cnstatfs(&after);
+	TEST_ASSERT_EQUAL_UINT32(before.free_blocks - 21, after.free_blocks);	//The data and one indirect block
+	fd = cnopen(sess, sess->cwd, "kept", FD_READ);
+	for(uint32_t i = 0; i < 20; i++)
+	{
+		memset(wbuf, 'a' + i, BLOCK_SIZE);
+		TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, cnread(sess, rbuf, BLOCK_SIZE, fd));
+		TEST_ASSERT_EQUAL_MEMORY(wbuf, rbuf, BLOCK_SIZE);
+	}
+	cnclose(sess, fd);
+	cnumount();
 }
@@ -4,6 +4,9 @@ static void RunAllTests(void)
 {
   //RUN_TEST_GROUP(blockdev);
   RUN_TEST_GROUP(fs);
+  RUN_TEST_GROUP(dcache);
+  RUN_TEST_GROUP(shell);
+  RUN_TEST_GROUP(aio);
   //RUN_TEST_GROUP(bitmap);
 }
 
@@ -0,0 +1,9 @@
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP_RUNNER(aio)
+{
+  RUN_TEST_CASE(aio, RequestsShouldCompleteThroughTheEventfd);
+  RUN_TEST_CASE(aio, ManyRequestsInFlightShouldAllComplete);
+  RUN_TEST_CASE(aio, PathsShouldResolveWhileTheCwdChanges);
+}
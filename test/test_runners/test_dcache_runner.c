@@ -0,0 +1,10 @@
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP_RUNNER(dcache)
+{
+  RUN_TEST_CASE(dcache, LookupAfterInsertShouldHit);
+  RUN_TEST_CASE(dcache, NegativeEntryShouldBeReplaced);
+  RUN_TEST_CASE(dcache, InvalidateAndPurgeShouldForget);
+  RUN_TEST_CASE(dcache, BlockShouldBeKnownOnlyForEntriesPlacedWithOne);
+}
@@ -16,4 +16,32 @@ TEST_GROUP_RUNNER(fs)
 	//RUN_TEST_CASE(fs, CatShouldComplete);
 	//RUN_TEST_CASE(fs, ImportExportShouldComplete);
 	RUN_TEST_CASE(fs, TreeShouldComplete);
+	RUN_TEST_CASE(fs, LookupCacheShouldFollowMkdirRmdir);
+	RUN_TEST_CASE(fs, LargeDirectoryShouldSpanBlocks);
+	RUN_TEST_CASE(fs, RmdirShouldReuseSlotsAndCompact);
+	RUN_TEST_CASE(fs, UnlinkShouldReclaimBlocks);
+	RUN_TEST_CASE(fs, TruncateShouldFreeAndZeroFill);
+	RUN_TEST_CASE(fs, SparseFileShouldReadZeros);
+	RUN_TEST_CASE(fs, InterleavedWritersShouldGetContiguousBlocks);
+	RUN_TEST_CASE(fs, FallocateShouldReserveContiguousUnwrittenBlocks);
+	RUN_TEST_CASE(fs, MountShouldReplayCommittedJournal);
+	RUN_TEST_CASE(fs, FsckShouldFindAndRepairDamage);
+	RUN_TEST_CASE(fs, ConcurrentOperationsShouldKeepFsConsistent);
+	RUN_TEST_CASE(fs, SessionsShouldKeepTheirOwnCwdAndFds);
+	RUN_TEST_CASE(fs, SequentialReadsShouldGrowReadahead);
+	RUN_TEST_CASE(fs, ReadViewShouldMapRunsWithoutCopying);
+	RUN_TEST_CASE(fs, ImportExportShouldStreamLargeFiles);
+	RUN_TEST_CASE(fs, ImportTreeShouldCopyDirectoriesAndFiles);
+	RUN_TEST_CASE(fs, TarExportImportShouldRoundTripATree);
+	RUN_TEST_CASE(fs, TreeShouldWalkDeepWideTreesWithoutMovingCwd);
+	RUN_TEST_CASE(fs, ReadDirPlusShouldReturnEntriesWithTheirInodes);
+	RUN_TEST_CASE(fs, ReadDirShouldStreamAndResumeFromCookies);
+	RUN_TEST_CASE(fs, CookieShouldResumeAfterCompactionBetweenPages);
+	RUN_TEST_CASE(fs, CatShouldKeepBinaryContentOfAnySize);
+	RUN_TEST_CASE(fs, DescriptorsOnOneFileShouldShareItsVnode);
+	RUN_TEST_CASE(fs, FdTableShouldGrowAndHandOutEachFdOnce);
+	RUN_TEST_CASE(fs, PositionalAndVectoredIoShouldLeaveTheCursorAlone);
+	RUN_TEST_CASE(fs, JournalShouldNotCommitHalfAnOperation);
+	RUN_TEST_CASE(fs, FreedBlocksShouldWaitForTheirTransactionToCommit);
+	RUN_TEST_CASE(fs, FailedFlushShouldKeepWhatItCouldNotPlace);
 }
@@ -0,0 +1,12 @@
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP_RUNNER(shell)
+{
+  RUN_TEST_CASE(shell, TokenizeShouldSplitInPlaceAndStripQuotes);
+  RUN_TEST_CASE(shell, LookupShouldFindEveryCommandAndNothingElse);
+  RUN_TEST_CASE(shell, RunCmdShouldAppendOutputToTheBuffer);
+  RUN_TEST_CASE(shell, ReadShouldRefuseCountsThatCouldNotFit);
+  RUN_TEST_CASE(shell, SizeArgumentsShouldBeRefusedUnlessTheyAreCounts);
+  RUN_TEST_CASE(shell, RemoteSessionShouldNotStreamTarThroughServerStdio);
+}
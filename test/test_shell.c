@@ -0,0 +1,131 @@
+#include <cdnwsh.h>
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(shell);
+
+TEST_SETUP(shell)
+{
+}
+
+TEST_TEAR_DOWN(shell)
+{
+}
+
+TEST(shell, TokenizeShouldSplitInPlaceAndStripQuotes)
+{
+	char line[] = "write  3 \"two words\" it\\'s 'a \"b\"' x\"y z\"\n";
+	char* argv[8];
+	TEST_ASSERT_EQUAL_INT(6, sh_tokenize(line, argv, 8));
+	TEST_ASSERT_EQUAL_STRING("write", argv[0]);
+	TEST_ASSERT_EQUAL_STRING("3", argv[1]);
+	TEST_ASSERT_EQUAL_STRING("two words", argv[2]);
+	TEST_ASSERT_EQUAL_STRING("it's", argv[3]);
+	TEST_ASSERT_EQUAL_STRING("a \"b\"", argv[4]);
+	TEST_ASSERT_EQUAL_STRING("xy z", argv[5]);
+	for(int i = 0; i < 6; i++)
+	{
+		TEST_ASSERT_TRUE(argv[i] >= line && argv[i] < line + sizeof(line));
+	}
+
+	char blank[] = "   \r\n";
+	TEST_ASSERT_EQUAL_INT(0, sh_tokenize(blank, argv, 8));
+	char open_quote[] = "cat \"never closed\n";
+	TEST_ASSERT_EQUAL_INT(SH_ERR_BADARGS, sh_tokenize(open_quote, argv, 8));
+	char too_many[] = "a b c";
+	TEST_ASSERT_EQUAL_INT(SH_ERR_BADARGS, sh_tokenize(too_many, argv, 2));
+}
+
+TEST(shell, LookupShouldFindEveryCommandAndNothingElse)
+{
+	for(int i = 0; i < SH_CMD_NUM; i++)
+	{
+		TEST_ASSERT_EQUAL_INT(i, sh_lookup(sh_cmds[i].name));
+	}
+	TEST_ASSERT_EQUAL_INT(-1, sh_lookup("bogus"));
+	TEST_ASSERT_EQUAL_INT(-1, sh_lookup(""));
+	TEST_ASSERT_EQUAL_INT(-1, sh_lookup("lsx"));
+}
+
+TEST(shell, RunCmdShouldAppendOutputToTheBuffer)
+{
+	outbuf out;
+	outbuf_init(&out, 0);
+	char help[] = "help 'ls'\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_SUCCESS, run_cmd(NULL, help, &out));
+	TEST_ASSERT_EQUAL_STRING(sh_cmds[SH_CMD_LS].help, out.data);
+
+	outbuf_truncate(&out, 0);
+	char bogus[] = "bogus arg\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADCMD, run_cmd(NULL, bogus, &out));
+	TEST_ASSERT_EQUAL_STRING(err_str(SH_ERR_BADCMD), out.data);
+
+	outbuf_truncate(&out, 0);
+	char blank[] = "\n";
+	TEST_ASSERT_EQUAL_INT8(SH_NO_CMD, run_cmd(NULL, blank, &out));
+	TEST_ASSERT_EQUAL_UINT32(0, out.len);
+	outbuf_free(&out);
+}
+
+TEST(shell, ReadShouldRefuseCountsThatCouldNotFit)
+{
+	outbuf out;
+	outbuf_init(&out, 0);
+	TEST_ASSERT_EQUAL_INT8(-1, outbuf_reserve(&out, SIZE_MAX));
+	outbuf_append(&out, "abc", 3);
+	TEST_ASSERT_EQUAL_INT8(-1, outbuf_reserve(&out, SIZE_MAX - 3));
+	TEST_ASSERT_EQUAL_STRING("abc", out.data);
+
+	int8_t vfs = shell_server.vfs;
+	shell_server.vfs = VFS_STATUS_ON;		//The counts are refused before the fs is touched
+	char negative[] = "read 0 -1\n";
+	char huge[] = "read 0 99999999999999999999\n";
+	char junk[] = "read 0 12abc\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, negative, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, huge, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, junk, &out));
+	char back[] = "seek 0 -5\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, back, &out));
+	shell_server.vfs = vfs;
+	outbuf_free(&out);
+}
+
+TEST(shell, SizeArgumentsShouldBeRefusedUnlessTheyAreCounts)
+{
+	outbuf out;
+	outbuf_init(&out, 0);
+	int8_t vfs = shell_server.vfs;
+	shell_server.vfs = VFS_STATUS_ON;		//Refused before the fs is touched
+	char negative[] = "truncate a -1\n";
+	char huge[] = "truncate a 4294967296\n";
+	char junk[] = "truncate a 1k\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, negative, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, huge, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, junk, &out));
+	char bad_offset[] = "fallocate 0 -4096 4096\n";
+	char bad_len[] = "fallocate 0 0 99999999999\n";
+	char junk_len[] = "fallocate 0 0 4096x\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, bad_offset, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, bad_len, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(NULL, junk_len, &out));
+	shell_server.vfs = vfs;
+	outbuf_free(&out);
+}
+
+TEST(shell, RemoteSessionShouldNotStreamTarThroughServerStdio)
+{
+	outbuf out;
+	outbuf_init(&out, 0);
+	int8_t vfs = shell_server.vfs;
+	session* remote = shell_server.remote;
+	shell_server.vfs = VFS_STATUS_ON;
+	static session client;		//Refused before the session is used
+	shell_server.remote = &client;
+	char export_tar[] = "export-tar / -\n";
+	char import_tar[] = "import-tar - /\n";
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(shell_server.remote, export_tar, &out));
+	TEST_ASSERT_EQUAL_INT8(SH_ERR_BADARGS, run_cmd(shell_server.remote, import_tar, &out));
+	shell_server.remote = remote;
+	shell_server.vfs = vfs;
+	outbuf_free(&out);
+}